@@ -16,7 +16,12 @@
 #include <unistd.h>
 
 #include "peepfs_archive.h"
+#include "peepfs_detect.h"
 #include "peepfs_cache.h"
+#include "peepfs_pool.h"
+#include "peepfs_ident.h"
+#include "peepfs_nested.h"
+#include "peepfs_workq.h"
 
 #define MIN(x,y) ((x) < (y) ? (x) : (y))
 
@@ -27,6 +32,9 @@ typedef struct peepfs_params {
     int         magic_suffix_len;
     int64_t     max_cache_entries;
     int64_t     grace;
+    int64_t     max_open_archives;
+    int         workers;
+    int         lazy_ident;
 } peepfs_params_t;
 
 /* 
@@ -37,6 +45,10 @@ typedef struct peepfs_params {
 typedef struct peepfs_global {
     peepfs_params_t *params;
     peepfs_cache_t  *cache;
+    peepfs_pool_t   *pool;
+    peepfs_ident_t  *ident;
+    peepfs_nested_t *nested;
+    peepfs_workq_t  *workq;
     pthread_key_t    key;
 } peepfs_global_t;
 
@@ -44,6 +56,9 @@ typedef struct peepfs_global {
 typedef struct peepfs_ctx {
     peepfs_params_t    *params;
     peepfs_cache_t     *cache;
+    peepfs_pool_t      *pool;
+    peepfs_ident_t     *ident;
+    peepfs_nested_t    *nested;
     char                peepname[PATH_MAX];
     char                fullpath[PATH_MAX];
     char                old_fullpath[PATH_MAX];
@@ -56,12 +71,13 @@ typedef struct peepfs_ctx {
 /* Cookie representing an open file 
  * for real files, we just hold a file descriptor
  * and proxy VOPs.
- * for archive files, we read the whole file into
- * memory at open() and then use it to serve read()
+ * for archive files, we hold a reference on the
+ * pooled archive handle and an open archive file.
  */
 
 typedef struct peepfs_cookie {
     int                     fd;
+    peepfs_pool_entry_t    *handle;
     peepfs_archive_t       *archive;
     peepfs_archive_entry_t  entry;
     peepfs_archive_file_t  *file;
@@ -121,6 +137,51 @@ peepfs_compose_path(char *out, peepfs_ctx_t *ctx, const char *relpath)
     snprintf(out, PATH_MAX, "%s%s", ctx->params->base, relpath);
 }
 
+/* Follow magic suffixes inside an archive down into nested archives,
+ * leaving archivepath at the innermost one (a spill file)
+ */
+
+static void
+peepfs_nested_archive_path(
+    peepfs_ctx_t   *ctx,
+    char           *archivepath,
+    const char    **relpath)
+{
+    const char *token = *relpath, *end;
+    char        name[PATH_MAX], spill[PATH_MAX];
+
+    if (ctx->nested == NULL) {
+        return;
+    }
+
+    while ((token = strstr(token, ctx->params->magic_suffix)) != NULL) {
+
+        end = token + ctx->params->magic_suffix_len;
+
+        if (token == *relpath || (*end != '/' && *end != '\0')) {
+            token++;
+            continue;
+        }
+
+        snprintf(name, token - *relpath + 1, "%s", *relpath);
+
+        peepfs_debug("peepfs_nested_archive_path: trying '%s' in '%s'",
+            name, archivepath);
+
+        if (peepfs_nested_path(ctx->nested, ctx->pool,
+                               archivepath, name, spill)) {
+            token++;
+            continue;
+        }
+
+        snprintf(archivepath, PATH_MAX, "%s", spill);
+
+        while (*end == '/') ++end;
+
+        *relpath = token = end;
+    }
+}
+
 /* Return 0 iff 'fullpath' appears to point inside an archive 
  * If 0, then set archivepath to the path of the archive,
  * and relpath to the path of the file within that archive
@@ -161,6 +222,8 @@ peepfs_static_archive_path(
 
                 *relpath = token;
 
+                peepfs_nested_archive_path(ctx, archivepath, relpath);
+
                 return 0;
             }
  
@@ -174,45 +237,108 @@ peepfs_static_archive_path(
 }
 
 
-/*
- * Return 1 iff 'path/name' appears to be an archive file
- * and if so return the synthesized content dir name in 'out'
- */
+/* Return 1 iff 'name' (of 'namelen') ends in 'suffix', ignoring case */
 
-int
-peepfs_archive_ident(
-    peepfs_ctx_t *ctx, const char *path, const char *name, char *out)
+static inline int
+peepfs_name_ends(const char *name, int namelen, const char *suffix)
+{
+    int suffixlen = strlen(suffix);
+
+    return namelen >= suffixlen &&
+           strcasecmp(name + namelen - suffixlen, suffix) == 0;
+}
+
+/* Return 1 iff 'name' has an extension we know archives by */
+
+static inline int
+peepfs_archive_name_ok(const char *name)
 {
     int namelen = strlen(name);
-    peepfs_archive_t *archive;
-
-    if (namelen < 4) return 0;
-
-    if (strcasecmp(name + namelen - 4, ".zip") == 0 ||
-        strcasecmp(name + namelen - 4, ".tar") == 0 ||
-        strcasecmp(name + namelen - 7, ".tar.gz") == 0 ||
-        strcasecmp(name + namelen - 8, ".tar.bz2") == 0 ||
-        strcasecmp(name + namelen - 7, ".tar.xz") == 0 ||
-        strcasecmp(name + namelen - 4, ".tgz") == 0 ||
-        strcasecmp(name + namelen - 4, ".iso") == 0 ||
-        strcasecmp(name + namelen - 4, ".rar") == 0 ||
-        strcasecmp(name + namelen - 4, ".cab") == 0
-    ) {
-        char archpath[PATH_MAX+1];
-
-        snprintf(archpath, sizeof(archpath), "%s/%s/%s", ctx->params->base, path, name);
-
-        archive = peepfs_archive_open(archpath);
-
-        if (archive) {
-            peepfs_archive_close(archive);
-            snprintf(out, NAME_MAX, "%s%s", name, ctx->params->magic_suffix);
-            return 1;
+
+    return (
+        peepfs_name_ends(name, namelen, ".zip") ||
+        peepfs_name_ends(name, namelen, ".jar") ||
+        peepfs_name_ends(name, namelen, ".war") ||
+        peepfs_name_ends(name, namelen, ".ear") ||
+        peepfs_name_ends(name, namelen, ".tar") ||
+        peepfs_name_ends(name, namelen, ".tar.gz") ||
+        peepfs_name_ends(name, namelen, ".tar.bz2") ||
+        peepfs_name_ends(name, namelen, ".tar.xz") ||
+        peepfs_name_ends(name, namelen, ".tgz") ||
+        peepfs_name_ends(name, namelen, ".txz") ||
+        peepfs_name_ends(name, namelen, ".tar.zst") ||
+        peepfs_name_ends(name, namelen, ".tzst") ||
+        peepfs_name_ends(name, namelen, ".gz") ||
+        peepfs_name_ends(name, namelen, ".xz") ||
+        peepfs_name_ends(name, namelen, ".zst") ||
+        peepfs_name_ends(name, namelen, ".bz2") ||
+        peepfs_name_ends(name, namelen, ".iso") ||
+        peepfs_name_ends(name, namelen, ".squashfs") ||
+        peepfs_name_ends(name, namelen, ".sqfs") ||
+        peepfs_name_ends(name, namelen, ".snap") ||
+        peepfs_name_ends(name, namelen, ".rar") ||
+        peepfs_name_ends(name, namelen, ".7z") ||
+        peepfs_name_ends(name, namelen, ".cab"));
+}
+
+/* Base directory files that may be archives, gathered during a listing */
+typedef struct peepfs_candidates {
+    const char    **paths;
+    const char    **names;      /* point into paths */
+    uint64_t       *inos;
+    int            *formats;
+    int64_t         count;
+    int64_t         max;
+} peepfs_candidates_t;
+
+static void
+peepfs_candidates_add(
+    peepfs_candidates_t *cands, const char *dirpath, const char *name, uint64_t ino)
+{
+    int     dirlen = strlen(dirpath);
+    char   *path;
+
+    if (cands->count == cands->max) {
+
+        cands->max     = cands->max ? cands->max * 2 : 64;
+        cands->paths   = realloc(cands->paths,   cands->max * sizeof(*cands->paths));
+        cands->names   = realloc(cands->names,   cands->max * sizeof(*cands->names));
+        cands->inos    = realloc(cands->inos,    cands->max * sizeof(*cands->inos));
+        cands->formats = realloc(cands->formats, cands->max * sizeof(*cands->formats));
+
+        if (!cands->paths || !cands->names || !cands->inos || !cands->formats) {
+            peepfs_panic("Failed to allocate memory");
         }
     }
 
-    return 0;
+    path = (char*)malloc(dirlen + strlen(name) + 2);
+
+    if (path == NULL) {
+        peepfs_panic("Failed to allocate memory");
+    }
+
+    sprintf(path, "%s/%s", dirpath, name);
+
+    cands->paths[cands->count]   = path;
+    cands->names[cands->count]   = path + dirlen + 1;
+    cands->inos[cands->count]    = ino;
+    cands->formats[cands->count] = PEEPFS_FORMAT_UNKNOWN;
+    cands->count++;
+}
 
+static void
+peepfs_candidates_free(peepfs_candidates_t *cands)
+{
+    int64_t i;
+
+    for (i = 0; i < cands->count; ++i) {
+        free((void*)cands->paths[i]);
+    }
+
+    free(cands->paths);
+    free(cands->names);
+    free(cands->inos);
+    free(cands->formats);
 }
 
 /* Initialize the global FUSE context, peepfs_global_t */
@@ -235,6 +361,28 @@ peepfs_init(struct fuse_conn_info *conn, struct fuse_config *cfg)
 
     gl->cache = peepfs_cache_init(gl->params->max_cache_entries, gl->params->grace);
 
+    if (gl->cache == NULL) {
+        fprintf(stderr,"Failed to allocate memory\n");
+        abort();
+    }
+
+    gl->pool = peepfs_pool_init(gl->params->max_open_archives);
+
+    gl->ident = peepfs_ident_init(PEEPFS_IDENT_ENTRIES);
+
+    if (gl->ident == NULL) {
+        fprintf(stderr,"Failed to allocate memory\n");
+        abort();
+    }
+
+    /* Without somewhere to spill, archives just don't nest */
+    gl->nested = peepfs_nested_init(getenv("TMPDIR"), PEEPFS_NESTED_BUDGET);
+
+    /* Decoders pick this up on their own, no need to pass it around */
+    gl->workq = peepfs_workq_create(gl->params->workers);
+
+    peepfs_workq_set_default(gl->workq);
+
     pthread_key_create(&gl->key, free);
 
     return gl;
@@ -248,6 +396,19 @@ peepfs_destroy(void *private_data)
 
     peepfs_cache_free(gl->cache);
 
+    peepfs_pool_free(gl->pool);
+
+    peepfs_ident_free(gl->ident);
+
+    if (gl->nested) {
+        peepfs_nested_free(gl->nested);
+    }
+
+    if (gl->workq) {
+        peepfs_workq_set_default(NULL);
+        peepfs_workq_destroy(gl->workq);
+    }
+
     free(private_data);
 }
 
@@ -274,12 +435,37 @@ peepfs_get_ctx()
    
         ctx->params = gl->params;
         ctx->cache  = gl->cache;
+        ctx->pool   = gl->pool;
+        ctx->ident  = gl->ident;
+        ctx->nested = gl->nested;
     }
 
 
     return ctx;
 }
 
+struct peepfs_readdir_ctx;
+
+static int peepfs_archive_populate(peepfs_ctx_t *ctx,
+    peepfs_pool_entry_t *handle, struct peepfs_readdir_ctx *dir);
+
+/*
+ * Whether a path the archive doesn't name could still be a directory
+ * implied by the paths under it, only then is a miss worth reading the
+ * whole listing for.  Names with an extension are taken to be files,
+ * and dot files are what shells and prompts go probing for.
+ */
+
+static inline int
+peepfs_maybe_implied(const char *relpath)
+{
+    const char *name = rindex(relpath, '/');
+
+    name = name ? name + 1 : relpath;
+
+    return name[0] != '.' && index(name, '.') == NULL;
+}
+
 int peepfs_getattr(
     const char*             path,
     struct stat*            stbuf,
@@ -288,7 +474,7 @@ int peepfs_getattr(
     peepfs_ctx_t           *ctx = peepfs_get_ctx();
     int                     error;
     const char             *relpath;
-    peepfs_archive_t       *archive;
+    peepfs_pool_entry_t    *handle;
     peepfs_archive_entry_t  entry;
 
     peepfs_debug("peepfs_getattr: path %s", path);
@@ -320,6 +506,12 @@ int peepfs_getattr(
 
         if (relpath[0] == '\0') {
 
+            /* Listed on the strength of its name alone, see if it holds up */
+            if (ctx->params->lazy_ident &&
+                peepfs_ident_format(ctx->ident, ctx->archivepath) == PEEPFS_FORMAT_UNKNOWN) {
+                return -ENOENT;
+            }
+
             stbuf->st_ino   = peepfs_compose_ino(stbuf->st_ino, 1);
             stbuf->st_mode &= ~S_IFMT;
             stbuf->st_mode |= S_IFDIR;
@@ -333,18 +525,28 @@ int peepfs_getattr(
 
             error = peepfs_cache_get(ctx->cache, ctx->archivepath, relpath, &entry);
 
-            if (error) {
+            /* With the whole listing at hand, a miss is a miss */
+            if (error && !peepfs_cache_listed(ctx->cache, ctx->archivepath)) {
 
-                archive = peepfs_archive_open(ctx->archivepath);
- 
-                error = peepfs_archive_entry_open(archive, relpath, &entry);
+                handle = peepfs_pool_get(ctx->pool, ctx->archivepath);
+
+                if (handle == NULL) {
+                    return -ENOENT;
+                }
+
+                error = peepfs_archive_entry_open(handle->archive, relpath, &entry);
 
                 if (error == 0) {
-                    peepfs_cache_insert(ctx->cache, 
+                    peepfs_cache_insert(ctx->cache,
                         ctx->archivepath, relpath, 0, &entry);
+                } else if (peepfs_maybe_implied(relpath) &&
+                           peepfs_archive_populate(ctx, handle, NULL) == 0) {
+                    /* Directories only implied by the paths under them */
+                    error = peepfs_cache_get(ctx->cache, ctx->archivepath,
+                        relpath, &entry);
                 }
 
-                peepfs_archive_close(archive);
+                peepfs_pool_put(ctx->pool, handle);
             }
     
             if (error == 0) {
@@ -378,69 +580,186 @@ int peepfs_getattr(
 
 /* State tracking for iterating an archive file */
 typedef struct peepfs_readdir_ctx {
-    peepfs_archive_t   *archive;
-    peepfs_cache_t     *cache;
-    fuse_fill_dir_t     filler;
-    void               *buf;
-    const char         *archivepath;
-    uint64_t            archive_id;
-    const char         *relpath;
-    int                 relpath_len;
-    int                 scanning;
-    uint64_t            zip_ino;
+    peepfs_cache_t             *cache;
+    fuse_fill_dir_t             filler;
+    void                       *buf;
+    const char                 *archivepath;
+    uint64_t                    archive_id;
+    const char                 *relpath;
+    int                         relpath_len;
+    const char                 *magic_suffix;
+    uint64_t                    zip_ino;
+    struct peepfs_readdir_ctx  *dir;            /* listed by the same pass */
+    int                         filled;         /* by a populate pass */
+    int                         implied_only;   /* the rest, from the tree */
 } peepfs_readdir_ctx_t;
 
-/* Called for each entry in an archive we want to enumerate for readdir */
-static inline int 
-peepfs_readdir_callback(const char *input_name, peepfs_archive_entry_t *entry, void *arg)
+/* Archive names come with the odd leading or trailing slash */
+static inline const char *
+peepfs_trim_name(const char *input_name, char *buf, int size)
+{
+    int name_len;
+
+    while (input_name[0] == '/') {
+        input_name++;
+    }
+
+    name_len = snprintf(buf, size, "%s", input_name);
+
+    if (name_len >= size) {
+        name_len = size - 1;
+    }
+
+    while (name_len > 0 && buf[name_len-1] == '/') {
+        buf[--name_len] = '\0';
+    }
+
+    return buf;
+}
+
+/* Called for each entry directly in the directory being listed */
+static inline int
+peepfs_readdir_callback(const char *name, peepfs_archive_entry_t *entry, void *arg)
 {
     peepfs_readdir_ctx_t   *ctx = (peepfs_readdir_ctx_t*)arg;
-    char                    buf[NAME_MAX], *name;
+    char                    peepname[PATH_MAX];
     struct stat             st;
-    int                     name_len, error = 0;
 
-    name_len = snprintf(buf, NAME_MAX, "%s", input_name);
+    if (ctx->implied_only && entry->index < PEEPFS_CACHE_IMPLIED_INDEX) {
+        return 0;
+    }
 
-    name = buf;
+    st.st_ino  = peepfs_compose_ino(ctx->zip_ino, entry->index + 2);
 
-    peepfs_debug("peepfs_readdir_callback: name %s relpath '%s'", name, ctx->relpath);
+    st.st_mode = (entry->flags & PEEPFS_FLAG_DIR) ? S_IFDIR : S_IFREG;
 
-    while (name[name_len-1] == '/') {
-        name[name_len-1] = '\0';
-        name_len--;
-    }
-    
-    if (!ctx->scanning) {
-        peepfs_cache_insert(ctx->cache, ctx->archivepath, name, ctx->archive_id, entry);
+    ctx->filler(ctx->buf, name, &st, 0, 0);
+
+    /* Archives in here can be looked into too, they're opened on lookup */
+    if (!(entry->flags & PEEPFS_FLAG_DIR) && peepfs_archive_name_ok(name)) {
+        snprintf(peepname, sizeof(peepname), "%s%s", name, ctx->magic_suffix);
+        st.st_mode = S_IFDIR;
+        ctx->filler(ctx->buf, peepname, &st, 0, 0);
     }
 
+    return 0;
+}
+
+/* Called for each entry in an archive, when there's no listing to go by */
+static inline int
+peepfs_readdir_filter_callback(const char *input_name, peepfs_archive_entry_t *entry, void *arg)
+{
+    peepfs_readdir_ctx_t   *ctx = (peepfs_readdir_ctx_t*)arg;
+    char                    buf[PATH_MAX];
+    const char             *name;
+
+    name = peepfs_trim_name(input_name, buf, sizeof(buf));
+
+    peepfs_debug("peepfs_readdir_filter_callback: name %s relpath '%s'", name, ctx->relpath);
+
     if (ctx->relpath_len) {
         if (strncmp(name, ctx->relpath, ctx->relpath_len) != 0) {
-            peepfs_debug("peepfs_readdir_callback: doesn't match relpath, skipping...");
-            goto out;
+            peepfs_debug("peepfs_readdir_filter_callback: doesn't match relpath, skipping...");
+            return 0;
         }
-    
+
         name += ctx->relpath_len;
 
         if (name[0] != '/') {
-            goto out;
+            return 0;
         }
 
         name++;
     }
 
-    if (index(name, '/')) {
-        peepfs_debug("peepfs_readdir_callback: relpath suffix is not a simple name, skipping...");
+    if (name[0] == '\0' || index(name, '/')) {
+        peepfs_debug("peepfs_readdir_filter_callback: relpath suffix is not a simple name, skipping...");
+        return 0;
+    }
+
+    return peepfs_readdir_callback(name, entry, arg);
+}
+
+/* Called for each entry in an archive being read into the cache */
+static inline int
+peepfs_populate_callback(const char *input_name, peepfs_archive_entry_t *entry, void *arg)
+{
+    peepfs_readdir_ctx_t   *ctx = (peepfs_readdir_ctx_t*)arg;
+    char                    buf[PATH_MAX];
+    const char             *name;
+
+    name = peepfs_trim_name(input_name, buf, sizeof(buf));
+
+    if (name[0]) {
+        peepfs_cache_insert(ctx->cache, ctx->archivepath, name, ctx->archive_id, entry);
+    }
+
+    if (ctx->dir) {
+        peepfs_readdir_filter_callback(input_name, entry, ctx->dir);
+    }
+
+    return 0;
+}
+
+/*
+ * Read the whole of an archive into the cache as its listing, which
+ * readdir and getattr then go by.  0 if the listing made it in whole;
+ * an archive can outgrow the cache, or take longer to read than the
+ * grace period, and the handle remembers that so it isn't tried again
+ * until the file changes.  Only one thread reads a given archive's
+ * listing, anyone else waits to use it.  If 'dir' is given, the same
+ * pass fills in the names directly in that directory.
+ */
+
+static int
+peepfs_archive_populate(
+    peepfs_ctx_t           *ctx,
+    peepfs_pool_entry_t    *handle,
+    peepfs_readdir_ctx_t   *dir)
+{
+    peepfs_readdir_ctx_t    populate_ctx;
+    int                     error = -1;
+
+    pthread_mutex_lock(&handle->listing_lock);
+
+    if (handle->unlisted) {
         goto out;
     }
 
-    st.st_ino  = peepfs_compose_ino(ctx->zip_ino, entry->index + 2);
+    if (peepfs_cache_listed(ctx->cache, ctx->archivepath)) {
+        error = 0;
+        goto out;
+    }
 
-    st.st_mode = (entry->flags & PEEPFS_FLAG_DIR) ? S_IFDIR : S_IFREG;
+    memset(&populate_ctx, 0, sizeof(populate_ctx));
 
-    ctx->filler(ctx->buf, name, &st, 0, 0);
+    populate_ctx.cache       = ctx->cache;
+    populate_ctx.archivepath = ctx->archivepath;
+    populate_ctx.dir         = dir;
+    populate_ctx.archive_id  = peepfs_cache_insert(
+        ctx->cache, ctx->archivepath, NULL, 0, NULL);
+
+    if (populate_ctx.archive_id == 0) {
+        handle->unlisted = 1;
+        goto out;
+    }
+
+    if (dir) {
+        dir->filled = 1;
+    }
+
+    if (peepfs_archive_enumerate(handle->archive,
+            peepfs_populate_callback, &populate_ctx) == 0) {
+        error = peepfs_cache_complete(ctx->cache, ctx->archivepath,
+            populate_ctx.archive_id);
+    }
+
+    if (error) {
+        handle->unlisted = 1;
+    }
 
 out:
+    pthread_mutex_unlock(&handle->listing_lock);
 
     return error;
 }
@@ -455,11 +774,14 @@ int peepfs_readdir(
 {
     peepfs_ctx_t            *ctx = peepfs_get_ctx();
     peepfs_cookie_t         *cookie = (peepfs_cookie_t*)fi->fh;
-    peepfs_readdir_ctx_t     readdir_ctx; 
+    peepfs_readdir_ctx_t     readdir_ctx;
+    peepfs_pool_entry_t     *handle;
+    peepfs_candidates_t      cands;
     DIR                     *dir;
     struct dirent           *dirent;
     const char             *relpath;
     int                     error;
+    int64_t                 i;
     struct stat             st;
 
     peepfs_debug("peepfs_readdir: path %s offset %ld cookie %p", path, offset, cookie);
@@ -482,6 +804,8 @@ int peepfs_readdir(
             return -errno;
         }
 
+        memset(&cands, 0, sizeof(cands));
+
         filler(buf,".",     NULL, 0, 0);
         filler(buf,"..",    NULL, 0, 0);
 
@@ -516,15 +840,44 @@ int peepfs_readdir(
 
             filler(buf, dirent->d_name, &st, 0, 0);
 
-            if (peepfs_archive_ident(ctx, path, dirent->d_name, ctx->peepname)) {
-                st.st_ino = peepfs_compose_ino(dirent->d_ino, 1);
-                st.st_mode = S_IFDIR;
-                filler(buf, ctx->peepname, &st, 0, 0);
+            /* Identified all together below, so one slow file doesn't hold up the rest */
+            if ((dirent->d_type == DT_REG || dirent->d_type == DT_LNK ||
+                 dirent->d_type == DT_UNKNOWN) &&
+                peepfs_archive_name_ok(dirent->d_name)) {
+                peepfs_candidates_add(&cands, ctx->fullpath,
+                    dirent->d_name, dirent->d_ino);
             }
         }
 
         closedir(dir);
 
+        /*
+         * Check the magic of all of them at once on the decode workers,
+         * or with lazy_ident take the names at their word for now and
+         * leave the check until somebody looks inside.
+         */
+        if (!ctx->params->lazy_ident) {
+            peepfs_ident_formats(ctx->ident, peepfs_workq_default(),
+                cands.paths, cands.formats, cands.count);
+        }
+
+        for (i = 0; i < cands.count; ++i) {
+
+            if (!ctx->params->lazy_ident &&
+                cands.formats[i] == PEEPFS_FORMAT_UNKNOWN) {
+                continue;
+            }
+
+            snprintf(ctx->peepname, NAME_MAX, "%s%s",
+                cands.names[i], ctx->params->magic_suffix);
+
+            st.st_ino = peepfs_compose_ino(cands.inos[i], 1);
+            st.st_mode = S_IFDIR;
+            filler(buf, ctx->peepname, &st, 0, 0);
+        }
+
+        peepfs_candidates_free(&cands);
+
     } else {
 
         filler(buf,".",     NULL, 0, 0);
@@ -532,32 +885,41 @@ int peepfs_readdir(
 
         error = lstat(ctx->archivepath, &st);
 
+        memset(&readdir_ctx, 0, sizeof(readdir_ctx));
+
         readdir_ctx.filler      = filler;
         readdir_ctx.zip_ino     = st.st_ino;
         readdir_ctx.buf         = buf;
         readdir_ctx.archivepath = ctx->archivepath;
         readdir_ctx.relpath     = relpath;
         readdir_ctx.relpath_len = strlen(relpath);
+        readdir_ctx.magic_suffix = ctx->params->magic_suffix;
         readdir_ctx.cache       = ctx->cache;
-        readdir_ctx.scanning    = 1;
 
-        error = peepfs_cache_scandir(ctx->cache, ctx->archivepath,
+        /* Only this directory's own entries, from the listing's tree */
+        error = peepfs_cache_scandir(ctx->cache, ctx->archivepath, relpath,
             peepfs_readdir_callback, &readdir_ctx);
-   
-        if (error) { 
 
-            readdir_ctx.scanning    = 0;
+        if (error) {
+
+            handle = peepfs_pool_get(ctx->pool, ctx->archivepath);
 
-            readdir_ctx.archive = peepfs_archive_open(ctx->archivepath);
+            if (handle) {
 
-            readdir_ctx.archive_id = peepfs_cache_insert(
-                ctx->cache, ctx->archivepath, NULL, 0, NULL);
+                /* Our own pass already named what the archive does */
+                if (peepfs_archive_populate(ctx, handle, &readdir_ctx) == 0) {
+                    readdir_ctx.implied_only = readdir_ctx.filled;
+                    error = peepfs_cache_scandir(ctx->cache, ctx->archivepath,
+                        relpath, peepfs_readdir_callback, &readdir_ctx);
+                }
 
-            if (readdir_ctx.archive) {
-                peepfs_archive_enumerate(readdir_ctx.archive,
-                    peepfs_readdir_callback, &readdir_ctx);
+                /* No listing to be had, pick this directory out of the lot */
+                if (error && !readdir_ctx.filled) {
+                    peepfs_archive_enumerate(handle->archive,
+                        peepfs_readdir_filter_callback, &readdir_ctx);
+                }
 
-                peepfs_archive_close(readdir_ctx.archive);
+                peepfs_pool_put(ctx->pool, handle);
             }
         }
 
@@ -708,17 +1070,19 @@ int peepfs_open(
             peepfs_panic("Failed to allocate memory");
         }
 
-        cookie->archive = peepfs_archive_open(ctx->archivepath);
+        cookie->handle = peepfs_pool_get(ctx->pool, ctx->archivepath);
 
-        if (cookie->archive == NULL) {
+        if (cookie->handle == NULL) {
             free(cookie);
             return -ENOENT;
         }
 
+        cookie->archive = cookie->handle->archive;
+
         error = peepfs_archive_entry_open(cookie->archive, relpath, &cookie->entry);
 
         if (error) {
-            peepfs_archive_close(cookie->archive);
+            peepfs_pool_put(ctx->pool, cookie->handle);
             free(cookie);
             return -ENOENT;
         }
@@ -726,7 +1090,7 @@ int peepfs_open(
         cookie->file = peepfs_archive_file_open(cookie->archive, &cookie->entry);
         
         if (cookie->file == NULL) {
-            peepfs_archive_close(cookie->archive);
+            peepfs_pool_put(ctx->pool, cookie->handle);
             free(cookie);
             return -ENOENT;
         }
@@ -780,6 +1144,7 @@ int peepfs_release(
     const char*             path,
     struct fuse_file_info*  fi)
 {
+    peepfs_ctx_t    *ctx = peepfs_get_ctx();
     peepfs_cookie_t *cookie;
 
     peepfs_debug("peepfs_release: path %s", path);
@@ -788,7 +1153,7 @@ int peepfs_release(
 
     if (cookie->file) {
         peepfs_archive_file_close(cookie->archive, cookie->file);
-        peepfs_archive_close(cookie->archive);
+        peepfs_pool_put(ctx->pool, cookie->handle);
     } else {
         close(cookie->fd);
     }
@@ -1326,7 +1691,7 @@ static struct fuse_operations peepfs_oper = {
 
 void help()
 {
-    fprintf(stderr,"peepfs [-f] [-d] [-g <cache grace in seconds>] [-n <max cache entries] [-m magic_suffix] <peepfs mountpoint> <basefs mountpoint>\n");
+    fprintf(stderr,"peepfs [-f] [-d] [-g <cache grace in seconds>] [-n <max cache entries] [-a <max open archives>] [-w <decode threads>] [-l] [-m magic_suffix] <peepfs mountpoint> <basefs mountpoint>\n");
 }
 
 int 
@@ -1344,6 +1709,9 @@ main(int argc,char **argv)
 
     PeepParams.max_cache_entries = 1024*1024;
     PeepParams.grace = 10;
+    /* Their caches don't scale with it, see LIBARCHIVE_CACHE_BUDGET */
+    PeepParams.max_open_archives = 64;
+    PeepParams.workers = sysconf(_SC_NPROCESSORS_ONLN);
     snprintf(PeepParams.magic_suffix, NAME_MAX, "%s", ".peep");
 
     while (1) {
@@ -1355,12 +1723,15 @@ main(int argc,char **argv)
             { "magic_suffix", required_argument, 0, 'm' },
             { "cache_size", required_argument, 0, 'n' },
             { "cache_grace", required_argument, 0, 'g' },
+            { "open_archives", required_argument, 0, 'a' },
+            { "workers",    required_argument, 0,  'w' },
+            { "lazy_ident", no_argument,    0,  'l' },
             { NULL,         0,              0,  0   }
         };
 
         option_index = 0;
 
-        c = getopt_long(argc, argv, "dfg:hn:V", long_options, &option_index);
+        c = getopt_long(argc, argv, "a:dfg:hln:Vw:", long_options, &option_index);
 
         if (c == -1) {
             break;
@@ -1374,6 +1745,10 @@ main(int argc,char **argv)
 
             break;
 
+        case 'a':
+            PeepParams.max_open_archives = strtoul(optarg, NULL, 10);
+            break;
+
         case 'd':
             fuse_argv[fuse_argc++] = "-d";
             PeepDebug = 1;
@@ -1391,6 +1766,10 @@ main(int argc,char **argv)
             help();
             exit(0);
 
+        case 'l':
+            PeepParams.lazy_ident = 1;
+            break;
+
         case 'm':
             snprintf(PeepParams.magic_suffix, NAME_MAX, ".%s", optarg);
             break;
@@ -1404,6 +1783,10 @@ main(int argc,char **argv)
             exit(0);
             break;
 
+        case 'w':
+            PeepParams.workers = strtoul(optarg, NULL, 10);
+            break;
+
         case '?':
             help();
             exit(0);
@@ -1,50 +1,120 @@
 #include <stdlib.h>
 
 #include "peepfs_archive.h"
+#include "peepfs_detect.h"
 
 extern peepfs_archive_ops_t libzip_ops;
 extern peepfs_archive_ops_t libarchive_ops;
-
-peepfs_archive_t *
-peepfs_archive_open(const char *path)
+extern peepfs_archive_ops_t tar_ops;
+extern peepfs_archive_ops_t raw_ops;
+extern peepfs_archive_ops_t iso_ops;
+extern peepfs_archive_ops_t squashfs_ops;
+extern peepfs_archive_ops_t layer_ops;
+
+static peepfs_archive_t *
+__peepfs_archive_open(peepfs_archive_ops_t *ops, const char *path)
 {
     peepfs_archive_t *archive;
     void             *plugin_data;
-    const char       *dot;
 
-    dot = rindex(path, '.');
+    plugin_data = ops->open(path);
+
+    if (plugin_data == NULL) {
+        return NULL;
+    }
+
+    archive = (peepfs_archive_t*)calloc(1,sizeof(peepfs_archive_t));
 
-    if (strcasecmp(dot,".zip") == 0) {
+    if (archive == NULL) {
+        ops->close(plugin_data);
+        return NULL;
+    }
 
-        plugin_data = libzip_ops.open(path);
+    archive->ops = ops;
+    archive->plugin_data = plugin_data;
 
-        if (plugin_data) {
+    return archive;
+}
 
-            archive = (peepfs_archive_t*)calloc(1,sizeof(peepfs_archive_t));
+peepfs_archive_t *
+peepfs_archive_open_format(const char *path, int format)
+{
+    peepfs_archive_t *archive = NULL;
 
-            archive->ops = &libzip_ops;
-            archive->plugin_data = plugin_data;
+    switch (format) {
+    case PEEPFS_FORMAT_ZIP:
 
-            return archive;
+        /* libarchive if libzip won't have it */
+        archive = __peepfs_archive_open(&libzip_ops, path);
+
+        if (archive == NULL) {
+            archive = __peepfs_archive_open(&libarchive_ops, path);
         }
 
-    } else {
+        break;
+
+    case PEEPFS_FORMAT_GZIP:
 
-        plugin_data = libarchive_ops.open(path);
+        /* A layer that brought its own index needn't be walked at all */
+        archive = __peepfs_archive_open(&layer_ops, path);
 
-        if (plugin_data) {
+        if (archive) {
+            break;
+        }
 
-            archive = (peepfs_archive_t*)calloc(1,sizeof(peepfs_archive_t));
+        /* fall through */
 
-            archive->ops = &libarchive_ops;
-            archive->plugin_data = plugin_data;
+    case PEEPFS_FORMAT_TAR:
+    case PEEPFS_FORMAT_XZ:
+    case PEEPFS_FORMAT_ZSTD:
+    case PEEPFS_FORMAT_BZ2:
 
-            return archive;
+        /* Native reader first, libarchive for anything it won't take */
+        archive = __peepfs_archive_open(&tar_ops, path);
+
+        if (archive == NULL) {
+            archive = __peepfs_archive_open(&libarchive_ops, path);
         }
 
+        /* Not an archive at all, just a compressed file */
+        if (archive == NULL && format != PEEPFS_FORMAT_TAR) {
+            archive = __peepfs_archive_open(&raw_ops, path);
+        }
+
+        break;
+
+    case PEEPFS_FORMAT_ISO:
+
+        archive = __peepfs_archive_open(&iso_ops, path);
+
+        if (archive == NULL) {
+            archive = __peepfs_archive_open(&libarchive_ops, path);
+        }
+
+        break;
+
+    case PEEPFS_FORMAT_SQUASHFS:
+
+        /* Nothing else reads these */
+        archive = __peepfs_archive_open(&squashfs_ops, path);
+
+        break;
+
+    default:
+
+        /* 7z, rar, cab, and whatever else libarchive may know */
+        archive = __peepfs_archive_open(&libarchive_ops, path);
+
+        break;
     }
 
-    return NULL;
+    return archive;
+}
+
+peepfs_archive_t *
+peepfs_archive_open(const char *path)
+{
+    return peepfs_archive_open_format(path, peepfs_detect_path(path));
 }
 
 void 
@@ -99,4 +169,15 @@ peepfs_archive_file_read(
     return archive->ops->file_read(archive->plugin_data, file, buffer, offset, len);
 }
 
+int
+peepfs_archive_extent(
+    peepfs_archive_t       *archive,
+    peepfs_archive_entry_t *entry,
+    int64_t                *offset)
+{
+    if (archive->ops->extent == NULL) {
+        return -1;
+    }
 
+    return archive->ops->extent(archive->plugin_data, entry, offset);
+}
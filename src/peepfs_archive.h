@@ -4,6 +4,7 @@
 #include <stdint.h>
 #include <string.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 
 #define PEEPFS_FLAG_DIR         0x01
 #define PEEPFS_FLAG_SEEKABLE    0x02
@@ -14,6 +15,31 @@ typedef struct peepfs_archive_entry {
     uint64_t    flags;
 } peepfs_archive_entry_t;
 
+/* Identity of an archive file in the base file system.  Any change
+ * to the file shows up as a change in at least one of these fields.
+ */
+
+typedef struct peepfs_archive_key {
+    uint64_t    dev;
+    uint64_t    ino;
+    int64_t     mtime_sec;
+    int64_t     mtime_nsec;
+    int64_t     size;
+} peepfs_archive_key_t;
+
+static inline void
+peepfs_archive_key_init(peepfs_archive_key_t *key, const struct stat *st)
+{
+    /* Zero first, the key is hashed and compared as raw bytes */
+    memset(key, 0, sizeof(*key));
+
+    key->dev        = st->st_dev;
+    key->ino        = st->st_ino;
+    key->mtime_sec  = st->st_mtim.tv_sec;
+    key->mtime_nsec = st->st_mtim.tv_nsec;
+    key->size       = st->st_size;
+}
+
 typedef int (*peepfs_archive_enum_callback_t)(
     const char *filename, peepfs_archive_entry_t *entry, void *arg);
 
@@ -38,6 +64,10 @@ typedef void  (*peepfs_archive_file_close_t)(
 typedef ssize_t (*peepfs_archive_file_read_t)(
     void *archive, void *file, void *buffer, size_t offset, size_t len);
 
+/* Optional, where a stored entry's bytes start in the archive file */
+typedef int (*peepfs_archive_extent_t)(
+    void *archive, peepfs_archive_entry_t *entry, int64_t *offset);
+
 typedef struct peepfs_archive_ops {
     peepfs_archive_open_t           open;
     peepfs_archive_close_t          close;
@@ -46,6 +76,7 @@ typedef struct peepfs_archive_ops {
     peepfs_archive_file_open_t      file_open;
     peepfs_archive_file_close_t     file_close;
     peepfs_archive_file_read_t      file_read;
+    peepfs_archive_extent_t         extent;
 } peepfs_archive_ops_t;
 
 typedef struct peepfs_archive {
@@ -58,6 +89,10 @@ typedef void peepfs_archive_file_t;
 peepfs_archive_t * peepfs_archive_open(
     const char *path);
 
+/* Skip detection, 'format' is one of the PEEPFS_FORMAT_ codes */
+peepfs_archive_t * peepfs_archive_open_format(
+    const char *path, int format);
+
 void peepfs_archive_close(
     peepfs_archive_t *archive);
 
@@ -78,4 +113,7 @@ int peepfs_archive_file_read(
     peepfs_archive_t *archive, peepfs_archive_file_t *file, 
     void *buffer, size_t offset, size_t len);
 
+int peepfs_archive_extent(
+    peepfs_archive_t *archive, peepfs_archive_entry_t *entry, int64_t *offset);
+
 #endif
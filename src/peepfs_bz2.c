@@ -0,0 +1,851 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <bzlib.h>
+
+#include "peepfs_stream.h"
+#include "peepfs_workq.h"
+
+/*
+ * Random access into bzip2 files.
+ *
+ * A bzip2 stream is a run of blocks that each decompress on their own,
+ * but blocks are bit aligned and their sizes aren't recorded anywhere.
+ * We find them by scanning the compressed data for the 48 bit block
+ * and end of stream magics at every bit offset, a chunk at a time as
+ * reads need more of the file.  A block is decoded by wrapping its
+ * bits in a stream header and trailer of its own, and decoding blocks
+ * in order is what tells us where each one lands in the uncompressed
+ * data.  Blocks are handed to the default worker pool ahead of the
+ * reader, so both the first pass and plain sequential reads run on
+ * several cores, and a small cache keeps the decoded blocks around.
+ *
+ * The magics can also turn up by chance inside compressed data.  The
+ * block before such a false mark fails to decode, and it is retried
+ * with the mark folded into it.
+ */
+
+#define MIN(x,y) ((x) < (y) ? (x) : (y))
+
+#define BZ2_SCAN_CHUNK      (1024*1024)
+#define BZ2_MAX_OUTPUT      (64*1024*1024)
+#define BZ2_MAX_MERGE       8
+
+#define BZ2_MAGIC_BITS      48
+#define BZ2_MAGIC_MASK      0xFFFFFFFFFFFFULL
+#define BZ2_BLOCK_MAGIC     0x314159265359ULL
+#define BZ2_EOS_MAGIC       0x177245385090ULL
+#define BZ2_HEADER_BITS     32
+#define BZ2_CRC_BITS        32
+
+#define BZ2_MARK_BLOCK      0
+#define BZ2_MARK_EOS        1
+
+#define BZ2_IDLE            0
+#define BZ2_QUEUED          1
+#define BZ2_RUNNING         2
+#define BZ2_DONE            3
+#define BZ2_FAILED          4
+
+typedef struct bz2_chunk {
+    int64_t             refcnt;
+    int64_t             len;
+    char               *data;
+} bz2_chunk_t;
+
+typedef struct bz2_mark {
+    int64_t             bit;        /* where the magic starts */
+    int                 type;
+    int                 bogus;      /* turned out to be part of a block */
+    int                 state;
+    int                 merges;
+    int64_t             out;        /* -1 until the marks before are decoded */
+    int64_t             size;       /* -1 until decoded */
+    bz2_chunk_t        *chunk;      /* decoded contents, while cached */
+} bz2_mark_t;
+
+typedef struct bz2_stream {
+    int                 fd;
+    int64_t             start;
+    int64_t             length;
+    pthread_mutex_t     lock;
+    pthread_cond_t      cond;
+    peepfs_workq_t     *workq;
+    int                 readahead;
+    int64_t             jobs;       /* submitted and not finished yet */
+    bz2_mark_t         *marks;
+    int64_t             num_marks;
+    int64_t             max_marks;
+    int64_t             scan_pos;
+    uint64_t            scan_reg;
+    int                 scan_done;
+    unsigned char      *scan_buffer;
+    int64_t             resolved;   /* marks with a known out offset */
+    int64_t             resolved_out;
+    int64_t            *cache;      /* ring of marks holding a chunk */
+    int                 cache_size;
+    int                 cache_next;
+} bz2_stream_t;
+
+typedef struct bz2_cursor {
+    bz2_chunk_t        *chunk;
+    int64_t             out;
+} bz2_cursor_t;
+
+typedef struct bz2_job {
+    bz2_stream_t       *stream;
+    int64_t             index;
+} bz2_job_t;
+
+static void
+__peepfs_bz2_chunk_put(bz2_chunk_t *chunk)
+{
+    if (--chunk->refcnt == 0) {
+        free(chunk->data);
+        free(chunk);
+    }
+}
+
+static uint64_t
+__peepfs_bz2_get_bits(const unsigned char *buffer, int64_t bit, int nbits)
+{
+    uint64_t    value = 0;
+    int         i;
+
+    for (i = 0; i < nbits; ++i, ++bit) {
+        value = (value << 1) | ((buffer[bit >> 3] >> (7 - (bit & 7))) & 1);
+    }
+
+    return value;
+}
+
+static void
+__peepfs_bz2_put_bits(unsigned char *buffer, int64_t bit, uint64_t value, int nbits)
+{
+    int i;
+
+    for (i = nbits - 1; i >= 0; --i, ++bit) {
+        if ((value >> i) & 1) {
+            buffer[bit >> 3] |= 0x80 >> (bit & 7);
+        }
+    }
+}
+
+static int
+__peepfs_bz2_add_mark(
+    bz2_stream_t   *stream,
+    int64_t         bit,
+    int             type)
+{
+    bz2_mark_t *marks, *mark;
+
+    if (stream->num_marks == stream->max_marks) {
+
+        marks = (bz2_mark_t*)realloc(stream->marks,
+            (stream->max_marks * 2 + 64) * sizeof(bz2_mark_t));
+
+        if (marks == NULL) {
+            return -1;
+        }
+
+        stream->marks     = marks;
+        stream->max_marks = stream->max_marks * 2 + 64;
+    }
+
+    mark = &stream->marks[stream->num_marks++];
+
+    memset(mark, 0, sizeof(*mark));
+
+    mark->bit  = bit;
+    mark->type = type;
+    mark->out  = -1;
+    mark->size = -1;
+
+    return 0;
+}
+
+/* Scan the next chunk of the file for magics, called with the lock held */
+static int
+__peepfs_bz2_scan(bz2_stream_t *stream)
+{
+    int64_t     i, end, bit;
+    ssize_t     len;
+    uint64_t    value;
+    int         shift;
+
+    len = MIN(BZ2_SCAN_CHUNK, stream->length - stream->scan_pos);
+
+    if (len > 0) {
+        len = pread(stream->fd, stream->scan_buffer, len,
+                    stream->start + stream->scan_pos);
+    }
+
+    if (len <= 0) {
+        stream->scan_done = 1;
+        return len < 0 ? -1 : 0;
+    }
+
+    for (i = 0; i < len; ++i) {
+
+        stream->scan_reg = (stream->scan_reg << 8) | stream->scan_buffer[i];
+
+        /* Try every alignment of a magic ending within this byte */
+        for (shift = 7; shift >= 0; --shift) {
+
+            end = (stream->scan_pos + i + 1) * 8 - shift;
+            bit = end - BZ2_MAGIC_BITS;
+
+            if (bit < BZ2_HEADER_BITS) {
+                continue;
+            }
+
+            value = (stream->scan_reg >> shift) & BZ2_MAGIC_MASK;
+
+            if (value == BZ2_BLOCK_MAGIC) {
+                if (__peepfs_bz2_add_mark(stream, bit, BZ2_MARK_BLOCK)) {
+                    return -1;
+                }
+            } else if (value == BZ2_EOS_MAGIC) {
+                if (__peepfs_bz2_add_mark(stream, bit, BZ2_MARK_EOS)) {
+                    return -1;
+                }
+            }
+        }
+    }
+
+    stream->scan_pos += len;
+
+    return 0;
+}
+
+/*
+ * The first mark after 'i' that isn't bogus, scanning further if need
+ * be, or -1 if there is none.  Called with the lock held.
+ */
+static int64_t
+__peepfs_bz2_next(bz2_stream_t *stream, int64_t i)
+{
+    int64_t j;
+
+    while (1) {
+
+        for (j = i + 1; j < stream->num_marks; ++j) {
+            if (!stream->marks[j].bogus) {
+                return j;
+            }
+        }
+
+        if (stream->scan_done || __peepfs_bz2_scan(stream)) {
+            return -1;
+        }
+    }
+}
+
+/* Decompress the block in bits [start, end) as a stream of its own */
+static bz2_chunk_t *
+__peepfs_bz2_decode(
+    bz2_stream_t   *stream,
+    int64_t         start,
+    int64_t         end)
+{
+    bz2_chunk_t    *chunk = NULL;
+    bz_stream       bz;
+    unsigned char  *raw = NULL, *syn = NULL;
+    char           *data = NULL, *ndata;
+    int64_t         nbits = end - start, rawlen, synlen, cap, i;
+    int             shift = start & 7, ret, init = 0;
+    uint64_t        crc;
+
+    if (nbits <= BZ2_MAGIC_BITS + BZ2_CRC_BITS || nbits > 8LL * BZ2_MAX_OUTPUT) {
+        return NULL;
+    }
+
+    rawlen = (end + 7) / 8 - start / 8;
+    synlen = (BZ2_HEADER_BITS + nbits + BZ2_MAGIC_BITS + BZ2_CRC_BITS + 7) / 8;
+
+    raw = (unsigned char*)malloc(rawlen + 1);
+    syn = (unsigned char*)calloc(1, synlen);
+
+    if (raw == NULL || syn == NULL) {
+        goto out;
+    }
+
+    if (pread(stream->fd, raw, rawlen, stream->start + start / 8) != rawlen) {
+        goto out;
+    }
+
+    raw[rawlen] = 0;
+
+    memcpy(syn, "BZh9", 4);
+
+    /* Move the block's bits down to a byte boundary */
+    for (i = 0; i < (nbits + 7) / 8; ++i) {
+        syn[4 + i] = shift ? (raw[i] << shift) | (raw[i+1] >> (8 - shift)) : raw[i];
+    }
+
+    if (nbits & 7) {
+        syn[4 + nbits / 8] &= 0xFF << (8 - (nbits & 7));
+    }
+
+    /* With one block, the stream CRC is just the block CRC */
+    crc = __peepfs_bz2_get_bits(syn, BZ2_HEADER_BITS + BZ2_MAGIC_BITS, BZ2_CRC_BITS);
+
+    __peepfs_bz2_put_bits(syn, BZ2_HEADER_BITS + nbits,
+                          BZ2_EOS_MAGIC, BZ2_MAGIC_BITS);
+    __peepfs_bz2_put_bits(syn, BZ2_HEADER_BITS + nbits + BZ2_MAGIC_BITS,
+                          crc, BZ2_CRC_BITS);
+
+    memset(&bz, 0, sizeof(bz));
+
+    if (BZ2_bzDecompressInit(&bz, 0, 0) != BZ_OK) {
+        goto out;
+    }
+
+    init = 1;
+
+    cap  = 1024*1024;
+    data = (char*)malloc(cap);
+
+    if (data == NULL) {
+        goto out;
+    }
+
+    bz.next_in   = (char*)syn;
+    bz.avail_in  = synlen;
+    bz.next_out  = data;
+    bz.avail_out = cap;
+
+    while (1) {
+
+        ret = BZ2_bzDecompress(&bz);
+
+        if (ret == BZ_STREAM_END) {
+            break;
+        }
+
+        if (ret != BZ_OK) {
+            goto out;
+        }
+
+        if (bz.avail_out == 0) {
+
+            if (cap >= BZ2_MAX_OUTPUT) {
+                goto out;
+            }
+
+            ndata = (char*)realloc(data, cap * 2);
+
+            if (ndata == NULL) {
+                goto out;
+            }
+
+            data          = ndata;
+            bz.next_out   = data + cap;
+            bz.avail_out  = cap;
+            cap          *= 2;
+
+        } else if (bz.avail_in == 0) {
+            /* Ran out of block without an end */
+            goto out;
+        }
+    }
+
+    chunk = (bz2_chunk_t*)calloc(1,sizeof(bz2_chunk_t));
+
+    if (chunk == NULL) {
+        goto out;
+    }
+
+    chunk->refcnt = 1;
+    chunk->len    = cap - bz.avail_out;
+    chunk->data   = data;
+
+    data = NULL;
+
+out:
+
+    if (init) {
+        BZ2_bzDecompressEnd(&bz);
+    }
+
+    free(data);
+    free(syn);
+    free(raw);
+
+    return chunk;
+}
+
+/* Hold on to a decoded block, letting go of the oldest one held */
+static void
+__peepfs_bz2_cache(bz2_stream_t *stream, int64_t i)
+{
+    int64_t old = stream->cache[stream->cache_next];
+
+    if (old >= 0 && old != i && stream->marks[old].chunk) {
+        __peepfs_bz2_chunk_put(stream->marks[old].chunk);
+        stream->marks[old].chunk = NULL;
+    }
+
+    stream->cache[stream->cache_next] = i;
+    stream->cache_next = (stream->cache_next + 1) % stream->cache_size;
+}
+
+/*
+ * Decode block 'i'.  Called with the lock held and the block marked
+ * running; the lock is dropped while the decoding happens.
+ */
+static void
+__peepfs_bz2_run(bz2_stream_t *stream, int64_t i)
+{
+    bz2_chunk_t    *chunk = NULL;
+    bz2_mark_t     *mark;
+    int64_t         j, start, end;
+
+    j = __peepfs_bz2_next(stream, i);
+
+    start = stream->marks[i].bit;
+    end   = j >= 0 ? stream->marks[j].bit : -1;
+
+    pthread_mutex_unlock(&stream->lock);
+
+    if (end >= 0) {
+        chunk = __peepfs_bz2_decode(stream, start, end);
+    }
+
+    pthread_mutex_lock(&stream->lock);
+
+    mark = &stream->marks[i];
+
+    if (mark->bogus) {
+        /* Folded into the block before while we were busy */
+        if (chunk) {
+            __peepfs_bz2_chunk_put(chunk);
+        }
+        mark->state = BZ2_IDLE;
+    } else if (chunk == NULL) {
+        mark->state = BZ2_FAILED;
+    } else {
+        mark->state = BZ2_DONE;
+        mark->size  = chunk->len;
+        mark->chunk = chunk;
+        __peepfs_bz2_cache(stream, i);
+    }
+
+    pthread_cond_broadcast(&stream->cond);
+}
+
+static void
+__peepfs_bz2_job(void *arg)
+{
+    bz2_job_t      *job = (bz2_job_t*)arg;
+    bz2_stream_t   *stream = job->stream;
+
+    pthread_mutex_lock(&stream->lock);
+
+    /* A reader may have gotten impatient and done it already */
+    if (stream->marks[job->index].state == BZ2_QUEUED) {
+        stream->marks[job->index].state = BZ2_RUNNING;
+        __peepfs_bz2_run(stream, job->index);
+    }
+
+    stream->jobs--;
+
+    pthread_cond_broadcast(&stream->cond);
+
+    pthread_mutex_unlock(&stream->lock);
+
+    free(job);
+}
+
+/* Queue up decoding of the blocks after 'i', called with the lock held */
+static void
+__peepfs_bz2_readahead(bz2_stream_t *stream, int64_t i)
+{
+    bz2_mark_t     *mark;
+    bz2_job_t      *job;
+    int             n = 0;
+
+    if (stream->workq == NULL) {
+        return;
+    }
+
+    while (n < stream->readahead && (i = __peepfs_bz2_next(stream, i)) >= 0) {
+
+        mark = &stream->marks[i];
+
+        if (mark->type != BZ2_MARK_BLOCK) {
+            continue;
+        }
+
+        ++n;
+
+        if (mark->state != BZ2_IDLE &&
+            !(mark->state == BZ2_DONE && mark->chunk == NULL)) {
+            continue;
+        }
+
+        job = (bz2_job_t*)calloc(1,sizeof(bz2_job_t));
+
+        if (job == NULL) {
+            break;
+        }
+
+        job->stream = stream;
+        job->index  = i;
+
+        mark->state = BZ2_QUEUED;
+        stream->jobs++;
+
+        if (peepfs_workq_submit(stream->workq, __peepfs_bz2_job, job)) {
+            mark->state = BZ2_IDLE;
+            stream->jobs--;
+            free(job);
+            break;
+        }
+    }
+}
+
+/*
+ * Return a referenced chunk with block 'i' decoded, or NULL if it
+ * can't be.  'readahead' is set when the caller is moving forward
+ * through the file.  Called with the lock held.
+ */
+static bz2_chunk_t *
+__peepfs_bz2_get(bz2_stream_t *stream, int64_t i, int readahead)
+{
+    bz2_mark_t     *mark;
+    int64_t         j;
+
+    if (readahead) {
+        __peepfs_bz2_readahead(stream, i);
+    }
+
+    while (1) {
+
+        mark = &stream->marks[i];
+
+        switch (mark->state) {
+
+        case BZ2_DONE:
+
+            if (mark->chunk) {
+                mark->chunk->refcnt++;
+                return mark->chunk;
+            }
+
+            /* Fell out of the cache, decode it again */
+            mark->state = BZ2_RUNNING;
+            __peepfs_bz2_run(stream, i);
+            break;
+
+        case BZ2_IDLE:
+        case BZ2_QUEUED:
+
+            /* Don't wait in line behind other work, just do it */
+            mark->state = BZ2_RUNNING;
+            __peepfs_bz2_run(stream, i);
+            break;
+
+        case BZ2_RUNNING:
+
+            pthread_cond_wait(&stream->cond, &stream->lock);
+            break;
+
+        case BZ2_FAILED:
+
+            /* Maybe the next mark is a false one, try it as part of this block */
+            j = __peepfs_bz2_next(stream, i);
+
+            mark = &stream->marks[i];
+
+            if (j < 0 || mark->merges >= BZ2_MAX_MERGE) {
+                return NULL;
+            }
+
+            mark->merges++;
+            mark->state = BZ2_IDLE;
+
+            stream->marks[j].bogus = 1;
+
+            if (stream->marks[j].chunk) {
+                __peepfs_bz2_chunk_put(stream->marks[j].chunk);
+                stream->marks[j].chunk = NULL;
+            }
+            break;
+        }
+    }
+}
+
+/* Assign out offsets as far as the decoded sizes allow */
+static void
+__peepfs_bz2_resolve(bz2_stream_t *stream)
+{
+    bz2_mark_t *mark;
+
+    while (stream->resolved < stream->num_marks) {
+
+        mark = &stream->marks[stream->resolved];
+
+        if (mark->type == BZ2_MARK_BLOCK && !mark->bogus) {
+
+            if (mark->size < 0) {
+                break;
+            }
+
+            mark->out = stream->resolved_out;
+            stream->resolved_out += mark->size;
+
+        } else {
+            mark->out = stream->resolved_out;
+        }
+
+        stream->resolved++;
+    }
+}
+
+/*
+ * Find the block holding 'offset', decoding our way there if needed.
+ * Returns -1 past the end and -2 on error.  Called with the lock held.
+ */
+static int64_t
+__peepfs_bz2_locate(bz2_stream_t *stream, int64_t offset)
+{
+    bz2_chunk_t    *chunk;
+    int64_t         lo, hi, mid;
+    int             walked = 0;
+
+    while (1) {
+
+        __peepfs_bz2_resolve(stream);
+
+        if (offset < stream->resolved_out) {
+
+            lo = 0;
+            hi = stream->resolved;
+
+            while (lo < hi) {
+                mid = (lo + hi) / 2;
+                if (stream->marks[mid].out <= offset) {
+                    lo = mid + 1;
+                } else {
+                    hi = mid;
+                }
+            }
+
+            return lo - 1;
+        }
+
+        if (stream->resolved == stream->num_marks) {
+
+            if (stream->scan_done) {
+                return -1;
+            }
+
+            if (__peepfs_bz2_scan(stream)) {
+                return -2;
+            }
+
+            continue;
+        }
+
+        /* Past the first block, we're on a walk and should read ahead */
+        chunk = __peepfs_bz2_get(stream, stream->resolved, walked++);
+
+        if (chunk == NULL) {
+            return -2;
+        }
+
+        __peepfs_bz2_chunk_put(chunk);
+    }
+}
+
+void peepfs_bz2_close(void *stream_data);
+
+void *
+peepfs_bz2_open(
+    int         fd,
+    int64_t     start,
+    int64_t     length)
+{
+    bz2_stream_t   *stream;
+    unsigned char   header[4];
+    int             i;
+
+    if (pread(fd, header, sizeof(header), start) != sizeof(header) ||
+        memcmp(header, "BZh", 3) || header[3] < '1' || header[3] > '9') {
+        return NULL;
+    }
+
+    stream = (bz2_stream_t*)calloc(1,sizeof(bz2_stream_t));
+
+    if (stream == NULL) {
+        return NULL;
+    }
+
+    pthread_mutex_init(&stream->lock, NULL);
+    pthread_cond_init(&stream->cond, NULL);
+
+    stream->fd        = fd;
+    stream->start     = start;
+    stream->length    = length;
+    stream->workq     = peepfs_workq_default();
+    stream->readahead = stream->workq ? peepfs_workq_threads(stream->workq) : 0;
+
+    /* Enough for a reader's block and everything read ahead of it, twice */
+    stream->cache_size = 2 * (stream->readahead + 2);
+
+    stream->cache       = (int64_t*)malloc(stream->cache_size * sizeof(int64_t));
+    stream->scan_buffer = (unsigned char*)malloc(BZ2_SCAN_CHUNK);
+
+    if (stream->cache == NULL || stream->scan_buffer == NULL) {
+        peepfs_bz2_close(stream);
+        return NULL;
+    }
+
+    for (i = 0; i < stream->cache_size; ++i) {
+        stream->cache[i] = -1;
+    }
+
+    return stream;
+}
+
+void
+peepfs_bz2_close(void *stream_data)
+{
+    bz2_stream_t   *stream = (bz2_stream_t*)stream_data;
+    int64_t         i;
+
+    /* Workers may still be decoding blocks for us */
+    pthread_mutex_lock(&stream->lock);
+
+    while (stream->jobs) {
+        pthread_cond_wait(&stream->cond, &stream->lock);
+    }
+
+    pthread_mutex_unlock(&stream->lock);
+
+    for (i = 0; i < stream->num_marks; ++i) {
+        if (stream->marks[i].chunk) {
+            __peepfs_bz2_chunk_put(stream->marks[i].chunk);
+        }
+    }
+
+    pthread_cond_destroy(&stream->cond);
+    pthread_mutex_destroy(&stream->lock);
+
+    free(stream->scan_buffer);
+    free(stream->cache);
+    free(stream->marks);
+    free(stream);
+}
+
+int64_t
+peepfs_bz2_size(void *stream_data)
+{
+    bz2_stream_t   *stream = (bz2_stream_t*)stream_data;
+    int64_t         size = -1;
+
+    pthread_mutex_lock(&stream->lock);
+
+    if (stream->scan_done && stream->resolved == stream->num_marks) {
+        size = stream->resolved_out;
+    }
+
+    pthread_mutex_unlock(&stream->lock);
+
+    return size;
+}
+
+void *
+peepfs_bz2_cursor_open(void *stream_data)
+{
+    return calloc(1,sizeof(bz2_cursor_t));
+}
+
+void
+peepfs_bz2_cursor_close(
+    void *stream_data,
+    void *cursor_data)
+{
+    bz2_stream_t   *stream = (bz2_stream_t*)stream_data;
+    bz2_cursor_t   *cursor = (bz2_cursor_t*)cursor_data;
+
+    if (cursor->chunk) {
+        pthread_mutex_lock(&stream->lock);
+        __peepfs_bz2_chunk_put(cursor->chunk);
+        pthread_mutex_unlock(&stream->lock);
+    }
+
+    free(cursor);
+}
+
+ssize_t
+peepfs_bz2_read(
+    void       *stream_data,
+    void       *cursor_data,
+    void       *buffer,
+    int64_t     offset,
+    size_t      len)
+{
+    bz2_stream_t   *stream = (bz2_stream_t*)stream_data;
+    bz2_cursor_t   *cursor = (bz2_cursor_t*)cursor_data;
+    bz2_chunk_t    *chunk;
+    int64_t         pos, i, n, copied = 0;
+    int             sequential;
+
+    while (copied < len) {
+
+        pos   = offset + copied;
+        chunk = cursor->chunk;
+
+        /* Anything in the block we already hold needs no lock */
+        if (chunk == NULL || pos < cursor->out || pos >= cursor->out + chunk->len) {
+
+            sequential = chunk && pos == cursor->out + chunk->len;
+
+            pthread_mutex_lock(&stream->lock);
+
+            if (cursor->chunk) {
+                __peepfs_bz2_chunk_put(cursor->chunk);
+                cursor->chunk = NULL;
+            }
+
+            i = __peepfs_bz2_locate(stream, pos);
+
+            chunk = i >= 0 ? __peepfs_bz2_get(stream, i, sequential) : NULL;
+
+            if (chunk) {
+                cursor->chunk = chunk;
+                cursor->out   = stream->marks[i].out;
+            }
+
+            pthread_mutex_unlock(&stream->lock);
+
+            if (i == -1) {
+                break;
+            }
+
+            if (chunk == NULL) {
+                return copied ? copied : -1;
+            }
+        }
+
+        n = MIN(len - copied, cursor->out + chunk->len - pos);
+
+        memcpy((char*)buffer + copied, chunk->data + (pos - cursor->out), n);
+
+        copied += n;
+    }
+
+    return copied;
+}
+
+peepfs_stream_ops_t bz2_stream_ops = {
+    .open           = peepfs_bz2_open,
+    .close          = peepfs_bz2_close,
+    .size           = peepfs_bz2_size,
+    .cursor_open    = peepfs_bz2_cursor_open,
+    .cursor_close   = peepfs_bz2_cursor_close,
+    .read           = peepfs_bz2_read
+};
@@ -1,197 +1,1064 @@
 #ifndef __PEEPFS_CACHE_H__
 #define __PEEPFS_CACHE_H__
 
+#include <stddef.h>
+
 #include "peepfs_archive.h"
+#include "peepfs_epoch.h"
+#include "peepfs_swiss.h"
 #include "utlist.h"
-#include "uthash.h"
+
+/*
+ * Cache of archive entry metadata, and of complete directory listings
+ * of archives.
+ *
+ * Everything cached for one archive lives in the same shard, picked by
+ * hashing the archive path, so the shards can be locked independently
+ * of each other.  Each shard keeps its own CLOCK ring and timer wheel;
+ * the entry budget is shared by all of them.
+ *
+ * Lookups take no lock at all.  Entries never change once they are in
+ * the shard's table (a new value is a new entry), an open addressing
+ * one probed a group of slots at a time and grown a little per insert
+ * (see peepfs_swiss.h), and anything taken out is only freed once the
+ * epoch says no lookup can still be looking at it.  A hit just sets the
+ * entry's reference bit; eviction gives referenced entries a second
+ * go around the ring instead of lookups reordering a list.
+ *
+ * Entries are carved out of an arena belonging to their archive, which
+ * also holds the archive path, once, for all of them.  They are keyed
+ * by that archive plus their path inside it, hashed once per call.  An
+ * entry's memory isn't reused on its own; the whole arena goes (after
+ * the epoch says so) when its last entry does.  Everything cached expires
+ * within 'grace', so arenas don't live long, and one that is mostly dead
+ * space is retired early: new entries start a fresh one.
+ *
+ * An archive's listing is a tree: each of its entries hangs off the
+ * entry for its directory, and the listing itself is the root.  Paths
+ * whose directories the archive never mentions get one made up for
+ * them, so a directory is listed by walking just its own children.
+ * Losing any entry of a listing loses the listing, the entries left
+ * stay cached on their own; only once it's complete does the absence of
+ * a name in it mean the archive doesn't have it.
+ *
+ * Nothing in the foreground expires entries either, it only checks the
+ * stamp of the entry it has in hand.  A reaper thread ticks once a
+ * second on the coarse monotonic clock and clears out whatever fell due,
+ * through a hierarchical timer wheel per shard: 64 one second slots,
+ * then 64 slots of 64 seconds, and so on, each cascading into the level
+ * below as its turn comes up.
+ */
+
+#define PEEPFS_CACHE_SHARDS     64      /* power of two */
+
+#define CACHE_WHEEL_BITS        6
+#define CACHE_WHEEL_SLOTS       (1 << CACHE_WHEEL_BITS)
+#define CACHE_WHEEL_LEVELS      4
+#define CACHE_WHEEL_SPAN        (1LL << (CACHE_WHEEL_BITS * CACHE_WHEEL_LEVELS))
+
+/* Most expired entries freed per hold of a shard lock */
+#define CACHE_REAP_BATCH        256
+
+/* Made up directories are numbered from here, past any real entry */
+#define PEEPFS_CACHE_IMPLIED_INDEX  (1LL << 31)
+
+/* Per shard tables start out this big and grow as needed */
+#define CACHE_TABLE_INITIAL     64
+
+/* Arena chunks start small, most archives only ever get a few entries */
+#define CACHE_CHUNK_MIN         1024
+#define CACHE_CHUNK_MAX         (64*1024)
+
+typedef struct peepfs_cache_chunk {
+    struct peepfs_cache_chunk  *next;
+    int64_t                     size;
+    int64_t                     used;
+    char                        data[];
+} peepfs_cache_chunk_t;
+
+/* One archive's arena, and its path */
+typedef struct peepfs_cache_archive {
+    struct peepfs_cache_archive    *next;       /* limbo */
+    uint64_t                        retired;    /* epoch it was let go in */
+    uint64_t                        hashv;
+    int                             current;    /* new entries go here */
+    int64_t                         live;       /* entries not yet deleted */
+    int64_t                         live_bytes;
+    int64_t                         used_bytes;
+    peepfs_cache_chunk_t           *chunks;     /* newest first */
+    int                             pathlen;
+    char                            path[];
+} peepfs_cache_archive_t;
+
+/* (archive, path inside it), with its hashes worked out up front */
+typedef struct peepfs_cache_key {
+    const char                 *archivepath;
+    int                         archivepath_len;
+    uint64_t                    archive_hashv;
+    const char                 *relpath;
+    int                         relpath_len;    /* -1 for the listing */
+    uint64_t                    hashv;
+} peepfs_cache_key_t;
 
 typedef struct peepfs_cache_entry {
     uint64_t                    id;
     uint64_t                    archive_id;
-    int64_t                     expire;
-    const char                 *archivepath;
-    const char                 *path;
-    const char                 *relpath;
+    int64_t                     expire;     /* last second it's good for */
+    uint64_t                    hashv;
+    int                         ref;        /* atomic, CLOCK reference bit */
+    peepfs_cache_archive_t     *archive;
     peepfs_archive_entry_t      entry;
     struct peepfs_cache_entry  *prev;
     struct peepfs_cache_entry  *next;
     struct peepfs_cache_entry  *prev_by_expire;
     struct peepfs_cache_entry  *next_by_expire;
-    struct peepfs_cache_entry  *next_by_dir;
-    UT_hash_handle              hh;
+    struct peepfs_cache_entry **wheel;      /* slot it's waiting in */
+    struct peepfs_cache_entry  *parent;     /* directory in its listing */
+    struct peepfs_cache_entry  *children;
+    struct peepfs_cache_entry  *prev_sibling;
+    struct peepfs_cache_entry  *next_sibling;
+    int                         complete;   /* atomic, listing fully read */
+    int                         implied;    /* listing's made up dirs */
+    int                         size;       /* of its piece of the arena */
+    int                         name_off;   /* last component of relpath */
+    int                         relpath_len;    /* -1 for the listing */
+    char                        relpath[];
 } peepfs_cache_entry_t;
 
-typedef struct peepfs_cache {
-    peepfs_cache_entry_t   *hash;
-    peepfs_cache_entry_t   *lru;
-    peepfs_cache_entry_t   *expire;
-    uint64_t                next_id;
+typedef struct peepfs_cache_shard {
+    peepfs_swiss_t          table;
+    peepfs_cache_entry_t   *clock;          /* hand at the head */
+    peepfs_cache_entry_t   *wheel[CACHE_WHEEL_LEVELS][CACHE_WHEEL_SLOTS];
+    int64_t                 wheel_count[CACHE_WHEEL_LEVELS];
+    int64_t                 wheel_next;     /* next tick to be reaped */
+    peepfs_swiss_t          archives;       /* current arena per archive */
+    peepfs_cache_archive_t *limbo;          /* let go of, not yet freed */
+    peepfs_cache_archive_t *limbo_tail;
     int64_t                 num_entries;
+    pthread_mutex_t         lock;
+} __attribute__((aligned(64))) peepfs_cache_shard_t;
+
+typedef struct peepfs_cache {
+    peepfs_cache_shard_t    shards[PEEPFS_CACHE_SHARDS];
+    peepfs_epoch_t          epoch;
+    uint64_t                next_id;        /* atomic */
+    int64_t                 num_entries;    /* atomic, across all shards */
     int64_t                 max_entries;
     int64_t                 grace;
-    pthread_mutex_t         lock;
+    unsigned                reclaim;        /* atomic, next shard to trim */
+    int64_t                 now;            /* atomic, reaper's clock */
+    int                     stop;
+    pthread_t               reaper;
+    pthread_mutex_t         reaper_lock;
+    pthread_cond_t          reaper_cond;
 } peepfs_cache_t;
 
+static inline int64_t
+__peepfs_cache_clock(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+
+    return ts.tv_sec;
+}
+
+static void *__peepfs_cache_reaper(void *arg);
+
 static inline peepfs_cache_t *
 peepfs_cache_init(int64_t max_entries, int64_t grace)
 {
-    peepfs_cache_t *cache;
+    peepfs_cache_t         *cache;
+    peepfs_cache_shard_t   *shard;
+    pthread_condattr_t      attr;
+    int                     i;
 
     cache = (peepfs_cache_t*)calloc(1,sizeof(peepfs_cache_t));
 
+    if (cache == NULL) {
+        return NULL;
+    }
+
     cache->max_entries  = max_entries;
     cache->grace        = grace;
     cache->next_id      = 1;
+    cache->now          = __peepfs_cache_clock();
 
-    pthread_mutex_init(&cache->lock, NULL);
+    for (i = 0; i < PEEPFS_CACHE_SHARDS; ++i) {
+
+        shard = &cache->shards[i];
+
+        if (peepfs_swiss_init(&shard->table, CACHE_TABLE_INITIAL,
+                offsetof(peepfs_cache_entry_t, hashv), &cache->epoch) ||
+            peepfs_swiss_init(&shard->archives, CACHE_TABLE_INITIAL,
+                offsetof(peepfs_cache_archive_t, hashv), NULL)) {
+            goto out;
+        }
+
+        shard->wheel_next = cache->now + 1;
+
+        pthread_mutex_init(&shard->lock, NULL);
+    }
+
+    pthread_mutex_init(&cache->reaper_lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&cache->reaper_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    if (pthread_create(&cache->reaper, NULL, __peepfs_cache_reaper, cache)) {
+        goto out;
+    }
 
     return cache;
+
+out:
+    /* Tables never set up are still zeroed, and free as nothing */
+    for (i = 0; i < PEEPFS_CACHE_SHARDS; ++i) {
+        peepfs_swiss_free(&cache->shards[i].table);
+        peepfs_swiss_free(&cache->shards[i].archives);
+    }
+
+    free(cache);
+
+    return NULL;
 }
 
-void
-peepfs_cache_free(peepfs_cache_t *cache)
+/* Relative paths are mixed in so a listing's entries spread out */
+static inline uint64_t
+__peepfs_cache_mix(uint64_t archive_hashv, uint64_t relpath_hashv)
 {
-    peepfs_cache_entry_t *e;
+    return __peepfs_swiss_mum(archive_hashv ^ 0x8bb84b93962eacc9ULL,
+                              relpath_hashv ^ 0x4b33a62ed433d4a3ULL);
+}
+
+/* Paths needn't be terminated at the given lengths */
+static inline void
+__peepfs_cache_key_make(
+    peepfs_cache_key_t *key,
+    const char         *archivepath,
+    int                 archivepath_len,
+    uint64_t            archive_hashv,
+    const char         *relpath,
+    int                 relpath_len)
+{
+    uint64_t hashv = 0;
 
-    while (cache->lru) {
-        e = cache->lru;
-        DL_DELETE(cache->lru, e);
-        HASH_DEL(cache->hash, e);
-        free((void*)e->archivepath);
-        free((void*)e->path);
-        free(e);
+    key->archivepath     = archivepath;
+    key->archivepath_len = archivepath_len;
+    key->archive_hashv   = archive_hashv;
+    key->relpath         = relpath;
+    key->relpath_len     = relpath ? relpath_len : -1;
 
+    if (relpath) {
+        hashv = peepfs_swiss_hash(relpath, relpath_len, 0);
     }
 
-    free(cache);
+    key->hashv = __peepfs_cache_mix(archive_hashv, hashv);
+}
+
+static inline void
+__peepfs_cache_key_init(
+    peepfs_cache_key_t *key,
+    const char         *archivepath,
+    const char         *relpath)
+{
+    int len = strlen(archivepath);
+
+    __peepfs_cache_key_make(key, archivepath, len,
+        peepfs_swiss_hash(archivepath, len, 0),
+        relpath, relpath ? (int)strlen(relpath) : -1);
+}
+
+/* Key for an archive's listing, from an arena we already have */
+static inline void
+__peepfs_cache_key_listing(peepfs_cache_key_t *key, peepfs_cache_archive_t *ca)
+{
+    __peepfs_cache_key_make(key, ca->path, ca->pathlen, ca->hashv, NULL, -1);
+}
+
+static inline peepfs_cache_shard_t *
+__peepfs_cache_shard(peepfs_cache_t *cache, const peepfs_cache_key_t *key)
+{
+    return &cache->shards[key->archive_hashv & (PEEPFS_CACHE_SHARDS - 1)];
+}
+
+static inline int
+__peepfs_cache_match(const void *item, const void *arg)
+{
+    const peepfs_cache_entry_t *e = (const peepfs_cache_entry_t*)item;
+    const peepfs_cache_key_t   *key = (const peepfs_cache_key_t*)arg;
+
+    return e->hashv == key->hashv &&
+           e->relpath_len == key->relpath_len &&
+           (key->relpath_len < 0 ||
+            memcmp(e->relpath, key->relpath, key->relpath_len) == 0) &&
+           e->archive->pathlen == key->archivepath_len &&
+           memcmp(e->archive->path, key->archivepath, key->archivepath_len) == 0;
+}
+
+static inline int
+__peepfs_cache_archive_match(const void *item, const void *arg)
+{
+    const peepfs_cache_archive_t   *ca = (const peepfs_cache_archive_t*)item;
+    const peepfs_cache_key_t       *key = (const peepfs_cache_key_t*)arg;
+
+    return ca->pathlen == key->archivepath_len &&
+           memcmp(ca->path, key->archivepath, key->archivepath_len) == 0;
+}
+
+/* Safe both with the shard lock held and inside an epoch */
+static inline peepfs_cache_entry_t *
+__peepfs_cache_find(
+    peepfs_cache_shard_t       *shard,
+    const peepfs_cache_key_t   *key)
+{
+    return (peepfs_cache_entry_t*)peepfs_swiss_find(&shard->table, key->hashv,
+        __peepfs_cache_match, key);
+}
+
+static inline void
+__peepfs_cache_archive_free(peepfs_cache_archive_t *ca)
+{
+    peepfs_cache_chunk_t *chunk;
+
+    while ((chunk = ca->chunks)) {
+        ca->chunks = chunk->next;
+        free(chunk);
+    }
+
+    free(ca);
+}
+
+/* Stop putting new entries in an arena.  Lock held. */
+static inline void
+__peepfs_cache_archive_close(peepfs_cache_shard_t *shard, peepfs_cache_archive_t *ca)
+{
+    if (ca->current) {
+        peepfs_swiss_delete(&shard->archives, ca);
+        ca->current = 0;
+    }
+}
+
+/* Its last entry is gone, free it once no lookup can be on one.  Lock held. */
+static inline void
+__peepfs_cache_archive_retire(
+    peepfs_cache_t         *cache,
+    peepfs_cache_shard_t   *shard,
+    peepfs_cache_archive_t *ca)
+{
+    __peepfs_cache_archive_close(shard, ca);
+
+    ca->retired = peepfs_epoch_retire(&cache->epoch);
+    ca->next    = NULL;
+
+    if (shard->limbo_tail) {
+        shard->limbo_tail->next = ca;
+    } else {
+        shard->limbo = ca;
+    }
+
+    shard->limbo_tail = ca;
+}
+
+/* Arena new entries for this archive go into, made if need be.  Lock held. */
+static inline peepfs_cache_archive_t *
+__peepfs_cache_archive(peepfs_cache_shard_t *shard, const peepfs_cache_key_t *key)
+{
+    peepfs_cache_archive_t *ca;
+
+    ca = (peepfs_cache_archive_t*)peepfs_swiss_find(&shard->archives,
+        key->archive_hashv, __peepfs_cache_archive_match, key);
+
+    /* Mostly dead space, let it go with its last entry and start afresh */
+    if (ca && ca->used_bytes > CACHE_CHUNK_MAX &&
+        ca->used_bytes - ca->live_bytes > ca->live_bytes) {
+        __peepfs_cache_archive_close(shard, ca);
+        ca = NULL;
+    }
+
+    if (ca) {
+        return ca;
+    }
+
+    ca = (peepfs_cache_archive_t*)calloc(1,
+        sizeof(peepfs_cache_archive_t) + key->archivepath_len + 1);
+
+    if (ca == NULL) {
+        return NULL;
+    }
+
+    memcpy(ca->path, key->archivepath, key->archivepath_len);
+
+    ca->pathlen = key->archivepath_len;
+    ca->hashv   = key->archive_hashv;
+    ca->current = 1;
+
+    if (peepfs_swiss_insert(&shard->archives, ca)) {
+        free(ca);
+        return NULL;
+    }
+
+    return ca;
 }
 
+static inline peepfs_cache_entry_t *
+__peepfs_cache_alloc(peepfs_cache_archive_t *ca, int size)
+{
+    peepfs_cache_chunk_t   *chunk = ca->chunks;
+    peepfs_cache_entry_t   *e;
+    int64_t                 chunk_size;
+
+    size = (size + 7) & ~7;
+
+    if (chunk == NULL || chunk->size - chunk->used < size) {
+
+        chunk_size = chunk ? chunk->size * 2 : CACHE_CHUNK_MIN;
+
+        if (chunk_size > CACHE_CHUNK_MAX) {
+            chunk_size = CACHE_CHUNK_MAX;
+        }
+
+        if (chunk_size < size) {
+            chunk_size = size;
+        }
+
+        chunk = (peepfs_cache_chunk_t*)malloc(sizeof(peepfs_cache_chunk_t) + chunk_size);
+
+        if (chunk == NULL) {
+            return NULL;
+        }
+
+        chunk->size = chunk_size;
+        chunk->used = 0;
+        chunk->next = ca->chunks;
+        ca->chunks  = chunk;
+    }
+
+    e = (peepfs_cache_entry_t*)(chunk->data + chunk->used);
+
+    memset(e, 0, size);
+
+    e->size      = size;
+    e->archive   = ca;
+    chunk->used += size;
+
+    ca->live++;
+    ca->live_bytes += size;
+    ca->used_bytes += size;
+
+    return e;
+}
+
+/* Free whatever no lookup can still see.  Lock held. */
+static inline void
+__peepfs_cache_drain(peepfs_cache_t *cache, peepfs_cache_shard_t *shard)
+{
+    peepfs_cache_archive_t *ca;
+    uint64_t                now;
+
+    if (shard->limbo == NULL && !peepfs_swiss_draining(&shard->table)) {
+        return;
+    }
+
+    now = peepfs_epoch_advance(&cache->epoch);
+
+    peepfs_swiss_drain(&shard->table, now);
+
+    while ((ca = shard->limbo) && peepfs_epoch_safe(ca->retired, now)) {
+
+        shard->limbo = ca->next;
+
+        if (shard->limbo == NULL) {
+            shard->limbo_tail = NULL;
+        }
+
+        __peepfs_cache_archive_free(ca);
+    }
+}
+
+/*
+ * Hang an entry on the wheel, in the slot for the tick it falls due in,
+ * at the coarsest level that still has that tick ahead of it.  Lock held.
+ */
+
+static inline void
+__peepfs_cache_wheel_add(peepfs_cache_shard_t *shard, peepfs_cache_entry_t *e)
+{
+    int64_t base = shard->wheel_next, due = e->expire + 1;
+    int     level = 0;
+
+    if (due < base) {
+        due = base;
+    }
+
+    /* Past the top level's reach it waits there and gets placed again */
+    if (due - base >= CACHE_WHEEL_SPAN) {
+        due = base + CACHE_WHEEL_SPAN - 1;
+    }
+
+    while (level < CACHE_WHEEL_LEVELS - 1 &&
+           due - base >= 1LL << (CACHE_WHEEL_BITS * (level + 1))) {
+        level++;
+    }
+
+    e->wheel = &shard->wheel[level][
+        (due >> (CACHE_WHEEL_BITS * level)) & (CACHE_WHEEL_SLOTS - 1)];
+
+    DL_APPEND2(*e->wheel, e, prev_by_expire, next_by_expire);
+
+    shard->wheel_count[level]++;
+}
+
+static inline void
+__peepfs_cache_wheel_del(peepfs_cache_shard_t *shard, peepfs_cache_entry_t *e)
+{
+    DL_DELETE2(*e->wheel, e, prev_by_expire, next_by_expire);
+
+    shard->wheel_count[(e->wheel - &shard->wheel[0][0]) / CACHE_WHEEL_SLOTS]--;
+}
+
+/* Take an entry out of everything but its listing's tree.  Lock held. */
+static inline void
+__peepfs_cache_remove(
+    peepfs_cache_t         *cache,
+    peepfs_cache_shard_t   *shard,
+    peepfs_cache_entry_t   *e)
+{
+    peepfs_cache_archive_t *ca = e->archive;
+
+    peepfs_swiss_delete(&shard->table, e);
+
+    DL_DELETE(shard->clock, e);
+
+    __peepfs_cache_wheel_del(shard, e);
+
+    ca->live_bytes -= e->size;
+
+    if (--ca->live == 0) {
+        __peepfs_cache_archive_retire(cache, shard, ca);
+    }
+
+    --shard->num_entries;
+
+    __atomic_sub_fetch(&cache->num_entries, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * A listing missing an entry is no listing, so it goes first; nothing
+ * walks the tree of a listing that's gone.  Lock held.
+ */
+
 static inline void
 __peepfs_cache_delete(
     peepfs_cache_t         *cache,
+    peepfs_cache_shard_t   *shard,
     peepfs_cache_entry_t   *e)
 {
-    peepfs_cache_entry_t *ae;
+    peepfs_cache_entry_t   *ae;
+    peepfs_cache_key_t      key;
 
     if (e->archive_id) {
-        HASH_FIND_STR(cache->hash, e->archivepath, ae);
+
+        __peepfs_cache_key_listing(&key, e->archive);
+
+        ae = __peepfs_cache_find(shard, &key);
 
         if (ae && ae->id == e->archive_id) {
-            __peepfs_cache_delete(cache, ae);
+            __peepfs_cache_delete(cache, shard, ae);
         }
     }
 
-    DL_DELETE(cache->lru, e);
-    DL_DELETE2(cache->expire, e, prev_by_expire, next_by_expire);
-    HASH_DEL(cache->hash, e);
-    if (e->archivepath) free((void*)e->archivepath);
-    if (e->relpath)     free((void*)e->relpath);
-    if (e->path)        free((void*)e->path);
+    __peepfs_cache_remove(cache, shard, e);
+}
+
+void
+peepfs_cache_free(peepfs_cache_t *cache)
+{
+    peepfs_cache_shard_t    *shard;
+    peepfs_cache_archive_t  *ca;
+    int                      i;
+
+    pthread_mutex_lock(&cache->reaper_lock);
+    cache->stop = 1;
+    pthread_cond_signal(&cache->reaper_cond);
+    pthread_mutex_unlock(&cache->reaper_lock);
+
+    pthread_join(cache->reaper, NULL);
+
+    pthread_cond_destroy(&cache->reaper_cond);
+    pthread_mutex_destroy(&cache->reaper_lock);
+
+    for (i = 0; i < PEEPFS_CACHE_SHARDS; ++i) {
+
+        shard = &cache->shards[i];
+
+        while (shard->clock) {
+            __peepfs_cache_delete(cache, shard, shard->clock);
+        }
+
+        /* Nobody is looking any more */
+        while ((ca = shard->limbo)) {
+            shard->limbo = ca->next;
+            __peepfs_cache_archive_free(ca);
+        }
 
-    free(e);
+        peepfs_swiss_free(&shard->table);
+        peepfs_swiss_free(&shard->archives);
 
-    --cache->num_entries;
+        pthread_mutex_destroy(&shard->lock);
+    }
+
+    free(cache);
 }
 
+/*
+ * Bring a shard's wheel up to 'now', freeing what fell due.  Each tick
+ * first moves the coarser slots whose turn it is down a level, then
+ * reaps the one second slot, letting go of the lock now and then so a
+ * second's worth of a big listing doesn't hold up the shard's writers.
+ * Lock held.
+ */
+
 static inline void
-__peepfs_cache_expunge(peepfs_cache_t *cache)
+__peepfs_cache_advance(
+    peepfs_cache_t         *cache,
+    peepfs_cache_shard_t   *shard,
+    int64_t                 now)
 {
-    peepfs_cache_entry_t *e;
-    int64_t now = time(NULL);
+    peepfs_cache_entry_t  **slot, *list, *e;
+    int64_t                 tick, period;
+    int                     level, reaped = 0;
 
-    while (1) {
+    while (shard->wheel_next <= now) {
 
-        e = cache->expire;
+        tick = shard->wheel_next;
 
-        if (e && e->expire < now) {
-            __peepfs_cache_delete(cache, e);
-        } else {
-            return;
+        /* With the finer levels empty, skip ahead to the next cascade */
+        for (level = 0; level < CACHE_WHEEL_LEVELS && !shard->wheel_count[level]; ++level);
+
+        if (level == CACHE_WHEEL_LEVELS) {
+            shard->wheel_next = now + 1;
+            break;
         }
 
+        if (level > 0) {
+
+            period = 1LL << (CACHE_WHEEL_BITS * level);
+            tick   = (tick + period - 1) & ~(period - 1);
+
+            if (tick > now) {
+                shard->wheel_next = now + 1;
+                break;
+            }
+        }
+
+        /* Entries cascading down are placed relative to this tick */
+        shard->wheel_next = tick;
+
+        for (level = 1; level < CACHE_WHEEL_LEVELS; ++level) {
+
+            if (tick & ((1LL << (CACHE_WHEEL_BITS * level)) - 1)) {
+                break;
+            }
+
+            slot  = &shard->wheel[level][
+                (tick >> (CACHE_WHEEL_BITS * level)) & (CACHE_WHEEL_SLOTS - 1)];
+            list  = *slot;
+            *slot = NULL;
+
+            while ((e = list)) {
+                DL_DELETE2(list, e, prev_by_expire, next_by_expire);
+                shard->wheel_count[level]--;
+                __peepfs_cache_wheel_add(shard, e);
+            }
+        }
+
+        slot = &shard->wheel[0][tick & (CACHE_WHEEL_SLOTS - 1)];
+
+        while ((e = *slot)) {
+
+            __peepfs_cache_delete(cache, shard, e);
+
+            if (++reaped % CACHE_REAP_BATCH == 0) {
+                pthread_mutex_unlock(&shard->lock);
+                pthread_mutex_lock(&shard->lock);
+            }
+        }
+
+        shard->wheel_next = tick + 1;
     }
-    
 }
 
+static void *
+__peepfs_cache_reaper(void *arg)
+{
+    peepfs_cache_t         *cache = (peepfs_cache_t*)arg;
+    peepfs_cache_shard_t   *shard;
+    struct timespec         ts;
+    int64_t                 now;
+    int                     i;
 
-static inline uint64_t
-peepfs_cache_insert(
-    peepfs_cache_t         *cache, 
-    const char             *archivepath,
-    const char             *relpath, 
-    uint64_t                archive_id,
-    peepfs_archive_entry_t *entry)
+    pthread_mutex_lock(&cache->reaper_lock);
+
+    while (!cache->stop) {
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        ts.tv_sec++;
+
+        pthread_cond_timedwait(&cache->reaper_cond, &cache->reaper_lock, &ts);
+
+        if (cache->stop) {
+            break;
+        }
+
+        pthread_mutex_unlock(&cache->reaper_lock);
+
+        now = __peepfs_cache_clock();
+
+        __atomic_store_n(&cache->now, now, __ATOMIC_RELAXED);
+
+        for (i = 0; i < PEEPFS_CACHE_SHARDS; ++i) {
+
+            shard = &cache->shards[i];
+
+            pthread_mutex_lock(&shard->lock);
+
+            __peepfs_cache_advance(cache, shard, now);
+
+            /* Quiet shards get their retired entries freed here too */
+            __peepfs_cache_drain(cache, shard);
+
+            pthread_mutex_unlock(&shard->lock);
+        }
+
+        pthread_mutex_lock(&cache->reaper_lock);
+    }
+
+    pthread_mutex_unlock(&cache->reaper_lock);
+
+    return NULL;
+}
+
+/* Evict one entry CLOCK fashion, returns 0 if the shard is empty.  Lock held. */
+static inline int
+__peepfs_cache_evict(peepfs_cache_t *cache, peepfs_cache_shard_t *shard)
 {
-    peepfs_cache_entry_t *e, *ae = NULL;
-    uint64_t id;
-    time_t now = time(NULL);
-    char fullpath[PATH_MAX];
+    peepfs_cache_entry_t *e;
 
-    if (relpath) {
-        snprintf(fullpath, PATH_MAX, "%s/%s", archivepath, relpath);
-    } else {
-        snprintf(fullpath, PATH_MAX, "%s", archivepath);
+    while ((e = shard->clock)) {
+
+        if (__atomic_load_n(&e->ref, __ATOMIC_RELAXED) == 0) {
+            __peepfs_cache_delete(cache, shard, e);
+            return 1;
+        }
+
+        /* Used since the hand last came by, give it another turn */
+        __atomic_store_n(&e->ref, 0, __ATOMIC_RELAXED);
+        DL_DELETE(shard->clock, e);
+        DL_APPEND(shard->clock, e);
+    }
+
+    return 0;
+}
+
+/*
+ * Make room for one more entry, shard lock held.  Our own shard gives
+ * up an entry, and one of the others, in turn, is trimmed if nobody has
+ * it locked, so shards nobody is looking at any more don't sit on their
+ * share of the budget forever.
+ */
+
+static inline void
+__peepfs_cache_reclaim(peepfs_cache_t *cache, peepfs_cache_shard_t *shard)
+{
+    peepfs_cache_shard_t *other;
+    unsigned              i;
+
+    if (__atomic_load_n(&cache->num_entries, __ATOMIC_RELAXED) < cache->max_entries) {
+        return;
     }
 
-    pthread_mutex_lock(&cache->lock);
+    i = __atomic_fetch_add(&cache->reclaim, 1, __ATOMIC_RELAXED);
+
+    other = &cache->shards[i & (PEEPFS_CACHE_SHARDS - 1)];
 
-    __peepfs_cache_expunge(cache);
+    if (other != shard && pthread_mutex_trylock(&other->lock) == 0) {
 
-    id = cache->next_id++;
+        if (__atomic_load_n(&cache->num_entries, __ATOMIC_RELAXED) >= cache->max_entries) {
+            __peepfs_cache_evict(cache, other);
+        }
 
-    HASH_FIND_STR(cache->hash, fullpath, e);
+        __peepfs_cache_drain(cache, other);
 
-    if (e) {
-        __peepfs_cache_delete(cache, e);
+        pthread_mutex_unlock(&other->lock);
     }
 
-    if (cache->num_entries == cache->max_entries) {
-        e = cache->lru;
-        __peepfs_cache_delete(cache, e);
+    if (__atomic_load_n(&cache->num_entries, __ATOMIC_RELAXED) >= cache->max_entries) {
+        __peepfs_cache_evict(cache, shard);
     }
+}
 
-    e = (peepfs_cache_entry_t*)calloc(1,sizeof(peepfs_cache_entry_t));
+/*
+ * Add an entry, in place of any with the same key, and hang it in its
+ * listing's tree if that listing is still whole, making up directories
+ * on the way as needed.  NULL on failure, which also costs the listing
+ * its completeness (so it goes).  Lock held.
+ */
+
+static inline peepfs_cache_entry_t *
+__peepfs_cache_add(
+    peepfs_cache_t             *cache,
+    peepfs_cache_shard_t       *shard,
+    const peepfs_cache_key_t   *key,
+    uint64_t                    id,
+    uint64_t                    archive_id,
+    peepfs_archive_entry_t     *entry)
+{
+    peepfs_cache_archive_t *ca;
+    peepfs_cache_entry_t   *e, *ae = NULL, *parent = NULL, *children = NULL, *c;
+    peepfs_cache_key_t      pkey;
+    peepfs_archive_entry_t  implied;
+    int                     name_off = 0;
+    int64_t                 now = __atomic_load_n(&cache->now, __ATOMIC_RELAXED);
 
-    if (e == NULL) {
-        pthread_mutex_unlock(&cache->lock);
-        return 0;
+    /* The key's path may be a prefix of a longer one, don't look past it */
+    if (key->relpath) {
+
+        name_off = key->relpath_len;
+
+        while (name_off > 0 && key->relpath[name_off - 1] != '/') {
+            name_off--;
+        }
+    }
+
+    if (archive_id && key->relpath) {
+
+        __peepfs_cache_key_make(&pkey, key->archivepath, key->archivepath_len,
+            key->archive_hashv, NULL, -1);
+
+        ae = __peepfs_cache_find(shard, &pkey);
+
+        /* Its listing is gone, leave whatever is there now alone */
+        if (ae == NULL || ae->id != archive_id) {
+            return NULL;
+        }
+    }
+
+    e = __peepfs_cache_find(shard, key);
+
+    /* A listing already has it, don't break that up for the same answer */
+    if (e && archive_id == 0 && key->relpath && e->archive_id) {
+        return e;
+    }
+
+    if (e && ae && e->archive_id == archive_id) {
+
+        /* Named twice, or a directory made up earlier: take over its place */
+        children = e->children;
+
+        DL_DELETE2(e->parent->children, e, prev_sibling, next_sibling);
+
+        __peepfs_cache_remove(cache, shard, e);
+
+    } else if (e) {
+        __peepfs_cache_delete(cache, shard, e);
+    }
+
+    if (ae) {
+
+        if (name_off == 0) {
+            parent = ae;
+        } else {
+
+            __peepfs_cache_key_make(&pkey, key->archivepath, key->archivepath_len,
+                key->archive_hashv, key->relpath, name_off - 1);
+
+            parent = __peepfs_cache_find(shard, &pkey);
+
+            if (parent == NULL || parent->archive_id != archive_id) {
+
+                implied.index = PEEPFS_CACHE_IMPLIED_INDEX + ae->implied++;
+                implied.size  = 0;
+                implied.flags = PEEPFS_FLAG_DIR;
+
+                parent = __peepfs_cache_add(cache, shard, &pkey,
+                    __atomic_fetch_add(&cache->next_id, 1, __ATOMIC_RELAXED),
+                    archive_id, &implied);
+
+                /* It took the listing with it */
+                if (parent == NULL) {
+                    ae = NULL;
+                }
+            }
+        }
     }
-   
-    if (archivepath) e->archivepath = strdup(archivepath);
-    if (relpath) e->relpath = strdup(relpath);
 
-    e->path = strdup(fullpath);
+    ca = __peepfs_cache_archive(shard, key);
 
-    HASH_ADD_STR(cache->hash, path, e);
+    e = ca ? __peepfs_cache_alloc(ca, sizeof(peepfs_cache_entry_t) +
+        (key->relpath ? key->relpath_len + 1 : 0)) : NULL;
 
-    ++cache->num_entries;
+    if (e == NULL) {
+
+        /* A brand new arena that never got anything */
+        if (ca && ca->live == 0) {
+            __peepfs_cache_archive_retire(cache, shard, ca);
+        }
+
+        goto fail;
+    }
+
+    if (key->relpath) {
+        memcpy(e->relpath, key->relpath, key->relpath_len);
+        e->relpath[key->relpath_len] = '\0';
+    }
+
+    e->relpath_len = key->relpath_len;
+    e->name_off    = name_off;
+    e->hashv       = key->hashv;
 
     if (entry) {
         e->entry = *entry;
     }
 
-    e->id = id;
-    e->expire = now + cache->grace;
+    e->id         = id;
+    e->archive_id = archive_id;
+    e->expire     = now + cache->grace;
+
+    /* Complete before anyone can find it */
+    if (peepfs_swiss_insert(&shard->table, e)) {
+
+        ca->live_bytes -= e->size;
+
+        if (--ca->live == 0) {
+            __peepfs_cache_archive_retire(cache, shard, ca);
+        }
+
+        goto fail;
+    }
+
+    ++shard->num_entries;
 
-    DL_APPEND(cache->lru, e);
-    DL_APPEND2(cache->expire, e, prev_by_expire, next_by_expire);
+    __atomic_add_fetch(&cache->num_entries, 1, __ATOMIC_RELAXED);
 
-    if (archive_id) {
+    DL_APPEND(shard->clock, e);
+
+    __peepfs_cache_wheel_add(shard, e);
+
+    if (ae) {
 
-        e->archive_id = archive_id;
+        e->parent   = parent;
+        e->children = children;
 
-        HASH_FIND_STR(cache->hash, archivepath, ae);
+        DL_APPEND2(parent->children, e, prev_sibling, next_sibling);
 
-        if (ae && ae->id == archive_id) {
-            DL_DELETE(cache->lru, ae);
-            DL_APPEND(cache->lru, ae);
-            LL_APPEND2(ae, e, next_by_dir);
+        DL_FOREACH2(children, c, next_sibling) {
+            c->parent = e;
         }
+
+        __atomic_store_n(&ae->ref, 1, __ATOMIC_RELAXED);
     }
 
-    pthread_mutex_unlock(&cache->lock);
+    return e;
+
+fail:
+
+    if (ae) {
+        __peepfs_cache_delete(cache, shard, ae);
+    }
 
-    return id;
+    return NULL;
+}
+
+static inline uint64_t
+peepfs_cache_insert(
+    peepfs_cache_t         *cache,
+    const char             *archivepath,
+    const char             *relpath,
+    uint64_t                archive_id,
+    peepfs_archive_entry_t *entry)
+{
+    peepfs_cache_shard_t   *shard;
+    peepfs_cache_entry_t   *e;
+    peepfs_cache_key_t      key;
+    uint64_t                id;
+
+    __peepfs_cache_key_init(&key, archivepath, relpath);
+
+    shard = __peepfs_cache_shard(cache, &key);
+
+    id = __atomic_fetch_add(&cache->next_id, 1, __ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&shard->lock);
+
+    __peepfs_cache_reclaim(cache, shard);
+
+    __peepfs_cache_drain(cache, shard);
+
+    e = __peepfs_cache_add(cache, shard, &key, id, archive_id, entry);
+
+    pthread_mutex_unlock(&shard->lock);
+
+    return e ? id : 0;
+}
+
+/* Everything in the archive has gone in under 'archive_id' */
+static inline int
+peepfs_cache_complete(
+    peepfs_cache_t *cache,
+    const char     *archivepath,
+    uint64_t        archive_id)
+{
+    peepfs_cache_shard_t *shard;
+    peepfs_cache_entry_t *ae;
+    peepfs_cache_key_t    key;
+
+    __peepfs_cache_key_init(&key, archivepath, NULL);
+
+    shard = __peepfs_cache_shard(cache, &key);
+
+    pthread_mutex_lock(&shard->lock);
+
+    ae = __peepfs_cache_find(shard, &key);
+
+    if (ae && ae->id == archive_id) {
+        __atomic_store_n(&ae->complete, 1, __ATOMIC_RELEASE);
+    } else {
+        ae = NULL;
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+
+    return ae ? 0 : -1;
+}
+
+/* Whether a complete listing says what is and isn't in the archive */
+static inline int
+peepfs_cache_listed(
+    peepfs_cache_t *cache,
+    const char     *archivepath)
+{
+    peepfs_cache_shard_t   *shard;
+    peepfs_cache_entry_t   *ae;
+    peepfs_cache_key_t      key;
+    uint64_t                epoch;
+    int                     listed;
+
+    __peepfs_cache_key_init(&key, archivepath, NULL);
+
+    shard = __peepfs_cache_shard(cache, &key);
+
+    epoch = peepfs_epoch_enter(&cache->epoch);
+
+    ae = __peepfs_cache_find(shard, &key);
+
+    listed = ae && __atomic_load_n(&ae->complete, __ATOMIC_ACQUIRE) &&
+             ae->expire >= __atomic_load_n(&cache->now, __ATOMIC_RELAXED);
+
+    peepfs_epoch_exit(&cache->epoch, epoch);
+
+    return listed;
 }
 
 static inline int
@@ -201,70 +1068,107 @@ peepfs_cache_get(
     const char             *relpath,
     peepfs_archive_entry_t *entry)
 {
+    peepfs_cache_shard_t   *shard;
     peepfs_cache_entry_t   *e;
+    peepfs_cache_key_t      key;
+    uint64_t                epoch;
     int                     error = -1;
-    char                    fullpath[PATH_MAX];
 
-    snprintf(fullpath, PATH_MAX, "%s/%s", archivepath, relpath);
+    __peepfs_cache_key_init(&key, archivepath, relpath);
+
+    shard = __peepfs_cache_shard(cache, &key);
 
-    pthread_mutex_lock(&cache->lock);
-    
-    __peepfs_cache_expunge(cache);
+    epoch = peepfs_epoch_enter(&cache->epoch);
 
-    HASH_FIND_STR(cache->hash, fullpath, e);
+    e = __peepfs_cache_find(shard, &key);
+
+    /* Expired ones are left for the reaper to clear out */
+    if (e && e->expire >= __atomic_load_n(&cache->now, __ATOMIC_RELAXED)) {
 
-    if (e) {
         *entry = e->entry;
-        DL_DELETE(cache->lru, e);
-        DL_APPEND(cache->lru, e);
+
+        /* Don't dirty the line when it's already marked */
+        if (__atomic_load_n(&e->ref, __ATOMIC_RELAXED) == 0) {
+            __atomic_store_n(&e->ref, 1, __ATOMIC_RELAXED);
+        }
+
         error = 0;
     }
 
-    pthread_mutex_unlock(&cache->lock);
+    peepfs_epoch_exit(&cache->epoch, epoch);
 
     return error;
 }
 
+/*
+ * Hand each entry directly in directory 'relpath' ("" for the top) of
+ * the archive's listing to 'enum_callback', by its last path component.
+ * -1 if there's no complete listing to go by.
+ */
+
 static inline int
 peepfs_cache_scandir(
     peepfs_cache_t                 *cache,
     const char                     *archivepath,
+    const char                     *relpath,
     peepfs_archive_enum_callback_t  enum_callback,
     void                           *arg)
 {
-    peepfs_cache_entry_t *ae,*e;
-    int                   error = -1;
+    peepfs_cache_shard_t *shard;
+    peepfs_cache_entry_t *ae, *dir, *e;
+    peepfs_cache_key_t    key;
 
-    pthread_mutex_lock(&cache->lock);
+    __peepfs_cache_key_init(&key, archivepath, NULL);
 
-    __peepfs_cache_expunge(cache);
+    shard = __peepfs_cache_shard(cache, &key);
 
-    HASH_FIND_STR(cache->hash, archivepath, ae);
+    pthread_mutex_lock(&shard->lock);
 
-    if (ae) {
+    ae = __peepfs_cache_find(shard, &key);
+
+    /* The listing went in before its entries, so it expires first */
+    if (ae && (!ae->complete ||
+               ae->expire < __atomic_load_n(&cache->now, __ATOMIC_RELAXED))) {
+        ae = NULL;
+    }
+
+    dir = ae;
 
-        LL_FOREACH2(ae->next_by_dir, e, next_by_dir) {
+    if (ae && relpath[0]) {
 
-            DL_DELETE(cache->lru, e);
-            DL_APPEND(cache->lru, e);
-            error = enum_callback(e->relpath, &e->entry, arg);
+        __peepfs_cache_key_make(&key, key.archivepath, key.archivepath_len,
+            key.archive_hashv, relpath, strlen(relpath));
 
-            if (error) {
+        dir = __peepfs_cache_find(shard, &key);
+
+        /* Not a directory of this listing, so nothing in it */
+        if (dir && (dir->archive_id != ae->id ||
+                    !(dir->entry.flags & PEEPFS_FLAG_DIR))) {
+            dir = NULL;
+        }
+    }
+
+    if (dir) {
+
+        DL_FOREACH2(dir->children, e, next_sibling) {
+
+            __atomic_store_n(&e->ref, 1, __ATOMIC_RELAXED);
+
+            if (enum_callback(e->relpath + e->name_off, &e->entry, arg)) {
                 break;
             }
         }
 
-        DL_DELETE(cache->lru, ae);
-        DL_APPEND(cache->lru, ae);
+        __atomic_store_n(&dir->ref, 1, __ATOMIC_RELAXED);
     }
 
-    pthread_mutex_unlock(&cache->lock);
-
     if (ae) {
-        return 0;
-    } else {
-        return -1;
+        __atomic_store_n(&ae->ref, 1, __ATOMIC_RELAXED);
     }
+
+    pthread_mutex_unlock(&shard->lock);
+
+    return ae ? 0 : -1;
 }
-    
+
 #endif
@@ -0,0 +1,163 @@
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "peepfs_detect.h"
+
+#define MIN(x,y) ((x) < (y) ? (x) : (y))
+
+#define DETECT_HEAD_LEN         512
+#define DETECT_ISO_OFFSET       32769
+#define DETECT_EOCD_LEN         22
+#define DETECT_EOCD_MAX         (65535 + DETECT_EOCD_LEN)
+
+#define TAR_CHKSUM_OFFSET       148
+#define TAR_CHKSUM_LEN          8
+#define TAR_MAGIC_OFFSET        257
+
+static const struct {
+    int                 format;
+    int                 offset;
+    int                 len;
+    const char         *magic;
+} detect_magic[] = {
+    { PEEPFS_FORMAT_ZIP,        0,  4,  "PK\003\004"                },
+    { PEEPFS_FORMAT_ZIP,        0,  4,  "PK\005\006"                },
+    { PEEPFS_FORMAT_GZIP,       0,  2,  "\037\213"                  },
+    { PEEPFS_FORMAT_XZ,         0,  6,  "\3757zXZ\000"              },
+    { PEEPFS_FORMAT_ZSTD,       0,  4,  "\050\265\057\375"          },
+    { PEEPFS_FORMAT_SQUASHFS,   0,  4,  "hsqs"                      },
+    { PEEPFS_FORMAT_7ZIP,       0,  6,  "7z\274\257\047\034"        },
+    { PEEPFS_FORMAT_RAR,        0,  6,  "Rar!\032\007"              },
+    { PEEPFS_FORMAT_CAB,        0,  4,  "MSCF"                      },
+    { PEEPFS_FORMAT_TAR,        TAR_MAGIC_OFFSET, 5, "ustar"        },
+    { PEEPFS_FORMAT_UNKNOWN,    0,  0,  NULL                        }
+};
+
+/* Old (v7) tars have no magic, only a header checksum that adds up */
+static int
+__peepfs_detect_tar_checksum(const unsigned char *hdr)
+{
+    int64_t expect = 0, usum = 0, ssum = 0;
+    int     i, digits = 0;
+
+    for (i = TAR_CHKSUM_OFFSET; i < TAR_CHKSUM_OFFSET + TAR_CHKSUM_LEN; ++i) {
+        if (hdr[i] >= '0' && hdr[i] <= '7') {
+            expect = expect * 8 + hdr[i] - '0';
+            digits++;
+        } else if (digits || (hdr[i] != ' ' && hdr[i] != '\0')) {
+            break;
+        }
+    }
+
+    if (digits == 0) {
+        return 0;
+    }
+
+    for (i = 0; i < DETECT_HEAD_LEN; ++i) {
+        if (i >= TAR_CHKSUM_OFFSET && i < TAR_CHKSUM_OFFSET + TAR_CHKSUM_LEN) {
+            usum += ' ';
+            ssum += ' ';
+        } else {
+            usum += hdr[i];
+            ssum += (signed char)hdr[i];
+        }
+    }
+
+    return expect == usum || expect == ssum;
+}
+
+/* A zip with a stub in front (self-extractors) still ends in an EOCD */
+static int
+__peepfs_detect_eocd(int fd, int64_t size)
+{
+    unsigned char  *tail, *p;
+    int64_t         len;
+    int             found = 0;
+
+    if (size < DETECT_EOCD_LEN) {
+        return 0;
+    }
+
+    len  = MIN(size, DETECT_EOCD_MAX);
+    tail = (unsigned char*)malloc(len);
+
+    if (tail == NULL || pread(fd, tail, len, size - len) != len) {
+        free(tail);
+        return 0;
+    }
+
+    /* The comment length has to reach exactly to the end of the file */
+    for (p = tail + len - DETECT_EOCD_LEN; p >= tail && !found; --p) {
+        found = memcmp(p, "PK\005\006", 4) == 0 &&
+                (p[20] | (p[21] << 8)) == tail + len - p - DETECT_EOCD_LEN;
+    }
+
+    free(tail);
+
+    return found;
+}
+
+int
+peepfs_detect(int fd, int64_t size)
+{
+    unsigned char   head[DETECT_HEAD_LEN], vd[5];
+    ssize_t         len;
+    int             i;
+
+    len = pread(fd, head, sizeof(head), 0);
+
+    if (len <= 0) {
+        return PEEPFS_FORMAT_UNKNOWN;
+    }
+
+    for (i = 0; detect_magic[i].magic; ++i) {
+        if (detect_magic[i].offset + detect_magic[i].len <= len &&
+            memcmp(head + detect_magic[i].offset, detect_magic[i].magic,
+                   detect_magic[i].len) == 0) {
+            return detect_magic[i].format;
+        }
+    }
+
+    if (len >= 4 && memcmp(head, "BZh", 3) == 0 && head[3] >= '1' && head[3] <= '9') {
+        return PEEPFS_FORMAT_BZ2;
+    }
+
+    if (len == DETECT_HEAD_LEN && __peepfs_detect_tar_checksum(head)) {
+        return PEEPFS_FORMAT_TAR;
+    }
+
+    if (pread(fd, vd, sizeof(vd), DETECT_ISO_OFFSET) == sizeof(vd) &&
+        memcmp(vd, "CD001", 5) == 0) {
+        return PEEPFS_FORMAT_ISO;
+    }
+
+    if (__peepfs_detect_eocd(fd, size)) {
+        return PEEPFS_FORMAT_ZIP;
+    }
+
+    return PEEPFS_FORMAT_UNKNOWN;
+}
+
+int
+peepfs_detect_path(const char *path)
+{
+    struct stat st;
+    int         fd, format = PEEPFS_FORMAT_UNKNOWN;
+
+    fd = open(path, O_RDONLY);
+
+    if (fd < 0) {
+        return PEEPFS_FORMAT_UNKNOWN;
+    }
+
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        format = peepfs_detect(fd, st.st_size);
+    }
+
+    close(fd);
+
+    return format;
+}
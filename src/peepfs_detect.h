@@ -0,0 +1,37 @@
+#ifndef __PEEPFS_DETECT_H__
+#define __PEEPFS_DETECT_H__
+
+#include <stdint.h>
+
+/*
+ * Telling archive formats apart by their magic numbers.
+ *
+ * A handful of bytes from the head of the file (and, for zips with
+ * something stuck in front of them, the tail) is enough to say which
+ * backend should get it, without parsing any of the archive.  Saying
+ * a file is a zip doesn't promise it's a good one; that only shows when
+ * the backend opens it.
+ */
+
+#define PEEPFS_FORMAT_UNKNOWN   0
+#define PEEPFS_FORMAT_ZIP       1
+#define PEEPFS_FORMAT_TAR       2
+#define PEEPFS_FORMAT_GZIP      3
+#define PEEPFS_FORMAT_XZ        4
+#define PEEPFS_FORMAT_ZSTD      5
+#define PEEPFS_FORMAT_BZ2       6
+#define PEEPFS_FORMAT_ISO       7
+#define PEEPFS_FORMAT_SQUASHFS  8
+#define PEEPFS_FORMAT_7ZIP      9
+#define PEEPFS_FORMAT_RAR       10
+#define PEEPFS_FORMAT_CAB       11
+
+/* Format of the 'size' byte file open at 'fd' */
+int peepfs_detect(
+    int fd, int64_t size);
+
+/* Same, by path; PEEPFS_FORMAT_UNKNOWN if it can't be read */
+int peepfs_detect_path(
+    const char *path);
+
+#endif
@@ -0,0 +1,108 @@
+#ifndef __PEEPFS_EPOCH_H__
+#define __PEEPFS_EPOCH_H__
+
+#include <stdint.h>
+
+/*
+ * Epoch based reclamation, for structures read without a lock.
+ *
+ * Readers bracket each lookup with enter/exit, which counts them as
+ * active in the current epoch.  Writers still lock against each other;
+ * whatever they unlink is retired with the epoch it was unlinked in and
+ * may only be freed once the epoch has moved on twice, by which time
+ * every reader that might have seen it has left.  The epoch can only
+ * move from E to E+1 once nobody is left in E-1, so two counters per
+ * slot (by parity) are enough.
+ *
+ * Readers are spread over a fixed set of slots by thread, so entering
+ * costs one atomic on a cache line shared with few other threads.
+ */
+
+#define PEEPFS_EPOCH_SLOTS      64
+
+typedef struct peepfs_epoch_slot {
+    int64_t             active[2];
+} __attribute__((aligned(64))) peepfs_epoch_slot_t;
+
+typedef struct peepfs_epoch {
+    uint64_t            epoch;
+    unsigned            next_slot;
+    peepfs_epoch_slot_t slots[PEEPFS_EPOCH_SLOTS];
+} peepfs_epoch_t;
+
+static inline peepfs_epoch_slot_t *
+__peepfs_epoch_slot(peepfs_epoch_t *ep)
+{
+    static __thread int slot = -1;
+
+    if (slot < 0) {
+        slot = __atomic_fetch_add(&ep->next_slot, 1, __ATOMIC_RELAXED) %
+               PEEPFS_EPOCH_SLOTS;
+    }
+
+    return &ep->slots[slot];
+}
+
+/* Returns the epoch entered, to be handed back to peepfs_epoch_exit() */
+static inline uint64_t
+peepfs_epoch_enter(peepfs_epoch_t *ep)
+{
+    peepfs_epoch_slot_t *slot = __peepfs_epoch_slot(ep);
+    uint64_t             e;
+
+    while (1) {
+
+        e = __atomic_load_n(&ep->epoch, __ATOMIC_SEQ_CST);
+
+        __atomic_add_fetch(&slot->active[e & 1], 1, __ATOMIC_SEQ_CST);
+
+        /* Moved on before we were counted, we'd hold up the wrong epoch */
+        if (__atomic_load_n(&ep->epoch, __ATOMIC_SEQ_CST) == e) {
+            return e;
+        }
+
+        __atomic_sub_fetch(&slot->active[e & 1], 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+static inline void
+peepfs_epoch_exit(peepfs_epoch_t *ep, uint64_t e)
+{
+    __atomic_sub_fetch(&__peepfs_epoch_slot(ep)->active[e & 1], 1, __ATOMIC_RELEASE);
+}
+
+/* Epoch to tag something with, call after it has been unlinked */
+static inline uint64_t
+peepfs_epoch_retire(peepfs_epoch_t *ep)
+{
+    /* An RMW rather than a load, so the unlink is ordered before it */
+    return __atomic_fetch_add(&ep->epoch, 0, __ATOMIC_SEQ_CST);
+}
+
+/* Move the epoch along if no reader is still in the previous one */
+static inline uint64_t
+peepfs_epoch_advance(peepfs_epoch_t *ep)
+{
+    uint64_t    e = __atomic_load_n(&ep->epoch, __ATOMIC_SEQ_CST);
+    int         i;
+
+    for (i = 0; i < PEEPFS_EPOCH_SLOTS; ++i) {
+        if (__atomic_load_n(&ep->slots[i].active[(e - 1) & 1], __ATOMIC_SEQ_CST)) {
+            return e;
+        }
+    }
+
+    __atomic_compare_exchange_n(&ep->epoch, &e, e + 1, 0,
+        __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+
+    return __atomic_load_n(&ep->epoch, __ATOMIC_SEQ_CST);
+}
+
+/* Whether something retired in epoch 'e' can't be seen by anyone now */
+static inline int
+peepfs_epoch_safe(uint64_t e, uint64_t now)
+{
+    return now >= e + 2;
+}
+
+#endif
@@ -0,0 +1,351 @@
+#ifndef __PEEPFS_IDENT_H__
+#define __PEEPFS_IDENT_H__
+
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "peepfs_archive.h"
+#include "peepfs_detect.h"
+#include "peepfs_workq.h"
+#include "utlist.h"
+#include "uthash.h"
+
+/*
+ * Remembered answers to "is this file an archive, and of what kind".
+ *
+ * Listing a base directory asks that of every candidate name, every
+ * time.  The answer only changes when the file does, so it is kept
+ * per file (dev, ino) along with the mtime and size it was worked out
+ * for, and worked out again only once those no longer match.  Files
+ * that turned out not to be archives are remembered just the same.
+ */
+
+#define PEEPFS_IDENT_ENTRIES    (256*1024)
+
+/* Most workers one listing will keep busy, on top of the lister itself */
+#define PEEPFS_IDENT_PARALLEL   8
+
+typedef struct peepfs_ident_entry {
+    peepfs_archive_key_t        key;
+    int                         format;
+    struct peepfs_ident_entry  *prev;
+    struct peepfs_ident_entry  *next;
+    UT_hash_handle              hh;
+} peepfs_ident_entry_t;
+
+typedef struct peepfs_ident {
+    peepfs_ident_entry_t   *hash;
+    peepfs_ident_entry_t   *lru;
+    int64_t                 num_entries;
+    int64_t                 max_entries;
+    pthread_mutex_t         lock;
+} peepfs_ident_t;
+
+/* Only dev and ino are hashed, the rest says whether it's still good */
+#define PEEPFS_IDENT_KEYLEN     (2 * sizeof(uint64_t))
+
+static inline peepfs_ident_t *
+peepfs_ident_init(int64_t max_entries)
+{
+    peepfs_ident_t *ident;
+
+    ident = (peepfs_ident_t*)calloc(1,sizeof(peepfs_ident_t));
+
+    if (ident == NULL) {
+        return NULL;
+    }
+
+    ident->max_entries = max_entries > 0 ? max_entries : 1;
+
+    pthread_mutex_init(&ident->lock, NULL);
+
+    return ident;
+}
+
+static inline void
+peepfs_ident_free(peepfs_ident_t *ident)
+{
+    peepfs_ident_entry_t *ie, *tmp;
+
+    HASH_ITER(hh, ident->hash, ie, tmp) {
+        HASH_DEL(ident->hash, ie);
+        free(ie);
+    }
+
+    pthread_mutex_destroy(&ident->lock);
+
+    free(ident);
+}
+
+/* Cached format, or -1 if we have nothing current for this file */
+static inline int
+__peepfs_ident_lookup(
+    peepfs_ident_t             *ident,
+    const peepfs_archive_key_t *key)
+{
+    peepfs_ident_entry_t   *ie;
+    int                     format = -1;
+
+    pthread_mutex_lock(&ident->lock);
+
+    HASH_FIND(hh, ident->hash, key, PEEPFS_IDENT_KEYLEN, ie);
+
+    if (ie && memcmp(&ie->key, key, sizeof(*key)) == 0) {
+        format = ie->format;
+        DL_DELETE(ident->lru, ie);
+        DL_APPEND(ident->lru, ie);
+    }
+
+    pthread_mutex_unlock(&ident->lock);
+
+    return format;
+}
+
+static inline void
+__peepfs_ident_store(
+    peepfs_ident_t             *ident,
+    const peepfs_archive_key_t *key,
+    int                         format)
+{
+    peepfs_ident_entry_t   *ie, *victim = NULL;
+
+    pthread_mutex_lock(&ident->lock);
+
+    HASH_FIND(hh, ident->hash, key, PEEPFS_IDENT_KEYLEN, ie);
+
+    if (ie) {
+        /* Same file, new contents: just take the new answer */
+        DL_DELETE(ident->lru, ie);
+    } else {
+
+        ie = (peepfs_ident_entry_t*)calloc(1,sizeof(peepfs_ident_entry_t));
+
+        if (ie == NULL) {
+            pthread_mutex_unlock(&ident->lock);
+            return;
+        }
+
+        ie->key = *key;
+
+        HASH_ADD(hh, ident->hash, key, PEEPFS_IDENT_KEYLEN, ie);
+
+        if (++ident->num_entries > ident->max_entries) {
+            victim = ident->lru;
+            DL_DELETE(ident->lru, victim);
+            HASH_DEL(ident->hash, victim);
+            --ident->num_entries;
+        }
+    }
+
+    ie->key    = *key;
+    ie->format = format;
+
+    DL_APPEND(ident->lru, ie);
+
+    pthread_mutex_unlock(&ident->lock);
+
+    free(victim);
+}
+
+/*
+ * Format of the file at 'path' (PEEPFS_FORMAT_UNKNOWN if it isn't an
+ * archive), from the cache if the file hasn't changed since we last
+ * looked, otherwise by reading its magic.
+ */
+
+static inline int
+peepfs_ident_format(
+    peepfs_ident_t *ident,
+    const char     *path)
+{
+    peepfs_archive_key_t    key;
+    struct stat             st;
+    int                     fd, format;
+
+    if (stat(path, &st) || !S_ISREG(st.st_mode)) {
+        return PEEPFS_FORMAT_UNKNOWN;
+    }
+
+    peepfs_archive_key_init(&key, &st);
+
+    format = __peepfs_ident_lookup(ident, &key);
+
+    if (format >= 0) {
+        return format;
+    }
+
+    fd = open(path, O_RDONLY);
+
+    if (fd < 0) {
+        return PEEPFS_FORMAT_UNKNOWN;
+    }
+
+    /* Key the answer to what we actually read, not the earlier stat */
+    if (fstat(fd, &st) == 0) {
+        peepfs_archive_key_init(&key, &st);
+        format = peepfs_detect(fd, st.st_size);
+        __peepfs_ident_store(ident, &key, format);
+    } else {
+        format = PEEPFS_FORMAT_UNKNOWN;
+    }
+
+    close(fd);
+
+    return format;
+}
+
+/*
+ * A listing's worth of files to identify.  Workers and the lister all
+ * take the next unclaimed path until none are left; the lister only
+ * waits for paths already claimed, so a helper stuck in the queue
+ * behind other work never holds up the listing.  Whoever is last to
+ * let go frees it.
+ */
+
+typedef struct peepfs_ident_batch {
+    peepfs_ident_t     *ident;
+    const char        **paths;
+    int                *formats;
+    int64_t             count;
+    int64_t             next;
+    int64_t             done;
+    int                 refcnt;
+    pthread_mutex_t     lock;
+    pthread_cond_t      cond;
+} peepfs_ident_batch_t;
+
+static inline void
+__peepfs_ident_batch_put(peepfs_ident_batch_t *batch)
+{
+    int refcnt;
+
+    pthread_mutex_lock(&batch->lock);
+
+    refcnt = --batch->refcnt;
+
+    pthread_mutex_unlock(&batch->lock);
+
+    if (refcnt == 0) {
+        pthread_cond_destroy(&batch->cond);
+        pthread_mutex_destroy(&batch->lock);
+        free(batch);
+    }
+}
+
+static inline void
+__peepfs_ident_batch_run(peepfs_ident_batch_t *batch)
+{
+    int64_t i;
+    int     format;
+
+    pthread_mutex_lock(&batch->lock);
+
+    while (batch->next < batch->count) {
+
+        i = batch->next++;
+
+        pthread_mutex_unlock(&batch->lock);
+
+        format = peepfs_ident_format(batch->ident, batch->paths[i]);
+
+        pthread_mutex_lock(&batch->lock);
+
+        batch->formats[i] = format;
+
+        if (++batch->done == batch->count) {
+            pthread_cond_broadcast(&batch->cond);
+        }
+    }
+
+    pthread_mutex_unlock(&batch->lock);
+}
+
+static inline void
+__peepfs_ident_batch_job(void *arg)
+{
+    peepfs_ident_batch_t *batch = (peepfs_ident_batch_t*)arg;
+
+    __peepfs_ident_batch_run(batch);
+    __peepfs_ident_batch_put(batch);
+}
+
+/*
+ * Fill in formats[i] for each of 'count' paths, spreading the work over
+ * 'workq' (if there is one).  The paths and formats belong to the
+ * caller and are no longer touched once this returns.
+ */
+
+static inline void
+peepfs_ident_formats(
+    peepfs_ident_t     *ident,
+    peepfs_workq_t     *workq,
+    const char        **paths,
+    int                *formats,
+    int64_t             count)
+{
+    peepfs_ident_batch_t   *batch;
+    int64_t                 i, helpers = 0;
+
+    if (workq && count > 1) {
+        helpers = peepfs_workq_threads(workq);
+
+        if (helpers > PEEPFS_IDENT_PARALLEL) {
+            helpers = PEEPFS_IDENT_PARALLEL;
+        }
+
+        if (helpers > count - 1) {
+            helpers = count - 1;
+        }
+    }
+
+    batch = helpers ? (peepfs_ident_batch_t*)calloc(1,sizeof(peepfs_ident_batch_t)) : NULL;
+
+    if (batch == NULL) {
+        for (i = 0; i < count; ++i) {
+            formats[i] = peepfs_ident_format(ident, paths[i]);
+        }
+        return;
+    }
+
+    batch->ident   = ident;
+    batch->paths   = paths;
+    batch->formats = formats;
+    batch->count   = count;
+    batch->refcnt  = 1;
+
+    pthread_mutex_init(&batch->lock, NULL);
+    pthread_cond_init(&batch->cond, NULL);
+
+    for (i = 0; i < helpers; ++i) {
+
+        pthread_mutex_lock(&batch->lock);
+        batch->refcnt++;
+        pthread_mutex_unlock(&batch->lock);
+
+        if (peepfs_workq_submit(workq, __peepfs_ident_batch_job, batch)) {
+            __peepfs_ident_batch_put(batch);
+            break;
+        }
+    }
+
+    __peepfs_ident_batch_run(batch);
+
+    pthread_mutex_lock(&batch->lock);
+
+    while (batch->done < batch->count) {
+        pthread_cond_wait(&batch->cond, &batch->lock);
+    }
+
+    /* Late helpers find nothing left, but mustn't see our arrays either */
+    batch->paths   = NULL;
+    batch->formats = NULL;
+
+    pthread_mutex_unlock(&batch->lock);
+
+    __peepfs_ident_batch_put(batch);
+}
+
+#endif
@@ -0,0 +1,1052 @@
+#include "peepfs_inflate.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define MIN(x,y) ((x) < (y) ? (x) : (y))
+#define MAX(x,y) ((x) > (y) ? (x) : (y))
+
+#define INFLATE_WINSIZE     32768
+#define INFLATE_MAXBITS     15
+#define INFLATE_FAST        10
+#define INFLATE_READ        (256*1024)
+#define INFLATE_PAD         16
+
+#define INFLATE_BAD         -1
+#define INFLATE_MORE        -2      /* ran past the compressed data loaded */
+
+/* A canonical Huffman code, with a lookup table for the short codes */
+typedef struct inflate_huff {
+    uint16_t            fast[1 << INFLATE_FAST];    /* symbol << 4 | length */
+    int                 bits;                       /* of 'fast' in use */
+    int16_t             count[INFLATE_MAXBITS+1];
+    int16_t             symbol[288];
+} inflate_huff_t;
+
+typedef struct inflate_state {
+    int                 fd;
+    int64_t             base;
+    int64_t             length;
+    int                 gzip;
+    unsigned char      *in;
+    int64_t             in_start;   /* compressed offset of in[0] */
+    int64_t             in_len;
+    int64_t             next;       /* in[] index of the next byte for bitbuf */
+    uint64_t            bitbuf;
+    int                 bitcnt;
+    uint16_t           *out;
+    int64_t             out_len;
+    int64_t             out_max;
+    int64_t             member;     /* output index the gzip member began at, -1 if unknown */
+    inflate_huff_t      lencode;
+    inflate_huff_t      distcode;
+} inflate_state_t;
+
+static const uint8_t __peepfs_inflate_order[19] = {
+    16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+static const uint16_t __peepfs_inflate_lbase[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+
+static const uint8_t __peepfs_inflate_lext[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+
+static const uint16_t __peepfs_inflate_dbase[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+    8193, 12289, 16385, 24577 };
+
+static const uint8_t __peepfs_inflate_dext[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+static inflate_huff_t   __peepfs_inflate_fixed_len;
+static inflate_huff_t   __peepfs_inflate_fixed_dist;
+static uint16_t         __peepfs_inflate_kraft[4096];   /* of four 3 bit lengths */
+static pthread_once_t   __peepfs_inflate_fixed_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Count a code's lengths and see that they make a code.  Like zlib, an
+ * incomplete code is only taken if 'lenient' and it's a lone one bit
+ * code (or no code at all).
+ */
+static int
+__peepfs_inflate_count(
+    inflate_huff_t     *h,
+    const uint8_t      *length,
+    int                 n,
+    int                 lenient)
+{
+    int                 len, sym, left, max = 0;
+
+    memset(h->count, 0, sizeof(h->count));
+
+    for (sym = 0; sym < n; ++sym) {
+        h->count[length[sym]]++;
+    }
+
+    left = 1;
+
+    for (len = 1; len <= INFLATE_MAXBITS; ++len) {
+
+        left <<= 1;
+        left  -= h->count[len];
+
+        if (left < 0) {
+            return -1;
+        }
+
+        if (h->count[len]) {
+            max = len;
+        }
+    }
+
+    if (left > 0 && max > 0 && !(lenient && max == 1)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Set up a code from its lengths, with a table 'bits' wide for short codes */
+static int
+__peepfs_inflate_build(
+    inflate_huff_t     *h,
+    const uint8_t      *length,
+    int                 n,
+    int                 lenient,
+    int                 bits)
+{
+    int16_t             offs[INFLATE_MAXBITS+1];
+    int                 len, sym, code, i, j, k;
+    unsigned            rev;
+
+    if (__peepfs_inflate_count(h, length, n, lenient)) {
+        return -1;
+    }
+
+    offs[1] = 0;
+
+    for (len = 1; len < INFLATE_MAXBITS; ++len) {
+        offs[len+1] = offs[len] + h->count[len];
+    }
+
+    for (sym = 0; sym < n; ++sym) {
+        if (length[sym]) {
+            h->symbol[offs[length[sym]]++] = sym;
+        }
+    }
+
+    /* Codes go in the stream first bit first, so the table is bit reversed */
+    memset(h->fast, 0, sizeof(h->fast[0]) << bits);
+
+    h->bits = bits;
+
+    code = 0;
+    i    = 0;
+
+    for (len = 1; len <= bits; ++len) {
+
+        for (k = 0; k < h->count[len]; ++k, ++i, ++code) {
+
+            for (rev = 0, j = 0; j < len; ++j) {
+                rev |= ((code >> j) & 1) << (len - 1 - j);
+            }
+
+            for (j = rev; j < (1 << bits); j += 1 << len) {
+                h->fast[j] = h->symbol[i] << 4 | len;
+            }
+        }
+
+        code <<= 1;
+    }
+
+    return 0;
+}
+
+static void
+__peepfs_inflate_fixed_init(void)
+{
+    uint8_t lengths[288];
+    int     sym, i, len;
+
+    for (sym = 0; sym < 144; ++sym) {
+        lengths[sym] = 8;
+    }
+    for (; sym < 256; ++sym) {
+        lengths[sym] = 9;
+    }
+    for (; sym < 280; ++sym) {
+        lengths[sym] = 7;
+    }
+    for (; sym < 288; ++sym) {
+        lengths[sym] = 8;
+    }
+
+    __peepfs_inflate_build(&__peepfs_inflate_fixed_len, lengths, 288, 0, INFLATE_FAST);
+
+    /* Distances 30 and 31 have codes, they just aren't valid */
+    for (sym = 0; sym < 32; ++sym) {
+        lengths[sym] = 5;
+    }
+
+    __peepfs_inflate_build(&__peepfs_inflate_fixed_dist, lengths, 32, 0, INFLATE_FAST);
+
+    /* A code length code 1..7 bits long takes up 2^(7 - length) of 128 */
+    for (sym = 0; sym < 4096; ++sym) {
+        for (i = 0; i < 4; ++i) {
+            len = (sym >> (3 * i)) & 7;
+            __peepfs_inflate_kraft[sym] += len ? 1 << (7 - len) : 0;
+        }
+    }
+}
+
+/* Have the compressed data up to offset 'upto' in memory, or all there is */
+static int
+__peepfs_inflate_load(inflate_state_t *s, int64_t upto)
+{
+    unsigned char  *in;
+    int64_t         want;
+    ssize_t         n;
+
+    want = MIN(upto, s->length) - s->in_start;
+
+    if (want <= s->in_len) {
+        return 0;
+    }
+
+    in = (unsigned char*)realloc(s->in, want + INFLATE_PAD);
+
+    if (in == NULL) {
+        return -1;
+    }
+
+    s->in = in;
+
+    while (s->in_len < want) {
+
+        n = pread(s->fd, in + s->in_len, want - s->in_len,
+                  s->base + s->in_start + s->in_len);
+
+        if (n <= 0) {
+            return -1;
+        }
+
+        s->in_len += n;
+    }
+
+    /* Past the end reads as zeros */
+    memset(in + s->in_len, 0, INFLATE_PAD);
+
+    return 0;
+}
+
+/* Load more of the data after a block ran off the end of it */
+static int
+__peepfs_inflate_more(inflate_state_t *s)
+{
+    if (s->in_start + s->in_len >= s->length) {
+        return -1;
+    }
+
+    return __peepfs_inflate_load(s, s->in_start + s->in_len * 2 + INFLATE_READ);
+}
+
+/* Compressed byte at 'pos', or -1 past the end */
+static int
+__peepfs_inflate_byte(inflate_state_t *s, int64_t pos)
+{
+    if (pos >= s->length ||
+        (pos >= s->in_start + s->in_len &&
+         __peepfs_inflate_load(s, pos + INFLATE_READ))) {
+        return -1;
+    }
+
+    return s->in[pos - s->in_start];
+}
+
+static inline void
+__peepfs_inflate_refill(inflate_state_t *s)
+{
+    const unsigned char *p;
+
+    if (s->next + 8 <= s->in_len + INFLATE_PAD) {
+
+        p = s->in + s->next;
+
+        s->bitbuf |= ((uint64_t)p[0]       | (uint64_t)p[1] << 8  |
+                      (uint64_t)p[2] << 16 | (uint64_t)p[3] << 24 |
+                      (uint64_t)p[4] << 32 | (uint64_t)p[5] << 40 |
+                      (uint64_t)p[6] << 48 | (uint64_t)p[7] << 56) << s->bitcnt;
+
+        s->next   += (63 - s->bitcnt) >> 3;
+        s->bitcnt |= 56;
+
+        return;
+    }
+
+    while (s->bitcnt <= 56) {
+        s->next++;
+        s->bitcnt += 8;
+    }
+}
+
+/* Bit offset of the next bit to decode */
+static inline int64_t
+__peepfs_inflate_pos(inflate_state_t *s)
+{
+    return (s->in_start + s->next) * 8 - s->bitcnt;
+}
+
+/* Whether decoding has gone past what's loaded */
+static inline int
+__peepfs_inflate_over(inflate_state_t *s)
+{
+    return s->next > s->in_len && (s->next - s->in_len) * 8 > s->bitcnt;
+}
+
+static void
+__peepfs_inflate_seek(inflate_state_t *s, int64_t bit)
+{
+    s->next   = bit / 8 - s->in_start;
+    s->bitbuf = 0;
+    s->bitcnt = 0;
+
+    __peepfs_inflate_refill(s);
+
+    s->bitbuf >>= bit & 7;
+    s->bitcnt  -= bit & 7;
+}
+
+static inline unsigned
+__peepfs_inflate_bits(inflate_state_t *s, int n)
+{
+    unsigned v;
+
+    if (s->bitcnt < n) {
+        __peepfs_inflate_refill(s);
+    }
+
+    v = s->bitbuf & ((1ull << n) - 1);
+
+    s->bitbuf >>= n;
+    s->bitcnt  -= n;
+
+    return v;
+}
+
+static inline int
+__peepfs_inflate_decode(inflate_state_t *s, const inflate_huff_t *h)
+{
+    int e, len, code, first, index, count;
+
+    if (s->bitcnt < INFLATE_MAXBITS) {
+        __peepfs_inflate_refill(s);
+    }
+
+    e = h->fast[s->bitbuf & ((1 << h->bits) - 1)];
+
+    if (e) {
+        len = e & 15;
+        s->bitbuf >>= len;
+        s->bitcnt  -= len;
+        return e >> 4;
+    }
+
+    /* Longer codes a bit at a time, as in puff */
+    code = first = index = 0;
+
+    for (len = 1; len <= INFLATE_MAXBITS; ++len) {
+
+        code |= (s->bitbuf >> (len - 1)) & 1;
+        count = h->count[len];
+
+        if (code - count < first) {
+            s->bitbuf >>= len;
+            s->bitcnt  -= len;
+            return h->symbol[index + (code - first)];
+        }
+
+        index  += count;
+        first  += count;
+        first <<= 1;
+        code  <<= 1;
+    }
+
+    return -1;
+}
+
+static int
+__peepfs_inflate_grow(inflate_state_t *s, int64_t need)
+{
+    uint16_t   *out;
+    int64_t     max = s->out_max;
+
+    while (max < s->out_len + need) {
+        max = max * 2 + 65536;
+    }
+
+    out = (uint16_t*)realloc(s->out, max * sizeof(uint16_t));
+
+    if (out == NULL) {
+        return -1;
+    }
+
+    s->out     = out;
+    s->out_max = max;
+
+    return 0;
+}
+
+static int
+__peepfs_inflate_stored(inflate_state_t *s)
+{
+    unsigned    len, nlen;
+
+    /* The length sits on the next byte boundary */
+    __peepfs_inflate_bits(s, s->bitcnt & 7);
+
+    len  = __peepfs_inflate_bits(s, 16);
+    nlen = __peepfs_inflate_bits(s, 16);
+
+    if (len != (~nlen & 0xffff)) {
+        return INFLATE_BAD;
+    }
+
+    if (s->out_len + len > s->out_max && __peepfs_inflate_grow(s, len)) {
+        return INFLATE_BAD;
+    }
+
+    while (len && s->bitcnt) {
+        s->out[s->out_len++] = __peepfs_inflate_bits(s, 8);
+        len--;
+    }
+
+    if (len) {
+
+        if (s->next + len > s->in_len) {
+            return INFLATE_MORE;
+        }
+
+        while (len--) {
+            s->out[s->out_len++] = s->in[s->next++];
+        }
+
+        s->bitbuf = 0;
+    }
+
+    return 0;
+}
+
+/* Decode a block's symbols up to its end-of-block code */
+static int
+__peepfs_inflate_codes(
+    inflate_state_t        *s,
+    const inflate_huff_t   *lencode,
+    const inflate_huff_t   *distcode)
+{
+    uint16_t   *out;
+    int64_t     from, reach;
+    int         sym, len, dist, i;
+
+    while (1) {
+
+        if (s->out_len + 258 > s->out_max && __peepfs_inflate_grow(s, 258)) {
+            return INFLATE_BAD;
+        }
+
+        if (__peepfs_inflate_over(s)) {
+            return INFLATE_MORE;
+        }
+
+        sym = __peepfs_inflate_decode(s, lencode);
+
+        if (sym < 256) {
+            if (sym < 0) {
+                return INFLATE_BAD;
+            }
+            s->out[s->out_len++] = sym;
+            continue;
+        }
+
+        if (sym == 256) {
+            return 0;
+        }
+
+        sym -= 257;
+
+        if (sym >= 29) {
+            return INFLATE_BAD;
+        }
+
+        len = __peepfs_inflate_lbase[sym] +
+              __peepfs_inflate_bits(s, __peepfs_inflate_lext[sym]);
+
+        sym = __peepfs_inflate_decode(s, distcode);
+
+        if (sym < 0 || sym >= 30) {
+            return INFLATE_BAD;
+        }
+
+        dist = __peepfs_inflate_dbase[sym] +
+               __peepfs_inflate_bits(s, __peepfs_inflate_dext[sym]);
+
+        /* Before the member began is nothing, before the chunk the window */
+        reach = s->member >= 0 ? s->out_len - s->member
+                               : s->out_len + INFLATE_WINSIZE;
+
+        if (dist > reach) {
+            return INFLATE_BAD;
+        }
+
+        out  = s->out + s->out_len;
+        from = s->out_len - dist;
+
+        if (from >= 0) {
+            for (i = 0; i < len; ++i) {
+                out[i] = s->out[from + i];
+            }
+        } else {
+            for (i = 0; i < len; ++i, ++from) {
+                out[i] = from < 0 ? 256 + INFLATE_WINSIZE + from : s->out[from];
+            }
+        }
+
+        s->out_len += len;
+    }
+}
+
+/*
+ * Read a dynamic block's header, up to the literal/length and distance
+ * code lengths, and check that those make codes.
+ */
+static int
+__peepfs_inflate_lengths(
+    inflate_state_t    *s,
+    uint8_t            *lengths,
+    int                *nlenp,
+    int                *ndistp)
+{
+    int         nlen, ndist, ncode, index, sym, len;
+
+    nlen  = __peepfs_inflate_bits(s, 5) + 257;
+    ndist = __peepfs_inflate_bits(s, 5) + 1;
+    ncode = __peepfs_inflate_bits(s, 4) + 4;
+
+    if (nlen > 286 || ndist > 30) {
+        return INFLATE_BAD;
+    }
+
+    for (index = 0; index < 19; ++index) {
+        lengths[__peepfs_inflate_order[index]] =
+            index < ncode ? __peepfs_inflate_bits(s, 3) : 0;
+    }
+
+    /* The code for the code lengths has to be complete */
+    if (__peepfs_inflate_build(&s->lencode, lengths, 19, 0, 7)) {
+        return INFLATE_BAD;
+    }
+
+    index = 0;
+
+    while (index < nlen + ndist) {
+
+        sym = __peepfs_inflate_decode(s, &s->lencode);
+
+        if (sym < 0) {
+            return INFLATE_BAD;
+        }
+
+        if (sym < 16) {
+            lengths[index++] = sym;
+            continue;
+        }
+
+        len = 0;
+
+        if (sym == 16) {
+            if (index == 0) {
+                return INFLATE_BAD;
+            }
+            len = lengths[index-1];
+            sym = 3 + __peepfs_inflate_bits(s, 2);
+        } else if (sym == 17) {
+            sym = 3 + __peepfs_inflate_bits(s, 3);
+        } else {
+            sym = 11 + __peepfs_inflate_bits(s, 7);
+        }
+
+        if (index + sym > nlen + ndist) {
+            return INFLATE_BAD;
+        }
+
+        while (sym--) {
+            lengths[index++] = len;
+        }
+    }
+
+    /* No end-of-block code, no way out of the block */
+    if (lengths[256] == 0 ||
+        __peepfs_inflate_count(&s->lencode, lengths, nlen, 1) ||
+        __peepfs_inflate_count(&s->distcode, lengths + nlen, ndist, 1)) {
+        return INFLATE_BAD;
+    }
+
+    *nlenp  = nlen;
+    *ndistp = ndist;
+
+    return 0;
+}
+
+static int
+__peepfs_inflate_dynamic(inflate_state_t *s)
+{
+    uint8_t     lengths[286+30];
+    int         nlen, ndist;
+
+    if (__peepfs_inflate_lengths(s, lengths, &nlen, &ndist) ||
+        __peepfs_inflate_build(&s->lencode, lengths, nlen, 1, INFLATE_FAST) ||
+        __peepfs_inflate_build(&s->distcode, lengths + nlen, ndist, 1, INFLATE_FAST)) {
+        return INFLATE_BAD;
+    }
+
+    return __peepfs_inflate_codes(s, &s->lencode, &s->distcode);
+}
+
+/* Skip the gzip member header at byte 'pos', returning where its data begins */
+static int64_t
+__peepfs_inflate_header(inflate_state_t *s, int64_t pos)
+{
+    int flags, c, xlen;
+
+    if (__peepfs_inflate_byte(s, pos) != 0x1f ||
+        __peepfs_inflate_byte(s, pos + 1) != 0x8b ||
+        __peepfs_inflate_byte(s, pos + 2) != 8) {
+        return -1;
+    }
+
+    flags = __peepfs_inflate_byte(s, pos + 3);
+
+    if (flags < 0 || (flags & 0xe0)) {
+        return -1;
+    }
+
+    pos += 10;
+
+    if (flags & 4) {
+
+        c    = __peepfs_inflate_byte(s, pos);
+        xlen = __peepfs_inflate_byte(s, pos + 1);
+
+        if (c < 0 || xlen < 0) {
+            return -1;
+        }
+
+        pos += 2 + (c | (xlen << 8));
+    }
+
+    /* Name, then comment, each zero terminated */
+    for (c = 8; c <= 16; c <<= 1) {
+
+        if (!(flags & c)) {
+            continue;
+        }
+
+        while ((xlen = __peepfs_inflate_byte(s, pos++)) > 0) {
+        }
+
+        if (xlen < 0) {
+            return -1;
+        }
+    }
+
+    if (flags & 2) {
+        pos += 2;
+    }
+
+    if (pos > s->length || (pos > s->in_start + s->in_len &&
+                            __peepfs_inflate_load(s, pos + INFLATE_READ))) {
+        return -1;
+    }
+
+    return pos;
+}
+
+/*
+ * Decode from where we are to the end of the chunk: the first split
+ * (the start of a dynamic block, or of a gzip member) at or past byte
+ * 'until', or any block boundary once 'max_out' is reached.
+ */
+static int
+__peepfs_inflate_run(
+    inflate_state_t        *s,
+    peepfs_inflate_chunk_t *chunk,
+    int64_t                 until,
+    int64_t                 max_out)
+{
+    int64_t     pos, out_len, p;
+    uint32_t    isize;
+    int         last, type, blocks = 0, error, i, c;
+
+    while (1) {
+
+        pos = __peepfs_inflate_pos(s);
+
+        if (blocks) {
+
+            if (s->bitcnt < 3) {
+                __peepfs_inflate_refill(s);
+            }
+
+            type = (s->bitbuf >> 1) & 3;
+
+            if (s->out_len >= max_out || (pos >= until * 8 && type == 2)) {
+                chunk->end = pos;
+                return 0;
+            }
+        }
+
+        out_len = s->out_len;
+
+        last = __peepfs_inflate_bits(s, 1);
+        type = __peepfs_inflate_bits(s, 2);
+
+        switch (type) {
+        case 0:
+            error = __peepfs_inflate_stored(s);
+            break;
+        case 1:
+            error = __peepfs_inflate_codes(s, &__peepfs_inflate_fixed_len,
+                                           &__peepfs_inflate_fixed_dist);
+            break;
+        case 2:
+            error = __peepfs_inflate_dynamic(s);
+            break;
+        default:
+            error = INFLATE_BAD;
+            break;
+        }
+
+        if (error == 0 && __peepfs_inflate_over(s)) {
+            error = INFLATE_MORE;
+        }
+
+        /* Do the block over with more of the input at hand */
+        if (error == INFLATE_MORE) {
+
+            if (__peepfs_inflate_more(s)) {
+                return INFLATE_BAD;
+            }
+
+            __peepfs_inflate_seek(s, pos);
+            s->out_len = out_len;
+
+            continue;
+        }
+
+        if (error) {
+            return error;
+        }
+
+        blocks++;
+
+        if (!last) {
+            continue;
+        }
+
+        pos = __peepfs_inflate_pos(s);
+
+        if (!s->gzip) {
+            chunk->end  = pos;
+            chunk->last = 1;
+            return 0;
+        }
+
+        /* The member's trailer, then maybe another member */
+        p = (pos + 7) / 8;
+
+        for (isize = 0, i = 0; i < 4; ++i) {
+
+            c = __peepfs_inflate_byte(s, p + 4 + i);
+
+            if (c < 0) {
+                break;
+            }
+
+            isize |= (uint32_t)c << (8 * i);
+        }
+
+        if (i < 4) {
+            chunk->end  = pos;
+            chunk->last = 1;
+            return 0;
+        }
+
+        if (s->member >= 0 && isize != (uint32_t)(s->out_len - s->member)) {
+            return INFLATE_BAD;
+        }
+
+        p += 8;
+
+        if (__peepfs_inflate_byte(s, p) != 0x1f ||
+            __peepfs_inflate_byte(s, p + 1) != 0x8b) {
+            chunk->end  = p * 8;
+            chunk->last = 1;
+            return 0;
+        }
+
+        if (p >= until || s->out_len >= max_out) {
+            chunk->end       = p * 8;
+            chunk->end_fresh = 1;
+            return 0;
+        }
+
+        p = __peepfs_inflate_header(s, p);
+
+        if (p < 0) {
+            return INFLATE_BAD;
+        }
+
+        __peepfs_inflate_seek(s, p * 8);
+
+        s->member = s->out_len;
+    }
+}
+
+/* 64 bits from bit offset 'bit' on, at least 57 of them real */
+static inline uint64_t
+__peepfs_inflate_peek(inflate_state_t *s, int64_t bit)
+{
+    const unsigned char *p = s->in + (bit / 8 - s->in_start);
+
+    return ((uint64_t)p[0]       | (uint64_t)p[1] << 8  |
+            (uint64_t)p[2] << 16 | (uint64_t)p[3] << 24 |
+            (uint64_t)p[4] << 32 | (uint64_t)p[5] << 40 |
+            (uint64_t)p[6] << 48 | (uint64_t)p[7] << 56) >> (bit & 7);
+}
+
+/* Cheap first look at whether a dynamic block header starting 'v' begins at 'bit' */
+static inline int
+__peepfs_inflate_maybe(inflate_state_t *s, int64_t bit, uint64_t v)
+{
+    const uint16_t *kraft = __peepfs_inflate_kraft;
+    int             ncode;
+
+    if (((v >> 1) & 3) != 2 || ((v >> 3) & 31) > 29 || ((v >> 8) & 31) > 29) {
+        return 0;
+    }
+
+    ncode = ((v >> 13) & 15) + 4;
+
+    /* The code length code has to be complete */
+    v = __peepfs_inflate_peek(s, bit + 17) & ((1ull << (3 * ncode)) - 1);
+
+    return kraft[v & 4095] + kraft[(v >> 12) & 4095] + kraft[(v >> 24) & 4095] +
+           kraft[(v >> 36) & 4095] + kraft[(v >> 48) & 4095] == 128;
+}
+
+/* Decode from somewhere a search turned up */
+static int
+__peepfs_inflate_try(
+    inflate_state_t        *s,
+    peepfs_inflate_chunk_t *chunk,
+    int64_t                 bit,
+    int                     fresh,
+    int64_t                 grid,
+    int64_t                 max_out)
+{
+    uint8_t                 lengths[286+30];
+    int64_t                 data;
+    int                     nlen, ndist;
+
+    s->out_len = 0;
+
+    if (fresh) {
+
+        data = __peepfs_inflate_header(s, bit / 8);
+
+        if (data < 0) {
+            return INFLATE_BAD;
+        }
+
+        __peepfs_inflate_seek(s, data * 8);
+
+    } else {
+
+        /* Most of what gets this far falls apart in the code lengths */
+        __peepfs_inflate_seek(s, bit + 3);
+
+        if (__peepfs_inflate_lengths(s, lengths, &nlen, &ndist)) {
+            return INFLATE_BAD;
+        }
+
+        __peepfs_inflate_seek(s, bit);
+    }
+
+    memset(chunk, 0, sizeof(*chunk));
+
+    s->member = fresh ? 0 : -1;
+
+    if (__peepfs_inflate_run(s, chunk, (bit / 8 / grid + 1) * grid, max_out)) {
+        return INFLATE_BAD;
+    }
+
+    chunk->start = bit;
+    chunk->fresh = fresh;
+
+    return 0;
+}
+
+/* Try every bit from byte 'from' on until something decodes to the end */
+static int
+__peepfs_inflate_find(
+    inflate_state_t        *s,
+    peepfs_inflate_chunk_t *chunk,
+    int64_t                 from,
+    int64_t                 search,
+    int64_t                 grid,
+    int64_t                 max_out)
+{
+    const unsigned char    *p;
+    uint64_t                v;
+    int64_t                 pos, end, wasted = 0;
+    int                     i;
+
+    end = MIN(from + search, s->length);
+
+    for (pos = from; pos < end && wasted <= max_out; ++pos) {
+
+        p = s->in + (pos - s->in_start);
+
+        if (s->gzip && p[0] == 0x1f && p[1] == 0x8b && p[2] == 8 && !(p[3] & 0xe0)) {
+
+            if (__peepfs_inflate_try(s, chunk, pos * 8, 1, grid, max_out) == 0) {
+                return 0;
+            }
+
+            wasted += s->out_len;
+        }
+
+        v = __peepfs_inflate_peek(s, pos * 8);
+
+        for (i = 0; i < 8; ++i) {
+
+            if (!__peepfs_inflate_maybe(s, pos * 8 + i, v >> i)) {
+                continue;
+            }
+
+            if (__peepfs_inflate_try(s, chunk, pos * 8 + i, 0, grid, max_out) == 0) {
+                return 0;
+            }
+
+            /* Random data can look like a block for a while, but not for long */
+            wasted += s->out_len;
+        }
+    }
+
+    return INFLATE_BAD;
+}
+
+int
+peepfs_inflate_chunk(
+    int                     fd,
+    int64_t                 base,
+    int64_t                 length,
+    int                     gzip,
+    int64_t                 start,
+    int                     fresh,
+    int64_t                 search,
+    int64_t                 grid,
+    int64_t                 max_out,
+    peepfs_inflate_chunk_t *chunk)
+{
+    inflate_state_t    *s;
+    int64_t             data;
+    int                 error = INFLATE_BAD;
+
+    memset(chunk, 0, sizeof(*chunk));
+
+    pthread_once(&__peepfs_inflate_fixed_once, __peepfs_inflate_fixed_init);
+
+    s = (inflate_state_t*)calloc(1,sizeof(inflate_state_t));
+
+    if (s == NULL) {
+        return -1;
+    }
+
+    s->fd       = fd;
+    s->base     = base;
+    s->length   = length;
+    s->gzip     = gzip;
+    s->in_start = start / 8;
+
+    if (s->in_start >= length ||
+        __peepfs_inflate_load(s, s->in_start + MAX(search, grid) + INFLATE_READ) ||
+        __peepfs_inflate_grow(s, 1024 * 1024)) {
+        goto out;
+    }
+
+    if (search) {
+
+        error = __peepfs_inflate_find(s, chunk, s->in_start, search, grid, max_out);
+
+    } else {
+
+        chunk->start = start;
+        chunk->fresh = fresh;
+
+        s->member = fresh ? 0 : -1;
+
+        data = fresh && gzip ? __peepfs_inflate_header(s, start / 8) : start / 8;
+
+        if (data < 0) {
+            goto out;
+        }
+
+        __peepfs_inflate_seek(s, fresh ? data * 8 : start);
+
+        error = __peepfs_inflate_run(s, chunk, (start / 8 / grid + 1) * grid, max_out);
+    }
+
+    if (error == 0) {
+        chunk->data = s->out;
+        chunk->len  = s->out_len;
+        s->out      = NULL;
+    }
+
+out:
+
+    free(s->in);
+    free(s->out);
+    free(s);
+
+    return error ? -1 : 0;
+}
+
+void
+peepfs_inflate_resolve(
+    const peepfs_inflate_chunk_t   *chunk,
+    const unsigned char            *window,
+    unsigned char                  *out)
+{
+    int64_t     i;
+    uint16_t    v;
+
+    for (i = 0; i < chunk->len; ++i) {
+        v = chunk->data[i];
+        out[i] = v < 256 ? v : window ? window[v - 256] : 0;
+    }
+}
+
+void
+peepfs_inflate_chunk_free(peepfs_inflate_chunk_t *chunk)
+{
+    free(chunk->data);
+
+    chunk->data = NULL;
+    chunk->len  = 0;
+}
@@ -0,0 +1,56 @@
+#ifndef __PEEPFS_INFLATE_H__
+#define __PEEPFS_INFLATE_H__
+
+#include <stdint.h>
+
+/*
+ * A deflate decoder that can start in the middle of a stream.
+ *
+ * zlib needs the 32K of output before wherever it starts.  This one
+ * doesn't: matches reaching back past the start of what it decoded are
+ * written out as references into that unknown window (256 + offset),
+ * to be filled in once whoever decodes the stretch before it has the
+ * window at hand.  Given a place to look rather than a place to start,
+ * it tries every bit offset from there for a dynamic block header (or,
+ * in gzip data, a member header) that decodes, after pugz and
+ * rapidgzip.
+ *
+ * A chunk stops at the first block boundary at or past the next
+ * multiple of 'grid' bytes after its start where a dynamic block (or a
+ * gzip member) begins, which is where a search from that multiple
+ * lands, so chunks decoded side by side meet without overlapping.  A
+ * search can be fooled, so a chunk is only to be trusted once the one
+ * before it is known to end exactly where it starts.
+ */
+
+typedef struct peepfs_inflate_chunk {
+    int64_t             start;      /* bit offset decoding began at */
+    int                 fresh;      /* a new stream began there */
+    int64_t             end;        /* bit offset it stopped at */
+    int                 end_fresh;  /* a new gzip member begins there */
+    int                 last;       /* no more data after it */
+    uint16_t           *data;
+    int64_t             len;
+} peepfs_inflate_chunk_t;
+
+/*
+ * Decode 'length' bytes of compressed data at 'base' in 'fd', from bit
+ * offset 'start' ('fresh' if a raw stream or gzip member begins there).
+ * With 'search', look for a place to begin instead, within 'search'
+ * bytes after byte start / 8.  Past 'max_out' output, the chunk stops
+ * at the next block boundary whatever the grid says.
+ */
+int peepfs_inflate_chunk(
+    int fd, int64_t base, int64_t length, int gzip, int64_t start, int fresh,
+    int64_t search, int64_t grid, int64_t max_out,
+    peepfs_inflate_chunk_t *chunk);
+
+/* The chunk's bytes, given the 32K 'window' before it (NULL if fresh) */
+void peepfs_inflate_resolve(
+    const peepfs_inflate_chunk_t *chunk, const unsigned char *window,
+    unsigned char *out);
+
+void peepfs_inflate_chunk_free(
+    peepfs_inflate_chunk_t *chunk);
+
+#endif
@@ -0,0 +1,983 @@
+#include "peepfs_archive.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <pthread.h>
+
+#include "uthash.h"
+
+#define MIN(x,y) ((x) < (y) ? (x) : (y))
+
+#define ISO_SECTOR          2048
+#define ISO_VD_START        16
+#define ISO_VD_MAX          64
+#define ISO_MAX_DEPTH       128
+#define ISO_MAX_DIR         (16*1024*1024)
+#define ISO_MAX_CE          16
+
+#define ISO_VD_PRIMARY      1
+#define ISO_VD_SUPPLEMENTARY 2
+#define ISO_VD_TERMINATOR   255
+
+#define ISO_FLAG_DIR        0x02
+#define ISO_FLAG_ASSOC      0x04
+#define ISO_FLAG_MULTI      0x80
+
+/*
+ * Native reader for ISO9660 images, with Joliet and Rock Ridge names.
+ *
+ * Every file on an ISO is one or more contiguous extents, so once the
+ * directory records have been walked (on first use, and only they are
+ * read) a file read is a plain pread() into the image.  Rock Ridge
+ * names win over Joliet, which win over the 8.3 names.  Anything the
+ * walk can't represent, like zisofs compressed files or interleaving,
+ * hands the whole image over to libarchive.
+ */
+
+extern peepfs_archive_ops_t libarchive_ops;
+
+typedef struct iso_extent {
+    int64_t             offset;
+    int64_t             len;
+} iso_extent_t;
+
+typedef struct iso_entry {
+    const char         *name;
+    int64_t             index;
+    int64_t             size;
+    uint64_t            flags;
+    iso_extent_t       *extents;
+    int                 num_extents;
+    UT_hash_handle      hh;
+} iso_entry_t;
+
+/* Directories already walked, so relocations can't loop us */
+typedef struct iso_seen {
+    int64_t             offset;
+    UT_hash_handle      hh;
+} iso_seen_t;
+
+typedef struct iso_archive {
+    const char         *filename;
+    int                 fd;
+    int64_t             block_size;
+    int64_t             root_offset;
+    int64_t             root_size;
+    int                 joliet;     /* names are UCS-2 */
+    int                 rockridge;  /* names come from NM entries */
+    int                 susp_skip;
+    pthread_mutex_t     lock;
+    int                 loaded;
+    int                 error;
+    void               *fallback;
+    iso_entry_t        *entries;
+    int64_t             num_entries;
+    int64_t             max_entries;
+    iso_entry_t        *hash;
+    iso_seen_t         *seen;
+} iso_archive_t;
+
+typedef struct iso_file {
+    iso_extent_t       *extents;
+    int                 num_extents;
+    int64_t             size;
+} iso_file_t;
+
+/* What we could make out of one directory record */
+typedef struct iso_record {
+    int64_t             offset;
+    int64_t             size;
+    int                 flags;
+    char                name[NAME_MAX+1];
+    int                 symlink;
+    int                 relocated;  /* RE, shows up again through a CL */
+    int64_t             child;      /* CL, the directory really lives here */
+} iso_record_t;
+
+static inline uint32_t
+__peepfs_iso_le32(const unsigned char *p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+           ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline uint16_t
+__peepfs_iso_le16(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+/* Joliet names are UCS-2 big endian (really UTF-16), we want UTF-8 */
+static void
+__peepfs_iso_ucs2(const unsigned char *in, int len, char *out, int outlen)
+{
+    uint32_t    c, lo;
+    int         i, n = 0;
+
+    for (i = 0; i + 1 < len; i += 2) {
+
+        c = (in[i] << 8) | in[i+1];
+
+        if (c >= 0xd800 && c < 0xdc00 && i + 3 < len) {
+            lo = (in[i+2] << 8) | in[i+3];
+            if (lo >= 0xdc00 && lo < 0xe000) {
+                c = 0x10000 + ((c - 0xd800) << 10) + (lo - 0xdc00);
+                i += 2;
+            }
+        }
+
+        if (n + 4 >= outlen) {
+            break;
+        }
+
+        if (c < 0x80) {
+            out[n++] = c;
+        } else if (c < 0x800) {
+            out[n++] = 0xc0 | (c >> 6);
+            out[n++] = 0x80 | (c & 0x3f);
+        } else if (c < 0x10000) {
+            out[n++] = 0xe0 | (c >> 12);
+            out[n++] = 0x80 | ((c >> 6) & 0x3f);
+            out[n++] = 0x80 | (c & 0x3f);
+        } else {
+            out[n++] = 0xf0 | (c >> 18);
+            out[n++] = 0x80 | ((c >> 12) & 0x3f);
+            out[n++] = 0x80 | ((c >> 6) & 0x3f);
+            out[n++] = 0x80 | (c & 0x3f);
+        }
+    }
+
+    out[n] = '\0';
+}
+
+/* Drop the ";1" version, and the dot of an extensionless 8.3 name */
+static void
+__peepfs_iso_trim(char *name)
+{
+    char   *semi;
+    int     len;
+
+    semi = rindex(name, ';');
+
+    if (semi) {
+        *semi = '\0';
+    }
+
+    len = strlen(name);
+
+    if (len > 1 && name[len-1] == '.') {
+        name[len-1] = '\0';
+    }
+}
+
+/*
+ * Walk the System Use entries of a record (and any continuation areas
+ * they point to) for the Rock Ridge bits we care about.
+ */
+static int
+__peepfs_iso_susp(
+    iso_archive_t      *archive,
+    const unsigned char *area,
+    int                 len,
+    iso_record_t       *rec)
+{
+    unsigned char  *ce = NULL;
+    char            name[NAME_MAX+1];
+    int             pos = 0, elen, nlen = 0, hops = 0, error = 0;
+    int64_t         ce_offset = -1, ce_len = 0;
+
+    while (1) {
+
+        while (pos + 4 <= len) {
+
+            elen = area[pos+2];
+
+            if (elen < 4 || pos + elen > len) {
+                break;
+            }
+
+            if (area[pos] == 'N' && area[pos+1] == 'M' && elen >= 5) {
+
+                /* Flags for "." and "..", nothing to name */
+                if (!(area[pos+4] & 0x06) && nlen + elen - 5 <= NAME_MAX) {
+                    memcpy(name + nlen, area + pos + 5, elen - 5);
+                    nlen += elen - 5;
+                }
+
+            } else if (area[pos] == 'P' && area[pos+1] == 'X' && elen >= 12) {
+
+                rec->symlink = S_ISLNK(__peepfs_iso_le32(area + pos + 4));
+
+            } else if (area[pos] == 'R' && area[pos+1] == 'E') {
+
+                rec->relocated = 1;
+
+            } else if (area[pos] == 'C' && area[pos+1] == 'L' && elen >= 12) {
+
+                rec->child = (int64_t)__peepfs_iso_le32(area + pos + 4) *
+                             archive->block_size;
+
+            } else if (area[pos] == 'C' && area[pos+1] == 'E' && elen >= 28) {
+
+                ce_offset = (int64_t)__peepfs_iso_le32(area + pos + 4) *
+                            archive->block_size + __peepfs_iso_le32(area + pos + 12);
+                ce_len    = __peepfs_iso_le32(area + pos + 20);
+
+            } else if (area[pos] == 'Z' && area[pos+1] == 'F') {
+
+                /* zisofs, the data on disk isn't the file */
+                error = -1;
+                goto out;
+
+            } else if (area[pos] == 'S' && area[pos+1] == 'T') {
+
+                break;
+            }
+
+            pos += elen;
+        }
+
+        if (ce_offset < 0 || ++hops > ISO_MAX_CE || ce_len > ISO_SECTOR) {
+            break;
+        }
+
+        free(ce);
+
+        ce = (unsigned char*)malloc(ce_len);
+
+        if (ce == NULL ||
+            pread(archive->fd, ce, ce_len, ce_offset) != ce_len) {
+            error = -1;
+            goto out;
+        }
+
+        area      = ce;
+        len       = ce_len;
+        pos       = 0;
+        ce_offset = -1;
+    }
+
+    if (nlen) {
+        memcpy(rec->name, name, nlen);
+        rec->name[nlen] = '\0';
+    }
+
+out:
+
+    free(ce);
+
+    return error;
+}
+
+/*
+ * Make sense of the directory record at 'dr'.  Returns 1 for "." and
+ * "..", 0 for a record worth keeping, -1 if we can't represent it.
+ */
+static int
+__peepfs_iso_record(
+    iso_archive_t      *archive,
+    const unsigned char *dr,
+    iso_record_t       *rec)
+{
+    int     len, name_len, su;
+
+    len      = dr[0];
+    name_len = dr[32];
+
+    if (33 + name_len > len) {
+        return -1;
+    }
+
+    if (name_len == 1 && (dr[33] == 0 || dr[33] == 1)) {
+        return 1;
+    }
+
+    /* Interleaved files don't live in one place */
+    if (dr[26] || dr[27]) {
+        return -1;
+    }
+
+    memset(rec, 0, sizeof(*rec));
+
+    rec->offset = ((int64_t)__peepfs_iso_le32(dr + 2) + dr[1]) *
+                  archive->block_size;
+    rec->size   = __peepfs_iso_le32(dr + 10);
+    rec->flags  = dr[25];
+    rec->child  = -1;
+
+    if (archive->joliet) {
+        __peepfs_iso_ucs2(dr + 33, name_len, rec->name, sizeof(rec->name));
+    } else {
+        memcpy(rec->name, dr + 33, name_len);
+        rec->name[name_len] = '\0';
+    }
+
+    __peepfs_iso_trim(rec->name);
+
+    if (archive->rockridge) {
+
+        su = 33 + name_len + !(name_len & 1) + archive->susp_skip;
+
+        if (su < len &&
+            __peepfs_iso_susp(archive, dr + su, len - su, rec)) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static iso_entry_t *
+__peepfs_iso_add_entry(iso_archive_t *archive)
+{
+    iso_entry_t *entries;
+
+    if (archive->num_entries == archive->max_entries) {
+
+        entries = (iso_entry_t*)realloc(archive->entries,
+            (archive->max_entries * 2 + 64) * sizeof(iso_entry_t));
+
+        if (entries == NULL) {
+            return NULL;
+        }
+
+        archive->entries = entries;
+        archive->max_entries = archive->max_entries * 2 + 64;
+    }
+
+    entries = &archive->entries[archive->num_entries];
+
+    memset(entries, 0, sizeof(*entries));
+
+    entries->index = archive->num_entries++;
+
+    return entries;
+}
+
+static int
+__peepfs_iso_add_extent(
+    iso_entry_t    *entry,
+    int64_t         offset,
+    int64_t         len)
+{
+    iso_extent_t *extents;
+
+    extents = (iso_extent_t*)realloc(entry->extents,
+        (entry->num_extents + 1) * sizeof(iso_extent_t));
+
+    if (extents == NULL) {
+        return -1;
+    }
+
+    extents[entry->num_extents].offset = offset;
+    extents[entry->num_extents].len    = len;
+
+    entry->extents = extents;
+    entry->num_extents++;
+    entry->size += len;
+
+    return 0;
+}
+
+/* The size of a directory is in its own "." record */
+static int64_t
+__peepfs_iso_dir_size(iso_archive_t *archive, int64_t offset)
+{
+    unsigned char dr[34];
+
+    if (pread(archive->fd, dr, sizeof(dr), offset) != sizeof(dr) ||
+        dr[0] < 34) {
+        return -1;
+    }
+
+    return __peepfs_iso_le32(dr + 10);
+}
+
+/* Walk the directory at 'offset', adding everything under 'path' */
+static int
+__peepfs_iso_walk(
+    iso_archive_t  *archive,
+    const char     *path,
+    int64_t         offset,
+    int64_t         size,
+    int             depth)
+{
+    unsigned char  *dir = NULL;
+    iso_record_t    rec;
+    iso_entry_t    *entry = NULL;
+    iso_seen_t     *seen;
+    char            name[PATH_MAX];
+    int64_t         pos, child, child_size;
+    int             error = 0, ret;
+
+    if (depth > ISO_MAX_DEPTH || size < 0 || size > ISO_MAX_DIR) {
+        return -1;
+    }
+
+    HASH_FIND(hh, archive->seen, &offset, sizeof(offset), seen);
+
+    if (seen) {
+        return 0;
+    }
+
+    seen = (iso_seen_t*)calloc(1,sizeof(iso_seen_t));
+
+    if (seen == NULL) {
+        return -1;
+    }
+
+    seen->offset = offset;
+
+    HASH_ADD(hh, archive->seen, offset, sizeof(seen->offset), seen);
+
+    dir = (unsigned char*)malloc(size + 1);
+
+    if (dir == NULL || pread(archive->fd, dir, size, offset) != size) {
+        error = -1;
+        goto out;
+    }
+
+    pos = 0;
+
+    while (pos < size) {
+
+        /* Records never straddle a sector, the rest of one is padding */
+        if (dir[pos] == 0) {
+            pos = (pos / ISO_SECTOR + 1) * ISO_SECTOR;
+            continue;
+        }
+
+        if (dir[pos] < 34 || pos + dir[pos] > size) {
+            error = -1;
+            goto out;
+        }
+
+        ret = __peepfs_iso_record(archive, dir + pos, &rec);
+
+        pos += dir[pos];
+
+        if (ret < 0) {
+            error = -1;
+            goto out;
+        }
+
+        if (ret > 0 || rec.relocated || (rec.flags & ISO_FLAG_ASSOC)) {
+            continue;
+        }
+
+        /* More extents of a file we already started */
+        if (entry) {
+
+            if (__peepfs_iso_add_extent(entry, rec.offset, rec.size)) {
+                error = -1;
+                goto out;
+            }
+
+            if (!(rec.flags & ISO_FLAG_MULTI)) {
+                entry = NULL;
+            }
+
+            continue;
+        }
+
+        if (rec.name[0] == '\0' || index(rec.name, '/') ||
+            strcmp(rec.name, ".") == 0 || strcmp(rec.name, "..") == 0) {
+            continue;
+        }
+
+        if (path[0]) {
+            snprintf(name, sizeof(name), "%s/%s", path, rec.name);
+        } else {
+            snprintf(name, sizeof(name), "%s", rec.name);
+        }
+
+        entry = __peepfs_iso_add_entry(archive);
+
+        if (entry == NULL) {
+            error = -1;
+            goto out;
+        }
+
+        entry->name  = strdup(name);
+        entry->flags = PEEPFS_FLAG_SEEKABLE;
+
+        if (entry->name == NULL) {
+            archive->num_entries--;
+            error = -1;
+            goto out;
+        }
+
+        if (rec.child >= 0 || (rec.flags & ISO_FLAG_DIR)) {
+
+            entry->flags |= PEEPFS_FLAG_DIR;
+            entry = NULL;
+
+            child      = rec.child >= 0 ? rec.child : rec.offset;
+            child_size = rec.child >= 0 ? __peepfs_iso_dir_size(archive, child)
+                                        : rec.size;
+
+            /* Entries may move when the table grows, go by name */
+            if (__peepfs_iso_walk(archive, name, child, child_size, depth + 1)) {
+                error = -1;
+                goto out;
+            }
+
+            continue;
+        }
+
+        if (!rec.symlink &&
+            __peepfs_iso_add_extent(entry, rec.offset, rec.size)) {
+            error = -1;
+            goto out;
+        }
+
+        if (rec.symlink || !(rec.flags & ISO_FLAG_MULTI)) {
+            entry = NULL;
+        }
+    }
+
+out:
+
+    free(dir);
+
+    return error;
+}
+
+/* Walk the whole tree from the root down, building the entry table */
+static int
+__peepfs_iso_load(iso_archive_t *archive)
+{
+    iso_entry_t    *entry, *target;
+    int64_t         i;
+
+    if (__peepfs_iso_walk(archive, "", archive->root_offset,
+                          archive->root_size, 0)) {
+        return -1;
+    }
+
+    /* Later entries replace earlier ones of the same name */
+    for (i = 0; i < archive->num_entries; ++i) {
+        entry = &archive->entries[i];
+        HASH_FIND_STR(archive->hash, entry->name, target);
+        if (target) {
+            HASH_DEL(archive->hash, target);
+        }
+        HASH_ADD_KEYPTR(hh, archive->hash, entry->name, strlen(entry->name), entry);
+    }
+
+    return 0;
+}
+
+static void
+__peepfs_iso_free_entries(iso_archive_t *archive)
+{
+    iso_seen_t *seen, *tmp;
+    int64_t     i;
+
+    HASH_CLEAR(hh, archive->hash);
+
+    HASH_ITER(hh, archive->seen, seen, tmp) {
+        HASH_DEL(archive->seen, seen);
+        free(seen);
+    }
+
+    for (i = 0; i < archive->num_entries; ++i) {
+        free((void*)archive->entries[i].name);
+        free(archive->entries[i].extents);
+    }
+
+    free(archive->entries);
+
+    archive->entries     = NULL;
+    archive->num_entries = 0;
+    archive->max_entries = 0;
+}
+
+/*
+ * Walk the image on first use.  If we can't represent it, libarchive
+ * gets it instead and every op is passed through from then on.
+ */
+
+static int
+__peepfs_iso_ready(iso_archive_t *archive)
+{
+    int error;
+
+    pthread_mutex_lock(&archive->lock);
+
+    if (!archive->loaded) {
+
+        archive->error = __peepfs_iso_load(archive);
+
+        if (archive->error) {
+
+            __peepfs_iso_free_entries(archive);
+
+            archive->fallback = libarchive_ops.open(archive->filename);
+
+            if (archive->fallback) {
+                archive->error = 0;
+            }
+        }
+
+        archive->loaded = 1;
+    }
+
+    error = archive->error;
+
+    pthread_mutex_unlock(&archive->lock);
+
+    return error;
+}
+
+/* See if the root directory says Rock Ridge, through its SP entry */
+static void
+__peepfs_iso_probe_rockridge(iso_archive_t *archive)
+{
+    unsigned char   dr[255];
+    int             su;
+
+    if (pread(archive->fd, dr, sizeof(dr), archive->root_offset) != sizeof(dr) ||
+        dr[0] < 34 || dr[32] != 1) {
+        return;
+    }
+
+    /* The root's one byte identifier is odd length, so no pad byte */
+    su = 33 + dr[32] + !(dr[32] & 1);
+
+    if (su + 7 <= dr[0] &&
+        dr[su] == 'S' && dr[su+1] == 'P' && dr[su+2] >= 7 &&
+        dr[su+4] == 0xbe && dr[su+5] == 0xef) {
+
+        archive->rockridge = 1;
+        archive->susp_skip = dr[su+6];
+    }
+}
+
+/* Pick the volume descriptor whose names we'll use */
+static int
+__peepfs_iso_volume(iso_archive_t *archive)
+{
+    unsigned char   vd[ISO_SECTOR], pvd[ISO_SECTOR], svd[ISO_SECTOR];
+    int             i, have_pvd = 0, have_svd = 0;
+
+    for (i = 0; i < ISO_VD_MAX; ++i) {
+
+        if (pread(archive->fd, vd, sizeof(vd),
+                  (int64_t)(ISO_VD_START + i) * ISO_SECTOR) != sizeof(vd) ||
+            memcmp(vd + 1, "CD001", 5)) {
+            break;
+        }
+
+        if (vd[0] == ISO_VD_TERMINATOR) {
+            break;
+        }
+
+        if (vd[0] == ISO_VD_PRIMARY && !have_pvd) {
+            memcpy(pvd, vd, sizeof(pvd));
+            have_pvd = 1;
+        }
+
+        /* Joliet is a supplementary descriptor with a UCS-2 escape */
+        if (vd[0] == ISO_VD_SUPPLEMENTARY && !have_svd &&
+            vd[88] == '%' && vd[89] == '/' &&
+            (vd[90] == '@' || vd[90] == 'C' || vd[90] == 'E')) {
+            memcpy(svd, vd, sizeof(svd));
+            have_svd = 1;
+        }
+    }
+
+    if (!have_pvd) {
+        return -1;
+    }
+
+    archive->block_size  = __peepfs_iso_le16(pvd + 128);
+
+    if (archive->block_size == 0) {
+        return -1;
+    }
+
+    archive->root_offset = (int64_t)__peepfs_iso_le32(pvd + 156 + 2) *
+                           archive->block_size;
+    archive->root_size   = __peepfs_iso_le32(pvd + 156 + 10);
+
+    __peepfs_iso_probe_rockridge(archive);
+
+    if (!archive->rockridge && have_svd) {
+        archive->joliet      = 1;
+        archive->root_offset = (int64_t)__peepfs_iso_le32(svd + 156 + 2) *
+                               archive->block_size;
+        archive->root_size   = __peepfs_iso_le32(svd + 156 + 10);
+    }
+
+    return 0;
+}
+
+void peepfs_iso_close(void *plugin_data);
+
+void *
+peepfs_iso_open(const char *filename)
+{
+    iso_archive_t *archive;
+
+    archive = (iso_archive_t*)calloc(1,sizeof(iso_archive_t));
+
+    if (archive == NULL) {
+        return NULL;
+    }
+
+    pthread_mutex_init(&archive->lock, NULL);
+
+    archive->filename = strdup(filename);
+    archive->fd       = open(filename, O_RDONLY);
+
+    if (archive->fd < 0 || __peepfs_iso_volume(archive)) {
+        goto fail;
+    }
+
+    return archive;
+
+fail:
+
+    peepfs_iso_close(archive);
+
+    return NULL;
+}
+
+void
+peepfs_iso_close(void *plugin_data)
+{
+    iso_archive_t *archive = (iso_archive_t*)plugin_data;
+
+    __peepfs_iso_free_entries(archive);
+
+    if (archive->fallback) {
+        libarchive_ops.close(archive->fallback);
+    }
+
+    if (archive->fd >= 0) {
+        close(archive->fd);
+    }
+
+    pthread_mutex_destroy(&archive->lock);
+
+    free((void*)archive->filename);
+    free(archive);
+}
+
+int
+peepfs_iso_enumerate(
+    void *plugin_data,
+    peepfs_archive_enum_callback_t enum_callback,
+    void *arg)
+{
+    iso_archive_t          *archive = (iso_archive_t*)plugin_data;
+    iso_entry_t            *ie;
+    peepfs_archive_entry_t  entry;
+    int64_t                 i;
+
+    if (__peepfs_iso_ready(archive)) {
+        return -1;
+    }
+
+    if (archive->fallback) {
+        return libarchive_ops.enumerate(archive->fallback, enum_callback, arg);
+    }
+
+    for (i = 0; i < archive->num_entries; ++i) {
+
+        ie = &archive->entries[i];
+
+        entry.index = ie->index;
+        entry.size  = ie->size;
+        entry.flags = ie->flags;
+
+        if (enum_callback(ie->name, &entry, arg) < 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int
+peepfs_iso_entry_open(
+    void                   *plugin_data,
+    const char             *name,
+    peepfs_archive_entry_t *entry)
+{
+    iso_archive_t  *archive = (iso_archive_t*)plugin_data;
+    iso_entry_t    *ie;
+
+    if (__peepfs_iso_ready(archive)) {
+        return -1;
+    }
+
+    if (archive->fallback) {
+        return libarchive_ops.entry_open(archive->fallback, name, entry);
+    }
+
+    HASH_FIND_STR(archive->hash, name, ie);
+
+    if (ie == NULL) {
+        return -1;
+    }
+
+    entry->index = ie->index;
+    entry->size  = ie->size;
+    entry->flags = ie->flags;
+
+    return 0;
+}
+
+void *
+peepfs_iso_file_open(
+    void *plugin_data,
+    peepfs_archive_entry_t *entry)
+{
+    iso_archive_t  *archive = (iso_archive_t*)plugin_data;
+    iso_file_t     *file;
+    iso_entry_t    *ie;
+
+    if (__peepfs_iso_ready(archive)) {
+        return NULL;
+    }
+
+    if (archive->fallback) {
+        return libarchive_ops.file_open(archive->fallback, entry);
+    }
+
+    if (entry->index < 0 || entry->index >= archive->num_entries) {
+        return NULL;
+    }
+
+    ie = &archive->entries[entry->index];
+
+    file = (iso_file_t*)calloc(1,sizeof(iso_file_t));
+
+    if (file == NULL) {
+        return NULL;
+    }
+
+    /* The entry table never changes once loaded, we can point into it */
+    file->extents     = ie->extents;
+    file->num_extents = ie->num_extents;
+    file->size        = ie->size;
+
+    return file;
+}
+
+void
+peepfs_iso_file_close(
+    void *plugin_data,
+    void *file_data)
+{
+    iso_archive_t  *archive = (iso_archive_t*)plugin_data;
+
+    if (archive->fallback) {
+        libarchive_ops.file_close(archive->fallback, file_data);
+        return;
+    }
+
+    free(file_data);
+}
+
+ssize_t
+peepfs_iso_file_read(
+    void                   *plugin_data,
+    void                   *file_data,
+    void                   *buffer,
+    size_t                  offset,
+    size_t                  size)
+{
+    iso_archive_t  *archive = (iso_archive_t*)plugin_data;
+    iso_file_t     *file  = (iso_file_t*)file_data;
+    iso_extent_t   *ext;
+    int64_t         start = 0, copied = 0, len;
+    ssize_t         rlen;
+    int             i;
+
+    if (archive->fallback) {
+        return libarchive_ops.file_read(archive->fallback, file_data,
+            buffer, offset, size);
+    }
+
+    if (offset >= file->size) {
+        return 0;
+    }
+
+    size = MIN(size, file->size - offset);
+
+    /* Almost always one extent, only huge files are split up */
+    for (i = 0; i < file->num_extents && copied < size; ++i) {
+
+        ext = &file->extents[i];
+
+        if (offset + copied < start + ext->len) {
+
+            len  = MIN(size - copied, start + ext->len - (offset + copied));
+            rlen = pread(archive->fd, (char*)buffer + copied, len,
+                         ext->offset + (offset + copied - start));
+
+            if (rlen < 0) {
+                return copied ? copied : -1;
+            }
+
+            copied += rlen;
+
+            if (rlen < len) {
+                break;
+            }
+        }
+
+        start += ext->len;
+    }
+
+    return copied;
+}
+
+/* Split files have no single place to point at */
+int
+peepfs_iso_extent(
+    void                   *plugin_data,
+    peepfs_archive_entry_t *entry,
+    int64_t                *offset)
+{
+    iso_archive_t  *archive = (iso_archive_t*)plugin_data;
+    iso_entry_t    *ie;
+
+    if (__peepfs_iso_ready(archive) || archive->fallback) {
+        return -1;
+    }
+
+    if (entry->index < 0 || entry->index >= archive->num_entries) {
+        return -1;
+    }
+
+    ie = &archive->entries[entry->index];
+
+    if ((ie->flags & PEEPFS_FLAG_DIR) || ie->num_extents != 1 ||
+        ie->extents[0].len < ie->size) {
+        return -1;
+    }
+
+    *offset = ie->extents[0].offset;
+
+    return 0;
+}
+
+peepfs_archive_ops_t iso_ops = {
+    .open           = peepfs_iso_open,
+    .close          = peepfs_iso_close,
+    .enumerate      = peepfs_iso_enumerate,
+    .entry_open     = peepfs_iso_entry_open,
+    .file_open      = peepfs_iso_file_open,
+    .file_close     = peepfs_iso_file_close,
+    .file_read      = peepfs_iso_file_read,
+    .extent         = peepfs_iso_extent
+};
@@ -0,0 +1,1544 @@
+#include "peepfs_archive.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <zlib.h>
+
+#include "peepfs_zran.h"
+#include "uthash.h"
+
+#define MIN(x,y) ((x) < (y) ? (x) : (y))
+#define MAX(x,y) ((x) > (y) ? (x) : (y))
+
+#define LAYER_CHUNK             65536
+#define LAYER_WINSIZE           32768
+#define LAYER_BLOCK_SIZE        512
+
+#define LAYER_FOOTER_LEN        51
+#define LAYER_LEGACY_FOOTER_LEN 47
+#define LAYER_TOC_NAME          "stargz.index.json"
+#define LAYER_TOC_MAX           (256*1024*1024)
+
+#define LAYER_ZTOC_SUFFIX       ".ztoc"
+#define LAYER_ZTOC_MAX          (256*1024*1024)
+
+/* Field numbers from the SOCI zTOC flatbuffers schema */
+#define ZTOC_COMPRESSED_SIZE    2
+#define ZTOC_UNCOMPRESSED_SIZE  3
+#define ZTOC_TOC                4
+#define ZTOC_COMPRESSION_INFO   5
+#define ZTOC_TOC_METADATA       0
+#define ZTOC_FILE_NAME          0
+#define ZTOC_FILE_TYPE          1
+#define ZTOC_FILE_OFFSET        2
+#define ZTOC_FILE_SIZE          3
+#define ZTOC_FILE_LINKNAME      4
+#define ZTOC_INFO_CHECKPOINTS   2
+#define ZTOC_INFO_ALGORITHM     3
+
+/*
+ * Container image layers (gzipped tars) that come with their own index,
+ * so nothing has to be decompressed to list them or to find a file.
+ *
+ * An eStargz layer starts every file's data in a fresh gzip member and
+ * ends with a table of contents (stargz.index.json, itself a gzipped
+ * tar) whose offset is in a footer.  The TOC gives each file's size and
+ * the member offset of each of its chunks, so a read inflates just the
+ * chunk it lands in.
+ *
+ * A layer with a SOCI zTOC next to it (foo.tar.gz and foo.tar.gz.ztoc)
+ * is an ordinary gzipped tar; the zTOC lists every file's offset in
+ * the uncompressed tar and carries gzip checkpoints, which go straight
+ * into a zran index.
+ *
+ * Anything else, or a TOC that doesn't add up, is left to the tar
+ * backend.
+ */
+
+typedef struct layer_chunk {
+    int64_t             in;         /* gzip member the chunk lives in */
+    int64_t             out;        /* where it starts in the file */
+    int64_t             inner;      /* bytes before it in the member */
+} layer_chunk_t;
+
+typedef struct layer_entry {
+    const char         *name;
+    int64_t             index;
+    int64_t             size;
+    uint64_t            flags;
+    int64_t             data_offset;    /* zTOC, in the uncompressed tar */
+    layer_chunk_t      *chunks;         /* eStargz */
+    int64_t             num_chunks;
+    UT_hash_handle      hh;
+} layer_entry_t;
+
+typedef struct layer_archive {
+    int                 fd;
+    int64_t             length;
+    peepfs_zran_t      *zran;           /* zTOC only */
+    layer_entry_t      *entries;
+    int64_t             num_entries;
+    int64_t             max_entries;
+    layer_entry_t      *hash;
+} layer_archive_t;
+
+typedef struct layer_file {
+    layer_entry_t          *entry;
+    pthread_mutex_t         lock;
+    peepfs_zran_cursor_t   *cursor;     /* zTOC */
+    z_stream                strm;       /* eStargz, inflating 'chunk' */
+    int                     active;
+    int64_t                 chunk;
+    int64_t                 in;         /* next compressed byte to load */
+    int64_t                 pos;        /* file offset of the next byte out */
+    unsigned char           input[LAYER_CHUNK];
+    unsigned char           output[LAYER_CHUNK];
+} layer_file_t;
+
+typedef struct layer_json {
+    const char         *p;
+    const char         *end;
+} layer_json_t;
+
+typedef struct layer_fb {
+    const unsigned char *buf;
+    int64_t              len;
+} layer_fb_t;
+
+static inline uint32_t
+__peepfs_layer_le16(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static inline uint32_t
+__peepfs_layer_le32(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline uint64_t
+__peepfs_layer_le64(const unsigned char *p)
+{
+    return __peepfs_layer_le32(p) | ((uint64_t)__peepfs_layer_le32(p + 4) << 32);
+}
+
+/* Strip leading "./" and trailing "/" the way the other backends do */
+static char *
+__peepfs_layer_normalize(char *name)
+{
+    char   *p = name;
+    int     len;
+
+    while (p[0] == '.' && p[1] == '/') {
+        p += 2;
+        while (*p == '/') ++p;
+    }
+
+    len = strlen(p);
+
+    while (len && p[len-1] == '/') {
+        p[--len] = '\0';
+    }
+
+    if (p != name) {
+        memmove(name, p, len + 1);
+    }
+
+    return name;
+}
+
+static layer_entry_t *
+__peepfs_layer_add_entry(layer_archive_t *archive)
+{
+    layer_entry_t *entries;
+
+    if (archive->num_entries == archive->max_entries) {
+
+        entries = (layer_entry_t*)realloc(archive->entries,
+            (archive->max_entries * 2 + 64) * sizeof(layer_entry_t));
+
+        if (entries == NULL) {
+            return NULL;
+        }
+
+        archive->entries = entries;
+        archive->max_entries = archive->max_entries * 2 + 64;
+    }
+
+    entries = &archive->entries[archive->num_entries];
+
+    memset(entries, 0, sizeof(*entries));
+
+    entries->index = archive->num_entries++;
+
+    return entries;
+}
+
+static inline int64_t
+__peepfs_layer_chunk_room(int64_t num)
+{
+    int64_t room = 1;
+
+    while (room < num) {
+        room *= 2;
+    }
+
+    return room;
+}
+
+static int
+__peepfs_layer_add_chunk(
+    layer_entry_t  *entry,
+    int64_t         in,
+    int64_t         out,
+    int64_t         inner)
+{
+    layer_chunk_t *chunks;
+
+    /* Powers of two, so the size is implied by the count */
+    if ((entry->num_chunks & (entry->num_chunks - 1)) == 0) {
+
+        chunks = (layer_chunk_t*)realloc(entry->chunks,
+            MAX(entry->num_chunks * 2, 1) * sizeof(layer_chunk_t));
+
+        if (chunks == NULL) {
+            return -1;
+        }
+
+        entry->chunks = chunks;
+    }
+
+    entry->chunks[entry->num_chunks].in    = in;
+    entry->chunks[entry->num_chunks].out   = out;
+    entry->chunks[entry->num_chunks].inner = inner;
+
+    entry->num_chunks++;
+
+    return 0;
+}
+
+/*
+ * Fill in an entry from its type, the same way the tar backend would:
+ * links and devices show up as empty files, a hard link as a copy of
+ * its target.
+ */
+static int
+__peepfs_layer_typed_entry(
+    layer_archive_t    *archive,
+    layer_entry_t      *entry,
+    const char         *type,
+    const char         *link,
+    int64_t             size)
+{
+    layer_entry_t  *target;
+    int64_t         i;
+
+    entry->flags = PEEPFS_FLAG_SEEKABLE;
+
+    if (strcmp(type, "dir") == 0) {
+
+        entry->flags |= PEEPFS_FLAG_DIR;
+
+    } else if (strcmp(type, "reg") == 0) {
+
+        entry->size = size;
+
+    } else if (strcmp(type, "hardlink") == 0 && link) {
+
+        __peepfs_layer_normalize((char*)link);
+
+        for (i = entry->index - 1; i >= 0; --i) {
+
+            target = &archive->entries[i];
+
+            if (strcmp(target->name, link) == 0) {
+
+                entry->size        = target->size;
+                entry->flags       = target->flags;
+                entry->data_offset = target->data_offset;
+
+                if (target->num_chunks) {
+
+                    /* Same power of two room the target has */
+                    entry->chunks = (layer_chunk_t*)malloc(
+                        __peepfs_layer_chunk_room(target->num_chunks) *
+                        sizeof(layer_chunk_t));
+
+                    if (entry->chunks == NULL) {
+                        return -1;
+                    }
+
+                    memcpy(entry->chunks, target->chunks,
+                        target->num_chunks * sizeof(layer_chunk_t));
+
+                    entry->num_chunks = target->num_chunks;
+                }
+
+                break;
+            }
+        }
+    }
+
+    return 0;
+}
+
+static void
+__peepfs_layer_json_ws(layer_json_t *j)
+{
+    while (j->p < j->end &&
+           (*j->p == ' ' || *j->p == '\t' || *j->p == '\n' || *j->p == '\r')) {
+        j->p++;
+    }
+}
+
+static int
+__peepfs_layer_json_char(layer_json_t *j, char c)
+{
+    __peepfs_layer_json_ws(j);
+
+    if (j->p < j->end && *j->p == c) {
+        j->p++;
+        return 0;
+    }
+
+    return -1;
+}
+
+static int
+__peepfs_layer_json_hex4(const char *p, uint32_t *cp)
+{
+    int i;
+
+    *cp = 0;
+
+    for (i = 0; i < 4; ++i) {
+
+        *cp <<= 4;
+
+        if (p[i] >= '0' && p[i] <= '9') {
+            *cp |= p[i] - '0';
+        } else if (p[i] >= 'a' && p[i] <= 'f') {
+            *cp |= p[i] - 'a' + 10;
+        } else if (p[i] >= 'A' && p[i] <= 'F') {
+            *cp |= p[i] - 'A' + 10;
+        } else {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* Parse a string, into a new buffer at 'out' unless that's NULL */
+static int
+__peepfs_layer_json_string(layer_json_t *j, char **out)
+{
+    const char *q;
+    char       *s = NULL;
+    uint32_t    cp, lo;
+    int         len = 0;
+    char        c;
+
+    __peepfs_layer_json_ws(j);
+
+    if (j->p >= j->end || *j->p != '"') {
+        return -1;
+    }
+
+    /* Escapes never decode to more than they take up */
+    for (q = ++j->p; q < j->end && *q != '"'; ++q) {
+        if (*q == '\\') {
+            ++q;
+        }
+    }
+
+    if (q >= j->end) {
+        return -1;
+    }
+
+    if (out) {
+
+        s = (char*)malloc(q - j->p + 1);
+
+        if (s == NULL) {
+            return -1;
+        }
+    }
+
+    while (j->p < q) {
+
+        c = *j->p++;
+
+        if (c == '\\') {
+
+            c = *j->p++;
+
+            switch (c) {
+            case 'b': c = '\b'; break;
+            case 'f': c = '\f'; break;
+            case 'n': c = '\n'; break;
+            case 'r': c = '\r'; break;
+            case 't': c = '\t'; break;
+            case '"': case '\\': case '/': break;
+            case 'u':
+
+                if (q - j->p < 4 || __peepfs_layer_json_hex4(j->p, &cp)) {
+                    goto fail;
+                }
+
+                j->p += 4;
+
+                /* A surrogate pair is one code point */
+                if (cp >= 0xd800 && cp < 0xdc00 && q - j->p >= 6 &&
+                    j->p[0] == '\\' && j->p[1] == 'u' &&
+                    __peepfs_layer_json_hex4(j->p + 2, &lo) == 0 &&
+                    lo >= 0xdc00 && lo < 0xe000) {
+                    cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+                    j->p += 6;
+                }
+
+                if (s == NULL) {
+                    continue;
+                }
+
+                if (cp < 0x80) {
+                    s[len++] = cp;
+                } else if (cp < 0x800) {
+                    s[len++] = 0xc0 | (cp >> 6);
+                    s[len++] = 0x80 | (cp & 0x3f);
+                } else if (cp < 0x10000) {
+                    s[len++] = 0xe0 | (cp >> 12);
+                    s[len++] = 0x80 | ((cp >> 6) & 0x3f);
+                    s[len++] = 0x80 | (cp & 0x3f);
+                } else {
+                    s[len++] = 0xf0 | (cp >> 18);
+                    s[len++] = 0x80 | ((cp >> 12) & 0x3f);
+                    s[len++] = 0x80 | ((cp >> 6) & 0x3f);
+                    s[len++] = 0x80 | (cp & 0x3f);
+                }
+
+                continue;
+
+            default:
+                goto fail;
+            }
+        }
+
+        if (s) {
+            s[len++] = c;
+        }
+    }
+
+    j->p = q + 1;
+
+    if (out) {
+        s[len] = '\0';
+        *out   = s;
+    }
+
+    return 0;
+
+fail:
+
+    free(s);
+
+    return -1;
+}
+
+/* Numbers we care about are all integers, any fraction is dropped */
+static int
+__peepfs_layer_json_number(layer_json_t *j, int64_t *out)
+{
+    char *end;
+
+    __peepfs_layer_json_ws(j);
+
+    *out = strtoll(j->p, &end, 10);
+
+    if (end == j->p) {
+        return -1;
+    }
+
+    j->p = end;
+
+    while (j->p < j->end && (*j->p == '.' || *j->p == 'e' || *j->p == 'E' ||
+           *j->p == '+' || *j->p == '-' || (*j->p >= '0' && *j->p <= '9'))) {
+        j->p++;
+    }
+
+    return 0;
+}
+
+/* Step over any value at all */
+static int
+__peepfs_layer_json_skip(layer_json_t *j, int depth)
+{
+    char close;
+
+    __peepfs_layer_json_ws(j);
+
+    if (j->p >= j->end || depth > 64) {
+        return -1;
+    }
+
+    if (*j->p == '"') {
+        return __peepfs_layer_json_string(j, NULL);
+    }
+
+    if (*j->p != '{' && *j->p != '[') {
+
+        while (j->p < j->end && !strchr(",}] \t\r\n", *j->p)) {
+            j->p++;
+        }
+
+        return 0;
+    }
+
+    close = *j->p++ == '{' ? '}' : ']';
+
+    if (__peepfs_layer_json_char(j, close) == 0) {
+        return 0;
+    }
+
+    do {
+        if (close == '}' && (__peepfs_layer_json_string(j, NULL) ||
+                             __peepfs_layer_json_char(j, ':'))) {
+            return -1;
+        }
+
+        if (__peepfs_layer_json_skip(j, depth + 1)) {
+            return -1;
+        }
+
+    } while (__peepfs_layer_json_char(j, ',') == 0);
+
+    return __peepfs_layer_json_char(j, close);
+}
+
+/* One object out of the TOC's "entries" */
+static int
+__peepfs_layer_toc_entry(layer_archive_t *archive, layer_json_t *j)
+{
+    layer_entry_t  *entry, *last;
+    char           *key = NULL, *name = NULL, *type = NULL, *link = NULL;
+    int64_t         size = 0, offset = -1, chunk_offset = 0, inner = 0;
+    int64_t        *number;
+    int             error = -1;
+
+    if (__peepfs_layer_json_char(j, '{')) {
+        return -1;
+    }
+
+    if (__peepfs_layer_json_char(j, '}') == 0) {
+        goto done;
+    }
+
+    do {
+        if (__peepfs_layer_json_string(j, &key) ||
+            __peepfs_layer_json_char(j, ':')) {
+            goto out;
+        }
+
+        number = NULL;
+
+        if (strcmp(key, "name") == 0 && name == NULL) {
+            error = __peepfs_layer_json_string(j, &name);
+        } else if (strcmp(key, "type") == 0 && type == NULL) {
+            error = __peepfs_layer_json_string(j, &type);
+        } else if (strcmp(key, "linkName") == 0 && link == NULL) {
+            error = __peepfs_layer_json_string(j, &link);
+        } else if (strcmp(key, "size") == 0) {
+            number = &size;
+        } else if (strcmp(key, "offset") == 0) {
+            number = &offset;
+        } else if (strcmp(key, "chunkOffset") == 0) {
+            number = &chunk_offset;
+        } else if (strcmp(key, "innerOffset") == 0) {
+            number = &inner;
+        } else {
+            error = __peepfs_layer_json_skip(j, 0);
+        }
+
+        if (number) {
+            error = __peepfs_layer_json_number(j, number);
+        }
+
+        free(key);
+        key = NULL;
+
+        if (error) {
+            goto out;
+        }
+
+        error = -1;
+
+    } while (__peepfs_layer_json_char(j, ',') == 0);
+
+    if (__peepfs_layer_json_char(j, '}')) {
+        goto out;
+    }
+
+done:
+
+    if (name == NULL || type == NULL) {
+        goto out;
+    }
+
+    __peepfs_layer_normalize(name);
+
+    /* More of the file before it, each chunk in a member of its own */
+    if (strcmp(type, "chunk") == 0) {
+
+        last = archive->num_entries ?
+            &archive->entries[archive->num_entries-1] : NULL;
+
+        if (last == NULL || strcmp(last->name, name) ||
+            last->num_chunks == 0 || offset < 0 ||
+            chunk_offset <= last->chunks[last->num_chunks-1].out) {
+            goto out;
+        }
+
+        error = __peepfs_layer_add_chunk(last, offset, chunk_offset, inner);
+
+        goto out;
+    }
+
+    /* The archive root itself, not worth an entry */
+    if (name[0] == '\0') {
+        error = 0;
+        goto out;
+    }
+
+    entry = __peepfs_layer_add_entry(archive);
+
+    if (entry == NULL) {
+        goto out;
+    }
+
+    entry->name = name;
+    name        = NULL;
+
+    if (__peepfs_layer_typed_entry(archive, entry, type, link, size)) {
+        goto out;
+    }
+
+    if (strcmp(type, "reg") == 0 && size > 0) {
+
+        if (offset < 0) {
+            goto out;
+        }
+
+        if (__peepfs_layer_add_chunk(entry, offset, 0, inner)) {
+            goto out;
+        }
+    }
+
+    error = 0;
+
+out:
+
+    free(key);
+    free(name);
+    free(type);
+    free(link);
+
+    return error;
+}
+
+static int
+__peepfs_layer_parse_toc(layer_archive_t *archive, layer_json_t *j)
+{
+    char   *key = NULL;
+    int     error;
+
+    if (__peepfs_layer_json_char(j, '{')) {
+        return -1;
+    }
+
+    if (__peepfs_layer_json_char(j, '}') == 0) {
+        return 0;
+    }
+
+    do {
+        if (__peepfs_layer_json_string(j, &key) ||
+            __peepfs_layer_json_char(j, ':')) {
+            free(key);
+            return -1;
+        }
+
+        if (strcmp(key, "entries") == 0) {
+
+            error = __peepfs_layer_json_char(j, '[');
+
+            if (error == 0 && __peepfs_layer_json_char(j, ']')) {
+                do {
+                    error = __peepfs_layer_toc_entry(archive, j);
+                } while (error == 0 && __peepfs_layer_json_char(j, ',') == 0);
+
+                error = error || __peepfs_layer_json_char(j, ']');
+            }
+
+        } else {
+            error = __peepfs_layer_json_skip(j, 0);
+        }
+
+        free(key);
+        key = NULL;
+
+        if (error) {
+            return -1;
+        }
+
+    } while (__peepfs_layer_json_char(j, ',') == 0);
+
+    return __peepfs_layer_json_char(j, '}');
+}
+
+/* Offset of the TOC, as 16 hex digits followed by STARGZ */
+static int64_t
+__peepfs_layer_footer_offset(const unsigned char *p)
+{
+    uint32_t    digit;
+    int64_t     offset = 0;
+    int         i;
+
+    if (memcmp(p + 16, "STARGZ", 6)) {
+        return -1;
+    }
+
+    for (i = 0; i < 16; i += 4) {
+
+        if (__peepfs_layer_json_hex4((const char*)p + i, &digit)) {
+            return -1;
+        }
+
+        offset = (offset << 16) | digit;
+    }
+
+    return offset;
+}
+
+/* The footer is an empty gzip member with the TOC offset in its extra field */
+static int64_t
+__peepfs_layer_footer(layer_archive_t *archive, int64_t *footer_len)
+{
+    unsigned char   footer[LAYER_FOOTER_LEN], *legacy;
+
+    if (archive->length < LAYER_FOOTER_LEN ||
+        pread(archive->fd, footer, sizeof(footer),
+              archive->length - sizeof(footer)) != sizeof(footer)) {
+        return -1;
+    }
+
+    /* eStargz: an "SG" subfield */
+    if (footer[0] == 0x1f && footer[1] == 0x8b && footer[2] == 8 &&
+        (footer[3] & 0x04) && __peepfs_layer_le16(footer + 10) == 26 &&
+        footer[12] == 'S' && footer[13] == 'G' &&
+        __peepfs_layer_le16(footer + 14) == 22) {
+        *footer_len = LAYER_FOOTER_LEN;
+        return __peepfs_layer_footer_offset(footer + 16);
+    }
+
+    /* Older stargz: the bare offset is the whole extra field */
+    legacy = footer + LAYER_FOOTER_LEN - LAYER_LEGACY_FOOTER_LEN;
+
+    if (legacy[0] == 0x1f && legacy[1] == 0x8b && legacy[2] == 8 &&
+        (legacy[3] & 0x04) && __peepfs_layer_le16(legacy + 10) == 22) {
+        *footer_len = LAYER_LEGACY_FOOTER_LEN;
+        return __peepfs_layer_footer_offset(legacy + 12);
+    }
+
+    return -1;
+}
+
+/* Inflate the gzip member at 'in', at most 'max' bytes of it */
+static char *
+__peepfs_layer_inflate(
+    layer_archive_t    *archive,
+    int64_t             in,
+    int64_t             end,
+    int64_t             max,
+    int64_t            *len)
+{
+    z_stream        strm;
+    unsigned char  *input;
+    char           *out = NULL, *grown;
+    int64_t         have = 0, size = LAYER_CHUNK;
+    ssize_t         rlen;
+    int             ret = Z_OK;
+
+    memset(&strm, 0, sizeof(strm));
+
+    input = (unsigned char*)malloc(LAYER_CHUNK);
+    out   = (char*)malloc(size + 1);
+
+    if (input == NULL || out == NULL || inflateInit2(&strm, 31) != Z_OK) {
+        free(input);
+        free(out);
+        return NULL;
+    }
+
+    while (ret != Z_STREAM_END) {
+
+        if (strm.avail_in == 0) {
+
+            rlen = pread(archive->fd, input, MIN(LAYER_CHUNK, end - in), in);
+
+            if (rlen <= 0) {
+                goto fail;
+            }
+
+            in            += rlen;
+            strm.next_in   = input;
+            strm.avail_in  = rlen;
+        }
+
+        if (have == size) {
+
+            if (size >= max) {
+                goto fail;
+            }
+
+            size  = MIN(size * 2, max);
+            grown = (char*)realloc(out, size + 1);
+
+            if (grown == NULL) {
+                goto fail;
+            }
+
+            out = grown;
+        }
+
+        strm.next_out  = (unsigned char*)out + have;
+        strm.avail_out = size - have;
+
+        ret = inflate(&strm, Z_NO_FLUSH);
+
+        if (ret != Z_OK && ret != Z_STREAM_END) {
+            goto fail;
+        }
+
+        have = size - strm.avail_out;
+    }
+
+    inflateEnd(&strm);
+    free(input);
+
+    out[have] = '\0';
+    *len      = have;
+
+    return out;
+
+fail:
+
+    inflateEnd(&strm);
+    free(input);
+    free(out);
+
+    return NULL;
+}
+
+static int
+__peepfs_layer_load_stargz(layer_archive_t *archive)
+{
+    layer_json_t    j;
+    layer_entry_t  *entry;
+    char           *toc;
+    int64_t         footer_len, toc_offset, len, size = 0, i, k;
+    int             error = -1;
+
+    toc_offset = __peepfs_layer_footer(archive, &footer_len);
+
+    if (toc_offset < 0 || toc_offset >= archive->length - footer_len) {
+        return -1;
+    }
+
+    /* The TOC is a one-entry tar of its own */
+    toc = __peepfs_layer_inflate(archive, toc_offset,
+        archive->length - footer_len, LAYER_TOC_MAX, &len);
+
+    if (toc == NULL) {
+        return -1;
+    }
+
+    if (len < LAYER_BLOCK_SIZE || strncmp(toc, LAYER_TOC_NAME, 100)) {
+        goto out;
+    }
+
+    for (i = 124; i < 136 && toc[i] >= '0' && toc[i] <= '7'; ++i) {
+        size = size * 8 + toc[i] - '0';
+    }
+
+    if (size > len - LAYER_BLOCK_SIZE) {
+        goto out;
+    }
+
+    j.p   = toc + LAYER_BLOCK_SIZE;
+    j.end = j.p + size;
+
+    if (__peepfs_layer_parse_toc(archive, &j)) {
+        goto out;
+    }
+
+    /* Every chunk has to be in the data before the TOC */
+    for (i = 0; i < archive->num_entries; ++i) {
+
+        entry = &archive->entries[i];
+
+        for (k = 0; k < entry->num_chunks; ++k) {
+            if (entry->chunks[k].in < 0 || entry->chunks[k].in >= toc_offset ||
+                entry->chunks[k].out >= entry->size) {
+                goto out;
+            }
+        }
+    }
+
+    error = 0;
+
+out:
+
+    free(toc);
+
+    return error;
+}
+
+/* Position of a field in the table at 'table', 0 if it isn't there */
+static int64_t
+__peepfs_layer_fb_field(const layer_fb_t *fb, int64_t table, int field)
+{
+    int64_t vtable, vtsize, off;
+
+    if (table <= 0 || table + 4 > fb->len) {
+        return 0;
+    }
+
+    vtable = table - (int32_t)__peepfs_layer_le32(fb->buf + table);
+
+    if (vtable < 0 || vtable + 4 > fb->len) {
+        return 0;
+    }
+
+    vtsize = __peepfs_layer_le16(fb->buf + vtable);
+
+    if (4 + 2 * field + 2 > vtsize || vtable + vtsize > fb->len) {
+        return 0;
+    }
+
+    off = __peepfs_layer_le16(fb->buf + vtable + 4 + 2 * field);
+
+    return off ? table + off : 0;
+}
+
+/* Follow the offset stored at 'pos' */
+static int64_t
+__peepfs_layer_fb_deref(const layer_fb_t *fb, int64_t pos)
+{
+    int64_t target;
+
+    if (pos <= 0 || pos + 4 > fb->len) {
+        return 0;
+    }
+
+    target = pos + __peepfs_layer_le32(fb->buf + pos);
+
+    return target < fb->len ? target : 0;
+}
+
+static int64_t
+__peepfs_layer_fb_long(const layer_fb_t *fb, int64_t table, int field)
+{
+    int64_t pos = __peepfs_layer_fb_field(fb, table, field);
+
+    if (pos == 0 || pos + 8 > fb->len) {
+        return 0;
+    }
+
+    return __peepfs_layer_le64(fb->buf + pos);
+}
+
+/* Length of a vector (or string) field, its data starts at 'data' */
+static int64_t
+__peepfs_layer_fb_vector(
+    const layer_fb_t   *fb,
+    int64_t             table,
+    int                 field,
+    int                 elem_size,
+    int64_t            *data)
+{
+    int64_t vec, num;
+
+    vec = __peepfs_layer_fb_deref(fb, __peepfs_layer_fb_field(fb, table, field));
+
+    if (vec == 0 || vec + 4 > fb->len) {
+        return -1;
+    }
+
+    num = __peepfs_layer_le32(fb->buf + vec);
+
+    if (vec + 4 + num * elem_size > fb->len) {
+        return -1;
+    }
+
+    *data = vec + 4;
+
+    return num;
+}
+
+static char *
+__peepfs_layer_fb_string(const layer_fb_t *fb, int64_t table, int field)
+{
+    int64_t data, len;
+
+    len = __peepfs_layer_fb_vector(fb, table, field, 1, &data);
+
+    if (len < 0) {
+        return NULL;
+    }
+
+    return strndup((const char*)fb->buf + data, len);
+}
+
+/*
+ * The checkpoints blob is a point count and span size, then for every
+ * point two offsets, the bit count and the 32K window before it.  Which
+ * offset comes first we tell from the first point, which always sits at
+ * the very start of the output.
+ */
+static void
+__peepfs_layer_checkpoints(
+    layer_archive_t        *archive,
+    const unsigned char    *p,
+    int64_t                 len)
+{
+    int64_t     num, point_len = 8 + 8 + 1 + LAYER_WINSIZE, in, out, i;
+    int         swap;
+
+    if (len < 12) {
+        return;
+    }
+
+    num = __peepfs_layer_le32(p);
+
+    if (num == 0 || 12 + num * point_len != len) {
+        return;
+    }
+
+    p += 12;
+
+    swap = __peepfs_layer_le64(p) != 0;
+
+    for (i = 0; i < num; ++i, p += point_len) {
+
+        out = __peepfs_layer_le64(p + (swap ? 8 : 0));
+        in  = __peepfs_layer_le64(p + (swap ? 0 : 8));
+
+        /* The start is a point already, and the rest go on in order */
+        if (out > 0 && peepfs_zran_import(archive->zran, in, out, p[16], p + 17)) {
+            return;
+        }
+    }
+}
+
+static int
+__peepfs_layer_load_ztoc(layer_archive_t *archive, const char *filename)
+{
+    layer_fb_t      fb = { NULL, 0 };
+    layer_entry_t  *entry;
+    unsigned char  *buf = NULL;
+    char            path[PATH_MAX], *name = NULL, *type = NULL, *link = NULL;
+    struct stat     st;
+    int64_t         root, toc, info, data, num, file, offset, size, total, i;
+    int             fd, error = -1;
+
+    snprintf(path, sizeof(path), "%s%s", filename, LAYER_ZTOC_SUFFIX);
+
+    fd = open(path, O_RDONLY);
+
+    if (fd < 0) {
+        return -1;
+    }
+
+    if (fstat(fd, &st) || st.st_size < 8 || st.st_size > LAYER_ZTOC_MAX) {
+        goto out;
+    }
+
+    buf = (unsigned char*)malloc(st.st_size);
+
+    if (buf == NULL || pread(fd, buf, st.st_size, 0) != st.st_size) {
+        goto out;
+    }
+
+    fb.buf = buf;
+    fb.len = st.st_size;
+
+    /* The root table's offset is the first thing in the buffer */
+    root = __peepfs_layer_le32(fb.buf);
+
+    /* A zTOC for some other layer, or this one before it changed */
+    if (__peepfs_layer_fb_long(&fb, root, ZTOC_COMPRESSED_SIZE) != archive->length) {
+        goto out;
+    }
+
+    total = __peepfs_layer_fb_long(&fb, root, ZTOC_UNCOMPRESSED_SIZE);
+
+    toc  = __peepfs_layer_fb_deref(&fb, __peepfs_layer_fb_field(&fb, root, ZTOC_TOC));
+    info = __peepfs_layer_fb_deref(&fb,
+        __peepfs_layer_fb_field(&fb, root, ZTOC_COMPRESSION_INFO));
+
+    if (toc == 0 || info == 0) {
+        goto out;
+    }
+
+    /* Only gzip (zero, the default) has checkpoints we can use */
+    i = __peepfs_layer_fb_field(&fb, info, ZTOC_INFO_ALGORITHM);
+
+    if (i && fb.buf[i] != 0) {
+        goto out;
+    }
+
+    num = __peepfs_layer_fb_vector(&fb, toc, ZTOC_TOC_METADATA, 4, &data);
+
+    if (num < 0) {
+        goto out;
+    }
+
+    for (i = 0; i < num; ++i) {
+
+        file = __peepfs_layer_fb_deref(&fb, data + 4 * i);
+
+        name   = __peepfs_layer_fb_string(&fb, file, ZTOC_FILE_NAME);
+        type   = __peepfs_layer_fb_string(&fb, file, ZTOC_FILE_TYPE);
+        link   = __peepfs_layer_fb_string(&fb, file, ZTOC_FILE_LINKNAME);
+        offset = __peepfs_layer_fb_long(&fb, file, ZTOC_FILE_OFFSET);
+        size   = __peepfs_layer_fb_long(&fb, file, ZTOC_FILE_SIZE);
+
+        if (name == NULL || type == NULL || offset < 0 || size < 0 ||
+            offset + size > total) {
+            goto out;
+        }
+
+        __peepfs_layer_normalize(name);
+
+        if (name[0]) {
+
+            entry = __peepfs_layer_add_entry(archive);
+
+            if (entry == NULL) {
+                goto out;
+            }
+
+            entry->name        = name;
+            entry->data_offset = offset;
+            name               = NULL;
+
+            if (__peepfs_layer_typed_entry(archive, entry, type, link, size)) {
+                goto out;
+            }
+        }
+
+        free(name);
+        free(type);
+        free(link);
+
+        name = type = link = NULL;
+    }
+
+    archive->zran = peepfs_zran_create(archive->fd, 0, archive->length,
+        PEEPFS_ZRAN_GZIP, 0);
+
+    if (archive->zran == NULL) {
+        goto out;
+    }
+
+    num = __peepfs_layer_fb_vector(&fb, info, ZTOC_INFO_CHECKPOINTS, 1, &data);
+
+    /* Without checkpoints the index just builds itself as usual */
+    if (num > 0) {
+        __peepfs_layer_checkpoints(archive, fb.buf + data, num);
+    }
+
+    error = 0;
+
+out:
+
+    free(name);
+    free(type);
+    free(link);
+    free(buf);
+
+    close(fd);
+
+    return error;
+}
+
+static void
+__peepfs_layer_free_entries(layer_archive_t *archive)
+{
+    int64_t i;
+
+    HASH_CLEAR(hh, archive->hash);
+
+    for (i = 0; i < archive->num_entries; ++i) {
+        free((void*)archive->entries[i].name);
+        free(archive->entries[i].chunks);
+    }
+
+    free(archive->entries);
+
+    archive->entries     = NULL;
+    archive->num_entries = 0;
+    archive->max_entries = 0;
+}
+
+void peepfs_layer_close(void *plugin_data);
+
+void *
+peepfs_layer_open(const char *filename)
+{
+    layer_archive_t    *archive;
+    layer_entry_t      *entry, *target;
+    struct stat         st;
+    int64_t             i;
+
+    archive = (layer_archive_t*)calloc(1,sizeof(layer_archive_t));
+
+    if (archive == NULL) {
+        return NULL;
+    }
+
+    archive->fd = open(filename, O_RDONLY);
+
+    if (archive->fd < 0 || fstat(archive->fd, &st)) {
+        goto fail;
+    }
+
+    archive->length = st.st_size;
+
+    if (__peepfs_layer_load_stargz(archive)) {
+
+        __peepfs_layer_free_entries(archive);
+
+        if (__peepfs_layer_load_ztoc(archive, filename)) {
+            goto fail;
+        }
+    }
+
+    /* Later entries replace earlier ones of the same name */
+    for (i = 0; i < archive->num_entries; ++i) {
+        entry = &archive->entries[i];
+        HASH_FIND_STR(archive->hash, entry->name, target);
+        if (target) {
+            HASH_DEL(archive->hash, target);
+        }
+        HASH_ADD_KEYPTR(hh, archive->hash, entry->name, strlen(entry->name), entry);
+    }
+
+    return archive;
+
+fail:
+
+    peepfs_layer_close(archive);
+
+    return NULL;
+}
+
+void
+peepfs_layer_close(void *plugin_data)
+{
+    layer_archive_t *archive = (layer_archive_t*)plugin_data;
+
+    __peepfs_layer_free_entries(archive);
+
+    if (archive->zran) {
+        peepfs_zran_destroy(archive->zran);
+    }
+
+    if (archive->fd >= 0) {
+        close(archive->fd);
+    }
+
+    free(archive);
+}
+
+int
+peepfs_layer_enumerate(
+    void *plugin_data,
+    peepfs_archive_enum_callback_t enum_callback,
+    void *arg)
+{
+    layer_archive_t        *archive = (layer_archive_t*)plugin_data;
+    layer_entry_t          *le;
+    peepfs_archive_entry_t  entry;
+    int64_t                 i;
+
+    for (i = 0; i < archive->num_entries; ++i) {
+
+        le = &archive->entries[i];
+
+        entry.index = le->index;
+        entry.size  = le->size;
+        entry.flags = le->flags;
+
+        if (enum_callback(le->name, &entry, arg) < 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int
+peepfs_layer_entry_open(
+    void                   *plugin_data,
+    const char             *name,
+    peepfs_archive_entry_t *entry)
+{
+    layer_archive_t    *archive = (layer_archive_t*)plugin_data;
+    layer_entry_t      *le;
+
+    HASH_FIND_STR(archive->hash, name, le);
+
+    if (le == NULL) {
+        return -1;
+    }
+
+    entry->index = le->index;
+    entry->size  = le->size;
+    entry->flags = le->flags;
+
+    return 0;
+}
+
+void *
+peepfs_layer_file_open(
+    void *plugin_data,
+    peepfs_archive_entry_t *entry)
+{
+    layer_archive_t    *archive = (layer_archive_t*)plugin_data;
+    layer_file_t       *file;
+
+    if (entry->index < 0 || entry->index >= archive->num_entries) {
+        return NULL;
+    }
+
+    file = (layer_file_t*)calloc(1,sizeof(layer_file_t));
+
+    if (file == NULL) {
+        return NULL;
+    }
+
+    /* The entry table never changes once loaded, we can point into it */
+    file->entry = &archive->entries[entry->index];
+
+    if (archive->zran) {
+
+        file->cursor = peepfs_zran_cursor_open(archive->zran);
+
+        if (file->cursor == NULL) {
+            free(file);
+            return NULL;
+        }
+    }
+
+    pthread_mutex_init(&file->lock, NULL);
+
+    return file;
+}
+
+void
+peepfs_layer_file_close(
+    void *plugin_data,
+    void *file_data)
+{
+    layer_file_t *file = (layer_file_t*)file_data;
+
+    if (file->cursor) {
+        peepfs_zran_cursor_close(file->cursor);
+    }
+
+    if (file->active) {
+        inflateEnd(&file->strm);
+    }
+
+    pthread_mutex_destroy(&file->lock);
+
+    free(file);
+}
+
+/* Start inflating chunk 'k' from the top of its gzip member */
+static int
+__peepfs_layer_seek(layer_file_t *file, int64_t k)
+{
+    layer_chunk_t *chunk = &file->entry->chunks[k];
+
+    if (file->active) {
+        inflateEnd(&file->strm);
+        file->active = 0;
+    }
+
+    memset(&file->strm, 0, sizeof(file->strm));
+
+    if (inflateInit2(&file->strm, 31) != Z_OK) {
+        return -1;
+    }
+
+    file->active = 1;
+    file->chunk  = k;
+    file->in     = chunk->in;
+    file->pos    = chunk->out - chunk->inner;
+
+    return 0;
+}
+
+/* Read from an eStargz file, a chunk at a time */
+static ssize_t
+__peepfs_layer_read_chunks(
+    layer_archive_t    *archive,
+    layer_file_t       *file,
+    void               *buffer,
+    int64_t             offset,
+    size_t              size)
+{
+    layer_entry_t  *entry = file->entry;
+    z_stream       *strm = &file->strm;
+    int64_t         k, limit, from, to, copied = 0;
+    ssize_t         rlen;
+    int             ret;
+
+    /* Last chunk starting at or before the offset */
+    k = entry->num_chunks - 1;
+
+    while (k > 0 && entry->chunks[k].out > offset) {
+        --k;
+    }
+
+    /* Carry on from where we are if that's on the way */
+    if (!file->active || file->pos > offset || file->chunk > k ||
+        (file->chunk < k && entry->chunks[k].in != entry->chunks[file->chunk].in)) {
+
+        if (__peepfs_layer_seek(file, k)) {
+            return -1;
+        }
+    }
+
+    while (copied < size) {
+
+        k     = file->chunk;
+        limit = k + 1 < entry->num_chunks ? entry->chunks[k+1].out : entry->size;
+
+        if (file->pos == limit) {
+
+            if (limit == entry->size) {
+                break;
+            }
+
+            /* Chunks sharing a member just run on */
+            if (entry->chunks[k+1].in != entry->chunks[k].in) {
+                if (__peepfs_layer_seek(file, k + 1)) {
+                    break;
+                }
+            } else {
+                file->chunk++;
+            }
+
+            continue;
+        }
+
+        if (strm->avail_in == 0) {
+
+            rlen = pread(archive->fd, file->input, LAYER_CHUNK, file->in);
+
+            if (rlen <= 0) {
+                break;
+            }
+
+            file->in       += rlen;
+            strm->next_in   = file->input;
+            strm->avail_in  = rlen;
+        }
+
+        strm->next_out  = file->output;
+        strm->avail_out = MIN(LAYER_CHUNK, limit - file->pos);
+
+        ret = inflate(strm, Z_NO_FLUSH);
+
+        if (ret != Z_OK && ret != Z_STREAM_END) {
+            inflateEnd(strm);
+            file->active = 0;
+            break;
+        }
+
+        to = file->pos + (strm->next_out - file->output);
+
+        if (to > offset + copied) {
+            from = MAX(file->pos, offset + copied);
+            to   = MIN(to, offset + (int64_t)size);
+
+            memcpy((char*)buffer + (from - offset),
+                   file->output + (from - file->pos), to - from);
+
+            copied = to - offset;
+        }
+
+        file->pos += strm->next_out - file->output;
+
+        /* A member that ends early is a broken layer */
+        if (ret == Z_STREAM_END && file->pos < limit) {
+            inflateEnd(strm);
+            file->active = 0;
+            break;
+        }
+    }
+
+    return copied ? copied : (file->active ? 0 : -1);
+}
+
+ssize_t
+peepfs_layer_file_read(
+    void                   *plugin_data,
+    void                   *file_data,
+    void                   *buffer,
+    size_t                  offset,
+    size_t                  size)
+{
+    layer_archive_t    *archive = (layer_archive_t*)plugin_data;
+    layer_file_t       *file  = (layer_file_t*)file_data;
+    layer_entry_t      *entry = file->entry;
+    ssize_t             len;
+
+    if (offset >= entry->size) {
+        return 0;
+    }
+
+    size = MIN(size, entry->size - offset);
+
+    pthread_mutex_lock(&file->lock);
+
+    if (file->cursor) {
+        len = peepfs_zran_read(file->cursor, buffer,
+                               entry->data_offset + offset, size);
+    } else {
+        len = __peepfs_layer_read_chunks(archive, file, buffer, offset, size);
+    }
+
+    pthread_mutex_unlock(&file->lock);
+
+    return len;
+}
+
+peepfs_archive_ops_t layer_ops = {
+    .open           = peepfs_layer_open,
+    .close          = peepfs_layer_close,
+    .enumerate      = peepfs_layer_enumerate,
+    .entry_open     = peepfs_layer_entry_open,
+    .file_open      = peepfs_layer_file_open,
+    .file_close     = peepfs_layer_file_close,
+    .file_read      = peepfs_layer_file_read
+};
@@ -2,20 +2,74 @@
 
 #include <stdlib.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <sys/stat.h>
 #include <time.h>
 #include <archive.h>
 #include <archive_entry.h>
 #include <pthread.h>
 
+#include "uthash.h"
+#include "utlist.h"
+
 #define MIN(x,y) ((x) < (y) ? (x) : (y))
 
+#define LIBARCHIVE_BLOCK_SIZE   10240
+
+/*
+ * Entry data kept for all open archives together, read ahead by one
+ * pass, and the biggest entry worth keeping
+ */
+#define LIBARCHIVE_CACHE_BUDGET     (256*1024*1024)
+#define LIBARCHIVE_FILL_BUDGET      (64*1024*1024)
+#define LIBARCHIVE_CACHE_MAX_ENTRY  (8*1024*1024)
+
+/* Where an entry lives in the uncompressed archive stream */
+typedef struct libarchive_offset {
+    int64_t             header;
+    int64_t             data;
+} libarchive_offset_t;
+
+/* The whole data of one entry, read out on a pass over the archive */
+typedef struct libarchive_blob {
+    struct libarchive_archive *archive;
+    int64_t                 index;
+    int64_t                 refcnt;
+    int64_t                 size;
+    char                   *data;
+    struct libarchive_blob *prev;
+    struct libarchive_blob *next;
+    UT_hash_handle          hh;
+} libarchive_blob_t;
+
 typedef struct libarchive_archive {
-    const char         *filename;
+    const char             *filename;
+    pthread_mutex_t         lock;
+    pthread_mutex_t         fill_lock;  /* one prefetch pass at a time */
+    int                     seekable;
+    int                     cacheable;
+    libarchive_offset_t    *offsets;
+    int64_t                 num_offsets;
+    int64_t                 max_offsets;
+    libarchive_blob_t      *blobs;      /* hashed by index, under the cache lock */
 } libarchive_archive_t;
 
+/* Shared by every archive, so -a doesn't multiply the budget */
+static pthread_mutex_t      __peepfs_libarchive_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static libarchive_blob_t   *__peepfs_libarchive_lru = NULL;
+static int64_t              __peepfs_libarchive_cached_bytes = 0;
+
+/* Read callback state, so we can start reading mid-file */
+typedef struct libarchive_client {
+    int                 fd;
+    int64_t             offset;
+    char                buffer[LIBARCHIVE_BLOCK_SIZE];
+} libarchive_client_t;
+
 typedef struct libarchive_file {
     struct archive         *arc;
+    libarchive_blob_t      *blob;       /* served from memory if set */
     struct archive_entry   *entry;
     int64_t                 index;
     int64_t                 offset;
@@ -23,31 +77,236 @@ typedef struct libarchive_file {
     pthread_mutex_t         lock;
 } libarchive_file_t;
 
+static la_ssize_t
+__peepfs_libarchive_client_read(
+    struct archive     *arc,
+    void               *arg,
+    const void        **buffer)
+{
+    libarchive_client_t *client = (libarchive_client_t*)arg;
+    ssize_t              len;
+
+    len = pread(client->fd, client->buffer, sizeof(client->buffer), 
+                client->offset);
+
+    if (len < 0) {
+        archive_set_error(arc, errno, "read failed");
+        return -1;
+    }
+
+    client->offset += len;
+
+    *buffer = client->buffer;
+
+    return len;
+}
+
+static la_int64_t
+__peepfs_libarchive_client_skip(
+    struct archive     *arc,
+    void               *arg,
+    la_int64_t          request)
+{
+    libarchive_client_t *client = (libarchive_client_t*)arg;
+
+    client->offset += request;
+
+    return request;
+}
+
+/* 7z and friends keep their directory at the end, and need to seek */
+static la_int64_t
+__peepfs_libarchive_client_seek(
+    struct archive     *arc,
+    void               *arg,
+    la_int64_t          offset,
+    int                 whence)
+{
+    libarchive_client_t *client = (libarchive_client_t*)arg;
+    struct stat          st;
+
+    switch (whence) {
+    case SEEK_SET:
+        client->offset = offset;
+        break;
+    case SEEK_CUR:
+        client->offset += offset;
+        break;
+    case SEEK_END:
+        if (fstat(client->fd, &st)) {
+            return ARCHIVE_FATAL;
+        }
+        client->offset = st.st_size + offset;
+        break;
+    default:
+        return ARCHIVE_FATAL;
+    }
+
+    return client->offset;
+}
+
+static int
+__peepfs_libarchive_client_close(
+    struct archive     *arc,
+    void               *arg)
+{
+    libarchive_client_t *client = (libarchive_client_t*)arg;
+
+    close(client->fd);
+    free(client);
+
+    return ARCHIVE_OK;
+}
+
+/* 
+ * Record where entry 'i' lives, if it's the next one we don't know about.
+ * Only plain tar streams are marked seekable, for those the offsets are
+ * real file offsets we can restart reading from.
+ */
+
+static inline void
+__peepfs_libarchive_note(
+    libarchive_archive_t   *archive,
+    struct archive         *arc,
+    int64_t                 i)
+{
+    libarchive_offset_t *offsets;
+    int                  format;
+
+    pthread_mutex_lock(&archive->lock);
+
+    if (archive->seekable < 0) {
+        archive->seekable = 
+            (archive_format(arc) & ARCHIVE_FORMAT_BASE_MASK) == ARCHIVE_FORMAT_TAR &&
+            archive_filter_count(arc) == 1 &&
+            archive_filter_code(arc, 0) == ARCHIVE_FILTER_NONE;
+    }
+
+    /* Solid or compressed, getting to an entry decompresses all before it */
+    if (archive->cacheable < 0) {
+        format = archive_format(arc) & ARCHIVE_FORMAT_BASE_MASK;
+        archive->cacheable =
+            format == ARCHIVE_FORMAT_7ZIP ||
+            format == ARCHIVE_FORMAT_RAR ||
+            format == ARCHIVE_FORMAT_RAR_V5 ||
+            archive_filter_count(arc) > 1;
+    }
+
+    if (archive->seekable && i == archive->num_offsets) {
+
+        if (archive->num_offsets == archive->max_offsets) {
+
+            offsets = (libarchive_offset_t*)realloc(archive->offsets,
+                (archive->max_offsets * 2 + 64) * sizeof(libarchive_offset_t));
+
+            if (offsets == NULL) {
+                goto out;
+            }
+
+            archive->offsets = offsets;
+            archive->max_offsets = archive->max_offsets * 2 + 64;
+        }
+
+        archive->offsets[i].header = archive_read_header_position(arc);
+        archive->offsets[i].data   = archive_filter_bytes(arc, 0);
+        archive->num_offsets++;
+    }
+
+out:
+
+    pthread_mutex_unlock(&archive->lock);
+}
+
+/*
+ * Open the archive and, if seek_index >= 0, position it at the data
+ * of that entry.  If we already know where the entry's header is we
+ * start reading right there, otherwise we walk the archive from the
+ * beginning.
+ */
+
 static inline struct archive *
-__peepfs_libarchive_open(const char *filename, int64_t seek_index)
+__peepfs_libarchive_open(libarchive_archive_t *archive, int64_t seek_index)
 {
     struct archive         *arc;
     struct archive_entry   *ae;
-    int64_t                 i, error;
+    libarchive_client_t    *client;
+    int64_t                 i, error, start = 0, data = 0;
+
+    if (seek_index >= 0) {
+
+        pthread_mutex_lock(&archive->lock);
+
+        if (archive->seekable > 0 && seek_index < archive->num_offsets) {
+            start = archive->offsets[seek_index].header;
+            data  = archive->offsets[seek_index].data;
+        }
+
+        pthread_mutex_unlock(&archive->lock);
+    }
+
+    client = (libarchive_client_t*)calloc(1,sizeof(libarchive_client_t));
+
+    if (client == NULL) {
+        return NULL;
+    }
+
+    client->fd     = open(archive->filename, O_RDONLY);
+    client->offset = start;
+
+    if (client->fd < 0) {
+        free(client);
+        return NULL;
+    }
 
     arc = archive_read_new();
 
-    archive_read_support_filter_all(arc);
-    archive_read_support_format_all(arc);
+    if (start) {
+        /* Mid-stream of a plain tar, don't let anything else bid */
+        archive_read_support_filter_none(arc);
+        archive_read_support_format_tar(arc);
+    } else {
+        archive_read_support_filter_all(arc);
+        archive_read_support_format_all(arc);
+    }
+
+    archive_read_set_callback_data(arc, client);
+    archive_read_set_read_callback(arc, __peepfs_libarchive_client_read);
+    archive_read_set_skip_callback(arc, __peepfs_libarchive_client_skip);
+    archive_read_set_seek_callback(arc, __peepfs_libarchive_client_seek);
+    archive_read_set_close_callback(arc, __peepfs_libarchive_client_close);
 
-    error = archive_read_open_filename(arc, filename, 10240);
+    error = archive_read_open1(arc);
 
     if (error != ARCHIVE_OK) {
         archive_read_free(arc);
         return NULL;
     }
 
-    if (seek_index >= 0) {
+    if (start) {
+
+        /* The entry's data must land exactly where we saw it last time,
+         * if not, stop trusting the index and walk from the top instead
+         */
+        if (archive_read_next_header(arc, &ae) != ARCHIVE_OK ||
+            start + archive_filter_bytes(arc, 0) != data) {
+
+            archive_read_free(arc);
+
+            pthread_mutex_lock(&archive->lock);
+            archive->seekable = 0;
+            pthread_mutex_unlock(&archive->lock);
+
+            return __peepfs_libarchive_open(archive, seek_index);
+        }
+
+    } else if (seek_index >= 0) {
 
         i = 0;
 
         while (archive_read_next_header(arc, &ae) == ARCHIVE_OK) {
 
+            __peepfs_libarchive_note(archive, arc, i);
+
             if (i == seek_index) {
                 break;
             }
@@ -66,26 +325,194 @@ __peepfs_libarchive_open(const char *filename, int64_t seek_index)
     return arc;
 }
 
+static void
+__peepfs_libarchive_blob_put(libarchive_blob_t *blob)
+{
+    if (--blob->refcnt == 0) {
+        free(blob->data);
+        free(blob);
+    }
+}
+
+/* A referenced blob for entry 'index', if we have one */
+static libarchive_blob_t *
+__peepfs_libarchive_blob_get(libarchive_archive_t *archive, int64_t index)
+{
+    libarchive_blob_t *blob;
+
+    pthread_mutex_lock(&__peepfs_libarchive_cache_lock);
+
+    HASH_FIND(hh, archive->blobs, &index, sizeof(index), blob);
+
+    if (blob) {
+        DL_DELETE(__peepfs_libarchive_lru, blob);
+        DL_APPEND(__peepfs_libarchive_lru, blob);
+        blob->refcnt++;
+    }
+
+    pthread_mutex_unlock(&__peepfs_libarchive_cache_lock);
+
+    return blob;
+}
+
+/*
+ * Keep a blob, pushing out the least recently used ones to make room,
+ * whichever archives they came from
+ */
+static void
+__peepfs_libarchive_blob_add(libarchive_archive_t *archive, libarchive_blob_t *blob)
+{
+    libarchive_blob_t *old;
+
+    pthread_mutex_lock(&__peepfs_libarchive_cache_lock);
+
+    HASH_FIND(hh, archive->blobs, &blob->index, sizeof(blob->index), old);
+
+    if (old) {
+        __peepfs_libarchive_blob_put(blob);
+        pthread_mutex_unlock(&__peepfs_libarchive_cache_lock);
+        return;
+    }
+
+    while (__peepfs_libarchive_lru &&
+           __peepfs_libarchive_cached_bytes + blob->size > LIBARCHIVE_CACHE_BUDGET) {
+        old = __peepfs_libarchive_lru;
+        DL_DELETE(__peepfs_libarchive_lru, old);
+        HASH_DEL(old->archive->blobs, old);
+        __peepfs_libarchive_cached_bytes -= old->size;
+        __peepfs_libarchive_blob_put(old);
+    }
+
+    blob->archive = archive;
+
+    HASH_ADD(hh, archive->blobs, index, sizeof(blob->index), blob);
+    DL_APPEND(__peepfs_libarchive_lru, blob);
+
+    __peepfs_libarchive_cached_bytes += blob->size;
+
+    pthread_mutex_unlock(&__peepfs_libarchive_cache_lock);
+}
+
+/*
+ * One pass from the top of the archive, keeping the data of entry
+ * 'index' and of as many entries after it as fit in the budget.  The
+ * decompression we'd pay to reach 'index' anyway then also covers the
+ * files most likely to be opened next.
+ */
+static void
+__peepfs_libarchive_fill(libarchive_archive_t *archive, int64_t index)
+{
+    struct archive         *arc;
+    struct archive_entry   *ae;
+    libarchive_blob_t      *blob, *have;
+    int64_t                 i, size, got, budget = LIBARCHIVE_FILL_BUDGET;
+    ssize_t                 len;
+
+    arc = __peepfs_libarchive_open(archive, -1);
+
+    if (arc == NULL) {
+        return;
+    }
+
+    for (i = 0; archive_read_next_header(arc, &ae) == ARCHIVE_OK; ++i) {
+
+        __peepfs_libarchive_note(archive, arc, i);
+
+        if (i < index) {
+            archive_read_data_skip(arc);
+            continue;
+        }
+
+        /* Directories and links come between the files, step over them */
+        if (!S_ISREG(archive_entry_filetype(ae)) || archive_entry_hardlink(ae)) {
+            archive_read_data_skip(arc);
+            continue;
+        }
+
+        size = archive_entry_size(ae);
+
+        if (!archive_entry_size_is_set(ae) ||
+            size > LIBARCHIVE_CACHE_MAX_ENTRY || size > budget) {
+            break;
+        }
+
+        budget -= size;
+
+        have = __peepfs_libarchive_blob_get(archive, i);
+
+        if (have) {
+            pthread_mutex_lock(&__peepfs_libarchive_cache_lock);
+            __peepfs_libarchive_blob_put(have);
+            pthread_mutex_unlock(&__peepfs_libarchive_cache_lock);
+            archive_read_data_skip(arc);
+            continue;
+        }
+
+        blob = (libarchive_blob_t*)calloc(1,sizeof(libarchive_blob_t));
+
+        if (blob == NULL) {
+            break;
+        }
+
+        blob->index  = i;
+        blob->refcnt = 1;
+        blob->size   = size;
+        blob->data   = (char*)malloc(size + 1);
+
+        for (got = 0; blob->data && got < size; got += len) {
+
+            len = archive_read_data(arc, blob->data + got, size - got);
+
+            if (len <= 0) {
+                break;
+            }
+        }
+
+        if (blob->data == NULL || got != size) {
+            free(blob->data);
+            free(blob);
+            break;
+        }
+
+        __peepfs_libarchive_blob_add(archive, blob);
+    }
+
+    archive_read_free(arc);
+}
+
+void peepfs_libarchive_close(void *plugin_data);
+
 void *
 peepfs_libarchive_open(const char *zipname)
 {
     libarchive_archive_t   *archive;
     struct archive         *arc;
 
-    arc = __peepfs_libarchive_open(zipname, -1);
+    archive = (libarchive_archive_t*)calloc(1,sizeof(libarchive_archive_t));
+
+    if (archive == NULL) {
+        return NULL;
+    }
+
+    archive->filename  = strdup(zipname); 
+    archive->seekable  = -1;
+    archive->cacheable = -1;
+
+    pthread_mutex_init(&archive->lock, NULL);
+    pthread_mutex_init(&archive->fill_lock, NULL);
+
+    arc = __peepfs_libarchive_open(archive, -1);
 
     if (arc) {
 
         archive_read_free(arc);
 
-        archive = (libarchive_archive_t*)calloc(1,sizeof(libarchive_archive_t));
-   
-        archive->filename = strdup(zipname); 
-
         return archive;
 
     } else {
 
+        peepfs_libarchive_close(archive);
+
         return NULL;
 
     }
@@ -96,7 +523,22 @@ void
 peepfs_libarchive_close(void *plugin_data)
 {
     libarchive_archive_t *archive = (libarchive_archive_t*)plugin_data;
+    libarchive_blob_t    *blob, *tmp;
+
+    pthread_mutex_lock(&__peepfs_libarchive_cache_lock);
+
+    HASH_ITER(hh, archive->blobs, blob, tmp) {
+        DL_DELETE(__peepfs_libarchive_lru, blob);
+        HASH_DEL(archive->blobs, blob);
+        __peepfs_libarchive_cached_bytes -= blob->size;
+        __peepfs_libarchive_blob_put(blob);
+    }
+
+    pthread_mutex_unlock(&__peepfs_libarchive_cache_lock);
 
+    pthread_mutex_destroy(&archive->lock);
+    pthread_mutex_destroy(&archive->fill_lock);
+    free(archive->offsets);
     free((void*)archive->filename);
     free(archive);
 
@@ -116,7 +558,7 @@ peepfs_libarchive_enumerate(
     unsigned int            i, error = 0;
     const char             *name;
 
-    arc = __peepfs_libarchive_open(archive->filename, -1);
+    arc = __peepfs_libarchive_open(archive, -1);
 
     if (arc == NULL) {
         error = -1;
@@ -126,6 +568,8 @@ peepfs_libarchive_enumerate(
     i = 0;
 
     while (archive_read_next_header(arc, &ae) == ARCHIVE_OK) {
+
+        __peepfs_libarchive_note(archive, arc, i);
           
         name = archive_entry_pathname(ae);
 
@@ -173,7 +617,7 @@ peepfs_libarchive_entry_open(
     struct archive             *arc = NULL;
     struct archive_entry       *ae;
 
-    arc = __peepfs_libarchive_open(archive->filename, -1);
+    arc = __peepfs_libarchive_open(archive, -1);
 
     if (arc == NULL) {
         error = -1;
@@ -186,6 +630,8 @@ peepfs_libarchive_entry_open(
 
     while (archive_read_next_header(arc, &ae) == ARCHIVE_OK) {
 
+        __peepfs_libarchive_note(archive, arc, i);
+
         arc_name = archive_entry_pathname(ae);
 
         if (arc_name[0] == '.' && arc_name[1] == '/') {
@@ -238,9 +684,53 @@ peepfs_libarchive_file_open(
 {
     libarchive_archive_t   *archive = (libarchive_archive_t*)plugin_data;
     libarchive_file_t      *file = NULL;
+    libarchive_blob_t      *blob = NULL;
     struct archive         *arc;
+    int                     cacheable;
+
+    if (!(entry->flags & PEEPFS_FLAG_DIR) &&
+        entry->size <= LIBARCHIVE_CACHE_MAX_ENTRY) {
+
+        blob = __peepfs_libarchive_blob_get(archive, entry->index);
+
+        pthread_mutex_lock(&archive->lock);
+        cacheable = archive->cacheable;
+        pthread_mutex_unlock(&archive->lock);
+
+        /* Whoever misses first reads ahead, everybody else waits for it */
+        if (blob == NULL && cacheable > 0) {
+
+            pthread_mutex_lock(&archive->fill_lock);
 
-    arc = __peepfs_libarchive_open(archive->filename, entry->index);
+            blob = __peepfs_libarchive_blob_get(archive, entry->index);
+
+            if (blob == NULL) {
+                __peepfs_libarchive_fill(archive, entry->index);
+                blob = __peepfs_libarchive_blob_get(archive, entry->index);
+            }
+
+            pthread_mutex_unlock(&archive->fill_lock);
+        }
+    }
+
+    if (blob) {
+
+        file = (libarchive_file_t*)calloc(1,sizeof(libarchive_file_t));
+
+        if (file == NULL) {
+            pthread_mutex_lock(&__peepfs_libarchive_cache_lock);
+            __peepfs_libarchive_blob_put(blob);
+            pthread_mutex_unlock(&__peepfs_libarchive_cache_lock);
+            return NULL;
+        }
+
+        file->blob  = blob;
+        file->index = entry->index;
+
+        return file;
+    }
+
+    arc = __peepfs_libarchive_open(archive, entry->index);
 
     if (arc == NULL) {
         goto out;
@@ -271,7 +761,14 @@ peepfs_libarchive_file_close(
 {
     libarchive_file_t    *file  = (libarchive_file_t*)file_data;
 
-    archive_read_free(file->arc);
+    if (file->blob) {
+        pthread_mutex_lock(&__peepfs_libarchive_cache_lock);
+        __peepfs_libarchive_blob_put(file->blob);
+        pthread_mutex_unlock(&__peepfs_libarchive_cache_lock);
+    } else {
+        archive_read_free(file->arc);
+    }
+
     free(file);
 }
 
@@ -288,6 +785,19 @@ peepfs_libarchive_file_read(
     libarchive_file_t      *file  = (libarchive_file_t*)file_data;
     ssize_t                 len;
 
+    if (file->blob) {
+
+        if (offset >= file->blob->size) {
+            return 0;
+        }
+
+        len = MIN(size, file->blob->size - offset);
+
+        memcpy(buffer, file->blob->data + offset, len);
+
+        return len;
+    }
+
     pthread_mutex_lock(&file->lock);
 
     if (file->error) {
@@ -301,7 +811,7 @@ peepfs_libarchive_file_read(
         if (file->offset > offset) {
 
             archive_read_free(file->arc);
-            file->arc = __peepfs_libarchive_open(archive->filename, file->index);
+            file->arc = __peepfs_libarchive_open(archive, file->index);
 
             if (file->arc == NULL) {
                 file->error = -1;
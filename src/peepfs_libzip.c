@@ -2,16 +2,45 @@
 
 #include <stdlib.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <sys/stat.h>
 #include <time.h>
 #include <zip.h>
 #include <pthread.h>
 
+#include "peepfs_zran.h"
+#include "uthash.h"
+
 #define MIN(x,y) ((x) < (y) ? (x) : (y))
 
+#define ZIP_LOCAL_HEADER_SIG     0x04034b50
+#define ZIP_CENTRAL_HEADER_SIG   0x02014b50
+#define ZIP_EOCD_SIG             0x06054b50
+#define ZIP_EOCD64_SIG           0x06064b50
+#define ZIP_EOCD64_LOCATOR_SIG   0x07064b50
+
+#define ZIP_LOCAL_HEADER_LEN     30
+#define ZIP_CENTRAL_HEADER_LEN   46
+#define ZIP_EOCD_LEN             22
+#define ZIP_EOCD64_LEN           56
+#define ZIP_EOCD64_LOCATOR_LEN   20
+
+/* Access point index for one deflated entry, kept across opens */
+typedef struct libzip_index {
+    int64_t             index;
+    peepfs_zran_t      *zran;
+    UT_hash_handle      hh;
+} libzip_index_t;
+
 typedef struct libzip_archive {
     zip_t              *zip;
     pthread_mutex_t     lock;
+    int                 fd;
+    int                 offsets_loaded;
+    int64_t            *offsets;
+    int64_t             num_offsets;
+    libzip_index_t     *indexes;
 } libzip_archive_t;
 
 typedef struct libzip_file {
@@ -20,8 +49,214 @@ typedef struct libzip_file {
     int64_t     index;
     int64_t     offset;
     int         seekable;
+    int         direct;
+    int64_t     data_offset;
+    int64_t     size;
+    peepfs_zran_cursor_t *cursor;
+    pthread_mutex_t cursor_lock;
 } libzip_file_t;
 
+static inline uint16_t
+__peepfs_libzip_le16(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static inline uint32_t
+__peepfs_libzip_le32(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline uint64_t
+__peepfs_libzip_le64(const unsigned char *p)
+{
+    return __peepfs_libzip_le32(p) | ((uint64_t)__peepfs_libzip_le32(p + 4) << 32);
+}
+
+/*
+ * libzip won't tell us where an entry's local header lives, so we
+ * walk the central directory ourselves, once, to find out.  Entries
+ * are numbered in central directory order, same as libzip does it.
+ * Any surprise just leaves the table empty and everything keeps
+ * going through libzip.  Called with archive->lock held.
+ */
+
+static void
+__peepfs_libzip_load_offsets(libzip_archive_t *archive)
+{
+    unsigned char  *tail = NULL, *cd = NULL, *p, *eocd = NULL, *x;
+    unsigned char   buf[ZIP_EOCD64_LEN];
+    struct stat     st;
+    int64_t         tail_len, eocd_pos, cd_offset, cd_size, num, bias;
+    int64_t         loc64, lho, i;
+    int             name_len, extra_len, comment_len, id, len, skip;
+
+    archive->offsets_loaded = 1;
+
+    if (archive->fd < 0 || fstat(archive->fd, &st) || st.st_size < ZIP_EOCD_LEN) {
+        return;
+    }
+
+    tail_len = MIN(st.st_size, 65535 + ZIP_EOCD_LEN);
+
+    tail = (unsigned char*)malloc(tail_len);
+
+    if (tail == NULL ||
+        pread(archive->fd, tail, tail_len, st.st_size - tail_len) != tail_len) {
+        goto out;
+    }
+
+    for (p = tail + tail_len - ZIP_EOCD_LEN; p >= tail; --p) {
+        if (__peepfs_libzip_le32(p) == ZIP_EOCD_SIG) {
+            eocd = p;
+            break;
+        }
+    }
+
+    if (eocd == NULL) {
+        goto out;
+    }
+
+    eocd_pos  = st.st_size - tail_len + (eocd - tail);
+    num       = __peepfs_libzip_le16(eocd + 10);
+    cd_size   = __peepfs_libzip_le32(eocd + 12);
+    cd_offset = __peepfs_libzip_le32(eocd + 16);
+
+    /* Anything that doesn't fit gets promoted to the zip64 record */
+    if (num == 0xffff || cd_size == 0xffffffff || cd_offset == 0xffffffff) {
+
+        if (eocd_pos < ZIP_EOCD64_LOCATOR_LEN ||
+            pread(archive->fd, buf, ZIP_EOCD64_LOCATOR_LEN,
+                eocd_pos - ZIP_EOCD64_LOCATOR_LEN) != ZIP_EOCD64_LOCATOR_LEN ||
+            __peepfs_libzip_le32(buf) != ZIP_EOCD64_LOCATOR_SIG) {
+            goto out;
+        }
+
+        loc64 = __peepfs_libzip_le64(buf + 8);
+
+        if (pread(archive->fd, buf, ZIP_EOCD64_LEN, loc64) != ZIP_EOCD64_LEN ||
+            __peepfs_libzip_le32(buf) != ZIP_EOCD64_SIG) {
+            goto out;
+        }
+
+        num       = __peepfs_libzip_le64(buf + 32);
+        cd_size   = __peepfs_libzip_le64(buf + 40);
+        cd_offset = __peepfs_libzip_le64(buf + 48);
+        eocd_pos  = loc64;
+    }
+
+    /* Data prepended to the zip (self extractors) shifts every offset */
+    bias = eocd_pos - cd_size - cd_offset;
+
+    if (bias < 0 || num != zip_get_num_entries(archive->zip, 0) ||
+        cd_size > st.st_size) {
+        goto out;
+    }
+
+    cd = (unsigned char*)malloc(cd_size);
+    archive->offsets = (int64_t*)malloc(num * sizeof(int64_t));
+
+    if (cd == NULL || archive->offsets == NULL ||
+        pread(archive->fd, cd, cd_size, cd_offset + bias) != cd_size) {
+        goto out;
+    }
+
+    p = cd;
+
+    for (i = 0; i < num; ++i) {
+
+        if (p + ZIP_CENTRAL_HEADER_LEN > cd + cd_size ||
+            __peepfs_libzip_le32(p) != ZIP_CENTRAL_HEADER_SIG) {
+            goto out;
+        }
+
+        name_len    = __peepfs_libzip_le16(p + 28);
+        extra_len   = __peepfs_libzip_le16(p + 30);
+        comment_len = __peepfs_libzip_le16(p + 32);
+        lho         = __peepfs_libzip_le32(p + 42);
+
+        x = p + ZIP_CENTRAL_HEADER_LEN + name_len;
+
+        if (x + extra_len > cd + cd_size) {
+            goto out;
+        }
+
+        if (lho == 0xffffffff) {
+
+            /* The zip64 extra field holds only the values that overflowed,
+             * in a fixed order: size, compressed size, header offset
+             */
+            lho = -1;
+
+            while (x + 4 <= p + ZIP_CENTRAL_HEADER_LEN + name_len + extra_len) {
+
+                id  = __peepfs_libzip_le16(x);
+                len = __peepfs_libzip_le16(x + 2);
+
+                if (id == 0x0001) {
+                    skip = 0;
+                    if (__peepfs_libzip_le32(p + 24) == 0xffffffff) skip += 8;
+                    if (__peepfs_libzip_le32(p + 20) == 0xffffffff) skip += 8;
+                    if (skip + 8 <= len) {
+                        lho = __peepfs_libzip_le64(x + 4 + skip);
+                    }
+                    break;
+                }
+
+                x += 4 + len;
+            }
+
+            if (lho < 0) {
+                goto out;
+            }
+        }
+
+        archive->offsets[i] = lho + bias;
+
+        p += ZIP_CENTRAL_HEADER_LEN + name_len + extra_len + comment_len;
+    }
+
+    archive->num_offsets = num;
+
+out:
+
+    if (archive->num_offsets == 0) {
+        free(archive->offsets);
+        archive->offsets = NULL;
+    }
+
+    free(tail);
+    free(cd);
+}
+
+/* Find where a stored entry's bytes start, or -1 if we can't tell */
+static int64_t
+__peepfs_libzip_data_offset(libzip_archive_t *archive, int64_t index)
+{
+    unsigned char   lh[ZIP_LOCAL_HEADER_LEN];
+    int64_t         lho;
+
+    if (!archive->offsets_loaded) {
+        __peepfs_libzip_load_offsets(archive);
+    }
+
+    if (index < 0 || index >= archive->num_offsets) {
+        return -1;
+    }
+
+    lho = archive->offsets[index];
+
+    if (pread(archive->fd, lh, sizeof(lh), lho) != sizeof(lh) ||
+        __peepfs_libzip_le32(lh) != ZIP_LOCAL_HEADER_SIG) {
+        return -1;
+    }
+
+    /* The local extra field needn't match the central one */
+    return lho + ZIP_LOCAL_HEADER_LEN + 
+        __peepfs_libzip_le16(lh + 26) + __peepfs_libzip_le16(lh + 28);
+}
+
 void *
 peepfs_libzip_open(const char *zipname)
 {
@@ -46,6 +281,9 @@ peepfs_libzip_open(const char *zipname)
     
     zip_archive->zip = zip;
 
+    /* Shared by all direct readers, pread() doesn't care about sharing */
+    zip_archive->fd = open(zipname, O_RDONLY);
+
     pthread_mutex_init(&zip_archive->lock, NULL);
 
     return zip_archive;
@@ -55,9 +293,23 @@ void
 peepfs_libzip_close(void *plugin_data)
 {
     libzip_archive_t *archive = (libzip_archive_t*)plugin_data;
+    libzip_index_t   *zi, *tmp;
+
+    HASH_ITER(hh, archive->indexes, zi, tmp) {
+        HASH_DEL(archive->indexes, zi);
+        peepfs_zran_destroy(zi->zran);
+        free(zi);
+    }
 
     zip_close(archive->zip);
 
+    if (archive->fd >= 0) {
+        close(archive->fd);
+    }
+
+    pthread_mutex_destroy(&archive->lock);
+
+    free(archive->offsets);
     free(archive);
 
 }
@@ -166,9 +418,90 @@ peepfs_libzip_file_open(
     libzip_archive_t       *archive = (libzip_archive_t*)plugin_data;
     libzip_file_t          *file = NULL;
     zip_file_t             *zf;
+    zip_stat_t              zstat;
+    libzip_index_t         *zi;
+    int64_t                 data_offset;
 
     pthread_mutex_lock(&archive->lock);
 
+    if (zip_stat_index(archive->zip, entry->index, 0, &zstat) ||
+        zstat.encryption_method != ZIP_EM_NONE) {
+        goto libzip;
+    }
+
+    /* Stored, we can read the bytes straight off disk */
+    if (zstat.comp_method == ZIP_CM_STORE && zstat.comp_size == zstat.size) {
+
+        data_offset = __peepfs_libzip_data_offset(archive, entry->index);
+
+        if (data_offset >= 0) {
+
+            file = (libzip_file_t*)calloc(1,sizeof(libzip_file_t));
+
+            if (file) {
+                file->direct      = 1;
+                file->index       = entry->index;
+                file->data_offset = data_offset;
+                file->size        = zstat.size;
+            }
+
+            goto out;
+        }
+    }
+
+    /* Deflated, we inflate it ourselves through the entry's access points */
+    if (zstat.comp_method == ZIP_CM_DEFLATE) {
+
+        HASH_FIND(hh, archive->indexes, &entry->index, sizeof(int64_t), zi);
+
+        if (zi == NULL) {
+
+            data_offset = __peepfs_libzip_data_offset(archive, entry->index);
+
+            if (data_offset < 0) {
+                goto libzip;
+            }
+
+            zi = (libzip_index_t*)calloc(1,sizeof(libzip_index_t));
+
+            if (zi == NULL) {
+                goto libzip;
+            }
+
+            zi->index = entry->index;
+            zi->zran  = peepfs_zran_create(archive->fd, data_offset, 
+                zstat.comp_size, PEEPFS_ZRAN_RAW, PEEPFS_ZRAN_SPAN);
+
+            if (zi->zran == NULL) {
+                free(zi);
+                goto libzip;
+            }
+
+            HASH_ADD(hh, archive->indexes, index, sizeof(int64_t), zi);
+        }
+
+        file = (libzip_file_t*)calloc(1,sizeof(libzip_file_t));
+
+        if (file) {
+
+            file->direct = 1;
+            file->index  = entry->index;
+            file->size   = zstat.size;
+            file->cursor = peepfs_zran_cursor_open(zi->zran);
+
+            if (file->cursor == NULL) {
+                free(file);
+                file = NULL;
+            } else {
+                pthread_mutex_init(&file->cursor_lock, NULL);
+            }
+        }
+
+        goto out;
+    }
+
+libzip:
+
     zf = zip_fopen_index(archive->zip, entry->index, 0);
 
     if (zf == NULL) {
@@ -198,11 +531,19 @@ peepfs_libzip_file_close(
     libzip_archive_t *archive = (libzip_archive_t*)plugin_data;
     libzip_file_t    *file  = (libzip_file_t*)file_data;
 
-    pthread_mutex_lock(&archive->lock);
+    if (file->cursor) {
+        peepfs_zran_cursor_close(file->cursor);
+        pthread_mutex_destroy(&file->cursor_lock);
+    }
 
-    zip_fclose(file->zipfile);
+    if (file->zipfile) {
 
-    pthread_mutex_unlock(&archive->lock);
+        pthread_mutex_lock(&archive->lock);
+
+        zip_fclose(file->zipfile);
+
+        pthread_mutex_unlock(&archive->lock);
+    }
 
     free(file);
 }
@@ -221,6 +562,25 @@ peepfs_libzip_file_read(
     int                 error;
     ssize_t             len = -1;
 
+    /* Direct reads never go near libzip or the archive lock */
+    if (file->direct) {
+
+        if (offset >= file->size) {
+            return 0;
+        }
+
+        size = MIN(size, file->size - offset);
+
+        if (file->cursor) {
+            pthread_mutex_lock(&file->cursor_lock);
+            len = peepfs_zran_read(file->cursor, buffer, offset, size);
+            pthread_mutex_unlock(&file->cursor_lock);
+            return len;
+        }
+
+        return pread(archive->fd, buffer, size, file->data_offset + offset);
+    }
+
     pthread_mutex_lock(&archive->lock);
 
     if (file->error) {
@@ -290,6 +650,32 @@ out:
 
 }
 
+int
+peepfs_libzip_extent(
+    void                   *plugin_data,
+    peepfs_archive_entry_t *entry,
+    int64_t                *offset)
+{
+    libzip_archive_t   *archive = (libzip_archive_t*)plugin_data;
+    zip_stat_t          zstat;
+    int                 error = -1;
+
+    pthread_mutex_lock(&archive->lock);
+
+    if (zip_stat_index(archive->zip, entry->index, 0, &zstat) == 0 &&
+        zstat.encryption_method == ZIP_EM_NONE &&
+        zstat.comp_method == ZIP_CM_STORE && zstat.comp_size == zstat.size) {
+
+        *offset = __peepfs_libzip_data_offset(archive, entry->index);
+
+        error = *offset < 0 ? -1 : 0;
+    }
+
+    pthread_mutex_unlock(&archive->lock);
+
+    return error;
+}
+
 peepfs_archive_ops_t libzip_ops = {
     .open           = peepfs_libzip_open,
     .close          = peepfs_libzip_close,
@@ -297,5 +683,6 @@ peepfs_archive_ops_t libzip_ops = {
     .entry_open     = peepfs_libzip_entry_open,
     .file_open      = peepfs_libzip_file_open,
     .file_close     = peepfs_libzip_file_close,
-    .file_read      = peepfs_libzip_file_read
+    .file_read      = peepfs_libzip_file_read,
+    .extent         = peepfs_libzip_extent
 };
@@ -0,0 +1,441 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "peepfs_nested.h"
+
+#define MIN(x,y) ((x) < (y) ? (x) : (y))
+
+#define NESTED_CHUNK    (1024*1024)
+
+typedef struct peepfs_nested_entry {
+    char                       *key;        /* outer key, then member name */
+    int                         keylen;
+    char                       *path;
+    int64_t                     size;
+    int                         ready;
+    int                         error;
+    int                         charged;    /* size counts against budget */
+    int64_t                     refcnt;
+    int                         pooled;
+    pthread_mutex_t             lock;
+    struct peepfs_nested       *owner;
+    struct peepfs_nested_entry *prev;
+    struct peepfs_nested_entry *next;
+    UT_hash_handle              hh;
+} peepfs_nested_entry_t;
+
+struct peepfs_nested {
+    char                        dir[PATH_MAX];
+    int64_t                     budget;
+    int64_t                     used;
+    int64_t                     seq;
+    peepfs_nested_entry_t      *hash;
+    peepfs_nested_entry_t      *lru;
+    pthread_mutex_t             lock;
+};
+
+static void
+__peepfs_nested_entry_free(peepfs_nested_entry_t *ne)
+{
+    unlink(ne->path);
+    pthread_mutex_destroy(&ne->lock);
+    free(ne->key);
+    free(ne->path);
+    free(ne);
+}
+
+/* Unhook an entry, returns 1 if the caller must free it.  Lock held. */
+static int
+__peepfs_nested_detach(
+    peepfs_nested_t        *nested,
+    peepfs_nested_entry_t  *ne)
+{
+    DL_DELETE(nested->lru, ne);
+    HASH_DEL(nested->hash, ne);
+
+    ne->pooled = 0;
+
+    if (ne->charged) {
+        nested->used -= ne->size;
+        ne->charged   = 0;
+    }
+
+    return --ne->refcnt == 0;
+}
+
+static void
+__peepfs_nested_put(
+    peepfs_nested_t        *nested,
+    peepfs_nested_entry_t  *ne)
+{
+    int64_t refcnt;
+
+    pthread_mutex_lock(&nested->lock);
+
+    refcnt = --ne->refcnt;
+
+    pthread_mutex_unlock(&nested->lock);
+
+    if (refcnt == 0) {
+        __peepfs_nested_entry_free(ne);
+    }
+}
+
+/* The spill's pool handle closed, it no longer needs the file */
+static void
+__peepfs_nested_release(void *arg)
+{
+    peepfs_nested_entry_t *ne = (peepfs_nested_entry_t*)arg;
+
+    __peepfs_nested_put(ne->owner, ne);
+}
+
+peepfs_nested_t *
+peepfs_nested_init(const char *tmpdir, int64_t budget)
+{
+    peepfs_nested_t *nested;
+
+    nested = (peepfs_nested_t*)calloc(1,sizeof(peepfs_nested_t));
+
+    if (nested == NULL) {
+        return NULL;
+    }
+
+    snprintf(nested->dir, sizeof(nested->dir), "%s/peepfs-XXXXXX",
+        tmpdir ? tmpdir : "/tmp");
+
+    if (mkdtemp(nested->dir) == NULL) {
+        free(nested);
+        return NULL;
+    }
+
+    nested->budget = budget;
+
+    pthread_mutex_init(&nested->lock, NULL);
+
+    return nested;
+}
+
+void
+peepfs_nested_free(peepfs_nested_t *nested)
+{
+    peepfs_nested_entry_t *ne, *tmp;
+
+    HASH_ITER(hh, nested->hash, ne, tmp) {
+        if (__peepfs_nested_detach(nested, ne)) {
+            __peepfs_nested_entry_free(ne);
+        }
+    }
+
+    rmdir(nested->dir);
+
+    pthread_mutex_destroy(&nested->lock);
+
+    free(nested);
+}
+
+/* Stored member, let the kernel move (or share) the bytes */
+static int
+__peepfs_nested_clone(
+    const char *archivepath,
+    int64_t     offset,
+    int         fd,
+    int64_t     size)
+{
+    loff_t      in_off = offset, out_off = 0;
+    ssize_t     len;
+    int         in;
+
+    in = open(archivepath, O_RDONLY);
+
+    if (in < 0) {
+        return -1;
+    }
+
+    while (out_off < size) {
+
+        len = copy_file_range(in, &in_off, fd, &out_off, size - out_off, 0);
+
+        if (len <= 0) {
+            break;
+        }
+    }
+
+    close(in);
+
+    return out_off == size ? 0 : -1;
+}
+
+/* Anything else is decoded through the outer backend */
+static int
+__peepfs_nested_copy(
+    peepfs_archive_t       *archive,
+    peepfs_archive_entry_t *entry,
+    int                     fd)
+{
+    peepfs_archive_file_t  *file;
+    char                   *buffer;
+    int64_t                 offset = 0;
+    ssize_t                 len;
+
+    file = peepfs_archive_file_open(archive, entry);
+
+    if (file == NULL) {
+        return -1;
+    }
+
+    buffer = (char*)malloc(NESTED_CHUNK);
+
+    while (buffer && offset < entry->size) {
+
+        len = peepfs_archive_file_read(archive, file, buffer, offset,
+            MIN(NESTED_CHUNK, entry->size - offset));
+
+        if (len <= 0 || pwrite(fd, buffer, len, offset) != len) {
+            break;
+        }
+
+        offset += len;
+    }
+
+    free(buffer);
+
+    peepfs_archive_file_close(archive, file);
+
+    return offset == entry->size ? 0 : -1;
+}
+
+static int
+__peepfs_nested_spill(
+    peepfs_pool_t  *pool,
+    const char     *archivepath,
+    const char     *name,
+    const char     *path,
+    int64_t        *size)
+{
+    peepfs_pool_entry_t    *handle;
+    peepfs_archive_entry_t  entry;
+    int64_t                 offset;
+    int                     fd = -1, error = -1;
+
+    handle = peepfs_pool_get(pool, archivepath);
+
+    if (handle == NULL) {
+        return -1;
+    }
+
+    if (peepfs_archive_entry_open(handle->archive, name, &entry) ||
+        (entry.flags & PEEPFS_FLAG_DIR)) {
+        goto out;
+    }
+
+    fd = open(path, O_WRONLY|O_CREAT|O_EXCL, 0600);
+
+    if (fd < 0) {
+        goto out;
+    }
+
+    if (peepfs_archive_extent(handle->archive, &entry, &offset) == 0 &&
+        __peepfs_nested_clone(archivepath, offset, fd, entry.size) == 0) {
+        error = 0;
+        goto out;
+    }
+
+    if (ftruncate(fd, 0) == 0) {
+        error = __peepfs_nested_copy(handle->archive, &entry, fd);
+    }
+
+out:
+
+    if (fd >= 0) {
+
+        close(fd);
+
+        if (error) {
+            unlink(path);
+        }
+    }
+
+    if (error == 0) {
+        *size = entry.size;
+    }
+
+    peepfs_pool_put(pool, handle);
+
+    return error;
+}
+
+/* Drop the oldest spills until we fit again, sparing 'keep'.  Lock held. */
+static void
+__peepfs_nested_evict(
+    peepfs_nested_t        *nested,
+    peepfs_nested_entry_t  *keep,
+    peepfs_nested_entry_t **victims)
+{
+    peepfs_nested_entry_t *ne, *tmp;
+
+    DL_FOREACH_SAFE(nested->lru, ne, tmp) {
+
+        if (nested->used <= nested->budget) {
+            break;
+        }
+
+        if (ne != keep && __peepfs_nested_detach(nested, ne)) {
+            /* Freed outside the lock, unlink can take a while */
+            ne->next = *victims;
+            *victims = ne;
+        }
+    }
+}
+
+int
+peepfs_nested_path(
+    peepfs_nested_t    *nested,
+    peepfs_pool_t      *pool,
+    const char         *archivepath,
+    const char         *name,
+    char               *out)
+{
+    peepfs_nested_entry_t  *ne, *victims = NULL;
+    peepfs_pool_entry_t    *handle;
+    peepfs_archive_key_t    key;
+    struct stat             st;
+    const char             *base;
+    char                   *buf;
+    int                     namelen = strlen(name), keylen, error;
+
+    if (stat(archivepath, &st)) {
+        return -1;
+    }
+
+    peepfs_archive_key_init(&key, &st);
+
+    keylen = sizeof(key) + namelen;
+
+    buf = (char*)malloc(keylen);
+
+    if (buf == NULL) {
+        return -1;
+    }
+
+    memcpy(buf, &key, sizeof(key));
+    memcpy(buf + sizeof(key), name, namelen);
+
+    pthread_mutex_lock(&nested->lock);
+
+    HASH_FIND(hh, nested->hash, buf, keylen, ne);
+
+    if (ne) {
+
+        free(buf);
+
+        ne->refcnt++;
+        DL_DELETE(nested->lru, ne);
+        DL_APPEND(nested->lru, ne);
+
+    } else {
+
+        ne = (peepfs_nested_entry_t*)calloc(1,sizeof(peepfs_nested_entry_t));
+
+        if (ne == NULL) {
+            pthread_mutex_unlock(&nested->lock);
+            free(buf);
+            return -1;
+        }
+
+        /* Keep the member's own name, backends go by the extension */
+        base = rindex(name, '/');
+        base = base ? base + 1 : name;
+
+        ne->path = (char*)malloc(PATH_MAX);
+
+        if (ne->path == NULL) {
+            pthread_mutex_unlock(&nested->lock);
+            free(buf);
+            free(ne);
+            return -1;
+        }
+
+        snprintf(ne->path, PATH_MAX, "%s/%lld-%s",
+            nested->dir, (long long)nested->seq++, base);
+
+        ne->key    = buf;
+        ne->keylen = keylen;
+        ne->owner  = nested;
+        ne->refcnt = 2; /* one for the table, one for us */
+        ne->pooled = 1;
+
+        pthread_mutex_init(&ne->lock, NULL);
+
+        HASH_ADD_KEYPTR(hh, nested->hash, ne->key, ne->keylen, ne);
+        DL_APPEND(nested->lru, ne);
+    }
+
+    pthread_mutex_unlock(&nested->lock);
+
+    /* Whoever gets here first spills, everybody else waits for it */
+    pthread_mutex_lock(&ne->lock);
+
+    if (!ne->ready) {
+
+        ne->error = __peepfs_nested_spill(pool, archivepath, name,
+            ne->path, &ne->size);
+
+        ne->ready = 1;
+
+        pthread_mutex_lock(&nested->lock);
+
+        if (ne->pooled && ne->error) {
+            /* Not worth remembering, we still hold a reference */
+            __peepfs_nested_detach(nested, ne);
+        } else if (ne->pooled) {
+            nested->used += ne->size;
+            ne->charged   = 1;
+            __peepfs_nested_evict(nested, ne, &victims);
+        }
+
+        pthread_mutex_unlock(&nested->lock);
+    }
+
+    error = ne->error;
+
+    if (error == 0) {
+        snprintf(out, PATH_MAX, "%s", ne->path);
+    }
+
+    pthread_mutex_unlock(&ne->lock);
+
+    /*
+     * Eviction only unhooks a spill, the file goes with the last
+     * reference.  Opening it here and handing our reference to the
+     * handle keeps it on disk for the caller's peepfs_pool_get() and
+     * for as long as the handle lives, backends reopen by path.
+     */
+    handle = error ? NULL : peepfs_pool_get(pool, ne->path);
+
+    if (handle == NULL ||
+        peepfs_pool_pin(pool, handle, __peepfs_nested_release, ne)) {
+        __peepfs_nested_put(nested, ne);
+    }
+
+    if (handle) {
+        peepfs_pool_put(pool, handle);
+    }
+
+    while (victims) {
+        ne      = victims;
+        victims = ne->next;
+        __peepfs_nested_entry_free(ne);
+    }
+
+    return error;
+}
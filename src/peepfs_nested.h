@@ -0,0 +1,42 @@
+#ifndef __PEEPFS_NESTED_H__
+#define __PEEPFS_NESTED_H__
+
+#include <stdint.h>
+
+#include "peepfs_pool.h"
+
+/*
+ * Archives inside archives (a jar in a war, a tar in a tar.gz).
+ *
+ * Every backend opens archives by path, so an inner archive is given
+ * one: its bytes are spilled to a file in a private directory and the
+ * spill is opened like any other archive, pooled and cached by its
+ * own path.  Stored members are cloned straight from the outer file,
+ * which costs no data copy at all where the file system can reflink,
+ * anything else is decoded through the outer backend once.
+ *
+ * Spills are keyed by the identity of the outer file plus the member
+ * name, so repeat lookups don't touch the outer archive, and a changed
+ * outer file simply stops matching.  The oldest spills are dropped
+ * once they add up to more than the budget, though a dropped spill's
+ * file stays until the pool closes the handle that has it open.
+ */
+
+#define PEEPFS_NESTED_BUDGET    (1024LL*1024*1024)
+
+typedef struct peepfs_nested peepfs_nested_t;
+
+/* Spills go in a fresh directory under 'tmpdir' */
+peepfs_nested_t * peepfs_nested_init(
+    const char *tmpdir, int64_t budget);
+
+/* Removes every spill and the directory */
+void peepfs_nested_free(
+    peepfs_nested_t *nested);
+
+/* Find or make the spill for member 'name' of 'archivepath', path in 'out' */
+int peepfs_nested_path(
+    peepfs_nested_t *nested, peepfs_pool_t *pool,
+    const char *archivepath, const char *name, char *out);
+
+#endif
@@ -0,0 +1,288 @@
+#ifndef __PEEPFS_POOL_H__
+#define __PEEPFS_POOL_H__
+
+#include <stdlib.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "peepfs_archive.h"
+#include "utlist.h"
+#include "uthash.h"
+
+/*
+ * Pool of open archive handles, shared by all threads.
+ *
+ * Opening an archive can mean parsing its whole directory, so
+ * handles are kept open and handed out again for as long as the
+ * underlying file keeps the same identity.  Handles are refcounted;
+ * an evicted or stale handle is unhooked from the pool right away
+ * but only closed once its last user puts it back.
+ */
+
+typedef struct peepfs_pool_entry {
+    peepfs_archive_key_t        key;
+    const char                 *path;
+    peepfs_archive_t           *archive;
+    int64_t                     refcnt;
+    int                         pooled;
+    void                      (*release)(void *arg);   /* once closed */
+    void                       *release_arg;
+    pthread_mutex_t             listing_lock;   /* one listing read at a time */
+    int                         unlisted;       /* its listing didn't fit */
+    struct peepfs_pool_entry   *prev;
+    struct peepfs_pool_entry   *next;
+    UT_hash_handle              hh;
+    UT_hash_handle              hh_path;
+} peepfs_pool_entry_t;
+
+typedef struct peepfs_pool {
+    peepfs_pool_entry_t    *hash;
+    peepfs_pool_entry_t    *hash_by_path;
+    peepfs_pool_entry_t    *lru;
+    int64_t                 num_entries;
+    int64_t                 max_entries;
+    pthread_mutex_t         lock;
+} peepfs_pool_t;
+
+static inline peepfs_pool_t *
+peepfs_pool_init(int64_t max_entries)
+{
+    peepfs_pool_t *pool;
+
+    pool = (peepfs_pool_t*)calloc(1,sizeof(peepfs_pool_t));
+
+    pool->max_entries = max_entries > 0 ? max_entries : 1;
+
+    pthread_mutex_init(&pool->lock, NULL);
+
+    return pool;
+}
+
+static inline void
+__peepfs_pool_entry_free(peepfs_pool_entry_t *pe)
+{
+    peepfs_archive_close(pe->archive);
+
+    if (pe->release) {
+        pe->release(pe->release_arg);
+    }
+
+    pthread_mutex_destroy(&pe->listing_lock);
+    free((void*)pe->path);
+    free(pe);
+}
+
+/* Unhook an entry from the pool, returns 1 if the caller must free it */
+static inline int
+__peepfs_pool_detach(
+    peepfs_pool_t          *pool,
+    peepfs_pool_entry_t    *pe)
+{
+    peepfs_pool_entry_t *ppe;
+
+    DL_DELETE(pool->lru, pe);
+    HASH_DEL(pool->hash, pe);
+
+    HASH_FIND(hh_path, pool->hash_by_path, pe->path, strlen(pe->path), ppe);
+
+    if (ppe == pe) {
+        HASH_DELETE(hh_path, pool->hash_by_path, pe);
+    }
+
+    pe->pooled = 0;
+
+    --pool->num_entries;
+
+    return --pe->refcnt == 0;
+}
+
+static inline void
+peepfs_pool_free(peepfs_pool_t *pool)
+{
+    peepfs_pool_entry_t *pe;
+
+    while (pool->lru) {
+        pe = pool->lru;
+
+        if (__peepfs_pool_detach(pool, pe)) {
+            __peepfs_pool_entry_free(pe);
+        }
+    }
+
+    pthread_mutex_destroy(&pool->lock);
+
+    free(pool);
+}
+
+/*
+ * Return a referenced handle for the archive at 'path', opening
+ * it if the pool doesn't already have one for the file as it is
+ * right now.  Returns NULL if the file isn't a usable archive.
+ * Each successful get must be paired with a peepfs_pool_put().
+ */
+
+static inline peepfs_pool_entry_t *
+peepfs_pool_get(
+    peepfs_pool_t  *pool,
+    const char     *path)
+{
+    peepfs_pool_entry_t    *pe, *stale, *victim = NULL, *dup = NULL;
+    peepfs_archive_key_t    key;
+    peepfs_archive_t       *archive;
+    struct stat             st;
+    int                     pathlen = strlen(path);
+
+    if (stat(path, &st)) {
+        return NULL;
+    }
+
+    peepfs_archive_key_init(&key, &st);
+
+    pthread_mutex_lock(&pool->lock);
+
+    HASH_FIND(hh, pool->hash, &key, sizeof(key), pe);
+
+    if (pe) {
+        pe->refcnt++;
+        DL_DELETE(pool->lru, pe);
+        DL_APPEND(pool->lru, pe);
+        pthread_mutex_unlock(&pool->lock);
+        return pe;
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+
+    /* Open without holding the lock, this may take a while */
+    archive = peepfs_archive_open(path);
+
+    if (archive == NULL) {
+        return NULL;
+    }
+
+    pe = (peepfs_pool_entry_t*)calloc(1,sizeof(peepfs_pool_entry_t));
+
+    if (pe == NULL) {
+        peepfs_archive_close(archive);
+        return NULL;
+    }
+
+    pe->key     = key;
+    pe->path    = strdup(path);
+    pe->archive = archive;
+    pe->refcnt  = 2; /* one for the pool, one for the caller */
+    pe->pooled  = 1;
+
+    pthread_mutex_init(&pe->listing_lock, NULL);
+
+    pthread_mutex_lock(&pool->lock);
+
+    HASH_FIND(hh, pool->hash, &key, sizeof(key), dup);
+
+    if (dup) {
+        /* Somebody else opened it while we were busy, use theirs */
+        dup->refcnt++;
+        DL_DELETE(pool->lru, dup);
+        DL_APPEND(pool->lru, dup);
+        pthread_mutex_unlock(&pool->lock);
+
+        __peepfs_pool_entry_free(pe);
+
+        return dup;
+    }
+
+    /* The file changed underneath an older handle, drop that one */
+    HASH_FIND(hh_path, pool->hash_by_path, path, pathlen, stale);
+
+    if (stale && __peepfs_pool_detach(pool, stale)) {
+        victim = stale;
+    }
+
+    HASH_ADD_KEYPTR(hh, pool->hash, &pe->key, sizeof(pe->key), pe);
+    HASH_ADD_KEYPTR(hh_path, pool->hash_by_path, pe->path, pathlen, pe);
+    DL_APPEND(pool->lru, pe);
+
+    ++pool->num_entries;
+
+    pthread_mutex_unlock(&pool->lock);
+
+    if (victim) {
+        __peepfs_pool_entry_free(victim);
+    }
+
+    /* Trim back down to size, closing idle handles outside the lock */
+    while (1) {
+
+        victim = NULL;
+
+        pthread_mutex_lock(&pool->lock);
+
+        if (pool->num_entries > pool->max_entries) {
+
+            stale = pool->lru;
+
+            if (__peepfs_pool_detach(pool, stale)) {
+                victim = stale;
+            }
+
+        } else {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+
+        pthread_mutex_unlock(&pool->lock);
+
+        if (victim) {
+            __peepfs_pool_entry_free(victim);
+        }
+    }
+
+    return pe;
+}
+
+/*
+ * Have 'release(arg)' called once the handle is finally closed, for
+ * whatever its file depends on.  Returns -1 if it already has one.
+ */
+
+static inline int
+peepfs_pool_pin(
+    peepfs_pool_t          *pool,
+    peepfs_pool_entry_t    *pe,
+    void                  (*release)(void *arg),
+    void                   *arg)
+{
+    int error = -1;
+
+    pthread_mutex_lock(&pool->lock);
+
+    if (pe->release == NULL) {
+        pe->release     = release;
+        pe->release_arg = arg;
+        error = 0;
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+
+    return error;
+}
+
+/* Drop a reference obtained from peepfs_pool_get() */
+static inline void
+peepfs_pool_put(
+    peepfs_pool_t          *pool,
+    peepfs_pool_entry_t    *pe)
+{
+    int64_t refcnt;
+
+    pthread_mutex_lock(&pool->lock);
+
+    refcnt = --pe->refcnt;
+
+    pthread_mutex_unlock(&pool->lock);
+
+    if (refcnt == 0) {
+        __peepfs_pool_entry_free(pe);
+    }
+}
+
+#endif
@@ -0,0 +1,341 @@
+#include "peepfs_archive.h"
+
+#include <stdlib.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <pthread.h>
+
+#include "peepfs_stream.h"
+
+#define MIN(x,y) ((x) < (y) ? (x) : (y))
+
+#define RAW_CHUNK       (1024*1024)
+
+/*
+ * A single compressed file (foo.log.gz, not a tarball) presented as an
+ * archive holding one entry, the decompressed data, named after the
+ * file with the compression suffix taken off.
+ *
+ * Reads go through a peepfs_stream, so they decode from the nearest
+ * point the format's index has.  The size has to be known before the
+ * entry can even be listed, and when the format doesn't record it we
+ * decode the whole thing once to find out.  That pass leaves the index
+ * behind, so every read after it, random or a tail, is cheap.
+ */
+
+typedef struct raw_archive {
+    int                 fd;
+    peepfs_stream_t    *stream;
+    char               *name;
+    pthread_mutex_t     lock;
+    int64_t             size;       /* -1 until we know */
+} raw_archive_t;
+
+typedef struct raw_file {
+    peepfs_stream_cursor_t *cursor;
+    pthread_mutex_t         lock;
+} raw_file_t;
+
+/* Suffixes we strip, the tar shorthands turn back into .tar */
+static const struct {
+    const char *suffix;
+    const char *replace;
+} raw_suffixes[] = {
+    { ".gz",    ""     },
+    { ".xz",    ""     },
+    { ".zst",   ""     },
+    { ".bz2",   ""     },
+    { ".tgz",   ".tar" },
+    { ".txz",   ".tar" },
+    { ".tzst",  ".tar" },
+    { ".tbz2",  ".tar" },
+    { NULL,     NULL   }
+};
+
+static char *
+__peepfs_raw_name(const char *filename)
+{
+    const char *base, *dot;
+    char       *name;
+    int         i, len;
+
+    base = rindex(filename, '/');
+    base = base ? base + 1 : filename;
+
+    dot = rindex(base, '.');
+
+    for (i = 0; dot && dot != base && raw_suffixes[i].suffix; ++i) {
+
+        if (strcasecmp(dot, raw_suffixes[i].suffix) == 0) {
+
+            len  = dot - base;
+            name = (char*)malloc(len + strlen(raw_suffixes[i].replace) + 1);
+
+            if (name) {
+                memcpy(name, base, len);
+                strcpy(name + len, raw_suffixes[i].replace);
+            }
+
+            return name;
+        }
+    }
+
+    return strdup(base);
+}
+
+/* Find out how big the data is, decoding all of it if we have to */
+static int64_t
+__peepfs_raw_size(raw_archive_t *archive)
+{
+    peepfs_stream_cursor_t *cursor;
+    char                   *buffer = NULL;
+    int64_t                 offset = 0, size;
+    ssize_t                 len;
+
+    /* Only the first caller has anything to work out */
+    size = __atomic_load_n(&archive->size, __ATOMIC_ACQUIRE);
+
+    if (size >= 0) {
+        return size;
+    }
+
+    pthread_mutex_lock(&archive->lock);
+
+    size = archive->size;
+
+    if (size >= 0) {
+        goto out;
+    }
+
+    size = peepfs_stream_size(archive->stream);
+
+    if (size >= 0) {
+        goto out;
+    }
+
+    cursor = peepfs_stream_cursor_open(archive->stream);
+    buffer = (char*)malloc(RAW_CHUNK);
+
+    if (cursor && buffer) {
+
+        while ((len = peepfs_stream_read(archive->stream, cursor, buffer,
+                                         offset, RAW_CHUNK)) > 0) {
+            offset += len;
+        }
+
+        /* A stream that breaks partway still shows what decoded */
+        size = offset;
+    }
+
+    if (cursor) {
+        peepfs_stream_cursor_close(archive->stream, cursor);
+    }
+
+    free(buffer);
+
+out:
+    __atomic_store_n(&archive->size, size, __ATOMIC_RELEASE);
+
+    pthread_mutex_unlock(&archive->lock);
+
+    return size;
+}
+
+void peepfs_raw_close(void *plugin_data);
+
+void *
+peepfs_raw_open(const char *filename)
+{
+    raw_archive_t          *archive;
+    peepfs_stream_cursor_t *cursor;
+    struct stat             st;
+    char                    byte;
+    ssize_t                 len = -1;
+
+    archive = (raw_archive_t*)calloc(1,sizeof(raw_archive_t));
+
+    if (archive == NULL) {
+        return NULL;
+    }
+
+    pthread_mutex_init(&archive->lock, NULL);
+
+    archive->size = -1;
+    archive->fd   = open(filename, O_RDONLY);
+    archive->name = __peepfs_raw_name(filename);
+
+    if (archive->fd < 0 || archive->name == NULL || fstat(archive->fd, &st)) {
+        goto fail;
+    }
+
+    archive->stream = peepfs_stream_open(archive->fd, 0, st.st_size);
+
+    if (archive->stream == NULL) {
+        goto fail;
+    }
+
+    /* Right magic is not enough, it has to decode */
+    cursor = peepfs_stream_cursor_open(archive->stream);
+
+    if (cursor) {
+        len = peepfs_stream_read(archive->stream, cursor, &byte, 0, 1);
+        peepfs_stream_cursor_close(archive->stream, cursor);
+    }
+
+    if (len < 0) {
+        goto fail;
+    }
+
+    return archive;
+
+fail:
+
+    peepfs_raw_close(archive);
+
+    return NULL;
+}
+
+void
+peepfs_raw_close(void *plugin_data)
+{
+    raw_archive_t *archive = (raw_archive_t*)plugin_data;
+
+    if (archive->stream) {
+        peepfs_stream_close(archive->stream);
+    }
+
+    if (archive->fd >= 0) {
+        close(archive->fd);
+    }
+
+    pthread_mutex_destroy(&archive->lock);
+
+    free(archive->name);
+    free(archive);
+}
+
+int
+peepfs_raw_enumerate(
+    void *plugin_data,
+    peepfs_archive_enum_callback_t enum_callback,
+    void *arg)
+{
+    raw_archive_t          *archive = (raw_archive_t*)plugin_data;
+    peepfs_archive_entry_t  entry;
+
+    entry.index = 0;
+    entry.size  = __peepfs_raw_size(archive);
+    entry.flags = PEEPFS_FLAG_SEEKABLE;
+
+    if (enum_callback(archive->name, &entry, arg) < 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+int
+peepfs_raw_entry_open(
+    void                   *plugin_data,
+    const char             *name,
+    peepfs_archive_entry_t *entry)
+{
+    raw_archive_t *archive = (raw_archive_t*)plugin_data;
+
+    if (strcmp(name, archive->name)) {
+        return -1;
+    }
+
+    entry->index = 0;
+    entry->size  = __peepfs_raw_size(archive);
+    entry->flags = PEEPFS_FLAG_SEEKABLE;
+
+    return 0;
+}
+
+void *
+peepfs_raw_file_open(
+    void *plugin_data,
+    peepfs_archive_entry_t *entry)
+{
+    raw_archive_t  *archive = (raw_archive_t*)plugin_data;
+    raw_file_t     *file;
+
+    if (entry->index != 0) {
+        return NULL;
+    }
+
+    file = (raw_file_t*)calloc(1,sizeof(raw_file_t));
+
+    if (file == NULL) {
+        return NULL;
+    }
+
+    file->cursor = peepfs_stream_cursor_open(archive->stream);
+
+    if (file->cursor == NULL) {
+        free(file);
+        return NULL;
+    }
+
+    pthread_mutex_init(&file->lock, NULL);
+
+    return file;
+}
+
+void
+peepfs_raw_file_close(
+    void *plugin_data,
+    void *file_data)
+{
+    raw_archive_t  *archive = (raw_archive_t*)plugin_data;
+    raw_file_t     *file  = (raw_file_t*)file_data;
+
+    peepfs_stream_cursor_close(archive->stream, file->cursor);
+    pthread_mutex_destroy(&file->lock);
+
+    free(file);
+}
+
+ssize_t
+peepfs_raw_file_read(
+    void                   *plugin_data,
+    void                   *file_data,
+    void                   *buffer,
+    size_t                  offset,
+    size_t                  size)
+{
+    raw_archive_t  *archive = (raw_archive_t*)plugin_data;
+    raw_file_t     *file  = (raw_file_t*)file_data;
+    int64_t         total;
+    ssize_t         len;
+
+    total = __peepfs_raw_size(archive);
+
+    if (offset >= total) {
+        return 0;
+    }
+
+    size = MIN(size, total - offset);
+
+    pthread_mutex_lock(&file->lock);
+
+    len = peepfs_stream_read(archive->stream, file->cursor, buffer,
+                             offset, size);
+
+    pthread_mutex_unlock(&file->lock);
+
+    return len;
+}
+
+peepfs_archive_ops_t raw_ops = {
+    .open           = peepfs_raw_open,
+    .close          = peepfs_raw_close,
+    .enumerate      = peepfs_raw_enumerate,
+    .entry_open     = peepfs_raw_entry_open,
+    .file_open      = peepfs_raw_file_open,
+    .file_close     = peepfs_raw_file_close,
+    .file_read      = peepfs_raw_file_read
+};
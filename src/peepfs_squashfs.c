@@ -0,0 +1,1098 @@
+#include "peepfs_archive.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <zlib.h>
+#include <lzma.h>
+#include <zstd.h>
+
+#include "uthash.h"
+#include "utlist.h"
+
+#define MIN(x,y) ((x) < (y) ? (x) : (y))
+#define MAX(x,y) ((x) > (y) ? (x) : (y))
+
+#define SQFS_MAGIC              0x73717368
+#define SQFS_SUPER_LEN          96
+#define SQFS_META_SIZE          8192
+#define SQFS_META_UNCOMPRESSED  0x8000
+#define SQFS_DATA_UNCOMPRESSED  0x1000000
+#define SQFS_DATA_SIZE_MASK     0xffffff
+#define SQFS_NO_FRAGMENT        0xffffffff
+#define SQFS_FRAGS_PER_BLOCK    (SQFS_META_SIZE / 16)
+#define SQFS_MAX_DEPTH          256
+#define SQFS_CACHE_BYTES        (2*1024*1024)
+#define SQFS_CACHE_MIN_BLOCKS   4
+
+#define SQFS_GZIP               1
+#define SQFS_LZMA               2
+#define SQFS_XZ                 4
+#define SQFS_ZSTD               6
+
+#define SQFS_DIR                1
+#define SQFS_FILE               2
+#define SQFS_SYMLINK            3
+#define SQFS_LDIR               8
+#define SQFS_LFILE              9
+
+/*
+ * Native reader for SquashFS 4.0 images.
+ *
+ * The inode and directory tables are walked once, on first use, and
+ * every file keeps where its data blocks start, their sizes, and which
+ * fragment holds its tail.  The metadata is let go after that.  A read
+ * then decompresses only the blocks it touches, and recently used
+ * blocks (fragment blocks especially, which are shared by many small
+ * files) stay in a small cache shared by all readers of the image,
+ * SQFS_CACHE_BYTES worth of them, or a few blocks if they're bigger.
+ */
+
+typedef struct sqfs_super {
+    uint32_t            block_size;
+    uint32_t            frag_count;
+    uint16_t            compressor;
+    uint64_t            root_inode;
+    uint64_t            inode_table;
+    uint64_t            dir_table;
+    uint64_t            frag_table;
+} sqfs_super_t;
+
+typedef struct sqfs_fragment {
+    int64_t             offset;
+    uint32_t            size;       /* on disk, with the uncompressed bit */
+} sqfs_fragment_t;
+
+typedef struct sqfs_entry {
+    const char         *name;
+    int64_t             index;
+    int64_t             size;
+    uint64_t            flags;
+    int64_t             blocks_start;
+    uint32_t           *blocks;     /* on disk sizes, with the uncompressed bit */
+    int64_t             num_blocks;
+    uint32_t            fragment;
+    uint32_t            frag_offset;
+    UT_hash_handle      hh;
+} sqfs_entry_t;
+
+/* A decompressed metadata block, only kept while walking */
+typedef struct sqfs_meta {
+    int64_t             offset;
+    int64_t             next;       /* where the block after it starts */
+    int                 len;
+    unsigned char       data[SQFS_META_SIZE];
+    UT_hash_handle      hh;
+} sqfs_meta_t;
+
+/* A decompressed data or fragment block */
+typedef struct sqfs_block {
+    int64_t             offset;
+    int64_t             refcnt;
+    int                 len;
+    unsigned char      *data;
+    struct sqfs_block  *prev;
+    struct sqfs_block  *next;
+    UT_hash_handle      hh;
+} sqfs_block_t;
+
+typedef struct sqfs_archive {
+    int                 fd;
+    sqfs_super_t        super;
+    pthread_mutex_t     lock;
+    int                 loaded;
+    int                 error;
+    sqfs_fragment_t    *fragments;
+    sqfs_entry_t       *entries;
+    int64_t             num_entries;
+    int64_t             max_entries;
+    sqfs_entry_t       *hash;
+    sqfs_meta_t        *meta;
+    sqfs_block_t       *cache;      /* hashed by offset */
+    sqfs_block_t       *lru;
+    int                 cache_blocks;
+    int                 cache_max;
+} sqfs_archive_t;
+
+typedef struct sqfs_file {
+    sqfs_entry_t       *entry;
+    int64_t            *starts;     /* where each data block is on disk */
+} sqfs_file_t;
+
+static inline uint16_t
+__peepfs_squashfs_le16(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static inline uint32_t
+__peepfs_squashfs_le32(const unsigned char *p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+           ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline uint64_t
+__peepfs_squashfs_le64(const unsigned char *p)
+{
+    return __peepfs_squashfs_le32(p) | ((uint64_t)__peepfs_squashfs_le32(p + 4) << 32);
+}
+
+/* Returns the decompressed length, or -1 */
+static int64_t
+__peepfs_squashfs_decompress(
+    sqfs_archive_t     *archive,
+    const void         *in,
+    size_t              inlen,
+    void               *out,
+    size_t              outlen)
+{
+    lzma_stream     strm = LZMA_STREAM_INIT;
+    uLongf          zlen = outlen;
+    uint64_t        memlimit = UINT64_MAX;
+    size_t          inpos = 0, outpos = 0, ret;
+    int64_t         len = -1;
+
+    switch (archive->super.compressor) {
+
+    case SQFS_GZIP:
+
+        if (uncompress(out, &zlen, in, inlen) == Z_OK) {
+            len = zlen;
+        }
+        break;
+
+    case SQFS_XZ:
+
+        if (lzma_stream_buffer_decode(&memlimit, 0, NULL, in, &inpos, inlen,
+                                      out, &outpos, outlen) == LZMA_OK) {
+            len = outpos;
+        }
+        break;
+
+    case SQFS_LZMA:
+
+        if (lzma_alone_decoder(&strm, UINT64_MAX) != LZMA_OK) {
+            break;
+        }
+
+        strm.next_in   = in;
+        strm.avail_in  = inlen;
+        strm.next_out  = out;
+        strm.avail_out = outlen;
+
+        ret = lzma_code(&strm, LZMA_FINISH);
+
+        if (ret == LZMA_OK || ret == LZMA_STREAM_END) {
+            len = outlen - strm.avail_out;
+        }
+
+        lzma_end(&strm);
+        break;
+
+    case SQFS_ZSTD:
+
+        ret = ZSTD_decompress(out, outlen, in, inlen);
+
+        if (!ZSTD_isError(ret)) {
+            len = ret;
+        }
+        break;
+    }
+
+    return len;
+}
+
+/* The metadata block at 'offset', decompressed once per walk */
+static sqfs_meta_t *
+__peepfs_squashfs_meta(sqfs_archive_t *archive, int64_t offset)
+{
+    sqfs_meta_t    *meta;
+    unsigned char   raw[SQFS_META_SIZE + 2];
+    int             size;
+
+    HASH_FIND(hh, archive->meta, &offset, sizeof(offset), meta);
+
+    if (meta) {
+        return meta;
+    }
+
+    if (pread(archive->fd, raw, 2, offset) != 2) {
+        return NULL;
+    }
+
+    size = __peepfs_squashfs_le16(raw) & ~SQFS_META_UNCOMPRESSED;
+
+    if (size == 0 || size > SQFS_META_SIZE ||
+        pread(archive->fd, raw + 2, size, offset + 2) != size) {
+        return NULL;
+    }
+
+    meta = (sqfs_meta_t*)calloc(1,sizeof(sqfs_meta_t));
+
+    if (meta == NULL) {
+        return NULL;
+    }
+
+    meta->offset = offset;
+    meta->next   = offset + 2 + size;
+
+    if (__peepfs_squashfs_le16(raw) & SQFS_META_UNCOMPRESSED) {
+        memcpy(meta->data, raw + 2, size);
+        meta->len = size;
+    } else {
+        meta->len = __peepfs_squashfs_decompress(archive, raw + 2, size,
+                                                 meta->data, SQFS_META_SIZE);
+    }
+
+    if (meta->len <= 0) {
+        free(meta);
+        return NULL;
+    }
+
+    HASH_ADD(hh, archive->meta, offset, sizeof(meta->offset), meta);
+
+    return meta;
+}
+
+/*
+ * Read 'len' bytes of metadata starting 'pos' bytes into the block at
+ * '*block', carrying on into the blocks after it.  Both are advanced.
+ */
+static int
+__peepfs_squashfs_meta_read(
+    sqfs_archive_t *archive,
+    int64_t        *block,
+    int            *pos,
+    void           *buffer,
+    int64_t         len)
+{
+    sqfs_meta_t    *meta;
+    int64_t         copied = 0, n;
+
+    while (copied < len) {
+
+        meta = __peepfs_squashfs_meta(archive, *block);
+
+        if (meta == NULL) {
+            return -1;
+        }
+
+        if (*pos >= meta->len) {
+            *pos  -= meta->len;
+            *block = meta->next;
+            continue;
+        }
+
+        n = MIN(len - copied, meta->len - *pos);
+
+        memcpy((char*)buffer + copied, meta->data + *pos, n);
+
+        copied += n;
+        *pos   += n;
+    }
+
+    return 0;
+}
+
+static sqfs_entry_t *
+__peepfs_squashfs_add_entry(sqfs_archive_t *archive)
+{
+    sqfs_entry_t *entries;
+
+    if (archive->num_entries == archive->max_entries) {
+
+        entries = (sqfs_entry_t*)realloc(archive->entries,
+            (archive->max_entries * 2 + 64) * sizeof(sqfs_entry_t));
+
+        if (entries == NULL) {
+            return NULL;
+        }
+
+        archive->entries = entries;
+        archive->max_entries = archive->max_entries * 2 + 64;
+    }
+
+    entries = &archive->entries[archive->num_entries];
+
+    memset(entries, 0, sizeof(*entries));
+
+    entries->index = archive->num_entries++;
+
+    return entries;
+}
+
+/* Fill in what a file inode says about where its data is */
+static int
+__peepfs_squashfs_file(
+    sqfs_archive_t *archive,
+    sqfs_entry_t   *entry,
+    int             type,
+    int64_t         block,
+    int             pos)
+{
+    unsigned char   buf[40];
+    int64_t         size, nblocks;
+
+    if (type == SQFS_FILE) {
+
+        if (__peepfs_squashfs_meta_read(archive, &block, &pos, buf, 16)) {
+            return -1;
+        }
+
+        entry->blocks_start = __peepfs_squashfs_le32(buf);
+        entry->fragment     = __peepfs_squashfs_le32(buf + 4);
+        entry->frag_offset  = __peepfs_squashfs_le32(buf + 8);
+        size                = __peepfs_squashfs_le32(buf + 12);
+
+    } else {
+
+        if (__peepfs_squashfs_meta_read(archive, &block, &pos, buf, 40)) {
+            return -1;
+        }
+
+        entry->blocks_start = __peepfs_squashfs_le64(buf);
+        size                = __peepfs_squashfs_le64(buf + 8);
+        entry->fragment     = __peepfs_squashfs_le32(buf + 28);
+        entry->frag_offset  = __peepfs_squashfs_le32(buf + 32);
+    }
+
+    if (size < 0 ||
+        (entry->fragment != SQFS_NO_FRAGMENT &&
+         entry->fragment >= archive->super.frag_count)) {
+        return -1;
+    }
+
+    /* The tail of the file is in a fragment, if it has one */
+    if (entry->fragment == SQFS_NO_FRAGMENT) {
+        nblocks = (size + archive->super.block_size - 1) / archive->super.block_size;
+    } else {
+        nblocks = size / archive->super.block_size;
+    }
+
+    entry->size       = size;
+    entry->num_blocks = nblocks;
+
+    if (nblocks == 0) {
+        return 0;
+    }
+
+    entry->blocks = (uint32_t*)malloc(nblocks * sizeof(uint32_t));
+
+    if (entry->blocks == NULL ||
+        __peepfs_squashfs_meta_read(archive, &block, &pos, entry->blocks,
+                                    nblocks * sizeof(uint32_t))) {
+        return -1;
+    }
+
+    for (size = 0; size < nblocks; ++size) {
+        entry->blocks[size] = __peepfs_squashfs_le32(
+            (unsigned char*)&entry->blocks[size]);
+    }
+
+    return 0;
+}
+
+/* Where a directory inode says its listing is */
+static int
+__peepfs_squashfs_dir(
+    sqfs_archive_t *archive,
+    int             type,
+    int64_t         block,
+    int             pos,
+    int64_t        *list_block,
+    int            *list_pos,
+    int64_t        *list_len)
+{
+    unsigned char buf[24];
+
+    if (type == SQFS_DIR) {
+
+        if (__peepfs_squashfs_meta_read(archive, &block, &pos, buf, 16)) {
+            return -1;
+        }
+
+        *list_block = __peepfs_squashfs_le32(buf);
+        *list_len   = __peepfs_squashfs_le16(buf + 8);
+        *list_pos   = __peepfs_squashfs_le16(buf + 10);
+
+    } else {
+
+        if (__peepfs_squashfs_meta_read(archive, &block, &pos, buf, 24)) {
+            return -1;
+        }
+
+        *list_len   = __peepfs_squashfs_le32(buf + 4);
+        *list_block = __peepfs_squashfs_le32(buf + 8);
+        *list_pos   = __peepfs_squashfs_le16(buf + 18);
+    }
+
+    *list_block += archive->super.dir_table;
+
+    /* The size counts "." and ".." which aren't stored */
+    *list_len -= 3;
+
+    return 0;
+}
+
+/* Walk the directory whose inode is at 'inode', adding everything under 'path' */
+static int
+__peepfs_squashfs_walk(
+    sqfs_archive_t *archive,
+    const char     *path,
+    uint64_t        inode,
+    int             depth)
+{
+    unsigned char   hdr[16], ent[8], *listing = NULL;
+    char            name[PATH_MAX], leaf[NAME_MAX+2];
+    sqfs_entry_t   *entry;
+    int64_t         block, list_block, list_len, lpos, count, ib;
+    int             pos, list_pos, type, name_len, ipos, itype;
+    int             error = 0;
+
+    if (depth > SQFS_MAX_DEPTH) {
+        return -1;
+    }
+
+    block = archive->super.inode_table + (inode >> 16);
+    pos   = inode & 0xffff;
+
+    if (__peepfs_squashfs_meta_read(archive, &block, &pos, hdr, 16)) {
+        return -1;
+    }
+
+    type = __peepfs_squashfs_le16(hdr);
+
+    if ((type != SQFS_DIR && type != SQFS_LDIR) ||
+        __peepfs_squashfs_dir(archive, type, block, pos,
+                              &list_block, &list_pos, &list_len)) {
+        return -1;
+    }
+
+    if (list_len <= 0) {
+        return 0;
+    }
+
+    listing = (unsigned char*)malloc(list_len);
+
+    if (listing == NULL ||
+        __peepfs_squashfs_meta_read(archive, &list_block, &list_pos,
+                                    listing, list_len)) {
+        error = -1;
+        goto out;
+    }
+
+    lpos = 0;
+
+    while (lpos + 12 <= list_len) {
+
+        /* A header, then the entries sharing its inode block */
+        count = __peepfs_squashfs_le32(listing + lpos) + 1;
+        ib    = __peepfs_squashfs_le32(listing + lpos + 4);
+
+        lpos += 12;
+
+        for (; count > 0; --count) {
+
+            if (lpos + 8 > list_len) {
+                error = -1;
+                goto out;
+            }
+
+            memcpy(ent, listing + lpos, 8);
+
+            name_len = __peepfs_squashfs_le16(ent + 6) + 1;
+            lpos    += 8;
+
+            if (lpos + name_len > list_len || name_len > (int)sizeof(leaf) - 1) {
+                error = -1;
+                goto out;
+            }
+
+            memcpy(leaf, listing + lpos, name_len);
+            leaf[name_len] = '\0';
+
+            lpos += name_len;
+
+            if (index(leaf, '/') || strcmp(leaf, ".") == 0 ||
+                strcmp(leaf, "..") == 0) {
+                continue;
+            }
+
+            if (path[0]) {
+                snprintf(name, sizeof(name), "%s/%s", path, leaf);
+            } else {
+                snprintf(name, sizeof(name), "%s", leaf);
+            }
+
+            /* The type in the listing is always the basic one */
+            block = archive->super.inode_table + ib;
+            ipos  = __peepfs_squashfs_le16(ent);
+
+            if (__peepfs_squashfs_meta_read(archive, &block, &ipos, hdr, 16)) {
+                error = -1;
+                goto out;
+            }
+
+            itype = __peepfs_squashfs_le16(hdr);
+
+            entry = __peepfs_squashfs_add_entry(archive);
+
+            if (entry == NULL) {
+                error = -1;
+                goto out;
+            }
+
+            entry->name     = strdup(name);
+            entry->flags    = PEEPFS_FLAG_SEEKABLE;
+            entry->fragment = SQFS_NO_FRAGMENT;
+
+            if (entry->name == NULL) {
+                archive->num_entries--;
+                error = -1;
+                goto out;
+            }
+
+            switch (itype) {
+
+            case SQFS_DIR:
+            case SQFS_LDIR:
+
+                entry->flags |= PEEPFS_FLAG_DIR;
+
+                if (__peepfs_squashfs_walk(archive, name,
+                        ((uint64_t)ib << 16) | __peepfs_squashfs_le16(ent),
+                        depth + 1)) {
+                    error = -1;
+                    goto out;
+                }
+                break;
+
+            case SQFS_FILE:
+            case SQFS_LFILE:
+
+                if (__peepfs_squashfs_file(archive, entry, itype, block, ipos)) {
+                    error = -1;
+                    goto out;
+                }
+                break;
+
+            default:
+                /* Symlinks, devices and such show up as empty files */
+                break;
+            }
+        }
+    }
+
+out:
+
+    free(listing);
+
+    return error;
+}
+
+static int
+__peepfs_squashfs_load_fragments(sqfs_archive_t *archive)
+{
+    unsigned char   loc[8], frag[16];
+    int64_t         i, block;
+    int             pos;
+
+    if (archive->super.frag_count == 0) {
+        return 0;
+    }
+
+    archive->fragments = (sqfs_fragment_t*)calloc(archive->super.frag_count,
+                                                  sizeof(sqfs_fragment_t));
+
+    if (archive->fragments == NULL) {
+        return -1;
+    }
+
+    for (i = 0; i < archive->super.frag_count; ++i) {
+
+        /* Every metadata block of the table is listed up front */
+        if (i % SQFS_FRAGS_PER_BLOCK == 0) {
+
+            if (pread(archive->fd, loc, 8, archive->super.frag_table +
+                      (i / SQFS_FRAGS_PER_BLOCK) * 8) != 8) {
+                return -1;
+            }
+
+            block = __peepfs_squashfs_le64(loc);
+            pos   = 0;
+        }
+
+        if (__peepfs_squashfs_meta_read(archive, &block, &pos, frag, 16)) {
+            return -1;
+        }
+
+        archive->fragments[i].offset = __peepfs_squashfs_le64(frag);
+        archive->fragments[i].size   = __peepfs_squashfs_le32(frag + 8);
+    }
+
+    return 0;
+}
+
+static void
+__peepfs_squashfs_free_meta(sqfs_archive_t *archive)
+{
+    sqfs_meta_t *meta, *tmp;
+
+    HASH_ITER(hh, archive->meta, meta, tmp) {
+        HASH_DEL(archive->meta, meta);
+        free(meta);
+    }
+}
+
+/* Walk the tables on first use, building the entry table */
+static int
+__peepfs_squashfs_ready(sqfs_archive_t *archive)
+{
+    sqfs_entry_t   *entry, *target;
+    int64_t         i;
+    int             error;
+
+    pthread_mutex_lock(&archive->lock);
+
+    if (!archive->loaded) {
+
+        if (__peepfs_squashfs_load_fragments(archive) ||
+            __peepfs_squashfs_walk(archive, "", archive->super.root_inode, 0)) {
+            archive->error = -1;
+        }
+
+        /* Every entry has what it needs, the metadata can go */
+        __peepfs_squashfs_free_meta(archive);
+
+        for (i = 0; !archive->error && i < archive->num_entries; ++i) {
+            entry = &archive->entries[i];
+            HASH_FIND_STR(archive->hash, entry->name, target);
+            if (target == NULL) {
+                HASH_ADD_KEYPTR(hh, archive->hash, entry->name,
+                                strlen(entry->name), entry);
+            }
+        }
+
+        archive->loaded = 1;
+    }
+
+    error = archive->error;
+
+    pthread_mutex_unlock(&archive->lock);
+
+    return error;
+}
+
+static void
+__peepfs_squashfs_block_put(sqfs_block_t *block)
+{
+    if (--block->refcnt == 0) {
+        free(block->data);
+        free(block);
+    }
+}
+
+/*
+ * Return a referenced, decompressed copy of the 'size' (as stored)
+ * bytes at 'offset', from the cache if we can.
+ */
+static sqfs_block_t *
+__peepfs_squashfs_block_get(
+    sqfs_archive_t *archive,
+    int64_t         offset,
+    uint32_t        size)
+{
+    sqfs_block_t   *block, *other, *old;
+    unsigned char  *raw;
+    int64_t         disk = size & SQFS_DATA_SIZE_MASK;
+
+    pthread_mutex_lock(&archive->lock);
+
+    HASH_FIND(hh, archive->cache, &offset, sizeof(offset), block);
+
+    if (block) {
+        DL_DELETE(archive->lru, block);
+        DL_APPEND(archive->lru, block);
+        block->refcnt++;
+        pthread_mutex_unlock(&archive->lock);
+        return block;
+    }
+
+    pthread_mutex_unlock(&archive->lock);
+
+    /* Decompress without holding up other readers */
+    block = (sqfs_block_t*)calloc(1,sizeof(sqfs_block_t));
+    raw   = (unsigned char*)malloc(disk + 1);
+
+    if (block == NULL || raw == NULL || disk > archive->super.block_size) {
+        goto fail;
+    }
+
+    block->offset = offset;
+    block->refcnt = 1;
+    block->data   = (unsigned char*)malloc(archive->super.block_size);
+
+    if (block->data == NULL ||
+        pread(archive->fd, raw, disk, offset) != disk) {
+        goto fail;
+    }
+
+    if (size & SQFS_DATA_UNCOMPRESSED) {
+        memcpy(block->data, raw, disk);
+        block->len = disk;
+    } else {
+        block->len = __peepfs_squashfs_decompress(archive, raw, disk,
+                         block->data, archive->super.block_size);
+    }
+
+    if (block->len < 0) {
+        goto fail;
+    }
+
+    free(raw);
+
+    pthread_mutex_lock(&archive->lock);
+
+    HASH_FIND(hh, archive->cache, &offset, sizeof(offset), other);
+
+    if (other) {
+        /* Somebody beat us to it */
+        other->refcnt++;
+        pthread_mutex_unlock(&archive->lock);
+        __peepfs_squashfs_block_put(block);
+        return other;
+    }
+
+    if (archive->cache_blocks >= archive->cache_max) {
+        old = archive->lru;
+        DL_DELETE(archive->lru, old);
+        HASH_DEL(archive->cache, old);
+        __peepfs_squashfs_block_put(old);
+        archive->cache_blocks--;
+    }
+
+    /* One reference for the cache, one for the caller */
+    block->refcnt++;
+
+    HASH_ADD(hh, archive->cache, offset, sizeof(block->offset), block);
+    DL_APPEND(archive->lru, block);
+    archive->cache_blocks++;
+
+    pthread_mutex_unlock(&archive->lock);
+
+    return block;
+
+fail:
+
+    if (block) {
+        free(block->data);
+        free(block);
+    }
+
+    free(raw);
+
+    return NULL;
+}
+
+static int
+__peepfs_squashfs_supported(int compressor)
+{
+    return compressor == SQFS_GZIP || compressor == SQFS_XZ ||
+           compressor == SQFS_LZMA || compressor == SQFS_ZSTD;
+}
+
+void peepfs_squashfs_close(void *plugin_data);
+
+void *
+peepfs_squashfs_open(const char *filename)
+{
+    sqfs_archive_t *archive;
+    sqfs_super_t   *super;
+    unsigned char   sb[SQFS_SUPER_LEN];
+
+    archive = (sqfs_archive_t*)calloc(1,sizeof(sqfs_archive_t));
+
+    if (archive == NULL) {
+        return NULL;
+    }
+
+    pthread_mutex_init(&archive->lock, NULL);
+
+    archive->fd = open(filename, O_RDONLY);
+
+    if (archive->fd < 0 ||
+        pread(archive->fd, sb, sizeof(sb), 0) != sizeof(sb)) {
+        goto fail;
+    }
+
+    super = &archive->super;
+
+    super->block_size  = __peepfs_squashfs_le32(sb + 12);
+    super->frag_count  = __peepfs_squashfs_le32(sb + 16);
+    super->compressor  = __peepfs_squashfs_le16(sb + 20);
+    super->root_inode  = __peepfs_squashfs_le64(sb + 32);
+    super->inode_table = __peepfs_squashfs_le64(sb + 64);
+    super->dir_table   = __peepfs_squashfs_le64(sb + 72);
+    super->frag_table  = __peepfs_squashfs_le64(sb + 80);
+
+    /* 4.0 only, block sizes are powers of two from 4K to 1M */
+    if (__peepfs_squashfs_le32(sb) != SQFS_MAGIC ||
+        __peepfs_squashfs_le16(sb + 28) != 4 ||
+        super->block_size < 4096 || super->block_size > 1024*1024 ||
+        (super->block_size & (super->block_size - 1)) ||
+        !__peepfs_squashfs_supported(super->compressor)) {
+        goto fail;
+    }
+
+    archive->cache_max = MAX(SQFS_CACHE_BYTES / super->block_size,
+                             SQFS_CACHE_MIN_BLOCKS);
+
+    return archive;
+
+fail:
+
+    peepfs_squashfs_close(archive);
+
+    return NULL;
+}
+
+void
+peepfs_squashfs_close(void *plugin_data)
+{
+    sqfs_archive_t *archive = (sqfs_archive_t*)plugin_data;
+    sqfs_block_t   *block, *tmp;
+    int64_t         i;
+
+    HASH_CLEAR(hh, archive->hash);
+
+    DL_FOREACH_SAFE(archive->lru, block, tmp) {
+        DL_DELETE(archive->lru, block);
+        HASH_DEL(archive->cache, block);
+        __peepfs_squashfs_block_put(block);
+    }
+
+    __peepfs_squashfs_free_meta(archive);
+
+    for (i = 0; i < archive->num_entries; ++i) {
+        free((void*)archive->entries[i].name);
+        free(archive->entries[i].blocks);
+    }
+
+    if (archive->fd >= 0) {
+        close(archive->fd);
+    }
+
+    pthread_mutex_destroy(&archive->lock);
+
+    free(archive->entries);
+    free(archive->fragments);
+    free(archive);
+}
+
+int
+peepfs_squashfs_enumerate(
+    void *plugin_data,
+    peepfs_archive_enum_callback_t enum_callback,
+    void *arg)
+{
+    sqfs_archive_t         *archive = (sqfs_archive_t*)plugin_data;
+    sqfs_entry_t           *se;
+    peepfs_archive_entry_t  entry;
+    int64_t                 i;
+
+    if (__peepfs_squashfs_ready(archive)) {
+        return -1;
+    }
+
+    for (i = 0; i < archive->num_entries; ++i) {
+
+        se = &archive->entries[i];
+
+        entry.index = se->index;
+        entry.size  = se->size;
+        entry.flags = se->flags;
+
+        if (enum_callback(se->name, &entry, arg) < 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int
+peepfs_squashfs_entry_open(
+    void                   *plugin_data,
+    const char             *name,
+    peepfs_archive_entry_t *entry)
+{
+    sqfs_archive_t *archive = (sqfs_archive_t*)plugin_data;
+    sqfs_entry_t   *se;
+
+    if (__peepfs_squashfs_ready(archive)) {
+        return -1;
+    }
+
+    HASH_FIND_STR(archive->hash, name, se);
+
+    if (se == NULL) {
+        return -1;
+    }
+
+    entry->index = se->index;
+    entry->size  = se->size;
+    entry->flags = se->flags;
+
+    return 0;
+}
+
+void *
+peepfs_squashfs_file_open(
+    void *plugin_data,
+    peepfs_archive_entry_t *entry)
+{
+    sqfs_archive_t *archive = (sqfs_archive_t*)plugin_data;
+    sqfs_file_t    *file;
+    sqfs_entry_t   *se;
+    int64_t         i, offset;
+
+    if (__peepfs_squashfs_ready(archive)) {
+        return NULL;
+    }
+
+    if (entry->index < 0 || entry->index >= archive->num_entries) {
+        return NULL;
+    }
+
+    se = &archive->entries[entry->index];
+
+    file = (sqfs_file_t*)calloc(1,sizeof(sqfs_file_t));
+
+    if (file == NULL) {
+        return NULL;
+    }
+
+    file->entry  = se;
+    file->starts = (int64_t*)malloc((se->num_blocks + 1) * sizeof(int64_t));
+
+    if (file->starts == NULL) {
+        free(file);
+        return NULL;
+    }
+
+    /* Blocks are back to back, so a running sum tells where each is */
+    offset = se->blocks_start;
+
+    for (i = 0; i < se->num_blocks; ++i) {
+        file->starts[i] = offset;
+        offset += se->blocks[i] & SQFS_DATA_SIZE_MASK;
+    }
+
+    return file;
+}
+
+void
+peepfs_squashfs_file_close(
+    void *plugin_data,
+    void *file_data)
+{
+    sqfs_file_t *file = (sqfs_file_t*)file_data;
+
+    free(file->starts);
+    free(file);
+}
+
+ssize_t
+peepfs_squashfs_file_read(
+    void                   *plugin_data,
+    void                   *file_data,
+    void                   *buffer,
+    size_t                  offset,
+    size_t                  size)
+{
+    sqfs_archive_t     *archive = (sqfs_archive_t*)plugin_data;
+    sqfs_file_t        *file = (sqfs_file_t*)file_data;
+    sqfs_entry_t       *se = file->entry;
+    sqfs_fragment_t    *frag;
+    sqfs_block_t       *block = NULL;
+    int64_t             bs = archive->super.block_size;
+    int64_t             i, pos, from, n, copied = 0;
+
+    if (offset >= se->size) {
+        return 0;
+    }
+
+    size = MIN(size, se->size - offset);
+
+    while (copied < size) {
+
+        pos  = offset + copied;
+        i    = pos / bs;
+        from = pos % bs;
+        n    = MIN(size - copied, bs - from);
+
+        if (i < se->num_blocks) {
+
+            /* A zero size block is a hole */
+            if ((se->blocks[i] & SQFS_DATA_SIZE_MASK) == 0) {
+                memset((char*)buffer + copied, 0, n);
+                copied += n;
+                continue;
+            }
+
+            block = __peepfs_squashfs_block_get(archive, file->starts[i],
+                                                se->blocks[i]);
+
+            if (block == NULL || from + n > block->len) {
+                goto fail;
+            }
+
+            memcpy((char*)buffer + copied, block->data + from, n);
+
+        } else {
+
+            /* The tail, packed in with other tails in a fragment block */
+            frag  = &archive->fragments[se->fragment];
+            block = __peepfs_squashfs_block_get(archive, frag->offset, frag->size);
+
+            if (block == NULL || se->frag_offset + from + n > block->len) {
+                goto fail;
+            }
+
+            memcpy((char*)buffer + copied, block->data + se->frag_offset + from, n);
+        }
+
+        pthread_mutex_lock(&archive->lock);
+        __peepfs_squashfs_block_put(block);
+        pthread_mutex_unlock(&archive->lock);
+
+        copied += n;
+    }
+
+    return copied;
+
+fail:
+
+    if (block) {
+        pthread_mutex_lock(&archive->lock);
+        __peepfs_squashfs_block_put(block);
+        pthread_mutex_unlock(&archive->lock);
+    }
+
+    return copied ? copied : -1;
+}
+
+peepfs_archive_ops_t squashfs_ops = {
+    .open           = peepfs_squashfs_open,
+    .close          = peepfs_squashfs_close,
+    .enumerate      = peepfs_squashfs_enumerate,
+    .entry_open     = peepfs_squashfs_entry_open,
+    .file_open      = peepfs_squashfs_file_open,
+    .file_close     = peepfs_squashfs_file_close,
+    .file_read      = peepfs_squashfs_file_read
+};
@@ -0,0 +1,115 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "peepfs_stream.h"
+
+extern peepfs_stream_ops_t zran_stream_ops;
+extern peepfs_stream_ops_t xz_stream_ops;
+extern peepfs_stream_ops_t zstd_stream_ops;
+extern peepfs_stream_ops_t bz2_stream_ops;
+
+typedef struct peepfs_stream_magic {
+    const unsigned char    *magic;
+    int                     len;
+    peepfs_stream_ops_t    *ops;
+} peepfs_stream_magic_t;
+
+static const peepfs_stream_magic_t peepfs_stream_magics[] = {
+    { (const unsigned char *)"\x1f\x8b",                 2, &zran_stream_ops },
+    { (const unsigned char *)"\xfd\x37\x7a\x58\x5a\x00", 6, &xz_stream_ops   },
+    { (const unsigned char *)"\x28\xb5\x2f\xfd",         4, &zstd_stream_ops },
+    { (const unsigned char *)"BZh",                      3, &bz2_stream_ops  },
+};
+
+#define PEEPFS_STREAM_NUM_MAGICS \
+    (sizeof(peepfs_stream_magics) / sizeof(peepfs_stream_magics[0]))
+
+peepfs_stream_t *
+peepfs_stream_open(
+    int         fd,
+    int64_t     start,
+    int64_t     length)
+{
+    peepfs_stream_t        *stream;
+    peepfs_stream_ops_t    *ops = NULL;
+    unsigned char           magic[8];
+    ssize_t                 len;
+    void                   *plugin_data;
+    int                     i;
+
+    len = pread(fd, magic, length < sizeof(magic) ? length : sizeof(magic), start);
+
+    if (len <= 0) {
+        return NULL;
+    }
+
+    for (i = 0; i < PEEPFS_STREAM_NUM_MAGICS; ++i) {
+        if (len >= peepfs_stream_magics[i].len &&
+            memcmp(magic, peepfs_stream_magics[i].magic,
+                   peepfs_stream_magics[i].len) == 0) {
+            ops = peepfs_stream_magics[i].ops;
+            break;
+        }
+    }
+
+    if (ops == NULL) {
+        return NULL;
+    }
+
+    plugin_data = ops->open(fd, start, length);
+
+    if (plugin_data == NULL) {
+        return NULL;
+    }
+
+    stream = (peepfs_stream_t*)calloc(1,sizeof(peepfs_stream_t));
+
+    if (stream == NULL) {
+        ops->close(plugin_data);
+        return NULL;
+    }
+
+    stream->ops = ops;
+    stream->plugin_data = plugin_data;
+
+    return stream;
+}
+
+void
+peepfs_stream_close(peepfs_stream_t *stream)
+{
+    stream->ops->close(stream->plugin_data);
+    free(stream);
+}
+
+int64_t
+peepfs_stream_size(peepfs_stream_t *stream)
+{
+    return stream->ops->size(stream->plugin_data);
+}
+
+peepfs_stream_cursor_t *
+peepfs_stream_cursor_open(peepfs_stream_t *stream)
+{
+    return stream->ops->cursor_open(stream->plugin_data);
+}
+
+void
+peepfs_stream_cursor_close(
+    peepfs_stream_t        *stream,
+    peepfs_stream_cursor_t *cursor)
+{
+    stream->ops->cursor_close(stream->plugin_data, cursor);
+}
+
+ssize_t
+peepfs_stream_read(
+    peepfs_stream_t        *stream,
+    peepfs_stream_cursor_t *cursor,
+    void                   *buffer,
+    int64_t                 offset,
+    size_t                  len)
+{
+    return stream->ops->read(stream->plugin_data, cursor, buffer, offset, len);
+}
@@ -0,0 +1,78 @@
+#ifndef __PEEPFS_STREAM_H__
+#define __PEEPFS_STREAM_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Random access into compressed streams.
+ *
+ * A stream is a range of a file holding compressed data, read as the
+ * bytes it decompresses to.  Each format keeps whatever index it can
+ * get (access points, block or frame tables) so that a read starts
+ * decoding close to where it lands instead of at the beginning.
+ * Readers each hold a cursor with their own decoder state, so
+ * sequential reads on one cursor carry on where the last one stopped.
+ */
+
+typedef void * (*peepfs_stream_open_t)(
+    int fd, int64_t start, int64_t length);
+
+typedef void   (*peepfs_stream_close_t)(
+    void *stream);
+
+typedef int64_t (*peepfs_stream_size_t)(
+    void *stream);
+
+typedef void * (*peepfs_stream_cursor_open_t)(
+    void *stream);
+
+typedef void   (*peepfs_stream_cursor_close_t)(
+    void *stream, void *cursor);
+
+typedef ssize_t (*peepfs_stream_read_t)(
+    void *stream, void *cursor, void *buffer, int64_t offset, size_t len);
+
+typedef struct peepfs_stream_ops {
+    peepfs_stream_open_t            open;
+    peepfs_stream_close_t           close;
+    peepfs_stream_size_t            size;
+    peepfs_stream_cursor_open_t     cursor_open;
+    peepfs_stream_cursor_close_t    cursor_close;
+    peepfs_stream_read_t            read;
+} peepfs_stream_ops_t;
+
+typedef struct peepfs_stream {
+    peepfs_stream_ops_t        *ops;
+    void                       *plugin_data;
+} peepfs_stream_t;
+
+typedef void peepfs_stream_cursor_t;
+
+/*
+ * Open the 'length' bytes at 'start' in 'fd' as a compressed stream,
+ * going by their magic number.  Returns NULL if the format isn't one
+ * we know.  The fd stays owned by the caller.
+ */
+peepfs_stream_t * peepfs_stream_open(
+    int fd, int64_t start, int64_t length);
+
+void peepfs_stream_close(
+    peepfs_stream_t *stream);
+
+/* Uncompressed size, or -1 if it isn't known yet */
+int64_t peepfs_stream_size(
+    peepfs_stream_t *stream);
+
+peepfs_stream_cursor_t * peepfs_stream_cursor_open(
+    peepfs_stream_t *stream);
+
+void peepfs_stream_cursor_close(
+    peepfs_stream_t *stream, peepfs_stream_cursor_t *cursor);
+
+/* Returns the bytes read, short only at the end of the stream, or -1 */
+ssize_t peepfs_stream_read(
+    peepfs_stream_t *stream, peepfs_stream_cursor_t *cursor,
+    void *buffer, int64_t offset, size_t len);
+
+#endif
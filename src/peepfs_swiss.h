@@ -0,0 +1,542 @@
+#ifndef __PEEPFS_SWISS_H__
+#define __PEEPFS_SWISS_H__
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "peepfs_epoch.h"
+
+/*
+ * Open addressing hash table of pointers, probed a group at a time.
+ *
+ * Slots come in groups of 16, each with a control byte per slot:
+ * empty, deleted, or 7 bits of the item's hash.  A lookup compares the
+ * whole group's control bytes at once (SSE2, or eight at a time in a
+ * plain word elsewhere) and only follows pointers whose bits match,
+ * stopping at the first group with an empty slot.  Items carry their
+ * own 64 bit hash at 'hash_offset', and the low bits of it are left to
+ * the caller, which shards on them.
+ *
+ * Writers lock against each other; lookups may run without a lock when
+ * the table is given an epoch.  A slot's pointer is published before
+ * its control byte and deleted slots keep their pointer, so a lookup
+ * only ever follows a pointer to an item that was in the table after
+ * it entered its epoch.
+ *
+ * Growing doesn't rehash everything at once.  The bigger table takes
+ * over straight away with the old one hanging off it; each insert then
+ * moves a few more groups across, and lookups try the new table before
+ * the old.  The old table is freed through the epoch once it's empty.
+ */
+
+#define PEEPFS_SWISS_GROUP      16
+
+/* Groups moved from the old table per insert while growing */
+#define SWISS_MIGRATE_GROUPS    8
+
+#define SWISS_EMPTY             0x80
+#define SWISS_DELETED           0xfe
+
+#define SWISS_LO                0x0101010101010101ULL
+#define SWISS_HI                0x8080808080808080ULL
+
+typedef struct peepfs_swiss_group {
+    uint64_t                    ctrl[PEEPFS_SWISS_GROUP / 8];   /* atomic */
+    void                       *slots[PEEPFS_SWISS_GROUP];      /* atomic */
+} __attribute__((aligned(16))) peepfs_swiss_group_t;
+
+typedef struct peepfs_swiss_table {
+    struct peepfs_swiss_table  *prev;       /* atomic, still being moved */
+    struct peepfs_swiss_table  *next;       /* retired */
+    uint64_t                    retired;    /* epoch it was let go in */
+    uint64_t                    mask;       /* groups - 1 */
+    int64_t                     live;
+    int64_t                     growth_left;    /* empty slots we may fill */
+    uint64_t                    migrated;   /* groups of 'prev' moved */
+    peepfs_swiss_group_t        groups[];
+} peepfs_swiss_table_t;
+
+typedef struct peepfs_swiss {
+    peepfs_swiss_table_t       *table;      /* atomic */
+    peepfs_swiss_table_t       *retired;    /* oldest first */
+    peepfs_swiss_table_t       *retired_tail;
+    peepfs_epoch_t             *epoch;      /* NULL if only writers look */
+    size_t                      hash_offset;
+} peepfs_swiss_t;
+
+/* Matches an item against whatever key the caller looks up by */
+typedef int (*peepfs_swiss_match_t)(const void *item, const void *key);
+
+static inline uint64_t
+__peepfs_swiss_mum(uint64_t a, uint64_t b)
+{
+    __uint128_t r = (__uint128_t)a * b;
+
+    return (uint64_t)r ^ (uint64_t)(r >> 64);
+}
+
+static inline uint64_t
+__peepfs_swiss_r8(const unsigned char *p)
+{
+    uint64_t v;
+
+    memcpy(&v, p, sizeof(v));
+
+    return v;
+}
+
+static inline uint64_t
+__peepfs_swiss_r4(const unsigned char *p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+
+    return v;
+}
+
+/* wyhash's construction: a 64x64->128 multiply folded, per 16 bytes */
+static inline uint64_t
+peepfs_swiss_hash(const void *key, size_t len, uint64_t seed)
+{
+    const uint64_t          p0 = 0xa0761d6478bd642fULL;
+    const uint64_t          p1 = 0xe7037ed1a0b428dbULL;
+    const unsigned char    *p = (const unsigned char*)key;
+    uint64_t                a, b;
+    size_t                  i = len;
+
+    seed ^= __peepfs_swiss_mum(seed ^ p0, p1);
+
+    if (len <= 16) {
+        if (len >= 4) {
+            a = (__peepfs_swiss_r4(p) << 32) | __peepfs_swiss_r4(p + ((len >> 3) << 2));
+            b = (__peepfs_swiss_r4(p + len - 4) << 32) |
+                __peepfs_swiss_r4(p + len - 4 - ((len >> 3) << 2));
+        } else if (len > 0) {
+            a = ((uint64_t)p[0] << 16) | ((uint64_t)p[len >> 1] << 8) | p[len - 1];
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        while (i > 16) {
+            seed = __peepfs_swiss_mum(__peepfs_swiss_r8(p) ^ p1,
+                                      __peepfs_swiss_r8(p + 8) ^ seed);
+            p += 16;
+            i -= 16;
+        }
+
+        /* The last 16 bytes, overlapping what's already been mixed */
+        a = __peepfs_swiss_r8(p + i - 16);
+        b = __peepfs_swiss_r8(p + i - 8);
+    }
+
+    return __peepfs_swiss_mum(p1 ^ len, __peepfs_swiss_mum(a ^ p1, b ^ seed));
+}
+
+static inline uint64_t
+__peepfs_swiss_hashof(peepfs_swiss_t *sw, const void *item)
+{
+    return *(const uint64_t*)((const char*)item + sw->hash_offset);
+}
+
+/* Control bits of a hash, and the group its probe starts at */
+static inline unsigned
+__peepfs_swiss_h2(uint64_t hash)
+{
+    return hash >> 57;
+}
+
+static inline uint64_t
+__peepfs_swiss_h1(uint64_t hash)
+{
+    return hash >> 7;
+}
+
+/* Bit i set for each slot i whose control byte is 'c' */
+static inline unsigned
+__peepfs_swiss_match_byte(peepfs_swiss_group_t *g, unsigned c)
+{
+    uint64_t lo = __atomic_load_n(&g->ctrl[0], __ATOMIC_ACQUIRE);
+    uint64_t hi = __atomic_load_n(&g->ctrl[1], __ATOMIC_ACQUIRE);
+
+#ifdef __SSE2__
+    __m128i ctrl = _mm_set_epi64x((long long)hi, (long long)lo);
+
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8((char)c)));
+#else
+    uint64_t x, m[2];
+    int      i;
+
+    for (i = 0; i < 2; ++i) {
+        x    = (i ? hi : lo) ^ (SWISS_LO * c);
+        /* Can be off only just after a real match, which gets checked */
+        m[i] = (x - SWISS_LO) & ~x & SWISS_HI;
+        m[i] = ((m[i] >> 7) * 0x0102040810204080ULL) >> 56;
+    }
+
+    return (unsigned)(m[0] | (m[1] << 8));
+#endif
+}
+
+/* Slots that are empty or deleted */
+static inline unsigned
+__peepfs_swiss_match_free(peepfs_swiss_group_t *g)
+{
+    uint64_t lo = __atomic_load_n(&g->ctrl[0], __ATOMIC_RELAXED);
+    uint64_t hi = __atomic_load_n(&g->ctrl[1], __ATOMIC_RELAXED);
+
+#ifdef __SSE2__
+    return _mm_movemask_epi8(_mm_set_epi64x((long long)hi, (long long)lo));
+#else
+    uint64_t m0 = ((((lo & SWISS_HI) >> 7) * 0x0102040810204080ULL) >> 56);
+    uint64_t m1 = ((((hi & SWISS_HI) >> 7) * 0x0102040810204080ULL) >> 56);
+
+    return (unsigned)(m0 | (m1 << 8));
+#endif
+}
+
+/* Writers only, lock held; readers see the whole word change at once */
+static inline void
+__peepfs_swiss_set_ctrl(peepfs_swiss_group_t *g, int i, unsigned c)
+{
+    uint64_t   *word = &g->ctrl[i >> 3];
+    int         shift = (i & 7) * 8;
+    uint64_t    v = __atomic_load_n(word, __ATOMIC_RELAXED);
+
+    v = (v & ~(0xffULL << shift)) | ((uint64_t)c << shift);
+
+    __atomic_store_n(word, v, __ATOMIC_RELEASE);
+}
+
+static inline peepfs_swiss_table_t *
+__peepfs_swiss_table_alloc(uint64_t num_groups)
+{
+    peepfs_swiss_table_t   *t;
+    uint64_t                i;
+
+    t = (peepfs_swiss_table_t*)aligned_alloc(16,
+        sizeof(peepfs_swiss_table_t) + num_groups * sizeof(peepfs_swiss_group_t));
+
+    if (t == NULL) {
+        return NULL;
+    }
+
+    memset(t, 0, sizeof(peepfs_swiss_table_t));
+
+    for (i = 0; i < num_groups; ++i) {
+        t->groups[i].ctrl[0] = t->groups[i].ctrl[1] = SWISS_LO * SWISS_EMPTY;
+        memset(t->groups[i].slots, 0, sizeof(t->groups[i].slots));
+    }
+
+    t->mask        = num_groups - 1;
+    t->growth_left = num_groups * PEEPFS_SWISS_GROUP * 7 / 8;
+
+    return t;
+}
+
+/* Room for about 'capacity' items before the first grow */
+static inline int
+peepfs_swiss_init(
+    peepfs_swiss_t *sw,
+    int64_t         capacity,
+    size_t          hash_offset,
+    peepfs_epoch_t *epoch)
+{
+    uint64_t num_groups = 1;
+
+    while (num_groups * PEEPFS_SWISS_GROUP * 7 / 8 < (uint64_t)capacity) {
+        num_groups <<= 1;
+    }
+
+    memset(sw, 0, sizeof(*sw));
+
+    sw->hash_offset = hash_offset;
+    sw->epoch       = epoch;
+    sw->table       = __peepfs_swiss_table_alloc(num_groups);
+
+    return sw->table ? 0 : -1;
+}
+
+/* The items themselves are the caller's */
+static inline void
+peepfs_swiss_free(peepfs_swiss_t *sw)
+{
+    peepfs_swiss_table_t *t;
+
+    while ((t = sw->retired)) {
+        sw->retired = t->next;
+        free(t);
+    }
+
+    if (sw->table) {
+        free(sw->table->prev);
+        free(sw->table);
+    }
+
+    sw->table = NULL;
+}
+
+static inline void *
+__peepfs_swiss_find_in(
+    peepfs_swiss_table_t   *t,
+    uint64_t                hash,
+    peepfs_swiss_match_t    match,
+    const void             *key)
+{
+    peepfs_swiss_group_t   *g;
+    uint64_t                pos = __peepfs_swiss_h1(hash), stride = 0;
+    unsigned                h2 = __peepfs_swiss_h2(hash), bits;
+    void                   *item;
+    int                     i;
+
+    do {
+        g = &t->groups[pos & t->mask];
+
+        for (bits = __peepfs_swiss_match_byte(g, h2); bits; bits &= bits - 1) {
+
+            i    = __builtin_ctz(bits);
+            item = __atomic_load_n(&g->slots[i], __ATOMIC_ACQUIRE);
+
+            if (item && match(item, key)) {
+                return item;
+            }
+        }
+
+        if (__peepfs_swiss_match_byte(g, SWISS_EMPTY)) {
+            return NULL;
+        }
+
+        /* Triangular steps visit every group of a power of two table */
+        pos += ++stride;
+
+    } while (stride <= t->mask);
+
+    return NULL;
+}
+
+/*
+ * The item matching 'key', or NULL.  Safe with the writers' lock held,
+ * or inside an epoch if the table was given one.
+ */
+
+static inline void *
+peepfs_swiss_find(
+    peepfs_swiss_t         *sw,
+    uint64_t                hash,
+    peepfs_swiss_match_t    match,
+    const void             *key)
+{
+    peepfs_swiss_table_t   *t = __atomic_load_n(&sw->table, __ATOMIC_ACQUIRE);
+    peepfs_swiss_table_t   *prev;
+    void                   *item;
+
+    /* Before the new table: once it reads NULL, every copy is visible */
+    prev = __atomic_load_n(&t->prev, __ATOMIC_ACQUIRE);
+
+    item = __peepfs_swiss_find_in(t, hash, match, key);
+
+    if (item == NULL && prev) {
+        item = __peepfs_swiss_find_in(prev, hash, match, key);
+    }
+
+    return item;
+}
+
+/* Put an item known not to be there yet.  Lock held. */
+static inline void
+__peepfs_swiss_place(peepfs_swiss_table_t *t, uint64_t hash, void *item)
+{
+    peepfs_swiss_group_t   *g;
+    uint64_t                pos = __peepfs_swiss_h1(hash), stride = 0;
+    unsigned                bits;
+    int                     i;
+
+    while (1) {
+        g    = &t->groups[pos & t->mask];
+        bits = __peepfs_swiss_match_free(g);
+
+        if (bits) {
+            break;
+        }
+
+        pos += ++stride;
+    }
+
+    i = __builtin_ctz(bits);
+
+    if (__peepfs_swiss_match_byte(g, SWISS_EMPTY) & (1U << i)) {
+        t->growth_left--;
+    }
+
+    __atomic_store_n(&g->slots[i], item, __ATOMIC_RELEASE);
+
+    __peepfs_swiss_set_ctrl(g, i, __peepfs_swiss_h2(hash));
+
+    t->live++;
+}
+
+/* Mark the item's slot deleted, if it has one here.  Lock held. */
+static inline void
+__peepfs_swiss_remove(peepfs_swiss_table_t *t, uint64_t hash, void *item)
+{
+    peepfs_swiss_group_t   *g;
+    uint64_t                pos = __peepfs_swiss_h1(hash), stride = 0;
+    unsigned                bits;
+    int                     i;
+
+    do {
+        g = &t->groups[pos & t->mask];
+
+        for (bits = __peepfs_swiss_match_byte(g, __peepfs_swiss_h2(hash)); bits;
+             bits &= bits - 1) {
+
+            i = __builtin_ctz(bits);
+
+            if (g->slots[i] == item) {
+                __peepfs_swiss_set_ctrl(g, i, SWISS_DELETED);
+                t->live--;
+                return;
+            }
+        }
+
+        if (__peepfs_swiss_match_byte(g, SWISS_EMPTY)) {
+            return;
+        }
+
+        pos += ++stride;
+
+    } while (stride <= t->mask);
+}
+
+/* Free retired tables no lookup can still be in.  Lock held. */
+static inline void
+peepfs_swiss_drain(peepfs_swiss_t *sw, uint64_t now)
+{
+    peepfs_swiss_table_t *t;
+
+    while ((t = sw->retired) && peepfs_epoch_safe(t->retired, now)) {
+
+        sw->retired = t->next;
+
+        if (sw->retired == NULL) {
+            sw->retired_tail = NULL;
+        }
+
+        free(t);
+    }
+}
+
+static inline int
+peepfs_swiss_draining(peepfs_swiss_t *sw)
+{
+    return sw->retired != NULL;
+}
+
+/* Move up to 'groups' more groups out of the old table.  Lock held. */
+static inline void
+__peepfs_swiss_migrate(peepfs_swiss_t *sw, uint64_t groups)
+{
+    peepfs_swiss_table_t   *t = sw->table, *prev = t->prev;
+    peepfs_swiss_group_t   *g;
+    unsigned                bits;
+    void                   *item;
+
+    if (prev == NULL) {
+        return;
+    }
+
+    /* Copies, the old slots stay put for lookups still walking them */
+    for (; groups && prev->migrated <= prev->mask; --groups, ++prev->migrated) {
+
+        g = &prev->groups[prev->migrated];
+
+        for (bits = ~__peepfs_swiss_match_free(g) & 0xffff; bits; bits &= bits - 1) {
+            item = g->slots[__builtin_ctz(bits)];
+            __peepfs_swiss_place(t, __peepfs_swiss_hashof(sw, item), item);
+        }
+    }
+
+    if (prev->migrated <= prev->mask) {
+        return;
+    }
+
+    __atomic_store_n(&t->prev, NULL, __ATOMIC_RELEASE);
+
+    if (sw->epoch == NULL) {
+        free(prev);
+        return;
+    }
+
+    prev->retired = peepfs_epoch_retire(sw->epoch);
+    prev->next    = NULL;
+
+    if (sw->retired_tail) {
+        sw->retired_tail->next = prev;
+    } else {
+        sw->retired = prev;
+    }
+
+    sw->retired_tail = prev;
+}
+
+/* Add an item whose key isn't there yet.  Lock held. */
+static inline int
+peepfs_swiss_insert(peepfs_swiss_t *sw, void *item)
+{
+    peepfs_swiss_table_t   *t = sw->table, *nt;
+    uint64_t                num_groups = t->mask + 1;
+
+    __peepfs_swiss_migrate(sw, SWISS_MIGRATE_GROUPS);
+
+    /* Copies can dip into the last eighth, which is never handed out */
+    if (t->growth_left <= 0) {
+
+        /* One move at a time, finish the last before starting another */
+        __peepfs_swiss_migrate(sw, UINT64_MAX);
+
+        /* Mostly deleted slots just get swept into a table the same size */
+        if (t->live * 2 > (int64_t)(num_groups * PEEPFS_SWISS_GROUP)) {
+            num_groups <<= 1;
+        }
+
+        nt = __peepfs_swiss_table_alloc(num_groups);
+
+        if (nt == NULL) {
+            return -1;
+        }
+
+        nt->prev = t;
+
+        __atomic_store_n(&sw->table, nt, __ATOMIC_RELEASE);
+
+        t = nt;
+
+        __peepfs_swiss_migrate(sw, SWISS_MIGRATE_GROUPS);
+    }
+
+    __peepfs_swiss_place(t, __peepfs_swiss_hashof(sw, item), item);
+
+    return 0;
+}
+
+/* Lock held */
+static inline void
+peepfs_swiss_delete(peepfs_swiss_t *sw, void *item)
+{
+    peepfs_swiss_table_t   *t = sw->table;
+    uint64_t                hash = __peepfs_swiss_hashof(sw, item);
+
+    __peepfs_swiss_remove(t, hash, item);
+
+    if (t->prev) {
+        __peepfs_swiss_remove(t->prev, hash, item);
+    }
+}
+
+#endif
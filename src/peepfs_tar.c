@@ -0,0 +1,887 @@
+#include "peepfs_archive.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <pthread.h>
+
+#include "peepfs_stream.h"
+#include "uthash.h"
+
+#define MIN(x,y) ((x) < (y) ? (x) : (y))
+
+#define TAR_BLOCK_SIZE  512
+
+#define TAR_ROUND(x)    (((x) + TAR_BLOCK_SIZE - 1) & ~((int64_t)TAR_BLOCK_SIZE - 1))
+
+/*
+ * Native reader for tar files, plain or compressed.
+ *
+ * The headers are walked once, on first use, and every entry's data
+ * offset is kept; after that the entry table never changes.  For a
+ * plain tar, reads are a plain pread() against the tar file with no
+ * locking and no dependence on where the previous read left off.  For
+ * a compressed tar, offsets are in the uncompressed stream and reads go
+ * through a peepfs_stream, which uses whatever index the format has (or
+ * the first walk builds) so opening an entry or seeking within one only
+ * decompresses from the nearest point.  Anything we don't understand
+ * (sparse files, multi-volume archives) hands the whole archive over to
+ * libarchive.
+ */
+
+extern peepfs_archive_ops_t libarchive_ops;
+
+typedef struct tar_header {
+    char        name[100];
+    char        mode[8];
+    char        uid[8];
+    char        gid[8];
+    char        size[12];
+    char        mtime[12];
+    char        chksum[8];
+    char        typeflag;
+    char        linkname[100];
+    char        magic[6];
+    char        version[2];
+    char        uname[32];
+    char        gname[32];
+    char        devmajor[8];
+    char        devminor[8];
+    char        prefix[155];
+    char        pad[12];
+} tar_header_t;
+
+typedef struct tar_entry {
+    const char         *name;
+    int64_t             index;
+    int64_t             size;
+    uint64_t            flags;
+    int64_t             data_offset;
+    UT_hash_handle      hh;
+} tar_entry_t;
+
+typedef struct tar_archive {
+    const char         *filename;
+    int                 fd;
+    peepfs_stream_t    *stream;
+    pthread_mutex_t     lock;
+    int                 loaded;
+    int                 error;
+    void               *fallback;
+    tar_entry_t        *entries;
+    int64_t             num_entries;
+    int64_t             max_entries;
+    tar_entry_t        *hash;
+} tar_archive_t;
+
+typedef struct tar_file {
+    int64_t                 data_offset;
+    int64_t                 size;
+    peepfs_stream_cursor_t *cursor;
+    pthread_mutex_t         lock;
+} tar_file_t;
+
+/* Read from the (uncompressed) tar stream */
+static ssize_t
+__peepfs_tar_pread(
+    tar_archive_t          *archive,
+    peepfs_stream_cursor_t *cursor,
+    void                   *buffer,
+    size_t                  len,
+    int64_t                 offset)
+{
+    if (archive->stream) {
+        return peepfs_stream_read(archive->stream, cursor, buffer, offset, len);
+    } else {
+        return pread(archive->fd, buffer, len, offset);
+    }
+}
+
+/* Parse an octal or base-256 numeric header field */
+static int64_t
+__peepfs_tar_number(const char *field, int len)
+{
+    const unsigned char *p = (const unsigned char *)field;
+    int64_t              value = 0;
+    int                  i;
+
+    if (p[0] & 0x80) {
+
+        /* Base-256, we don't do negative numbers */
+        if (p[0] & 0x40) {
+            return -1;
+        }
+
+        value = p[0] & 0x3f;
+
+        for (i = 1; i < len; ++i) {
+            if (value >> 55) {
+                return -1;
+            }
+            value = (value << 8) | p[i];
+        }
+
+        return value;
+    }
+
+    for (i = 0; i < len && (p[i] == ' ' || p[i] == '\0'); ++i);
+
+    for (; i < len && p[i] >= '0' && p[i] <= '7'; ++i) {
+        value = (value << 3) | (p[i] - '0');
+    }
+
+    return value;
+}
+
+/* Header checksum, both the unsigned and the historic signed flavor */
+static int
+__peepfs_tar_checksum_ok(const tar_header_t *hdr)
+{
+    const unsigned char    *u = (const unsigned char *)hdr;
+    const signed char      *s = (const signed char *)hdr;
+    int64_t                 expect, usum = 0, ssum = 0;
+    int                     i;
+
+    expect = __peepfs_tar_number(hdr->chksum, sizeof(hdr->chksum));
+
+    for (i = 0; i < TAR_BLOCK_SIZE; ++i) {
+
+        if (i >= offsetof(tar_header_t, chksum) &&
+            i < offsetof(tar_header_t, chksum) + sizeof(hdr->chksum)) {
+            usum += ' ';
+            ssum += ' ';
+        } else {
+            usum += u[i];
+            ssum += s[i];
+        }
+    }
+
+    return expect == usum || expect == ssum;
+}
+
+static int
+__peepfs_tar_zero_block(const tar_header_t *hdr)
+{
+    const uint64_t *p = (const uint64_t *)hdr;
+    int             i;
+
+    for (i = 0; i < TAR_BLOCK_SIZE / sizeof(uint64_t); ++i) {
+        if (p[i]) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static int
+__peepfs_tar_read_header(
+    tar_archive_t          *archive,
+    peepfs_stream_cursor_t *cursor,
+    int64_t                 offset,
+    tar_header_t           *hdr)
+{
+    ssize_t len;
+
+    len = __peepfs_tar_pread(archive, cursor, hdr, sizeof(*hdr), offset);
+
+    if (len != sizeof(*hdr)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Read the 'size' bytes of data following a GNU long name or pax header */
+static char *
+__peepfs_tar_read_blob(
+    tar_archive_t          *archive,
+    peepfs_stream_cursor_t *cursor,
+    int64_t                 offset,
+    int64_t                 size)
+{
+    char *blob;
+
+    if (size < 0 || size > 16*1024*1024) {
+        return NULL;
+    }
+
+    blob = (char*)malloc(size + 1);
+
+    if (blob == NULL) {
+        return NULL;
+    }
+
+    if (__peepfs_tar_pread(archive, cursor, blob, size, offset) != size) {
+        free(blob);
+        return NULL;
+    }
+
+    blob[size] = '\0';
+
+    return blob;
+}
+
+/*
+ * Pick the records we care about out of a pax extended header.
+ * Returns -1 on anything we can't represent faithfully.
+ */
+
+static int
+__peepfs_tar_parse_pax(
+    const char     *blob,
+    int64_t         len,
+    char          **name,
+    char          **link,
+    int64_t        *size)
+{
+    const char *p = blob, *end = blob + len, *key, *eq;
+    char       *stop;
+    int64_t     reclen;
+
+    while (p < end) {
+
+        reclen = strtoll(p, &stop, 10);
+
+        if (reclen <= 0 || p + reclen > end || *stop != ' ') {
+            return -1;
+        }
+
+        key = stop + 1;
+        eq  = memchr(key, '=', p + reclen - key);
+
+        if (eq == NULL || p[reclen-1] != '\n') {
+            return -1;
+        }
+
+        if (eq - key == 4 && strncmp(key, "path", 4) == 0) {
+            free(*name);
+            *name = strndup(eq + 1, p + reclen - 1 - (eq + 1));
+        } else if (eq - key == 8 && strncmp(key, "linkpath", 8) == 0) {
+            free(*link);
+            *link = strndup(eq + 1, p + reclen - 1 - (eq + 1));
+        } else if (eq - key == 4 && strncmp(key, "size", 4) == 0) {
+            *size = strtoll(eq + 1, NULL, 10);
+        } else if (eq - key > 11 && strncmp(key, "GNU.sparse.", 11) == 0) {
+            return -1;
+        }
+
+        p += reclen;
+    }
+
+    return 0;
+}
+
+/* Strip leading "./" and trailing "/" the way the other backends do */
+static char *
+__peepfs_tar_normalize(char *name)
+{
+    char   *p = name;
+    int     len;
+
+    while (p[0] == '.' && p[1] == '/') {
+        p += 2;
+        while (*p == '/') ++p;
+    }
+
+    len = strlen(p);
+
+    while (len && p[len-1] == '/') {
+        p[--len] = '\0';
+    }
+
+    if (p != name) {
+        memmove(name, p, len + 1);
+    }
+
+    return name;
+}
+
+static tar_entry_t *
+__peepfs_tar_add_entry(tar_archive_t *archive)
+{
+    tar_entry_t *entries;
+
+    if (archive->num_entries == archive->max_entries) {
+
+        entries = (tar_entry_t*)realloc(archive->entries,
+            (archive->max_entries * 2 + 64) * sizeof(tar_entry_t));
+
+        if (entries == NULL) {
+            return NULL;
+        }
+
+        archive->entries = entries;
+        archive->max_entries = archive->max_entries * 2 + 64;
+    }
+
+    entries = &archive->entries[archive->num_entries];
+
+    memset(entries, 0, sizeof(*entries));
+
+    entries->index = archive->num_entries++;
+
+    return entries;
+}
+
+/* Walk every header in the file, building the entry table */
+static int
+__peepfs_tar_load(tar_archive_t *archive, peepfs_stream_cursor_t *cursor)
+{
+    tar_header_t    hdr;
+    tar_entry_t    *entry, *target;
+    int64_t         offset = 0, size, pax_size = -1, i;
+    char           *name = NULL, *link = NULL, *blob;
+    char            buf[sizeof(hdr.prefix) + sizeof(hdr.name) + 2];
+    int             error = 0, ustar, slash;
+
+    while (1) {
+
+        if (__peepfs_tar_read_header(archive, cursor, offset, &hdr)) {
+            /* Truncated archive, keep whatever we found */
+            break;
+        }
+
+        if (__peepfs_tar_zero_block(&hdr)) {
+            break;
+        }
+
+        if (!__peepfs_tar_checksum_ok(&hdr)) {
+            error = -1;
+            goto out;
+        }
+
+        size = __peepfs_tar_number(hdr.size, sizeof(hdr.size));
+
+        if (size < 0) {
+            error = -1;
+            goto out;
+        }
+
+        switch (hdr.typeflag) {
+
+        case 'L': /* GNU long name for the next entry */
+            free(name);
+            name = __peepfs_tar_read_blob(archive, cursor,
+                offset + TAR_BLOCK_SIZE, size);
+            if (name == NULL) {
+                error = -1;
+                goto out;
+            }
+            break;
+
+        case 'K': /* GNU long link name for the next entry */
+            free(link);
+            link = __peepfs_tar_read_blob(archive, cursor,
+                offset + TAR_BLOCK_SIZE, size);
+            if (link == NULL) {
+                error = -1;
+                goto out;
+            }
+            break;
+
+        case 'x': /* pax extended header for the next entry */
+            blob = __peepfs_tar_read_blob(archive, cursor,
+                offset + TAR_BLOCK_SIZE, size);
+            if (blob == NULL) {
+                error = -1;
+                goto out;
+            }
+            error = __peepfs_tar_parse_pax(blob, size, &name, &link, &pax_size);
+            free(blob);
+            if (error) {
+                goto out;
+            }
+            break;
+
+        case 'g': /* pax global header, nothing in there we use */
+        case 'V': /* volume label */
+            break;
+
+        case 'S': /* GNU sparse */
+        case 'M': /* GNU multi-volume continuation */
+            error = -1;
+            goto out;
+
+        default:
+
+            entry = __peepfs_tar_add_entry(archive);
+
+            if (entry == NULL) {
+                error = -1;
+                goto out;
+            }
+
+            if (name == NULL) {
+
+                ustar = memcmp(hdr.magic, "ustar\0", 6) == 0;
+
+                if (ustar && hdr.prefix[0]) {
+                    snprintf(buf, sizeof(buf), "%.*s/%.*s",
+                        (int)strnlen(hdr.prefix, sizeof(hdr.prefix)), hdr.prefix,
+                        (int)strnlen(hdr.name, sizeof(hdr.name)), hdr.name);
+                } else {
+                    snprintf(buf, sizeof(buf), "%.*s",
+                        (int)strnlen(hdr.name, sizeof(hdr.name)), hdr.name);
+                }
+
+                name = strdup(buf);
+
+                if (name == NULL) {
+                    error = -1;
+                    goto out;
+                }
+            }
+
+            if (pax_size >= 0) {
+                size = pax_size;
+            }
+
+            slash = name[0] && name[strlen(name)-1] == '/';
+
+            entry->name        = __peepfs_tar_normalize(name);
+            entry->data_offset = offset + TAR_BLOCK_SIZE;
+            entry->size        = size;
+
+            name = NULL;
+
+            switch (hdr.typeflag) {
+            case '0': case '\0':
+                /* Pre-POSIX tars only mark directories with a trailing '/' */
+                if (!slash) {
+                    break;
+                }
+                /* fall through */
+            case '5':
+                entry->flags |= PEEPFS_FLAG_DIR;
+                entry->size = 0;
+                size = 0;
+                break;
+            case '1':
+                /* Hard link, the data lives with the link target */
+                if (link == NULL) {
+                    snprintf(buf, sizeof(buf), "%.*s",
+                        (int)strnlen(hdr.linkname, sizeof(hdr.linkname)),
+                        hdr.linkname);
+                    link = strdup(buf);
+                }
+                if (link) {
+                    __peepfs_tar_normalize(link);
+                    for (i = entry->index - 1; i >= 0; --i) {
+                        target = &archive->entries[i];
+                        if (strcmp(target->name, link) == 0) {
+                            entry->data_offset = target->data_offset;
+                            entry->size        = target->size;
+                            entry->flags       = target->flags;
+                            break;
+                        }
+                    }
+                }
+                /* fall through */
+            case '2': case '3': case '4': case '6':
+                size = 0;
+                break;
+            }
+
+            entry->flags |= PEEPFS_FLAG_SEEKABLE;
+
+            if (entry->name[0] == '\0') {
+                /* The archive root itself, not worth an entry */
+                free((void*)entry->name);
+                archive->num_entries--;
+            }
+
+            free(link);
+            link     = NULL;
+            pax_size = -1;
+
+            break;
+        }
+
+        offset += TAR_BLOCK_SIZE + TAR_ROUND(size);
+    }
+
+    /* Later entries replace earlier ones of the same name */
+    for (i = 0; i < archive->num_entries; ++i) {
+        entry = &archive->entries[i];
+        HASH_FIND_STR(archive->hash, entry->name, target);
+        if (target) {
+            HASH_DEL(archive->hash, target);
+        }
+        HASH_ADD_KEYPTR(hh, archive->hash, entry->name, strlen(entry->name), entry);
+    }
+
+out:
+
+    free(name);
+    free(link);
+
+    return error;
+}
+
+static void
+__peepfs_tar_free_entries(tar_archive_t *archive)
+{
+    int64_t i;
+
+    HASH_CLEAR(hh, archive->hash);
+
+    for (i = 0; i < archive->num_entries; ++i) {
+        free((void*)archive->entries[i].name);
+    }
+
+    free(archive->entries);
+
+    archive->entries     = NULL;
+    archive->num_entries = 0;
+    archive->max_entries = 0;
+}
+
+/*
+ * Walk the archive on first use.  If we can't represent it, libarchive
+ * gets it instead and every op is passed through from then on.
+ */
+
+static int
+__peepfs_tar_ready(tar_archive_t *archive)
+{
+    peepfs_stream_cursor_t *cursor = NULL;
+    int                     error;
+
+    pthread_mutex_lock(&archive->lock);
+
+    if (!archive->loaded) {
+
+        if (archive->stream) {
+            cursor = peepfs_stream_cursor_open(archive->stream);
+        }
+
+        if (archive->stream && cursor == NULL) {
+            archive->error = -1;
+        } else {
+            archive->error = __peepfs_tar_load(archive, cursor);
+        }
+
+        if (cursor) {
+            peepfs_stream_cursor_close(archive->stream, cursor);
+        }
+
+        if (archive->error) {
+
+            __peepfs_tar_free_entries(archive);
+
+            archive->fallback = libarchive_ops.open(archive->filename);
+
+            if (archive->fallback) {
+                archive->error = 0;
+            }
+        }
+
+        archive->loaded = 1;
+    }
+
+    error = archive->error;
+
+    pthread_mutex_unlock(&archive->lock);
+
+    return error;
+}
+
+void peepfs_tar_close(void *plugin_data);
+
+void *
+peepfs_tar_open(const char *filename)
+{
+    tar_archive_t          *archive;
+    tar_header_t            hdr;
+    peepfs_stream_cursor_t *cursor = NULL;
+    struct stat             st;
+    int                     error;
+
+    archive = (tar_archive_t*)calloc(1,sizeof(tar_archive_t));
+
+    if (archive == NULL) {
+        return NULL;
+    }
+
+    pthread_mutex_init(&archive->lock, NULL);
+
+    archive->filename = strdup(filename);
+    archive->fd       = open(filename, O_RDONLY);
+
+    if (archive->fd < 0 || fstat(archive->fd, &st)) {
+        goto fail;
+    }
+
+    /* No stream means the tar isn't compressed, or not in a way we know */
+    archive->stream = peepfs_stream_open(archive->fd, 0, st.st_size);
+
+    if (archive->stream) {
+
+        cursor = peepfs_stream_cursor_open(archive->stream);
+
+        if (cursor == NULL) {
+            goto fail;
+        }
+    }
+
+    /* Don't bother with anything that doesn't start with a header */
+    error = __peepfs_tar_read_header(archive, cursor, 0, &hdr) ||
+            __peepfs_tar_zero_block(&hdr) ||
+            !__peepfs_tar_checksum_ok(&hdr);
+
+    if (cursor) {
+        peepfs_stream_cursor_close(archive->stream, cursor);
+    }
+
+    if (error) {
+        goto fail;
+    }
+
+    return archive;
+
+fail:
+
+    peepfs_tar_close(archive);
+
+    return NULL;
+}
+
+void
+peepfs_tar_close(void *plugin_data)
+{
+    tar_archive_t  *archive = (tar_archive_t*)plugin_data;
+
+    __peepfs_tar_free_entries(archive);
+
+    if (archive->fallback) {
+        libarchive_ops.close(archive->fallback);
+    }
+
+    if (archive->stream) {
+        peepfs_stream_close(archive->stream);
+    }
+
+    if (archive->fd >= 0) {
+        close(archive->fd);
+    }
+
+    pthread_mutex_destroy(&archive->lock);
+
+    free((void*)archive->filename);
+    free(archive);
+}
+
+int
+peepfs_tar_enumerate(
+    void *plugin_data,
+    peepfs_archive_enum_callback_t enum_callback,
+    void *arg)
+{
+    tar_archive_t          *archive = (tar_archive_t*)plugin_data;
+    tar_entry_t            *te;
+    peepfs_archive_entry_t  entry;
+    int64_t                 i;
+
+    if (__peepfs_tar_ready(archive)) {
+        return -1;
+    }
+
+    if (archive->fallback) {
+        return libarchive_ops.enumerate(archive->fallback, enum_callback, arg);
+    }
+
+    for (i = 0; i < archive->num_entries; ++i) {
+
+        te = &archive->entries[i];
+
+        entry.index = te->index;
+        entry.size  = te->size;
+        entry.flags = te->flags;
+
+        if (enum_callback(te->name, &entry, arg) < 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int
+peepfs_tar_entry_open(
+    void                   *plugin_data,
+    const char             *name,
+    peepfs_archive_entry_t *entry)
+{
+    tar_archive_t  *archive = (tar_archive_t*)plugin_data;
+    tar_entry_t    *te;
+
+    if (__peepfs_tar_ready(archive)) {
+        return -1;
+    }
+
+    if (archive->fallback) {
+        return libarchive_ops.entry_open(archive->fallback, name, entry);
+    }
+
+    HASH_FIND_STR(archive->hash, name, te);
+
+    if (te == NULL) {
+        return -1;
+    }
+
+    entry->index = te->index;
+    entry->size  = te->size;
+    entry->flags = te->flags;
+
+    return 0;
+}
+
+void *
+peepfs_tar_file_open(
+    void *plugin_data,
+    peepfs_archive_entry_t *entry)
+{
+    tar_archive_t  *archive = (tar_archive_t*)plugin_data;
+    tar_file_t     *file;
+    tar_entry_t    *te;
+
+    if (__peepfs_tar_ready(archive)) {
+        return NULL;
+    }
+
+    if (archive->fallback) {
+        return libarchive_ops.file_open(archive->fallback, entry);
+    }
+
+    if (entry->index < 0 || entry->index >= archive->num_entries) {
+        return NULL;
+    }
+
+    te = &archive->entries[entry->index];
+
+    file = (tar_file_t*)calloc(1,sizeof(tar_file_t));
+
+    if (file == NULL) {
+        return NULL;
+    }
+
+    file->data_offset = te->data_offset;
+    file->size        = te->size;
+
+    if (archive->stream) {
+
+        file->cursor = peepfs_stream_cursor_open(archive->stream);
+
+        if (file->cursor == NULL) {
+            free(file);
+            return NULL;
+        }
+
+        pthread_mutex_init(&file->lock, NULL);
+    }
+
+    return file;
+}
+
+void
+peepfs_tar_file_close(
+    void *plugin_data,
+    void *file_data)
+{
+    tar_archive_t  *archive = (tar_archive_t*)plugin_data;
+    tar_file_t     *file  = (tar_file_t*)file_data;
+
+    if (archive->fallback) {
+        libarchive_ops.file_close(archive->fallback, file_data);
+        return;
+    }
+
+    if (file->cursor) {
+        peepfs_stream_cursor_close(archive->stream, file->cursor);
+        pthread_mutex_destroy(&file->lock);
+    }
+
+    free(file);
+}
+
+ssize_t
+peepfs_tar_file_read(
+    void                   *plugin_data,
+    void                   *file_data,
+    void                   *buffer,
+    size_t                  offset,
+    size_t                  size)
+{
+    tar_archive_t  *archive = (tar_archive_t*)plugin_data;
+    tar_file_t     *file  = (tar_file_t*)file_data;
+    ssize_t         len;
+
+    if (archive->fallback) {
+        return libarchive_ops.file_read(archive->fallback, file_data,
+            buffer, offset, size);
+    }
+
+    if (offset >= file->size) {
+        return 0;
+    }
+
+    size = MIN(size, file->size - offset);
+
+    if (file->cursor == NULL) {
+        return pread(archive->fd, buffer, size, file->data_offset + offset);
+    }
+
+    pthread_mutex_lock(&file->lock);
+
+    len = peepfs_stream_read(archive->stream, file->cursor, buffer,
+                             file->data_offset + offset, size);
+
+    pthread_mutex_unlock(&file->lock);
+
+    return len;
+}
+
+/* Only a plain tar has its members sitting in the file as they are */
+int
+peepfs_tar_extent(
+    void                   *plugin_data,
+    peepfs_archive_entry_t *entry,
+    int64_t                *offset)
+{
+    tar_archive_t  *archive = (tar_archive_t*)plugin_data;
+    tar_entry_t    *te;
+
+    if (__peepfs_tar_ready(archive) || archive->fallback || archive->stream) {
+        return -1;
+    }
+
+    if (entry->index < 0 || entry->index >= archive->num_entries) {
+        return -1;
+    }
+
+    te = &archive->entries[entry->index];
+
+    if (te->flags & PEEPFS_FLAG_DIR) {
+        return -1;
+    }
+
+    *offset = te->data_offset;
+
+    return 0;
+}
+
+peepfs_archive_ops_t tar_ops = {
+    .open           = peepfs_tar_open,
+    .close          = peepfs_tar_close,
+    .enumerate      = peepfs_tar_enumerate,
+    .entry_open     = peepfs_tar_entry_open,
+    .file_open      = peepfs_tar_file_open,
+    .file_close     = peepfs_tar_file_close,
+    .file_read      = peepfs_tar_file_read,
+    .extent         = peepfs_tar_extent
+};
@@ -0,0 +1,181 @@
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "peepfs_workq.h"
+
+typedef struct peepfs_workq_job {
+    peepfs_workq_fn_t           fn;
+    void                       *arg;
+    struct peepfs_workq_job    *next;
+} peepfs_workq_job_t;
+
+struct peepfs_workq {
+    pthread_mutex_t         lock;
+    pthread_cond_t          cond;
+    peepfs_workq_job_t     *head;
+    peepfs_workq_job_t     *tail;
+    int                     shutdown;
+    int                     num_threads;
+    pthread_t              *threads;
+};
+
+static peepfs_workq_t *peepfs_workq_default_pool = NULL;
+
+static void *
+__peepfs_workq_worker(void *arg)
+{
+    peepfs_workq_t     *workq = (peepfs_workq_t*)arg;
+    peepfs_workq_job_t *job;
+
+    pthread_mutex_lock(&workq->lock);
+
+    while (1) {
+
+        while (workq->head == NULL && !workq->shutdown) {
+            pthread_cond_wait(&workq->cond, &workq->lock);
+        }
+
+        if (workq->head == NULL) {
+            break;
+        }
+
+        job = workq->head;
+        workq->head = job->next;
+
+        if (workq->head == NULL) {
+            workq->tail = NULL;
+        }
+
+        pthread_mutex_unlock(&workq->lock);
+
+        job->fn(job->arg);
+
+        free(job);
+
+        pthread_mutex_lock(&workq->lock);
+    }
+
+    pthread_mutex_unlock(&workq->lock);
+
+    return NULL;
+}
+
+peepfs_workq_t *
+peepfs_workq_create(int num_threads)
+{
+    peepfs_workq_t *workq;
+    int             i;
+
+    if (num_threads < 1) {
+        num_threads = 1;
+    }
+
+    workq = (peepfs_workq_t*)calloc(1,sizeof(peepfs_workq_t));
+
+    if (workq == NULL) {
+        return NULL;
+    }
+
+    workq->threads = (pthread_t*)calloc(num_threads, sizeof(pthread_t));
+
+    if (workq->threads == NULL) {
+        free(workq);
+        return NULL;
+    }
+
+    pthread_mutex_init(&workq->lock, NULL);
+    pthread_cond_init(&workq->cond, NULL);
+
+    for (i = 0; i < num_threads; ++i) {
+
+        if (pthread_create(&workq->threads[i], NULL,
+                           __peepfs_workq_worker, workq)) {
+            break;
+        }
+
+        workq->num_threads++;
+    }
+
+    if (workq->num_threads == 0) {
+        peepfs_workq_destroy(workq);
+        return NULL;
+    }
+
+    return workq;
+}
+
+void
+peepfs_workq_destroy(peepfs_workq_t *workq)
+{
+    int i;
+
+    pthread_mutex_lock(&workq->lock);
+
+    workq->shutdown = 1;
+
+    pthread_cond_broadcast(&workq->cond);
+
+    pthread_mutex_unlock(&workq->lock);
+
+    for (i = 0; i < workq->num_threads; ++i) {
+        pthread_join(workq->threads[i], NULL);
+    }
+
+    pthread_cond_destroy(&workq->cond);
+    pthread_mutex_destroy(&workq->lock);
+
+    free(workq->threads);
+    free(workq);
+}
+
+int
+peepfs_workq_submit(
+    peepfs_workq_t     *workq,
+    peepfs_workq_fn_t   fn,
+    void               *arg)
+{
+    peepfs_workq_job_t *job;
+
+    job = (peepfs_workq_job_t*)calloc(1,sizeof(peepfs_workq_job_t));
+
+    if (job == NULL) {
+        return -1;
+    }
+
+    job->fn  = fn;
+    job->arg = arg;
+
+    pthread_mutex_lock(&workq->lock);
+
+    if (workq->tail) {
+        workq->tail->next = job;
+    } else {
+        workq->head = job;
+    }
+
+    workq->tail = job;
+
+    pthread_cond_signal(&workq->cond);
+
+    pthread_mutex_unlock(&workq->lock);
+
+    return 0;
+}
+
+int
+peepfs_workq_threads(peepfs_workq_t *workq)
+{
+    return workq->num_threads;
+}
+
+void
+peepfs_workq_set_default(peepfs_workq_t *workq)
+{
+    peepfs_workq_default_pool = workq;
+}
+
+peepfs_workq_t *
+peepfs_workq_default(void)
+{
+    return peepfs_workq_default_pool;
+}
@@ -0,0 +1,35 @@
+#ifndef __PEEPFS_WORKQ_H__
+#define __PEEPFS_WORKQ_H__
+
+/*
+ * A fixed pool of worker threads running queued jobs in FIFO order.
+ *
+ * Decoders use the process default pool, set up once per mount, to
+ * spread independent work (compressed blocks, mostly) across cores.
+ * If no default pool has been set, callers are expected to do the
+ * work inline instead.
+ */
+
+typedef void (*peepfs_workq_fn_t)(void *arg);
+
+typedef struct peepfs_workq peepfs_workq_t;
+
+peepfs_workq_t * peepfs_workq_create(
+    int num_threads);
+
+/* Runs whatever is still queued, then stops the workers */
+void peepfs_workq_destroy(
+    peepfs_workq_t *workq);
+
+int peepfs_workq_submit(
+    peepfs_workq_t *workq, peepfs_workq_fn_t fn, void *arg);
+
+int peepfs_workq_threads(
+    peepfs_workq_t *workq);
+
+void peepfs_workq_set_default(
+    peepfs_workq_t *workq);
+
+peepfs_workq_t * peepfs_workq_default(void);
+
+#endif
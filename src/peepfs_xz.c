@@ -0,0 +1,399 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <lzma.h>
+
+#include "peepfs_stream.h"
+
+/*
+ * Random access into xz files.
+ *
+ * Every xz stream ends with an index listing its blocks, and every
+ * block can be decoded on its own.  When the file was written with
+ * more than one block (xz -T, or --block-size) a read decodes from the
+ * start of the block holding its offset, so it costs at most a block.
+ * Single block files work the same way, they just always start from
+ * the top.  If the index can't be read we stream the whole thing from
+ * the beginning like any other decoder would.
+ */
+
+#define MIN(x,y) ((x) < (y) ? (x) : (y))
+#define MAX(x,y) ((x) > (y) ? (x) : (y))
+
+#define XZ_CHUNK        65536
+
+typedef struct xz_stream {
+    int                 fd;
+    int64_t             start;
+    int64_t             length;
+    lzma_index         *index;      /* NULL if we have to stream */
+    int64_t             size;
+    pthread_mutex_t     lock;
+} xz_stream_t;
+
+typedef struct xz_cursor {
+    lzma_stream         strm;
+    lzma_block          block;      /* liblzma keeps a pointer to this */
+    int                 active;
+    int                 failed;
+    int                 eof;
+    int64_t             in;         /* next compressed byte to load */
+    int64_t             out;        /* offset of the next byte decoded */
+    uint8_t             input[XZ_CHUNK];
+    uint8_t             output[XZ_CHUNK];
+} xz_cursor_t;
+
+/* Read the indexes of every stream in the file, seeking as liblzma asks */
+static lzma_index *
+__peepfs_xz_load_index(xz_stream_t *stream)
+{
+    lzma_stream     strm = LZMA_STREAM_INIT;
+    lzma_index     *index = NULL;
+    uint8_t         buffer[XZ_CHUNK];
+    int64_t         pos = 0;
+    ssize_t         len;
+    lzma_ret        ret;
+
+    if (lzma_file_info_decoder(&strm, &index, UINT64_MAX,
+                               stream->length) != LZMA_OK) {
+        return NULL;
+    }
+
+    while (1) {
+
+        if (strm.avail_in == 0) {
+
+            len = MIN(sizeof(buffer), stream->length - pos);
+            len = pread(stream->fd, buffer, len, stream->start + pos);
+
+            if (len < 0) {
+                break;
+            }
+
+            strm.next_in  = buffer;
+            strm.avail_in = len;
+            pos          += len;
+        }
+
+        ret = lzma_code(&strm, LZMA_RUN);
+
+        if (ret == LZMA_SEEK_NEEDED) {
+            pos           = strm.seek_pos;
+            strm.avail_in = 0;
+        } else if (ret != LZMA_OK) {
+            break;
+        }
+    }
+
+    lzma_end(&strm);
+
+    /* The index is only handed over if the whole file made sense */
+    return index;
+}
+
+void *
+peepfs_xz_open(
+    int         fd,
+    int64_t     start,
+    int64_t     length)
+{
+    xz_stream_t *stream;
+
+    stream = (xz_stream_t*)calloc(1,sizeof(xz_stream_t));
+
+    if (stream == NULL) {
+        return NULL;
+    }
+
+    stream->fd     = fd;
+    stream->start  = start;
+    stream->length = length;
+    stream->size   = -1;
+
+    pthread_mutex_init(&stream->lock, NULL);
+
+    stream->index = __peepfs_xz_load_index(stream);
+
+    if (stream->index) {
+        stream->size = lzma_index_uncompressed_size(stream->index);
+    }
+
+    return stream;
+}
+
+void
+peepfs_xz_close(void *stream_data)
+{
+    xz_stream_t *stream = (xz_stream_t*)stream_data;
+
+    if (stream->index) {
+        lzma_index_end(stream->index, NULL);
+    }
+
+    pthread_mutex_destroy(&stream->lock);
+
+    free(stream);
+}
+
+int64_t
+peepfs_xz_size(void *stream_data)
+{
+    xz_stream_t    *stream = (xz_stream_t*)stream_data;
+    int64_t         size;
+
+    pthread_mutex_lock(&stream->lock);
+
+    size = stream->size;
+
+    pthread_mutex_unlock(&stream->lock);
+
+    return size;
+}
+
+void *
+peepfs_xz_cursor_open(void *stream_data)
+{
+    return calloc(1,sizeof(xz_cursor_t));
+}
+
+void
+peepfs_xz_cursor_close(
+    void *stream_data,
+    void *cursor_data)
+{
+    xz_cursor_t *cursor = (xz_cursor_t*)cursor_data;
+
+    if (cursor->active) {
+        lzma_end(&cursor->strm);
+    }
+
+    free(cursor);
+}
+
+static void
+__peepfs_xz_reset(xz_cursor_t *cursor)
+{
+    if (cursor->active) {
+        lzma_end(&cursor->strm);
+        cursor->active = 0;
+    }
+
+    memset(&cursor->strm, 0, sizeof(cursor->strm));
+
+    cursor->failed = 0;
+    cursor->eof    = 0;
+}
+
+/* Start decoding at the block holding 'offset' */
+static int
+__peepfs_xz_seek_block(
+    xz_stream_t    *stream,
+    xz_cursor_t    *cursor,
+    int64_t         offset)
+{
+    lzma_index_iter     iter;
+    lzma_block         *block = &cursor->block;
+    lzma_filter         filters[LZMA_FILTERS_MAX + 1];
+    uint8_t             header[LZMA_BLOCK_HEADER_SIZE_MAX];
+    lzma_ret            ret;
+    int                 i;
+
+    __peepfs_xz_reset(cursor);
+
+    lzma_index_iter_init(&iter, stream->index);
+
+    if (lzma_index_iter_locate(&iter, offset)) {
+        /* Past the end */
+        cursor->eof = 1;
+        cursor->out = stream->size;
+        return 0;
+    }
+
+    if (pread(stream->fd, header, 1,
+              stream->start + iter.block.compressed_file_offset) != 1) {
+        return -1;
+    }
+
+    memset(block, 0, sizeof(*block));
+
+    block->version     = 1;
+    block->check       = iter.stream.flags->check;
+    block->filters     = filters;
+    block->header_size = lzma_block_header_size_decode(header[0]);
+
+    if (pread(stream->fd, header + 1, block->header_size - 1,
+              stream->start + iter.block.compressed_file_offset + 1) !=
+        block->header_size - 1) {
+        return -1;
+    }
+
+    if (lzma_block_header_decode(block, NULL, header) != LZMA_OK) {
+        return -1;
+    }
+
+    ret = lzma_block_compressed_size(block, iter.block.unpadded_size);
+
+    if (ret == LZMA_OK) {
+        ret = lzma_block_decoder(&cursor->strm, block);
+    }
+
+    /* The filter options are only needed to set the decoder up */
+    for (i = 0; filters[i].id != LZMA_VLI_UNKNOWN; ++i) {
+        free(filters[i].options);
+    }
+
+    block->filters = NULL;
+
+    if (ret != LZMA_OK) {
+        return -1;
+    }
+
+    cursor->active = 1;
+    cursor->in     = iter.block.compressed_file_offset + block->header_size;
+    cursor->out    = iter.block.uncompressed_file_offset;
+
+    return 0;
+}
+
+/* Start decoding at the very beginning, for files without a usable index */
+static int
+__peepfs_xz_seek_start(xz_cursor_t *cursor)
+{
+    __peepfs_xz_reset(cursor);
+
+    if (lzma_stream_decoder(&cursor->strm, UINT64_MAX,
+                            LZMA_CONCATENATED) != LZMA_OK) {
+        return -1;
+    }
+
+    cursor->active = 1;
+    cursor->in     = 0;
+    cursor->out    = 0;
+
+    return 0;
+}
+
+static int
+__peepfs_xz_seek(
+    xz_stream_t    *stream,
+    xz_cursor_t    *cursor,
+    int64_t         offset)
+{
+    if (stream->index) {
+        return __peepfs_xz_seek_block(stream, cursor, offset);
+    } else {
+        return __peepfs_xz_seek_start(cursor);
+    }
+}
+
+ssize_t
+peepfs_xz_read(
+    void       *stream_data,
+    void       *cursor_data,
+    void       *buffer,
+    int64_t     offset,
+    size_t      len)
+{
+    xz_stream_t    *stream = (xz_stream_t*)stream_data;
+    xz_cursor_t    *cursor = (xz_cursor_t*)cursor_data;
+    lzma_index_iter iter;
+    lzma_action     action;
+    lzma_ret        ret;
+    ssize_t         rlen;
+    int64_t         produced, from, to, copied = 0;
+    int             restart;
+
+    restart = !cursor->active || cursor->failed || cursor->out > offset;
+
+    /* With an index, jumping ahead to a later block beats decoding to it */
+    if (!restart && stream->index && offset < stream->size) {
+
+        lzma_index_iter_init(&iter, stream->index);
+
+        if (!lzma_index_iter_locate(&iter, offset) &&
+            iter.block.uncompressed_file_offset > cursor->out) {
+            restart = 1;
+        }
+    }
+
+    if (restart && __peepfs_xz_seek(stream, cursor, offset)) {
+        cursor->failed = 1;
+        return -1;
+    }
+
+    while (copied < len && !cursor->eof) {
+
+        if (cursor->strm.avail_in == 0) {
+
+            rlen = MIN(XZ_CHUNK, stream->length - cursor->in);
+
+            if (rlen > 0) {
+                rlen = pread(stream->fd, cursor->input, rlen,
+                             stream->start + cursor->in);
+            }
+
+            if (rlen < 0) {
+                cursor->failed = 1;
+                return copied ? copied : -1;
+            }
+
+            cursor->strm.next_in  = cursor->input;
+            cursor->strm.avail_in = rlen;
+            cursor->in           += rlen;
+        }
+
+        action = cursor->in >= stream->length ? LZMA_FINISH : LZMA_RUN;
+
+        cursor->strm.next_out  = cursor->output;
+        cursor->strm.avail_out = XZ_CHUNK;
+
+        ret = lzma_code(&cursor->strm, action);
+
+        produced     = XZ_CHUNK - cursor->strm.avail_out;
+        cursor->out += produced;
+
+        if (cursor->out > offset + copied) {
+            from = MAX(cursor->out - produced, offset + copied);
+            to   = MIN(cursor->out, offset + (int64_t)len);
+
+            memcpy((char*)buffer + (from - offset),
+                   cursor->output + (from - (cursor->out - produced)),
+                   to - from);
+
+            copied = to - offset;
+        }
+
+        if (ret == LZMA_STREAM_END) {
+
+            if (stream->index) {
+                /* End of a block, carry on with the next one */
+                if (__peepfs_xz_seek_block(stream, cursor, cursor->out)) {
+                    cursor->failed = 1;
+                    return copied ? copied : -1;
+                }
+            } else {
+                cursor->eof = 1;
+
+                pthread_mutex_lock(&stream->lock);
+                stream->size = cursor->out;
+                pthread_mutex_unlock(&stream->lock);
+            }
+
+        } else if (ret != LZMA_OK) {
+            cursor->failed = 1;
+            return copied ? copied : -1;
+        }
+    }
+
+    return copied;
+}
+
+peepfs_stream_ops_t xz_stream_ops = {
+    .open           = peepfs_xz_open,
+    .close          = peepfs_xz_close,
+    .size           = peepfs_xz_size,
+    .cursor_open    = peepfs_xz_cursor_open,
+    .cursor_close   = peepfs_xz_cursor_close,
+    .read           = peepfs_xz_read
+};
@@ -0,0 +1,1486 @@
+#include "peepfs_zran.h"
+#include "peepfs_stream.h"
+#include "peepfs_workq.h"
+#include "peepfs_inflate.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <zlib.h>
+
+#define MIN(x,y) ((x) < (y) ? (x) : (y))
+#define MAX(x,y) ((x) > (y) ? (x) : (y))
+
+#define ZRAN_WINSIZE        32768
+#define ZRAN_CHUNK          65536
+#define ZRAN_MAX_READAHEAD  8
+#define ZRAN_BGZF_SPAN      (1024*1024)
+#define ZRAN_SPEC_GRID      (1024*1024)
+#define ZRAN_SPEC_MAX_OUT   (8*1024*1024)
+#define ZRAN_SPEC_SLOTS     (ZRAN_MAX_READAHEAD + 2)
+#define ZRAN_SPEC_THREADS   3
+
+#define ZRAN_IDLE           0
+#define ZRAN_QUEUED         1
+#define ZRAN_RUNNING        2
+#define ZRAN_DONE           3
+#define ZRAN_FAILED         4
+
+/* Everything from one access point to the next, decoded */
+typedef struct peepfs_zran_span {
+    int64_t             refcnt;
+    int64_t             len;
+    unsigned char      *data;
+} peepfs_zran_span_t;
+
+typedef struct peepfs_zran_point {
+    int64_t             out;
+    int64_t             in;
+    int                 bits;
+    unsigned char      *window;     /* NULL if a fresh stream starts at 'in' */
+    int                 state;
+    peepfs_zran_span_t *span;
+} peepfs_zran_point_t;
+
+/*
+ * Past the end of the index, a stretch of the stream decoded without
+ * knowing the window before it: either from the last point, or from
+ * wherever a search from grid line 'line' found something to decode.
+ */
+typedef struct peepfs_zran_spec {
+    int64_t                 refcnt;
+    int64_t                 line;       /* -1 if it starts at 'start' */
+    int64_t                 start;
+    int                     fresh;
+    int                     state;
+    peepfs_inflate_chunk_t  chunk;
+} peepfs_zran_spec_t;
+
+struct peepfs_zran {
+    int                     fd;
+    int64_t                 start;
+    int64_t                 length;
+    int                     format;
+    int64_t                 span;
+    int64_t                 size;
+    pthread_mutex_t         lock;
+    pthread_cond_t          cond;
+    peepfs_zran_point_t    *points;
+    int64_t                 num_points;
+    int64_t                 max_points;
+    peepfs_workq_t         *workq;
+    int                     readahead;
+    int64_t                 jobs;
+    int64_t                *cache;      /* ring of points holding a span */
+    int                     cache_size;
+    int                     cache_next;
+    int                     bgzf;       /* member sizes are in the headers */
+    int                     bgzf_done;
+    int64_t                 bgzf_in;
+    int64_t                 bgzf_out;
+    peepfs_zran_spec_t     *specs[ZRAN_SPEC_SLOTS];
+    int                     spec_off;   /* not decoding ahead of the index */
+};
+
+struct peepfs_zran_cursor {
+    peepfs_zran_t          *zran;
+    z_stream                strm;
+    int                     active;
+    int                     failed;
+    int                     eof;
+    int                     raw;        /* bare deflate data, no gzip wrapper */
+    int64_t                 in;         /* next compressed byte to load */
+    int64_t                 out;        /* offset of the next byte inflated */
+    int64_t                 next;       /* where the last read ended */
+    unsigned char           input[ZRAN_CHUNK];
+    unsigned char           window[ZRAN_WINSIZE];
+};
+
+static void
+__peepfs_zran_span_put(peepfs_zran_span_t *span)
+{
+    if (--span->refcnt == 0) {
+        free(span->data);
+        free(span);
+    }
+}
+
+static void
+__peepfs_zran_spec_put(peepfs_zran_spec_t *spec)
+{
+    if (--spec->refcnt == 0) {
+        peepfs_inflate_chunk_free(&spec->chunk);
+        free(spec);
+    }
+}
+
+/* Append a blank access point, called with the lock held */
+static peepfs_zran_point_t *
+__peepfs_zran_add_point(peepfs_zran_t *zran)
+{
+    peepfs_zran_point_t *points, *pt;
+
+    if (zran->num_points == zran->max_points) {
+
+        points = (peepfs_zran_point_t*)realloc(zran->points,
+            (zran->max_points * 2 + 16) * sizeof(peepfs_zran_point_t));
+
+        if (points == NULL) {
+            return NULL;
+        }
+
+        zran->points = points;
+        zran->max_points = zran->max_points * 2 + 16;
+    }
+
+    pt = &zran->points[zran->num_points++];
+
+    memset(pt, 0, sizeof(*pt));
+
+    return pt;
+}
+
+/*
+ * Pick up the header of the BGZF member at 'in'.  Its extra field says
+ * how long the member is, and its trailer how much it inflates to.
+ */
+static int
+__peepfs_zran_bgzf_member(
+    peepfs_zran_t  *zran,
+    int64_t         in,
+    int64_t        *member_len,
+    int64_t        *isize)
+{
+    unsigned char   header[12], extra[256], trailer[4];
+    int             xlen, pos, slen;
+
+    if (pread(zran->fd, header, sizeof(header), zran->start + in) != sizeof(header)) {
+        return -1;
+    }
+
+    /* gzip, deflate, with an extra field */
+    if (header[0] != 0x1f || header[1] != 0x8b || header[2] != 8 ||
+        !(header[3] & 4)) {
+        return -1;
+    }
+
+    xlen = header[10] | (header[11] << 8);
+
+    if (xlen > sizeof(extra) ||
+        pread(zran->fd, extra, xlen, zran->start + in + sizeof(header)) != xlen) {
+        return -1;
+    }
+
+    for (pos = 0; pos + 4 <= xlen; pos += 4 + slen) {
+
+        slen = extra[pos+2] | (extra[pos+3] << 8);
+
+        if (extra[pos] == 'B' && extra[pos+1] == 'C' && slen == 2 &&
+            pos + 6 <= xlen) {
+
+            *member_len = (extra[pos+4] | (extra[pos+5] << 8)) + 1;
+
+            if (in + *member_len > zran->length ||
+                pread(zran->fd, trailer, sizeof(trailer),
+                      zran->start + in + *member_len - 4) != sizeof(trailer)) {
+                return -1;
+            }
+
+            *isize = (int64_t)trailer[0] | ((int64_t)trailer[1] << 8) |
+                     ((int64_t)trailer[2] << 16) | ((int64_t)trailer[3] << 24);
+
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+/*
+ * Index BGZF members, which start fresh streams, until the index
+ * reaches past 'until'.  No inflating needed.  Called with the lock held.
+ */
+static void
+__peepfs_zran_bgzf_scan(peepfs_zran_t *zran, int64_t until)
+{
+    peepfs_zran_point_t    *pt;
+    int64_t                 member_len, isize, last;
+
+    while (!zran->bgzf_done && zran->bgzf_out <= until) {
+
+        if (zran->bgzf_in == zran->length) {
+            zran->size = zran->bgzf_out;
+            zran->bgzf_done = 1;
+            break;
+        }
+
+        /* Anything else tacked on gets indexed the usual way */
+        if (__peepfs_zran_bgzf_member(zran, zran->bgzf_in, &member_len, &isize)) {
+            zran->bgzf_done = 1;
+            break;
+        }
+
+        last = zran->points[zran->num_points-1].out;
+
+        if (zran->bgzf_out >= last + ZRAN_BGZF_SPAN) {
+
+            pt = __peepfs_zran_add_point(zran);
+
+            if (pt == NULL) {
+                zran->bgzf_done = 1;
+                break;
+            }
+
+            pt->out = zran->bgzf_out;
+            pt->in  = zran->bgzf_in;
+        }
+
+        zran->bgzf_in  += member_len;
+        zran->bgzf_out += isize;
+    }
+}
+
+peepfs_zran_t *
+peepfs_zran_create(
+    int         fd,
+    int64_t     start,
+    int64_t     length,
+    int         format,
+    int64_t     span)
+{
+    peepfs_zran_t  *zran;
+    int64_t         member_len, isize;
+    int             i;
+
+    zran = (peepfs_zran_t*)calloc(1,sizeof(peepfs_zran_t));
+
+    if (zran == NULL) {
+        return NULL;
+    }
+
+    zran->fd     = fd;
+    zran->start  = start;
+    zran->length = length;
+    zran->format = format;
+    zran->span   = span > 0 ? span : PEEPFS_ZRAN_SPAN;
+    zran->size   = -1;
+
+    pthread_mutex_init(&zran->lock, NULL);
+    pthread_cond_init(&zran->cond, NULL);
+
+    zran->workq = peepfs_workq_default();
+
+    if (zran->workq) {
+        zran->readahead = MIN(peepfs_workq_threads(zran->workq), ZRAN_MAX_READAHEAD);
+    }
+
+    /* Guessing is slower than zlib, it only wins with a few threads at it */
+    zran->spec_off = zran->readahead < ZRAN_SPEC_THREADS;
+
+    zran->cache_size = zran->readahead + 2;
+    zran->cache = (int64_t*)malloc(zran->cache_size * sizeof(int64_t));
+
+    /* The start of the data is always a point */
+    if (zran->cache == NULL || __peepfs_zran_add_point(zran) == NULL) {
+        peepfs_zran_destroy(zran);
+        return NULL;
+    }
+
+    for (i = 0; i < zran->cache_size; ++i) {
+        zran->cache[i] = -1;
+    }
+
+    zran->bgzf = format == PEEPFS_ZRAN_GZIP &&
+                 __peepfs_zran_bgzf_member(zran, 0, &member_len, &isize) == 0;
+
+    return zran;
+}
+
+void
+peepfs_zran_destroy(peepfs_zran_t *zran)
+{
+    int64_t i;
+
+    /* Workers may still be inflating spans for us */
+    pthread_mutex_lock(&zran->lock);
+
+    while (zran->jobs) {
+        pthread_cond_wait(&zran->cond, &zran->lock);
+    }
+
+    pthread_mutex_unlock(&zran->lock);
+
+    for (i = 0; i < zran->num_points; ++i) {
+        free(zran->points[i].window);
+        if (zran->points[i].span) {
+            __peepfs_zran_span_put(zran->points[i].span);
+        }
+    }
+
+    for (i = 0; i < ZRAN_SPEC_SLOTS; ++i) {
+        if (zran->specs[i]) {
+            __peepfs_zran_spec_put(zran->specs[i]);
+        }
+    }
+
+    pthread_cond_destroy(&zran->cond);
+    pthread_mutex_destroy(&zran->lock);
+
+    free(zran->cache);
+    free(zran->points);
+    free(zran);
+}
+
+int64_t
+peepfs_zran_size(peepfs_zran_t *zran)
+{
+    int64_t size;
+
+    pthread_mutex_lock(&zran->lock);
+
+    size = zran->size;
+
+    pthread_mutex_unlock(&zran->lock);
+
+    return size;
+}
+
+int
+peepfs_zran_import(
+    peepfs_zran_t          *zran,
+    int64_t                 in,
+    int64_t                 out,
+    int                     bits,
+    const unsigned char    *window)
+{
+    peepfs_zran_point_t    *pt;
+    unsigned char          *copy;
+    int                     error = -1;
+
+    copy = (unsigned char*)malloc(ZRAN_WINSIZE);
+
+    if (copy == NULL) {
+        return -1;
+    }
+
+    memcpy(copy, window, ZRAN_WINSIZE);
+
+    pthread_mutex_lock(&zran->lock);
+
+    pt = &zran->points[zran->num_points-1];
+
+    /* BGZF indexes itself, and points only ever go on the end */
+    if (zran->bgzf || out <= pt->out || in <= pt->in ||
+        in > zran->length || bits < 0 || bits > 7) {
+        goto out;
+    }
+
+    pt = __peepfs_zran_add_point(zran);
+
+    if (pt == NULL) {
+        goto out;
+    }
+
+    pt->in     = in;
+    pt->out    = out;
+    pt->bits   = bits;
+    pt->window = copy;
+
+    copy  = NULL;
+    error = 0;
+
+out:
+
+    pthread_mutex_unlock(&zran->lock);
+
+    free(copy);
+
+    return error;
+}
+
+peepfs_zran_cursor_t *
+peepfs_zran_cursor_open(peepfs_zran_t *zran)
+{
+    peepfs_zran_cursor_t *cursor;
+
+    cursor = (peepfs_zran_cursor_t*)calloc(1,sizeof(peepfs_zran_cursor_t));
+
+    if (cursor == NULL) {
+        return NULL;
+    }
+
+    cursor->zran = zran;
+    cursor->next = -1;
+
+    return cursor;
+}
+
+void
+peepfs_zran_cursor_close(peepfs_zran_cursor_t *cursor)
+{
+    if (cursor->active) {
+        inflateEnd(&cursor->strm);
+    }
+
+    free(cursor);
+}
+
+/* Make at least 'need' compressed bytes available, if there are that many */
+static int
+__peepfs_zran_fill(peepfs_zran_cursor_t *cursor, int need)
+{
+    peepfs_zran_t  *zran = cursor->zran;
+    z_stream       *strm = &cursor->strm;
+    ssize_t         len;
+
+    if (strm->avail_in >= need) {
+        return 0;
+    }
+
+    if (strm->avail_in) {
+        memmove(cursor->input, strm->next_in, strm->avail_in);
+    }
+
+    strm->next_in = cursor->input;
+
+    len = MIN(ZRAN_CHUNK - strm->avail_in, zran->length - cursor->in);
+
+    if (len > 0) {
+
+        len = pread(zran->fd, cursor->input + strm->avail_in, len,
+                    zran->start + cursor->in);
+
+        if (len < 0) {
+            return -1;
+        }
+
+        cursor->in      += len;
+        strm->avail_in  += len;
+    }
+
+    return 0;
+}
+
+/* Remember where we are as an access point if we're past the indexed part */
+static void
+__peepfs_zran_note(peepfs_zran_cursor_t *cursor)
+{
+    peepfs_zran_t          *zran = cursor->zran;
+    z_stream               *strm = &cursor->strm;
+    peepfs_zran_point_t    *pt;
+    unsigned char          *window;
+    int64_t                 last;
+    int                     pos;
+
+    pthread_mutex_lock(&zran->lock);
+
+    last = zran->points[zran->num_points-1].out;
+
+    if (cursor->out < last + zran->span) {
+        goto out;
+    }
+
+    window = (unsigned char*)malloc(ZRAN_WINSIZE);
+
+    if (window == NULL) {
+        goto out;
+    }
+
+    pt = __peepfs_zran_add_point(zran);
+
+    if (pt == NULL) {
+        free(window);
+        goto out;
+    }
+
+    pt->window = window;
+
+    pt->out  = cursor->out;
+    pt->in   = cursor->in - strm->avail_in;
+    pt->bits = strm->data_type & 7;
+
+    /* The window is circular, oldest byte sits where the next one goes */
+    pos = ZRAN_WINSIZE - strm->avail_out;
+
+    memcpy(pt->window, cursor->window + pos, ZRAN_WINSIZE - pos);
+    memcpy(pt->window + ZRAN_WINSIZE - pos, cursor->window, pos);
+
+out:
+
+    pthread_mutex_unlock(&zran->lock);
+}
+
+/* Restart decompression at an access point */
+static int
+__peepfs_zran_seek(peepfs_zran_cursor_t *cursor, peepfs_zran_point_t *pt)
+{
+    peepfs_zran_t  *zran = cursor->zran;
+    z_stream       *strm = &cursor->strm;
+    unsigned char   prime;
+    int             error;
+
+    if (cursor->active) {
+        inflateEnd(strm);
+        cursor->active = 0;
+    }
+
+    memset(strm, 0, sizeof(*strm));
+
+    /* Mid-stream points are bare deflate no matter the wrapper */
+    cursor->raw = pt->window || zran->format == PEEPFS_ZRAN_RAW;
+
+    error = inflateInit2(strm, cursor->raw ? -15 : 31);
+
+    if (error != Z_OK) {
+        return -1;
+    }
+
+    cursor->active  = 1;
+    cursor->failed  = 0;
+    cursor->eof     = 0;
+    cursor->in      = pt->in;
+    cursor->out     = pt->out;
+
+    if (pt->bits) {
+
+        if (pread(zran->fd, &prime, 1, zran->start + pt->in - 1) != 1) {
+            return -1;
+        }
+
+        inflatePrime(strm, pt->bits, prime >> (8 - pt->bits));
+    }
+
+    if (pt->window) {
+        inflateSetDictionary(strm, pt->window, ZRAN_WINSIZE);
+        memcpy(cursor->window, pt->window, ZRAN_WINSIZE);
+    }
+
+    strm->next_out  = cursor->window;
+    strm->avail_out = ZRAN_WINSIZE;
+
+    return 0;
+}
+
+/* A deflate stream just ended, see whether another gzip member follows */
+static int
+__peepfs_zran_stream_end(peepfs_zran_cursor_t *cursor)
+{
+    peepfs_zran_t  *zran = cursor->zran;
+    z_stream       *strm = &cursor->strm;
+
+    if (zran->format == PEEPFS_ZRAN_GZIP) {
+
+        if (cursor->raw) {
+
+            /* zlib didn't see the header, so it won't eat the trailer */
+            if (__peepfs_zran_fill(cursor, 8) || strm->avail_in < 8) {
+                goto eof;
+            }
+
+            strm->next_in  += 8;
+            strm->avail_in -= 8;
+        }
+
+        if (__peepfs_zran_fill(cursor, 2)) {
+            return -1;
+        }
+
+        if (strm->avail_in >= 2 &&
+            strm->next_in[0] == 0x1f && strm->next_in[1] == 0x8b) {
+
+            if (inflateReset2(strm, 31) != Z_OK) {
+                return -1;
+            }
+
+            cursor->raw = 0;
+
+            return 0;
+        }
+    }
+
+eof:
+
+    cursor->eof = 1;
+
+    pthread_mutex_lock(&zran->lock);
+
+    zran->size = cursor->out;
+
+    pthread_mutex_unlock(&zran->lock);
+
+    return 0;
+}
+
+/* Inflate up to the next block boundary, returning what came out */
+static int
+__peepfs_zran_step(
+    peepfs_zran_cursor_t   *cursor,
+    unsigned char         **data,
+    size_t                 *produced)
+{
+    z_stream   *strm = &cursor->strm;
+    int         ret, avail;
+
+    if (strm->avail_in == 0 && __peepfs_zran_fill(cursor, 1)) {
+        return -1;
+    }
+
+    if (strm->avail_out == 0) {
+        strm->next_out  = cursor->window;
+        strm->avail_out = ZRAN_WINSIZE;
+    }
+
+    *data = strm->next_out;
+    avail = strm->avail_out;
+
+    ret = inflate(strm, Z_BLOCK);
+
+    *produced    = avail - strm->avail_out;
+    cursor->out += *produced;
+
+    switch (ret) {
+    case Z_OK:
+        break;
+    case Z_STREAM_END:
+        return __peepfs_zran_stream_end(cursor);
+    case Z_BUF_ERROR:
+        /* No progress possible, the stream is truncated */
+        if (*produced == 0) {
+            return -1;
+        }
+        break;
+    default:
+        return -1;
+    }
+
+    /* Between blocks, and more blocks to come, is where points can go */
+    if ((strm->data_type & 128) && !(strm->data_type & 64)) {
+        __peepfs_zran_note(cursor);
+    }
+
+    return 0;
+}
+
+/* Index of the last access point at or before 'offset', lock held */
+static int64_t
+__peepfs_zran_find(peepfs_zran_t *zran, int64_t offset)
+{
+    int64_t lo, hi, mid;
+
+    lo = 0;
+    hi = zran->num_points;
+
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (zran->points[mid].out <= offset) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo - 1;
+}
+
+/* Inflate with the cursor's own stream, starting from the nearest point */
+static ssize_t
+__peepfs_zran_inflate(
+    peepfs_zran_cursor_t   *cursor,
+    void                   *buffer,
+    int64_t                 offset,
+    size_t                  len)
+{
+    peepfs_zran_t          *zran = cursor->zran;
+    peepfs_zran_point_t     pt;
+    unsigned char          *data;
+    size_t                  produced;
+    int64_t                 from, to, copied = 0;
+
+    pthread_mutex_lock(&zran->lock);
+
+    pt = zran->points[__peepfs_zran_find(zran, offset)];
+
+    pthread_mutex_unlock(&zran->lock);
+
+    /* Only start over if we can't get there from where we are */
+    if (!cursor->active || cursor->failed ||
+        cursor->out > offset || pt.out > cursor->out) {
+
+        if (__peepfs_zran_seek(cursor, &pt)) {
+            cursor->failed = 1;
+            return -1;
+        }
+    }
+
+    while (copied < len && !cursor->eof) {
+
+        if (__peepfs_zran_step(cursor, &data, &produced)) {
+            cursor->failed = 1;
+            return copied ? copied : -1;
+        }
+
+        if (cursor->out > offset + copied) {
+            from = MAX(cursor->out - (int64_t)produced, offset + copied);
+            to   = MIN(cursor->out, offset + (int64_t)len);
+
+            memcpy((char*)buffer + (from - offset),
+                   data + (from - (cursor->out - produced)), to - from);
+
+            copied = to - offset;
+        }
+    }
+
+    return copied;
+}
+
+/* Where the span starting at point 'k' ends, or -1 if we don't know yet */
+static int64_t
+__peepfs_zran_span_end(peepfs_zran_t *zran, int64_t k)
+{
+    if (k + 1 < zran->num_points) {
+        return zran->points[k+1].out;
+    } else {
+        return zran->size;
+    }
+}
+
+/* Hold on to an inflated span, letting go of the oldest one held */
+static void
+__peepfs_zran_cache(peepfs_zran_t *zran, int64_t k)
+{
+    int64_t old = zran->cache[zran->cache_next];
+
+    if (old >= 0 && old != k && zran->points[old].span) {
+        __peepfs_zran_span_put(zran->points[old].span);
+        zran->points[old].span = NULL;
+    }
+
+    zran->cache[zran->cache_next] = k;
+    zran->cache_next = (zran->cache_next + 1) % zran->cache_size;
+}
+
+/*
+ * Inflate the span starting at point 'k'.  Called with the lock held
+ * and the point marked running; the lock is dropped while inflating.
+ */
+static void
+__peepfs_zran_run(peepfs_zran_t *zran, int64_t k)
+{
+    peepfs_zran_cursor_t   *cursor;
+    peepfs_zran_span_t     *span = NULL;
+    peepfs_zran_point_t    *pt;
+    unsigned char          *data;
+    int64_t                 start, end;
+    ssize_t                 len = -1;
+
+    start = zran->points[k].out;
+    end   = __peepfs_zran_span_end(zran, k);
+
+    pthread_mutex_unlock(&zran->lock);
+
+    cursor = peepfs_zran_cursor_open(zran);
+    data   = (unsigned char*)malloc(end - start + 1);
+
+    if (cursor && data) {
+        len = __peepfs_zran_inflate(cursor, data, start, end - start);
+    }
+
+    if (len == end - start) {
+
+        span = (peepfs_zran_span_t*)calloc(1,sizeof(peepfs_zran_span_t));
+
+        if (span) {
+            span->refcnt = 1;
+            span->len    = len;
+            span->data   = data;
+            data         = NULL;
+        }
+    }
+
+    if (cursor) {
+        peepfs_zran_cursor_close(cursor);
+    }
+
+    free(data);
+
+    pthread_mutex_lock(&zran->lock);
+
+    pt = &zran->points[k];
+
+    if (span) {
+        pt->state = ZRAN_DONE;
+        pt->span  = span;
+        __peepfs_zran_cache(zran, k);
+    } else {
+        pt->state = ZRAN_FAILED;
+    }
+
+    pthread_cond_broadcast(&zran->cond);
+}
+
+/* Bit offset of a point */
+static inline int64_t
+__peepfs_zran_bit(const peepfs_zran_point_t *pt)
+{
+    return pt->in * 8 - pt->bits;
+}
+
+/* Take a stretch out of the table, lock held */
+static void
+__peepfs_zran_spec_drop(peepfs_zran_t *zran, int i)
+{
+    peepfs_zran_spec_t *spec = zran->specs[i];
+
+    zran->specs[i] = NULL;
+
+    __peepfs_zran_spec_put(spec);
+}
+
+/*
+ * Turn decoded stretches into points and spans, for as long as one
+ * starts exactly where the index ends.  That's what makes a guessed
+ * start trustworthy: the stretch before it decoded right up to it.
+ * Called with the lock held.
+ */
+static void
+__peepfs_zran_stitch(peepfs_zran_t *zran)
+{
+    peepfs_zran_spec_t     *spec = NULL;
+    peepfs_zran_point_t    *pt;
+    peepfs_zran_span_t     *span;
+    unsigned char          *window;
+    int64_t                 k, bit, len, end;
+    int                     i;
+
+    while (zran->size < 0 && !zran->spec_off) {
+
+        k   = zran->num_points - 1;
+        pt  = &zran->points[k];
+        bit = __peepfs_zran_bit(pt);
+
+        for (i = 0; i < ZRAN_SPEC_SLOTS; ++i) {
+
+            spec = zran->specs[i];
+
+            if (spec && spec->state == ZRAN_DONE &&
+                spec->chunk.start == bit &&
+                spec->chunk.fresh == (pt->window == NULL)) {
+                break;
+            }
+        }
+
+        if (i == ZRAN_SPEC_SLOTS) {
+            return;
+        }
+
+        len    = spec->chunk.len;
+        end    = spec->chunk.end;
+        span   = (peepfs_zran_span_t*)calloc(1,sizeof(peepfs_zran_span_t));
+        window = NULL;
+
+        if (span == NULL || (span->data = (unsigned char*)malloc(len + 1)) == NULL ||
+            (len == 0 && !spec->chunk.last)) {
+            goto fail;
+        }
+
+        span->refcnt = 1;
+        span->len    = len;
+
+        peepfs_inflate_resolve(&spec->chunk, pt->window, span->data);
+
+        if (spec->chunk.last) {
+
+            zran->size = pt->out + len;
+
+        } else {
+
+            /* A new member needs no window, anywhere else wants the last 32K */
+            if (!spec->chunk.end_fresh) {
+
+                window = (unsigned char*)malloc(ZRAN_WINSIZE);
+
+                if (window == NULL) {
+                    goto fail;
+                }
+
+                if (len >= ZRAN_WINSIZE) {
+                    memcpy(window, span->data + len - ZRAN_WINSIZE, ZRAN_WINSIZE);
+                } else {
+                    if (pt->window) {
+                        memcpy(window, pt->window + len, ZRAN_WINSIZE - len);
+                    } else {
+                        memset(window, 0, ZRAN_WINSIZE - len);
+                    }
+                    memcpy(window + ZRAN_WINSIZE - len, span->data, len);
+                }
+            }
+
+            if (__peepfs_zran_add_point(zran) == NULL) {
+                goto fail;
+            }
+
+            pt = &zran->points[k];
+
+            zran->points[k+1].out    = pt->out + len;
+            zran->points[k+1].in     = (end + 7) / 8;
+            zran->points[k+1].bits   = (end + 7) / 8 * 8 - end;
+            zran->points[k+1].window = window;
+        }
+
+        /* Whoever reads it next finds it inflated already */
+        if (pt->state == ZRAN_IDLE ||
+            (pt->state == ZRAN_DONE && pt->span == NULL)) {
+            pt->state = ZRAN_DONE;
+            pt->span  = span;
+            __peepfs_zran_cache(zran, k);
+        } else {
+            __peepfs_zran_span_put(span);
+        }
+
+        __peepfs_zran_spec_drop(zran, i);
+    }
+
+    return;
+
+fail:
+
+    if (span) {
+        free(span->data);
+        free(span);
+    }
+
+    free(window);
+
+    zran->spec_off = 1;
+}
+
+/*
+ * Decode a stretch past the end of the index.  Called with the lock
+ * held and the stretch marked running; the lock is dropped meanwhile.
+ */
+static void
+__peepfs_zran_spec_run(peepfs_zran_t *zran, peepfs_zran_spec_t *spec)
+{
+    int error;
+
+    /* It might get dropped from the table while we're at it */
+    spec->refcnt++;
+
+    pthread_mutex_unlock(&zran->lock);
+
+    if (spec->line >= 0) {
+        error = peepfs_inflate_chunk(zran->fd, zran->start, zran->length,
+                    zran->format == PEEPFS_ZRAN_GZIP, spec->line * 8, 0,
+                    ZRAN_SPEC_GRID, ZRAN_SPEC_GRID, ZRAN_SPEC_MAX_OUT,
+                    &spec->chunk);
+    } else {
+        error = peepfs_inflate_chunk(zran->fd, zran->start, zran->length,
+                    zran->format == PEEPFS_ZRAN_GZIP, spec->start, spec->fresh,
+                    0, ZRAN_SPEC_GRID, ZRAN_SPEC_MAX_OUT, &spec->chunk);
+    }
+
+    pthread_mutex_lock(&zran->lock);
+
+    spec->state = error ? ZRAN_FAILED : ZRAN_DONE;
+
+    __peepfs_zran_stitch(zran);
+    __peepfs_zran_spec_put(spec);
+
+    pthread_cond_broadcast(&zran->cond);
+}
+
+typedef struct peepfs_zran_job {
+    peepfs_zran_t          *zran;
+    int64_t                 index;
+    peepfs_zran_spec_t     *spec;      /* or a stretch past the index */
+} peepfs_zran_job_t;
+
+static void
+__peepfs_zran_job(void *arg)
+{
+    peepfs_zran_job_t  *job = (peepfs_zran_job_t*)arg;
+    peepfs_zran_t      *zran = job->zran;
+
+    pthread_mutex_lock(&zran->lock);
+
+    /* A reader may have gotten impatient and done it already */
+    if (job->spec) {
+
+        if (job->spec->state == ZRAN_QUEUED) {
+            job->spec->state = ZRAN_RUNNING;
+            __peepfs_zran_spec_run(zran, job->spec);
+        }
+
+        __peepfs_zran_spec_put(job->spec);
+
+    } else if (zran->points[job->index].state == ZRAN_QUEUED) {
+        zran->points[job->index].state = ZRAN_RUNNING;
+        __peepfs_zran_run(zran, job->index);
+    }
+
+    zran->jobs--;
+
+    pthread_cond_broadcast(&zran->cond);
+
+    pthread_mutex_unlock(&zran->lock);
+
+    free(job);
+}
+
+/* Queue up the indexed spans after point 'k', called with the lock held */
+static void
+__peepfs_zran_readahead(peepfs_zran_t *zran, int64_t k)
+{
+    peepfs_zran_point_t    *pt;
+    peepfs_zran_job_t      *job;
+    int64_t                 i;
+
+    for (i = k + 1; i <= k + zran->readahead; ++i) {
+
+        if (i >= zran->num_points || __peepfs_zran_span_end(zran, i) < 0) {
+            break;
+        }
+
+        pt = &zran->points[i];
+
+        if (pt->state != ZRAN_IDLE &&
+            !(pt->state == ZRAN_DONE && pt->span == NULL)) {
+            continue;
+        }
+
+        job = (peepfs_zran_job_t*)calloc(1,sizeof(peepfs_zran_job_t));
+
+        if (job == NULL) {
+            break;
+        }
+
+        job->zran  = zran;
+        job->index = i;
+
+        pt->state = ZRAN_QUEUED;
+        zran->jobs++;
+
+        if (peepfs_workq_submit(zran->workq, __peepfs_zran_job, job)) {
+            pt->state = ZRAN_IDLE;
+            zran->jobs--;
+            free(job);
+            break;
+        }
+    }
+}
+
+/* Put a stretch in the table and queue it, lock held */
+static peepfs_zran_spec_t *
+__peepfs_zran_spec_queue(
+    peepfs_zran_t  *zran,
+    int64_t         line,
+    int64_t         start,
+    int             fresh)
+{
+    peepfs_zran_spec_t *spec;
+    peepfs_zran_job_t  *job;
+    int                 i;
+
+    for (i = 0; i < ZRAN_SPEC_SLOTS && zran->specs[i]; ++i) {
+    }
+
+    if (i == ZRAN_SPEC_SLOTS) {
+        return NULL;
+    }
+
+    spec = (peepfs_zran_spec_t*)calloc(1,sizeof(peepfs_zran_spec_t));
+
+    if (spec == NULL) {
+        return NULL;
+    }
+
+    spec->refcnt = 1;
+    spec->line   = line;
+    spec->start  = start;
+    spec->fresh  = fresh;
+    spec->state  = ZRAN_QUEUED;
+
+    zran->specs[i] = spec;
+
+    job = (peepfs_zran_job_t*)calloc(1,sizeof(peepfs_zran_job_t));
+
+    if (job) {
+
+        job->zran = zran;
+        job->spec = spec;
+
+        spec->refcnt++;
+        zran->jobs++;
+
+        if (peepfs_workq_submit(zran->workq, __peepfs_zran_job, job)) {
+            spec->refcnt--;
+            zran->jobs--;
+            free(job);
+            job = NULL;
+        }
+    }
+
+    /* A reader can still do it itself, but nobody waits on a guess */
+    if (job == NULL && line >= 0) {
+        spec->state = ZRAN_FAILED;
+    }
+
+    return spec;
+}
+
+/*
+ * Keep decoding ahead of the index: from its last point, and from the
+ * grid lines after that up to 'readahead' lines past the reader at
+ * 'offset'.  Returns what the end of the index is waiting on, or NULL.
+ * Called with the lock held.
+ */
+static peepfs_zran_spec_t *
+__peepfs_zran_speculate(peepfs_zran_t *zran, int64_t offset)
+{
+    peepfs_zran_spec_t     *spec, *wait = NULL;
+    peepfs_zran_point_t    *pt;
+    int64_t                 bit, line, limit;
+    int                     i, found;
+
+    pt    = &zran->points[zran->num_points-1];
+    bit   = __peepfs_zran_bit(pt);
+    line  = bit / 8 / ZRAN_SPEC_GRID * ZRAN_SPEC_GRID;
+    limit = zran->points[__peepfs_zran_find(zran, offset)].in +
+            zran->readahead * ZRAN_SPEC_GRID;
+
+    for (i = 0; i < ZRAN_SPEC_SLOTS; ++i) {
+
+        spec = zran->specs[i];
+
+        if (spec == NULL) {
+            continue;
+        }
+
+        /* A search from the last point's grid line should land on it */
+        if (spec->state == ZRAN_QUEUED || spec->state == ZRAN_RUNNING) {
+            if (spec->line >= 0 ? spec->line == line : spec->start == bit) {
+                wait = spec;
+            }
+            continue;
+        }
+
+        /* Hang on to what lies ahead, failures too so they aren't retried */
+        if (spec->line >= 0 && spec->line > line &&
+            (spec->state == ZRAN_FAILED || spec->chunk.start > bit)) {
+            continue;
+        }
+
+        /* Decoding from a known point failed, so leave it to zlib */
+        if (spec->line < 0 && spec->start == bit && spec->state == ZRAN_FAILED) {
+            zran->spec_off = 1;
+        }
+
+        __peepfs_zran_spec_drop(zran, i);
+    }
+
+    if (zran->spec_off) {
+        return NULL;
+    }
+
+    /* No further ahead of the reader than that, though */
+    if (wait == NULL && pt->in <= limit) {
+        wait = __peepfs_zran_spec_queue(zran, -1, bit, pt->window == NULL);
+    }
+
+    for (line += ZRAN_SPEC_GRID; line <= limit && line < zran->length;
+         line += ZRAN_SPEC_GRID) {
+
+        for (found = 0, i = 0; i < ZRAN_SPEC_SLOTS; ++i) {
+            if (zran->specs[i] && zran->specs[i]->line == line) {
+                found = 1;
+            }
+        }
+
+        if (!found && __peepfs_zran_spec_queue(zran, line, 0, 0) == NULL) {
+            break;
+        }
+    }
+
+    return wait;
+}
+
+/*
+ * Get the index to reach past 'offset' by decoding ahead of it, or
+ * return -1 if that won't work.  Called with the lock held.
+ */
+static int
+__peepfs_zran_extend(peepfs_zran_t *zran, int64_t offset)
+{
+    peepfs_zran_spec_t *spec;
+
+    while (zran->size < 0 &&
+           __peepfs_zran_find(zran, offset) == zran->num_points - 1) {
+
+        if (zran->spec_off) {
+            return -1;
+        }
+
+        spec = __peepfs_zran_speculate(zran, offset);
+
+        if (spec == NULL) {
+            return -1;
+        }
+
+        switch (spec->state) {
+
+        case ZRAN_QUEUED:
+
+            spec->state = ZRAN_RUNNING;
+            __peepfs_zran_spec_run(zran, spec);
+            break;
+
+        case ZRAN_RUNNING:
+
+            pthread_cond_wait(&zran->cond, &zran->lock);
+            break;
+
+        default:
+
+            /* Didn't fit, the next time round sorts it out */
+            break;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Return a referenced span starting at point 'k', or NULL if it won't
+ * inflate.  Called with the lock held.
+ */
+static peepfs_zran_span_t *
+__peepfs_zran_get(peepfs_zran_t *zran, int64_t k)
+{
+    peepfs_zran_point_t *pt;
+
+    __peepfs_zran_readahead(zran, k);
+
+    while (1) {
+
+        pt = &zran->points[k];
+
+        switch (pt->state) {
+
+        case ZRAN_DONE:
+
+            if (pt->span) {
+                pt->span->refcnt++;
+                return pt->span;
+            }
+
+            /* Fell out of the cache, inflate it again */
+            pt->state = ZRAN_RUNNING;
+            __peepfs_zran_run(zran, k);
+            break;
+
+        case ZRAN_IDLE:
+        case ZRAN_QUEUED:
+
+            /* Don't wait in line behind other work, just do it */
+            pt->state = ZRAN_RUNNING;
+            __peepfs_zran_run(zran, k);
+            break;
+
+        case ZRAN_RUNNING:
+
+            pthread_cond_wait(&zran->cond, &zran->lock);
+            break;
+
+        case ZRAN_FAILED:
+
+            return NULL;
+        }
+    }
+}
+
+/* Copy out of inflated spans, for as much of the range as is indexed */
+static int64_t
+__peepfs_zran_read_spans(
+    peepfs_zran_cursor_t   *cursor,
+    void                   *buffer,
+    int64_t                 offset,
+    size_t                  len)
+{
+    peepfs_zran_t          *zran = cursor->zran;
+    peepfs_zran_span_t     *span;
+    int64_t                 k, pos, start, end, n, copied = 0;
+
+    pthread_mutex_lock(&zran->lock);
+
+    while (copied < len) {
+
+        pos = offset + copied;
+        k   = __peepfs_zran_find(zran, pos);
+        end = __peepfs_zran_span_end(zran, k);
+
+        if (end < 0 || pos >= end) {
+            break;
+        }
+
+        span = __peepfs_zran_get(zran, k);
+
+        if (span == NULL) {
+            break;
+        }
+
+        start = zran->points[k].out;
+
+        pthread_mutex_unlock(&zran->lock);
+
+        n = MIN(len - copied, end - pos);
+
+        memcpy((char*)buffer + copied, span->data + (pos - start), n);
+
+        copied += n;
+
+        pthread_mutex_lock(&zran->lock);
+
+        __peepfs_zran_span_put(span);
+    }
+
+    pthread_mutex_unlock(&zran->lock);
+
+    return copied;
+}
+
+ssize_t
+peepfs_zran_read(
+    peepfs_zran_cursor_t   *cursor,
+    void                   *buffer,
+    int64_t                 offset,
+    size_t                  len)
+{
+    peepfs_zran_t  *zran = cursor->zran;
+    ssize_t         n;
+    int64_t         copied = 0;
+    int             spans, extended = 0;
+
+    pthread_mutex_lock(&zran->lock);
+
+    if (zran->bgzf) {
+        __peepfs_zran_bgzf_scan(zran,
+            offset + len + zran->readahead * ZRAN_BGZF_SPAN);
+    }
+
+    /* Skipping ahead into what nobody has decoded yet counts as sequential */
+    spans = zran->workq && (offset == cursor->next ||
+            (zran->size < 0 && zran->points[zran->num_points-1].out <= offset));
+
+    pthread_mutex_unlock(&zran->lock);
+
+    /*
+     * Sequential readers get spans inflated ahead of them in parallel.
+     * Past the end of the index, stretches of the stream are decoded
+     * ahead of them in parallel too, and stitched onto the index as
+     * they line up.  If that fails, and for random reads, the cursor
+     * inflates on its own.
+     */
+    while (spans) {
+
+        n = __peepfs_zran_read_spans(cursor, (char*)buffer + copied,
+                                     offset + copied, len - copied);
+
+        copied += n;
+
+        if (copied == len || (n == 0 && extended)) {
+            break;
+        }
+
+        pthread_mutex_lock(&zran->lock);
+
+        spans = (!zran->bgzf || zran->bgzf_done) &&
+                __peepfs_zran_extend(zran, offset + copied) == 0;
+
+        pthread_mutex_unlock(&zran->lock);
+
+        extended = 1;
+    }
+
+    /* Keep the decoding ahead going while the reader catches up */
+    if (zran->workq && copied && copied == len) {
+
+        pthread_mutex_lock(&zran->lock);
+
+        if (zran->size < 0 && !zran->spec_off &&
+            (!zran->bgzf || zran->bgzf_done)) {
+            __peepfs_zran_speculate(zran, offset + copied);
+        }
+
+        pthread_mutex_unlock(&zran->lock);
+    }
+
+    if (copied < len) {
+
+        n = __peepfs_zran_inflate(cursor, (char*)buffer + copied,
+                                  offset + copied, len - copied);
+
+        if (n < 0) {
+            return copied ? copied : -1;
+        }
+
+        copied += n;
+    }
+
+    cursor->next = offset + copied;
+
+    return copied;
+}
+
+/* A whole gzip file (or range of one) as a peepfs_stream */
+
+static void *
+__peepfs_zran_stream_open(int fd, int64_t start, int64_t length)
+{
+    return peepfs_zran_create(fd, start, length, PEEPFS_ZRAN_GZIP,
+                              PEEPFS_ZRAN_SPAN);
+}
+
+static void
+__peepfs_zran_stream_close(void *stream)
+{
+    peepfs_zran_destroy((peepfs_zran_t*)stream);
+}
+
+static int64_t
+__peepfs_zran_stream_size(void *stream)
+{
+    return peepfs_zran_size((peepfs_zran_t*)stream);
+}
+
+static void *
+__peepfs_zran_stream_cursor_open(void *stream)
+{
+    return peepfs_zran_cursor_open((peepfs_zran_t*)stream);
+}
+
+static void
+__peepfs_zran_stream_cursor_close(void *stream, void *cursor)
+{
+    peepfs_zran_cursor_close((peepfs_zran_cursor_t*)cursor);
+}
+
+static ssize_t
+__peepfs_zran_stream_read(
+    void       *stream,
+    void       *cursor,
+    void       *buffer,
+    int64_t     offset,
+    size_t      len)
+{
+    return peepfs_zran_read((peepfs_zran_cursor_t*)cursor, buffer, offset, len);
+}
+
+peepfs_stream_ops_t zran_stream_ops = {
+    .open           = __peepfs_zran_stream_open,
+    .close          = __peepfs_zran_stream_close,
+    .size           = __peepfs_zran_stream_size,
+    .cursor_open    = __peepfs_zran_stream_cursor_open,
+    .cursor_close   = __peepfs_zran_stream_cursor_close,
+    .read           = __peepfs_zran_stream_read
+};
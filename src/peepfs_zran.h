@@ -0,0 +1,73 @@
+#ifndef __PEEPFS_ZRAN_H__
+#define __PEEPFS_ZRAN_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Random access into deflate streams, after zlib's zran.c.
+ *
+ * A peepfs_zran_t covers one compressed stream (a raw deflate stream,
+ * like a zip entry, or a gzip file) and holds a shared index of access
+ * points: places at deflate block boundaries where decompression can
+ * be resumed given the 32K of output that preceded them.  Points are
+ * added lazily, every 'span' bytes of output, whenever a reader decodes
+ * past the end of what is indexed.  After one sequential pass, a read
+ * anywhere costs at most 'span' bytes of decompression.
+ *
+ * Each reader has its own cursor holding the inflate state, so
+ * sequential reads just continue where the last one left off.  With a
+ * default work queue, sequential readers are instead served whole
+ * spans between points, inflated ahead of them in parallel.  BGZF files
+ * (bgzip, and friends) record every member's length in its header, so
+ * those are indexed up front without inflating anything.
+ *
+ * Past the end of the index, with a few threads to spare, the first
+ * pass is parallel too: every megabyte of compressed data after the
+ * reader, a worker looks for a gzip member or a dynamic block that
+ * starts there and decodes on from it without the window before it
+ * (see peepfs_inflate.h).  Each stretch becomes a point once the one
+ * before it ends exactly where it begins, so a wrong guess only costs
+ * the time spent on it.  Data made only of stored and fixed blocks
+ * gives nothing to find, and is inflated one stretch after another.
+ */
+
+#define PEEPFS_ZRAN_RAW         0
+#define PEEPFS_ZRAN_GZIP        1
+
+#define PEEPFS_ZRAN_SPAN        (4*1024*1024)
+
+typedef struct peepfs_zran peepfs_zran_t;
+typedef struct peepfs_zran_cursor peepfs_zran_cursor_t;
+
+/* 'length' bytes of compressed data starting at 'start' in 'fd' */
+peepfs_zran_t * peepfs_zran_create(
+    int fd, int64_t start, int64_t length, int format, int64_t span);
+
+void peepfs_zran_destroy(
+    peepfs_zran_t *zran);
+
+/* Uncompressed size, or -1 if nobody has decoded to the end yet */
+int64_t peepfs_zran_size(
+    peepfs_zran_t *zran);
+
+/*
+ * Add an access point from an index built elsewhere: decoding resumes
+ * at compressed offset 'in' (after the low 'bits' of the byte before
+ * it) as uncompressed offset 'out', given the 32K 'window' before it.
+ * Points have to come in order, past everything already indexed.
+ */
+int peepfs_zran_import(
+    peepfs_zran_t *zran, int64_t in, int64_t out, int bits,
+    const unsigned char *window);
+
+peepfs_zran_cursor_t * peepfs_zran_cursor_open(
+    peepfs_zran_t *zran);
+
+void peepfs_zran_cursor_close(
+    peepfs_zran_cursor_t *cursor);
+
+ssize_t peepfs_zran_read(
+    peepfs_zran_cursor_t *cursor, void *buffer, int64_t offset, size_t len);
+
+#endif
@@ -0,0 +1,444 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <zstd.h>
+
+#include "peepfs_stream.h"
+
+/*
+ * Random access into zstd files.
+ *
+ * zstd frames decode independently, so any frame start is a place a
+ * read can begin.  Files in the zstd seekable format end with a seek
+ * table (a skippable frame listing the size of every frame) and we
+ * take all the frame starts from it at open.  Other files are read
+ * from the top, and every frame end a reader decodes past is kept as
+ * a frame start for later reads, so multi-frame files become seekable
+ * after one pass.  A file that is one big frame simply streams.
+ */
+
+#define MIN(x,y) ((x) < (y) ? (x) : (y))
+#define MAX(x,y) ((x) > (y) ? (x) : (y))
+
+#define ZSTD_CHUNK                  131072
+
+#define ZSTD_SKIPPABLE_HEADER_LEN   8
+#define ZSTD_SEEKABLE_MAGIC         0x8F92EAB1
+#define ZSTD_SEEKABLE_FOOTER_LEN    9
+#define ZSTD_SEEKABLE_SKIP_MAGIC    0x184D2A5E
+#define ZSTD_SEEKABLE_CHECKSUM      0x80
+#define ZSTD_SEEKABLE_RESERVED      0x7C
+
+typedef struct zstd_frame {
+    int64_t             in;
+    int64_t             out;
+} zstd_frame_t;
+
+typedef struct zstd_stream {
+    int                 fd;
+    int64_t             start;
+    int64_t             length;
+    int64_t             size;
+    int                 seekable;   /* frames came from a seek table */
+    pthread_mutex_t     lock;
+    zstd_frame_t       *frames;
+    int64_t             num_frames;
+    int64_t             max_frames;
+} zstd_stream_t;
+
+typedef struct zstd_cursor {
+    ZSTD_DCtx          *dctx;
+    int                 active;
+    int                 failed;
+    int                 eof;
+    int                 idle;       /* between frames */
+    int                 pending;    /* output may be left in the decoder */
+    int64_t             in;         /* next compressed byte to load */
+    int64_t             out;        /* offset of the next byte decoded */
+    ZSTD_inBuffer       input;
+    uint8_t             inbuf[ZSTD_CHUNK];
+    uint8_t             outbuf[ZSTD_CHUNK];
+} zstd_cursor_t;
+
+static inline uint32_t
+__peepfs_zstd_le32(const uint8_t *p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+           ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static int
+__peepfs_zstd_add_frame(
+    zstd_stream_t  *stream,
+    int64_t         in,
+    int64_t         out)
+{
+    zstd_frame_t *frames;
+
+    if (stream->num_frames == stream->max_frames) {
+
+        frames = (zstd_frame_t*)realloc(stream->frames,
+            (stream->max_frames * 2 + 16) * sizeof(zstd_frame_t));
+
+        if (frames == NULL) {
+            return -1;
+        }
+
+        stream->frames     = frames;
+        stream->max_frames = stream->max_frames * 2 + 16;
+    }
+
+    stream->frames[stream->num_frames].in  = in;
+    stream->frames[stream->num_frames].out = out;
+
+    stream->num_frames++;
+
+    return 0;
+}
+
+/* Load the seek table at the end of the file, if there is one */
+static int
+__peepfs_zstd_load_seek_table(zstd_stream_t *stream)
+{
+    uint8_t     footer[ZSTD_SEEKABLE_FOOTER_LEN];
+    uint8_t     header[ZSTD_SKIPPABLE_HEADER_LEN];
+    uint8_t    *table = NULL, *entry;
+    int64_t     num_frames, entry_len, table_len, table_start, in, out, i;
+    int         error = -1;
+
+    if (stream->length < ZSTD_SEEKABLE_FOOTER_LEN + ZSTD_SKIPPABLE_HEADER_LEN) {
+        return -1;
+    }
+
+    if (pread(stream->fd, footer, sizeof(footer),
+              stream->start + stream->length - sizeof(footer)) != sizeof(footer)) {
+        return -1;
+    }
+
+    if (__peepfs_zstd_le32(footer + 5) != ZSTD_SEEKABLE_MAGIC ||
+        (footer[4] & ZSTD_SEEKABLE_RESERVED)) {
+        return -1;
+    }
+
+    num_frames = __peepfs_zstd_le32(footer);
+    entry_len  = (footer[4] & ZSTD_SEEKABLE_CHECKSUM) ? 12 : 8;
+    table_len  = num_frames * entry_len + ZSTD_SEEKABLE_FOOTER_LEN;
+
+    table_start = stream->length - table_len - ZSTD_SKIPPABLE_HEADER_LEN;
+
+    if (table_start < 0) {
+        return -1;
+    }
+
+    if (pread(stream->fd, header, sizeof(header),
+              stream->start + table_start) != sizeof(header)) {
+        return -1;
+    }
+
+    if (__peepfs_zstd_le32(header) != ZSTD_SEEKABLE_SKIP_MAGIC ||
+        __peepfs_zstd_le32(header + 4) != table_len) {
+        return -1;
+    }
+
+    table = (uint8_t*)malloc(num_frames * entry_len + 1);
+
+    if (table == NULL) {
+        return -1;
+    }
+
+    if (pread(stream->fd, table, num_frames * entry_len,
+              stream->start + table_start + sizeof(header)) !=
+        num_frames * entry_len) {
+        goto out;
+    }
+
+    in  = 0;
+    out = 0;
+
+    for (i = 0; i < num_frames; ++i) {
+
+        entry = table + i * entry_len;
+
+        if (__peepfs_zstd_add_frame(stream, in, out)) {
+            goto out;
+        }
+
+        in  += __peepfs_zstd_le32(entry);
+        out += __peepfs_zstd_le32(entry + 4);
+    }
+
+    /* The frames have to account for everything before the table */
+    if (in != table_start) {
+        goto out;
+    }
+
+    stream->size     = out;
+    stream->seekable = 1;
+
+    error = 0;
+
+out:
+
+    if (error) {
+        free(stream->frames);
+        stream->frames     = NULL;
+        stream->num_frames = 0;
+        stream->max_frames = 0;
+    }
+
+    free(table);
+
+    return error;
+}
+
+void *
+peepfs_zstd_open(
+    int         fd,
+    int64_t     start,
+    int64_t     length)
+{
+    zstd_stream_t *stream;
+
+    stream = (zstd_stream_t*)calloc(1,sizeof(zstd_stream_t));
+
+    if (stream == NULL) {
+        return NULL;
+    }
+
+    stream->fd     = fd;
+    stream->start  = start;
+    stream->length = length;
+    stream->size   = -1;
+
+    pthread_mutex_init(&stream->lock, NULL);
+
+    __peepfs_zstd_load_seek_table(stream);
+
+    return stream;
+}
+
+void
+peepfs_zstd_close(void *stream_data)
+{
+    zstd_stream_t *stream = (zstd_stream_t*)stream_data;
+
+    pthread_mutex_destroy(&stream->lock);
+
+    free(stream->frames);
+    free(stream);
+}
+
+int64_t
+peepfs_zstd_size(void *stream_data)
+{
+    zstd_stream_t  *stream = (zstd_stream_t*)stream_data;
+    int64_t         size;
+
+    pthread_mutex_lock(&stream->lock);
+
+    size = stream->size;
+
+    pthread_mutex_unlock(&stream->lock);
+
+    return size;
+}
+
+void *
+peepfs_zstd_cursor_open(void *stream_data)
+{
+    zstd_cursor_t *cursor;
+
+    cursor = (zstd_cursor_t*)calloc(1,sizeof(zstd_cursor_t));
+
+    if (cursor == NULL) {
+        return NULL;
+    }
+
+    cursor->dctx = ZSTD_createDCtx();
+
+    if (cursor->dctx == NULL) {
+        free(cursor);
+        return NULL;
+    }
+
+    return cursor;
+}
+
+void
+peepfs_zstd_cursor_close(
+    void *stream_data,
+    void *cursor_data)
+{
+    zstd_cursor_t *cursor = (zstd_cursor_t*)cursor_data;
+
+    ZSTD_freeDCtx(cursor->dctx);
+
+    free(cursor);
+}
+
+/* A reader just finished a frame, remember where the next one starts */
+static void
+__peepfs_zstd_note(
+    zstd_stream_t  *stream,
+    zstd_cursor_t  *cursor)
+{
+    int64_t in = cursor->in - (cursor->input.size - cursor->input.pos);
+
+    pthread_mutex_lock(&stream->lock);
+
+    if (!stream->seekable &&
+        (stream->num_frames == 0 ||
+         stream->frames[stream->num_frames-1].in < in)) {
+        __peepfs_zstd_add_frame(stream, in, cursor->out);
+    }
+
+    pthread_mutex_unlock(&stream->lock);
+}
+
+static int
+__peepfs_zstd_seek(
+    zstd_cursor_t  *cursor,
+    zstd_frame_t   *frame)
+{
+    if (ZSTD_isError(ZSTD_DCtx_reset(cursor->dctx, ZSTD_reset_session_only))) {
+        return -1;
+    }
+
+    cursor->active     = 1;
+    cursor->failed     = 0;
+    cursor->eof        = 0;
+    cursor->idle       = 1;
+    cursor->pending    = 0;
+    cursor->in         = frame->in;
+    cursor->out        = frame->out;
+    cursor->input.src  = cursor->inbuf;
+    cursor->input.size = 0;
+    cursor->input.pos  = 0;
+
+    return 0;
+}
+
+ssize_t
+peepfs_zstd_read(
+    void       *stream_data,
+    void       *cursor_data,
+    void       *buffer,
+    int64_t     offset,
+    size_t      len)
+{
+    zstd_stream_t  *stream = (zstd_stream_t*)stream_data;
+    zstd_cursor_t  *cursor = (zstd_cursor_t*)cursor_data;
+    zstd_frame_t    frame = { 0, 0 };
+    ZSTD_outBuffer  output;
+    ssize_t         rlen;
+    size_t          ret;
+    int64_t         lo, hi, mid, from, to, copied = 0;
+
+    /* Find the last frame starting at or before the offset */
+    pthread_mutex_lock(&stream->lock);
+
+    lo = 0;
+    hi = stream->num_frames;
+
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (stream->frames[mid].out <= offset) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    if (lo) {
+        frame = stream->frames[lo-1];
+    }
+
+    pthread_mutex_unlock(&stream->lock);
+
+    /* Only start over if we can't get there from where we are */
+    if (!cursor->active || cursor->failed ||
+        cursor->out > offset || frame.out > cursor->out) {
+
+        if (__peepfs_zstd_seek(cursor, &frame)) {
+            cursor->failed = 1;
+            return -1;
+        }
+    }
+
+    while (copied < len && !cursor->eof) {
+
+        /* Output left behind in the decoder has to come out first */
+        if (cursor->input.pos == cursor->input.size && !cursor->pending) {
+
+            rlen = MIN(ZSTD_CHUNK, stream->length - cursor->in);
+
+            if (rlen > 0) {
+                rlen = pread(stream->fd, cursor->inbuf, rlen,
+                             stream->start + cursor->in);
+            }
+
+            if (rlen < 0 || (rlen == 0 && !cursor->idle)) {
+                /* Read error, or the file ends mid-frame */
+                cursor->failed = 1;
+                return copied ? copied : -1;
+            }
+
+            if (rlen == 0) {
+
+                cursor->eof = 1;
+
+                pthread_mutex_lock(&stream->lock);
+                stream->size = cursor->out;
+                pthread_mutex_unlock(&stream->lock);
+
+                break;
+            }
+
+            cursor->input.size = rlen;
+            cursor->input.pos  = 0;
+            cursor->in        += rlen;
+        }
+
+        output.dst  = cursor->outbuf;
+        output.size = ZSTD_CHUNK;
+        output.pos  = 0;
+
+        ret = ZSTD_decompressStream(cursor->dctx, &output, &cursor->input);
+
+        if (ZSTD_isError(ret)) {
+            cursor->failed = 1;
+            return copied ? copied : -1;
+        }
+
+        cursor->pending = output.pos == output.size;
+        cursor->out    += output.pos;
+        cursor->idle    = ret == 0;
+
+        if (cursor->out > offset + copied) {
+            from = MAX(cursor->out - (int64_t)output.pos, offset + copied);
+            to   = MIN(cursor->out, offset + (int64_t)len);
+
+            memcpy((char*)buffer + (from - offset),
+                   cursor->outbuf + (from - (cursor->out - output.pos)),
+                   to - from);
+
+            copied = to - offset;
+        }
+
+        if (cursor->idle) {
+            __peepfs_zstd_note(stream, cursor);
+        }
+    }
+
+    return copied;
+}
+
+peepfs_stream_ops_t zstd_stream_ops = {
+    .open           = peepfs_zstd_open,
+    .close          = peepfs_zstd_close,
+    .size           = peepfs_zstd_size,
+    .cursor_open    = peepfs_zstd_cursor_open,
+    .cursor_close   = peepfs_zstd_cursor_close,
+    .read           = peepfs_zstd_read
+};